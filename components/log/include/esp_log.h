@@ -16,6 +16,7 @@
 #define __ESP_LOG_H__
 
 #include <stdint.h>
+#include <stddef.h>
 #include <stdarg.h>
 #include "sdkconfig.h"
 #include <rom/ets_sys.h>
@@ -61,6 +62,74 @@ void esp_log_level_set(const char* tag, esp_log_level_t level);
  */
 void esp_log_set_vprintf(vprintf_like_t func);
 
+/**
+ * @brief Get number of log messages which have been dropped
+ *
+ * With CONFIG_LOG_ASYNC enabled, messages are buffered until a background
+ * task writes them out. Messages which don't fit into the buffer are dropped.
+ *
+ * @return number of messages dropped since startup, always 0 if CONFIG_LOG_ASYNC is disabled
+ */
+uint32_t esp_log_get_dropped_count(void);
+
+/**
+ * @brief Set rate limit for given tag
+ *
+ * Each tag may write out up to burst messages at once, after that
+ * per_second messages per second. Other messages are suppressed, and their
+ * number is logged before the next message of the tag which is written out.
+ * Initial limits are set in menuconfig.
+ *
+ * Has no effect unless CONFIG_LOG_RATE_LIMIT is enabled.
+ *
+ * @param tag         Tag of the log entries to limit. Value "*" sets limits of all tags.
+ * @param burst       Number of messages which may be written out at once
+ * @param per_second  Number of messages per second written out on average, 0 to disable the limit
+ */
+void esp_log_rate_limit_set(const char* tag, uint32_t burst, uint32_t per_second);
+
+/**
+ * @brief Get number of log messages suppressed by rate limit or as repeats
+ *
+ * See CONFIG_LOG_RATE_LIMIT and CONFIG_LOG_SUPPRESS_REPEATS options.
+ *
+ * @return number of messages suppressed since startup
+ */
+uint32_t esp_log_get_suppressed_count(void);
+
+/**
+ * @brief Logging statistics of one tag
+ */
+typedef struct {
+    const char* tag;            /*!< tag, NULL for the tags which didn't fit into the table */
+    uint32_t emitted;           /*!< number of messages written out */
+    uint32_t suppressed;        /*!< number of messages not written out because of the log level */
+    uint32_t bytes;             /*!< number of bytes written out */
+    uint64_t output_time_us;    /*!< time spent formatting and writing out messages, in microseconds */
+} esp_log_tag_stats_t;
+
+/**
+ * @brief Get logging statistics of tags
+ *
+ * Statistics are collected if CONFIG_LOG_TAG_STATS is enabled, for up to
+ * CONFIG_LOG_TAG_STATS_SIZE tags. Messages of other tags are added to an
+ * entry with NULL tag.
+ *
+ * Messages of ESP_LOGx_FAST statements disabled by esp_log_level_set are not
+ * counted, nor messages disabled at compile time.
+ *
+ * @param stats  array which receives statistics of the tags, ordered by number of bytes written out
+ * @param count  size of stats array
+ *
+ * @return number of tags with statistics, which may be more than count
+ */
+size_t esp_log_stats_get(esp_log_tag_stats_t* stats, size_t count);
+
+/**
+ * @brief Reset logging statistics of all tags
+ */
+void esp_log_stats_reset(void);
+
 /**
  * @brief Function which returns timestamp to be used in log output
  *
@@ -85,6 +154,20 @@ uint32_t esp_log_timestamp(void);
  */
 uint32_t esp_log_early_timestamp(void);
 
+/**
+ * @brief Function which returns timestamp with microsecond resolution
+ *
+ * Time is counted by a hardware timer shared by both CPUs, so timestamps
+ * taken on different CPUs can be compared, and doesn't depend on CPU
+ * frequency. The timer is started on the first call. This function is used
+ * in expansion of ESP_LOGx macros if CONFIG_LOG_TIMESTAMP_US is enabled.
+ *
+ * This function should not be called from an interrupt.
+ *
+ * @return timestamp, in microseconds, counted from the same point as esp_log_timestamp
+ */
+uint64_t esp_log_timestamp_us(void);
+
 /**
  * @brief Write message into the log
  *
@@ -119,6 +202,57 @@ void esp_log_buffer_hex(const char *tag, const char *buffer, uint16_t buff_len);
  */
 void esp_log_buffer_char(const char *tag, const char *buffer, uint16_t buff_len);
 
+/**
+ * @brief Log a buffer as a hex dump, with offsets and printable characters
+ *
+ * Each line shows 16 bytes of the buffer:
+ *
+ *     0010  48 54 54 50 2f 31 2e 31  20 32 30 30 20 4f 4b 0d  |HTTP/1.1 200 OK.|
+ *
+ * If the log output is written directly, the whole dump is a single message.
+ * With CONFIG_LOG_ASYNC or CONFIG_LOG_SUPPRESS_REPEATS, each line is a
+ * separate message. Nothing is formatted if level is disabled for the tag,
+ * or if it is above CONFIG_LOG_DEFAULT_LEVEL.
+ *
+ * Use ESP_LOG_BUFFER_HEXDUMP macro to also apply LOG_LOCAL_LEVEL.
+ *
+ * @param  tag      description tag
+ *
+ * @param  buffer   Pointer to the buffer
+ *
+ * @param  buff_len length of buffer
+ *
+ * @param  level    level of the log message
+ */
+void esp_log_buffer_hexdump(const char *tag, const void *buffer, uint16_t buff_len, esp_log_level_t level);
+
+/**
+ * @brief Log level of one ESP_LOGx_FAST call site
+ *
+ * Defined by ESP_LOGx_FAST macros, not intended to be used directly.
+ * Descriptor is registered on its first use, after that esp_log_level_set
+ * keeps its level up to date, so the check whether the message should be
+ * printed doesn't need to look up the tag.
+ */
+typedef struct esp_log_tag_desc_ {
+    const char* tag;                    /*!< tag of the call site, set on registration */
+    struct esp_log_tag_desc_* next;     /*!< next registered descriptor */
+    volatile uint8_t level;             /*!< level of the tag, ESP_LOG_TAG_UNREGISTERED before the first use */
+} esp_log_tag_desc_t;
+
+/** Level of a descriptor which hasn't been registered yet. Higher than any level, so the first message always reaches esp_log_write_desc. */
+#define ESP_LOG_TAG_UNREGISTERED 0xff
+
+/**
+ * @brief Write message into the log, using level stored in the descriptor
+ *
+ * This function is not intended to be used directly. Instead, use one of
+ * ESP_LOGE_FAST, ESP_LOGW_FAST, ESP_LOGI_FAST, ESP_LOGD_FAST, ESP_LOGV_FAST macros.
+ *
+ * @param desc  descriptor of the call site; registered on the first call
+ */
+void esp_log_write_desc(esp_log_tag_desc_t* desc, esp_log_level_t level, const char* tag, const char* format, ...) __attribute__ ((format (printf, 4, 5)));
+
 #if CONFIG_LOG_COLORS
 #define LOG_COLOR_BLACK   "30"
 #define LOG_COLOR_RED     "31"
@@ -146,6 +280,19 @@ void esp_log_buffer_char(const char *tag, const char *buffer, uint16_t buff_len)
 
 #define LOG_FORMAT(letter, format)  LOG_COLOR_ ## letter #letter " (%d) %s: " format LOG_RESET_COLOR "\n"
 
+#if CONFIG_LOG_TIMESTAMP_US && !defined(BOOTLOADER_BUILD)
+#define LOG_TIMESTAMP_FORMAT        "%u.%06u"
+#define LOG_TIMESTAMP_DECLARE(ts)   uint64_t ts = esp_log_timestamp_us()
+#define LOG_TIMESTAMP_ARGS(ts)      (uint32_t) ((ts) / 1000000), (uint32_t) ((ts) % 1000000)
+#else
+#define LOG_TIMESTAMP_FORMAT        "%d"
+#define LOG_TIMESTAMP_DECLARE(ts)   uint32_t ts = esp_log_timestamp()
+#define LOG_TIMESTAMP_ARGS(ts)      (ts)
+#endif
+
+/* Same as LOG_FORMAT, but the timestamp is in the format selected in menuconfig, and takes LOG_TIMESTAMP_ARGS */
+#define LOG_FORMAT_TS(letter, format)  LOG_COLOR_ ## letter #letter " (" LOG_TIMESTAMP_FORMAT ") %s: " format LOG_RESET_COLOR "\n"
+
 #ifndef LOG_LOCAL_LEVEL
 #ifndef BOOTLOADER_BUILD
 #define LOG_LOCAL_LEVEL  ((esp_log_level_t) CONFIG_LOG_DEFAULT_LEVEL)
@@ -154,6 +301,8 @@ void esp_log_buffer_char(const char *tag, const char *buffer, uint16_t buff_len)
 #endif
 #endif
 
+#define ESP_LOG_BUFFER_HEXDUMP( tag, buffer, buff_len, level )  if (LOG_LOCAL_LEVEL >= (level)) { esp_log_buffer_hexdump(tag, buffer, buff_len, level); }
+
 #define ESP_EARLY_LOGE( tag, format, ... )  if (LOG_LOCAL_LEVEL >= ESP_LOG_ERROR)   { ets_printf(LOG_FORMAT(E, format), esp_log_timestamp(), tag, ##__VA_ARGS__); }
 #define ESP_EARLY_LOGW( tag, format, ... )  if (LOG_LOCAL_LEVEL >= ESP_LOG_WARN)    { ets_printf(LOG_FORMAT(W, format), esp_log_timestamp(), tag, ##__VA_ARGS__); }
 #define ESP_EARLY_LOGI( tag, format, ... )  if (LOG_LOCAL_LEVEL >= ESP_LOG_INFO)    { ets_printf(LOG_FORMAT(I, format), esp_log_timestamp(), tag, ##__VA_ARGS__); }
@@ -161,17 +310,42 @@ void esp_log_buffer_char(const char *tag, const char *buffer, uint16_t buff_len)
 #define ESP_EARLY_LOGV( tag, format, ... )  if (LOG_LOCAL_LEVEL >= ESP_LOG_VERBOSE) { ets_printf(LOG_FORMAT(V, format), esp_log_timestamp(), tag, ##__VA_ARGS__); }
 
 #ifndef BOOTLOADER_BUILD
-#define ESP_LOGE( tag, format, ... )  if (LOG_LOCAL_LEVEL >= ESP_LOG_ERROR)   { esp_log_write(ESP_LOG_ERROR,   tag, LOG_FORMAT(E, format), esp_log_timestamp(), tag, ##__VA_ARGS__); }
-#define ESP_LOGW( tag, format, ... )  if (LOG_LOCAL_LEVEL >= ESP_LOG_WARN)    { esp_log_write(ESP_LOG_WARN,    tag, LOG_FORMAT(W, format), esp_log_timestamp(), tag, ##__VA_ARGS__); }
-#define ESP_LOGI( tag, format, ... )  if (LOG_LOCAL_LEVEL >= ESP_LOG_INFO)    { esp_log_write(ESP_LOG_INFO,    tag, LOG_FORMAT(I, format), esp_log_timestamp(), tag, ##__VA_ARGS__); }
-#define ESP_LOGD( tag, format, ... )  if (LOG_LOCAL_LEVEL >= ESP_LOG_DEBUG)   { esp_log_write(ESP_LOG_DEBUG,   tag, LOG_FORMAT(D, format), esp_log_timestamp(), tag, ##__VA_ARGS__); }
-#define ESP_LOGV( tag, format, ... )  if (LOG_LOCAL_LEVEL >= ESP_LOG_VERBOSE) { esp_log_write(ESP_LOG_VERBOSE, tag, LOG_FORMAT(V, format), esp_log_timestamp(), tag, ##__VA_ARGS__); }
+#define ESP_LOG_LEVEL(log_level, letter, tag, format, ... )  if (LOG_LOCAL_LEVEL >= (log_level)) { \
+        LOG_TIMESTAMP_DECLARE(__esp_log_ts); \
+        esp_log_write((log_level), tag, LOG_FORMAT_TS(letter, format), LOG_TIMESTAMP_ARGS(__esp_log_ts), tag, ##__VA_ARGS__); \
+    }
+
+#define ESP_LOGE( tag, format, ... )  ESP_LOG_LEVEL(ESP_LOG_ERROR,   E, tag, format, ##__VA_ARGS__)
+#define ESP_LOGW( tag, format, ... )  ESP_LOG_LEVEL(ESP_LOG_WARN,    W, tag, format, ##__VA_ARGS__)
+#define ESP_LOGI( tag, format, ... )  ESP_LOG_LEVEL(ESP_LOG_INFO,    I, tag, format, ##__VA_ARGS__)
+#define ESP_LOGD( tag, format, ... )  ESP_LOG_LEVEL(ESP_LOG_DEBUG,   D, tag, format, ##__VA_ARGS__)
+#define ESP_LOGV( tag, format, ... )  ESP_LOG_LEVEL(ESP_LOG_VERBOSE, V, tag, format, ##__VA_ARGS__)
+
+#define ESP_LOG_LEVEL_FAST(log_level, letter, tag, format, ... )  do { \
+        static esp_log_tag_desc_t __esp_log_desc = { NULL, NULL, ESP_LOG_TAG_UNREGISTERED }; \
+        if (LOG_LOCAL_LEVEL >= (log_level) && __esp_log_desc.level >= (log_level)) { \
+            LOG_TIMESTAMP_DECLARE(__esp_log_ts); \
+            esp_log_write_desc(&__esp_log_desc, (log_level), tag, LOG_FORMAT_TS(letter, format), LOG_TIMESTAMP_ARGS(__esp_log_ts), tag, ##__VA_ARGS__); \
+        } \
+    } while(0)
+
+#define ESP_LOGE_FAST( tag, format, ... )  ESP_LOG_LEVEL_FAST(ESP_LOG_ERROR,   E, tag, format, ##__VA_ARGS__)
+#define ESP_LOGW_FAST( tag, format, ... )  ESP_LOG_LEVEL_FAST(ESP_LOG_WARN,    W, tag, format, ##__VA_ARGS__)
+#define ESP_LOGI_FAST( tag, format, ... )  ESP_LOG_LEVEL_FAST(ESP_LOG_INFO,    I, tag, format, ##__VA_ARGS__)
+#define ESP_LOGD_FAST( tag, format, ... )  ESP_LOG_LEVEL_FAST(ESP_LOG_DEBUG,   D, tag, format, ##__VA_ARGS__)
+#define ESP_LOGV_FAST( tag, format, ... )  ESP_LOG_LEVEL_FAST(ESP_LOG_VERBOSE, V, tag, format, ##__VA_ARGS__)
 #else
 #define ESP_LOGE( tag, format, ... )  ESP_EARLY_LOGE(tag, format, ##__VA_ARGS__)
 #define ESP_LOGW( tag, format, ... )  ESP_EARLY_LOGW(tag, format, ##__VA_ARGS__)
 #define ESP_LOGI( tag, format, ... )  ESP_EARLY_LOGI(tag, format, ##__VA_ARGS__)
 #define ESP_LOGD( tag, format, ... )  ESP_EARLY_LOGD(tag, format, ##__VA_ARGS__)
 #define ESP_LOGV( tag, format, ... )  ESP_EARLY_LOGV(tag, format, ##__VA_ARGS__)
+
+#define ESP_LOGE_FAST( tag, format, ... )  ESP_EARLY_LOGE(tag, format, ##__VA_ARGS__)
+#define ESP_LOGW_FAST( tag, format, ... )  ESP_EARLY_LOGW(tag, format, ##__VA_ARGS__)
+#define ESP_LOGI_FAST( tag, format, ... )  ESP_EARLY_LOGI(tag, format, ##__VA_ARGS__)
+#define ESP_LOGD_FAST( tag, format, ... )  ESP_EARLY_LOGD(tag, format, ##__VA_ARGS__)
+#define ESP_LOGV_FAST( tag, format, ... )  ESP_EARLY_LOGV(tag, format, ##__VA_ARGS__)
 #endif  // BOOTLOADER_BUILD
 
 #ifdef __cplusplus
@@ -21,31 +21,67 @@
  * To avoid looking up log level for given tag each time message is
  * printed, this library caches pointers to tags. Because the suggested
  * way of creating tags uses one 'TAG' constant per file, this caching
- * should be effective. Cache is a binary min-heap of cached_tag_entry_t
- * items, ordering is done on 'generation' member. In this context,
- * generation is an integer which is incremented each time an operation
- * with cache is performed. When cache is full, new item is inserted in
- * place of an oldest item (that is, with smallest 'generation' value).
- * After that, bubble-down operation is performed to fix ordering in the
- * min-heap.
+ * should be effective. Cache is an open addressing hash table of
+ * cached_tag_entry_t items, indexed by the tag pointer. If the few slots
+ * probed for a new tag are taken, the first of them is replaced.
  *
- * The potential problem with wrap-around of cache generation counter is
- * ignored for now. This will happen if someone happens to output more
- * than 4 billion log entries, at which point wrap-around will not be
- * the biggest problem.
+ * esp_log_write reads the cache without taking the mutex. Cache is only
+ * modified with the mutex held, and each modification is enclosed in two
+ * increments of s_log_cache_seq (a sequence lock): a reader which sees an
+ * odd value, or a different value after the lookup, may have read a torn
+ * entry and falls back to the lookup under the mutex. The mutex is
+ * therefore only taken for the first message of each tag, after the level
+ * of some tag has been changed, or if the tag has been pushed out of the
+ * cache.
+ *
+ * ESP_LOGx_FAST call sites don't use the cache at all. Each of them has a
+ * static esp_log_tag_desc_t holding the level of its tag, which the macro
+ * compares with the level of the message. Descriptor is linked into
+ * s_log_descs_head when the call site is used for the first time, and
+ * esp_log_level_set updates levels of all registered descriptors with
+ * matching tags.
+ *
+ * With CONFIG_LOG_ASYNC, messages which pass the level check are formatted
+ * into a stack buffer and sent to the ring buffer of the current CPU.
+ * log_async_task waits for a notification from the writers, empties the
+ * ring buffers and passes each message to s_log_print_func. Messages of
+ * different CPUs may therefore come out of order, timestamps show the real
+ * order. If a ring buffer is full, the message is dropped and counted.
+ * Ring buffers and the task are created on the first message logged after
+ * the scheduler has started; until then messages are written directly.
+ *
+ * With CONFIG_LOG_RATE_LIMIT or CONFIG_LOG_SUPPRESS_REPEATS, each message
+ * which passes the level check is also checked against log_limit_state_t
+ * of its tag, under the mutex. There are CONFIG_LOG_LIMIT_TAGS states,
+ * found by tag pointer; the one idle for the longest time is reused for a
+ * new tag. Rate limit is a token bucket, refilled from the timestamp.
+ * Repeats are recognized by a hash of the formatted message, without the
+ * timestamp. Numbers of suppressed messages are written out before the
+ * next message of the tag which passes.
+ *
+ * esp_log_timestamp_us reads FRC2, which both CPUs share, instead of the
+ * per-CPU cycle counter. The 32-bit counter is extended using the tick
+ * count, so no interrupt is needed to count its overflows.
+ *
+ * With CONFIG_LOG_TAG_STATS, s_log_stats is an open addressing table of
+ * esp_log_tag_stats_t indexed by tag pointer, guarded by a spinlock so that
+ * the level check path doesn't need the mutex.
  *
  */
-
 #ifndef BOOTLOADER_BUILD
 #include <freertos/FreeRTOS.h>
 #include <freertos/FreeRTOSConfig.h>
 #include <freertos/task.h>
 #include <freertos/semphr.h>
+#if CONFIG_LOG_ASYNC
+#include <freertos/ringbuf.h>
+#endif
 #endif
 
 #include "esp_attr.h"
 #include "xtensa/hal.h"
 #include "soc/soc.h"
+#include "soc/frc_timer_reg.h"
 #include <stdbool.h>
 #include <stdarg.h>
 #include <string.h>
@@ -59,8 +95,11 @@
 
 #ifndef BOOTLOADER_BUILD
 
-// Number of tags to be cached. Must be 2**n - 1, n >= 2.
-#define TAG_CACHE_SIZE 31
+// Number of tags to be cached. Must be 2**n.
+#define TAG_CACHE_SIZE 32
+
+// Number of cache slots checked for a tag, starting from its hash.
+#define TAG_CACHE_MAX_PROBES 4
 
 // Maximum time to wait for the mutex in a logging statement.
 #define MAX_MUTEX_WAIT_MS 10
@@ -71,8 +110,7 @@
 
 typedef struct {
     const char* tag;
-    uint32_t level : 3;
-    uint32_t generation : 29;
+    uint32_t level;
 } cached_tag_entry_t;
 
 typedef struct uncached_tag_entry_{
@@ -85,10 +123,62 @@ static esp_log_level_t s_log_default_level = ESP_LOG_VERBOSE;
 static uncached_tag_entry_t* s_log_tags_head = NULL;
 static uncached_tag_entry_t* s_log_tags_tail = NULL;
 static cached_tag_entry_t s_log_cache[TAG_CACHE_SIZE];
-static uint32_t s_log_cache_max_generation = 0;
-static uint32_t s_log_cache_entry_count = 0;
+static volatile uint32_t s_log_cache_seq = 0;
 static vprintf_like_t s_log_print_func = &vprintf;
 static SemaphoreHandle_t s_log_mutex = NULL;
+static esp_log_tag_desc_t* s_log_descs_head = NULL;
+
+#if CONFIG_LOG_ASYNC
+static RingbufHandle_t s_log_async_buf[portNUM_PROCESSORS];
+static TaskHandle_t s_log_async_task = NULL;
+static volatile bool s_log_async_started = false;
+static bool s_log_async_failed = false;
+static volatile uint32_t s_log_async_dropped = 0;
+static portMUX_TYPE s_log_async_lock = portMUX_INITIALIZER_UNLOCKED;
+#endif
+
+#if CONFIG_LOG_RATE_LIMIT || CONFIG_LOG_SUPPRESS_REPEATS
+#define LOG_LIMITS 1
+
+#if CONFIG_LOG_RATE_LIMIT
+typedef struct log_rate_limit_entry_ {
+    struct log_rate_limit_entry_* next;
+    uint32_t burst;
+    uint32_t per_second;
+    char tag[0];    // beginning of a zero-terminated string
+} log_rate_limit_entry_t;
+
+static log_rate_limit_entry_t* s_log_rate_limits_head = NULL;
+static uint32_t s_log_rate_burst = CONFIG_LOG_RATE_LIMIT_BURST;
+static uint32_t s_log_rate_per_second = CONFIG_LOG_RATE_LIMIT_PER_SECOND;
+#endif
+
+typedef struct {
+    const char* tag;
+    uint32_t last_time;     // timestamp of the last message, in ms
+#if CONFIG_LOG_RATE_LIMIT
+    uint32_t burst;
+    uint32_t per_second;
+    uint32_t tokens;        // in thousandths of a message
+    uint32_t limited;       // messages suppressed by rate limit since the last one written out
+#endif
+#if CONFIG_LOG_SUPPRESS_REPEATS
+    uint32_t hash;          // of the last message written out, 0 if none
+    uint32_t repeats;       // times it was repeated since then
+#endif
+} log_limit_state_t;
+
+static log_limit_state_t s_log_limits[CONFIG_LOG_LIMIT_TAGS];
+static uint32_t s_log_suppressed = 0;
+#endif // CONFIG_LOG_RATE_LIMIT || CONFIG_LOG_SUPPRESS_REPEATS
+
+#if CONFIG_LOG_TAG_STATS
+// last entry collects messages of tags which didn't fit
+static esp_log_tag_stats_t s_log_stats[CONFIG_LOG_TAG_STATS_SIZE + 1];
+static portMUX_TYPE s_log_stats_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static void log_stats_add(const char* tag, uint32_t emitted, uint32_t suppressed, uint32_t bytes, uint32_t time_us);
+#endif
 
 #ifdef LOG_BUILTIN_CHECKS
 static uint32_t s_log_cache_misses = 0;
@@ -96,11 +186,14 @@ static uint32_t s_log_cache_misses = 0;
 
 static inline bool get_cached_log_level(const char* tag, esp_log_level_t* level);
 static inline bool get_uncached_log_level(const char* tag, esp_log_level_t* level);
+static inline bool get_log_level(const char* tag, esp_log_level_t* level);
 static inline void add_to_cache(const char* tag, esp_log_level_t level);
-static void heap_bubble_down(int index);
-static inline void heap_swap(int i, int j);
+static inline void cache_write_begin();
+static inline void cache_write_end();
 static inline bool should_output(esp_log_level_t level_for_message, esp_log_level_t level_for_tag);
 static inline void clear_log_level_list();
+static inline void update_descs(const char* tag, esp_log_level_t level);
+static inline void log_output(const char* tag, const char* format, va_list list);
 
 void esp_log_set_vprintf(vprintf_like_t func)
 {
@@ -118,10 +211,31 @@ void esp_log_level_set(const char* tag, esp_log_level_t level)
     if (strcmp(tag, "*") == 0) {
         s_log_default_level = level;
         clear_log_level_list();
+        update_descs(NULL, level);
         xSemaphoreGive(s_log_mutex);
         return;
     }
 
+    update_descs(tag, level);
+
+    // update cached entries of the tag, which may be at several pointers
+    cache_write_begin();
+    for (int i = 0; i < TAG_CACHE_SIZE; ++i) {
+        if (s_log_cache[i].tag != NULL && strcmp(s_log_cache[i].tag, tag) == 0) {
+            s_log_cache[i].level = level;
+        }
+    }
+    cache_write_end();
+
+    // tag which has been set before keeps its linked list entry
+    for (uncached_tag_entry_t* it = s_log_tags_head; it != NULL; it = it->next) {
+        if (strcmp(tag, it->tag) == 0) {
+            it->level = (uint8_t) level;
+            xSemaphoreGive(s_log_mutex);
+            return;
+        }
+    }
+
     // allocate new linked list entry and append it to the endo of the list
     size_t entry_size = offsetof(uncached_tag_entry_t, tag) + strlen(tag) + 1;
     uncached_tag_entry_t* new_entry = (uncached_tag_entry_t*) malloc(entry_size);
@@ -151,8 +265,9 @@ void clear_log_level_list()
     }
     s_log_tags_tail = NULL;
     s_log_tags_head = NULL;
-    s_log_cache_entry_count = 0;
-    s_log_cache_max_generation = 0;
+    cache_write_begin();
+    memset(s_log_cache, 0, sizeof(s_log_cache));
+    cache_write_end();
 #ifdef LOG_BUILTIN_CHECKS
     s_log_cache_misses = 0;
 #endif
@@ -163,90 +278,573 @@ void IRAM_ATTR esp_log_write(esp_log_level_t level,
         const char* tag,
         const char* format, ...)
 {
+    esp_log_level_t level_for_tag;
+    if (!get_log_level(tag, &level_for_tag)) {
+        return;
+    }
+    if (!should_output(level, level_for_tag)) {
+#if CONFIG_LOG_TAG_STATS
+        log_stats_add(tag, 0, 1, 0, 0);
+#endif
+        return;
+    }
+
+    va_list list;
+    va_start(list, format);
+    log_output(tag, format, list);
+    va_end(list);
+}
+
+void IRAM_ATTR esp_log_write_desc(esp_log_tag_desc_t* desc,
+        esp_log_level_t level,
+        const char* tag,
+        const char* format, ...)
+{
+    if (desc->level == ESP_LOG_TAG_UNREGISTERED) {
+        if (!s_log_mutex) {
+            s_log_mutex = xSemaphoreCreateMutex();
+        }
+        if (xSemaphoreTake(s_log_mutex, MAX_MUTEX_WAIT_TICKS) == pdFALSE) {
+            return;
+        }
+        // another task may have registered the call site while we were waiting
+        if (desc->level == ESP_LOG_TAG_UNREGISTERED) {
+            esp_log_level_t level_for_tag;
+            if (!get_uncached_log_level(tag, &level_for_tag)) {
+                level_for_tag = s_log_default_level;
+            }
+            desc->tag = tag;
+            desc->next = s_log_descs_head;
+            s_log_descs_head = desc;
+            desc->level = (uint8_t) level_for_tag;
+        }
+        xSemaphoreGive(s_log_mutex);
+    }
+    if (!should_output(level, (esp_log_level_t) desc->level)) {
+#if CONFIG_LOG_TAG_STATS
+        log_stats_add(tag, 0, 1, 0, 0);
+#endif
+        return;
+    }
+
+    va_list list;
+    va_start(list, format);
+    log_output(tag, format, list);
+    va_end(list);
+}
+
+static int log_print_direct(const char* format, ...)
+{
+    va_list list;
+    va_start(list, format);
+    int ret = (*s_log_print_func)(format, list);
+    va_end(list);
+    return ret;
+}
+
+#if CONFIG_LOG_ASYNC || CONFIG_LOG_SUPPRESS_REPEATS
+static int log_format_line(char* line, size_t size, const char* format, va_list list)
+{
+    int len = vsnprintf(line, size, format, list);
+    if (len >= (int) size) {
+        // keep the line break of the truncated message
+        len = size - 1;
+        line[len - 1] = '\n';
+    }
+    return len;
+}
+#endif
+
+#if CONFIG_LOG_ASYNC
+static void log_async_task(void* arg)
+{
+    uint32_t reported_dropped = 0;
+    while (true) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        for (int cpu = 0; cpu < portNUM_PROCESSORS; ++cpu) {
+            size_t size;
+            char* item;
+            while ((item = (char*) xRingbufferReceive(s_log_async_buf[cpu], &size, 0)) != NULL) {
+                log_print_direct("%.*s", (int) size, item);
+                vRingbufferReturnItem(s_log_async_buf[cpu], item);
+            }
+        }
+        uint32_t dropped = s_log_async_dropped;
+        if (dropped != reported_dropped) {
+            LOG_TIMESTAMP_DECLARE(ts);
+            log_print_direct(LOG_FORMAT_TS(W, "%u messages dropped, buffer full"), LOG_TIMESTAMP_ARGS(ts),
+                    "log", dropped - reported_dropped);
+            reported_dropped = dropped;
+        }
+    }
+}
+
+static bool log_async_start()
+{
+    if (s_log_async_failed || xTaskGetSchedulerState() == taskSCHEDULER_NOT_STARTED) {
+        return false;
+    }
     if (!s_log_mutex) {
         s_log_mutex = xSemaphoreCreateMutex();
     }
     if (xSemaphoreTake(s_log_mutex, MAX_MUTEX_WAIT_TICKS) == pdFALSE) {
-        return;
+        return false;
     }
-    esp_log_level_t level_for_tag;
-    // Look for the tag in cache first, then in the linked list of all tags
-    if (!get_cached_log_level(tag, &level_for_tag)) {
-        if (!get_uncached_log_level(tag, &level_for_tag)) {
-            level_for_tag = s_log_default_level;
+    // another task may have started the output task while we were waiting
+    if (!s_log_async_started && !s_log_async_failed) {
+        bool ok = true;
+        for (int cpu = 0; cpu < portNUM_PROCESSORS && ok; ++cpu) {
+            s_log_async_buf[cpu] = xRingbufferCreate(CONFIG_LOG_ASYNC_BUFFER_SIZE, RINGBUF_TYPE_NOSPLIT);
+            ok = s_log_async_buf[cpu] != NULL;
+        }
+        if (ok) {
+            ok = xTaskCreatePinnedToCore(&log_async_task, "log", CONFIG_LOG_ASYNC_TASK_STACK_SIZE, NULL,
+                    CONFIG_LOG_ASYNC_TASK_PRIORITY, &s_log_async_task, tskNO_AFFINITY) == pdPASS;
+        }
+        if (ok) {
+            s_log_async_started = true;
+        } else {
+            // keep writing messages directly
+            for (int cpu = 0; cpu < portNUM_PROCESSORS; ++cpu) {
+                if (s_log_async_buf[cpu]) {
+                    vRingbufferDelete(s_log_async_buf[cpu]);
+                    s_log_async_buf[cpu] = NULL;
+                }
+            }
+            s_log_async_failed = true;
         }
-        add_to_cache(tag, level_for_tag);
-#ifdef LOG_BUILTIN_CHECKS
-        ++s_log_cache_misses;
-#endif
     }
     xSemaphoreGive(s_log_mutex);
-    if (!should_output(level, level_for_tag)) {
-        return;
+    return s_log_async_started;
+}
+
+static void log_async_send(const char* line, int len)
+{
+    if (xRingbufferSend(s_log_async_buf[xPortGetCoreID()], (void*) line, len, 0) != pdTRUE) {
+        portENTER_CRITICAL(&s_log_async_lock);
+        ++s_log_async_dropped;
+        portEXIT_CRITICAL(&s_log_async_lock);
+    }
+    // also wakes the task to report dropped messages
+    xTaskNotifyGive(s_log_async_task);
+}
+#endif // CONFIG_LOG_ASYNC
+
+// Writes the message out, directly or through the log task. Returns its length.
+static int log_print(const char* format, va_list list)
+{
+#if CONFIG_LOG_ASYNC
+    if (s_log_async_started || log_async_start()) {
+        char line[CONFIG_LOG_MAX_LINE_LENGTH];
+        int len = log_format_line(line, sizeof(line), format, list);
+        if (len > 0) {
+            log_async_send(line, len);
+        }
+        return len;
     }
+#endif
+    return (*s_log_print_func)(format, list);
+}
 
+#if LOG_LIMITS
+static void log_printf(const char* format, ...)
+{
     va_list list;
     va_start(list, format);
-    (*s_log_print_func)(format, list);
+    log_print(format, list);
     va_end(list);
 }
+#endif
 
-static inline bool get_cached_log_level(const char* tag, esp_log_level_t* level)
+#if CONFIG_LOG_SUPPRESS_REPEATS
+static int log_print_line(const char* line, int len)
 {
-    // Look for `tag` in cache
-    int i;
-    for (i = 0; i < s_log_cache_entry_count; ++i) {
-#ifdef LOG_BUILTIN_CHECKS
-        assert(i == 0 || s_log_cache[(i - 1) / 2].generation < s_log_cache[i].generation);
+#if CONFIG_LOG_ASYNC
+    if (s_log_async_started || log_async_start()) {
+        log_async_send(line, len);
+        return len;
+    }
+#endif
+    return log_print_direct("%.*s", len, line);
+}
+
+static uint32_t log_line_hash(const char* line, int len)
+{
+    // skip the timestamp, "(1234)", so that the same message logged later has the same hash
+    const char* end = line + len;
+    const char* ts_begin = (const char*) memchr(line, '(', len < 16 ? len : 16);
+    const char* ts_end = ts_begin ? (const char*) memchr(ts_begin, ')', end - ts_begin) : NULL;
+    if (!ts_end) {
+        ts_begin = NULL;
+    }
+    uint32_t hash = 2166136261u;
+    for (const char* p = line; p < end; ++p) {
+        if (p == ts_begin) {
+            p = ts_end;
+            continue;
+        }
+        hash = (hash ^ (uint8_t) *p) * 16777619u;
+    }
+    // 0 marks a state without any message
+    return hash ? hash : 1;
+}
+#endif // CONFIG_LOG_SUPPRESS_REPEATS
+
+#if LOG_LIMITS
+static log_limit_state_t* get_limit_state(const char* tag, uint32_t now)
+{
+    log_limit_state_t* state = &s_log_limits[0];
+    for (int i = 0; i < CONFIG_LOG_LIMIT_TAGS; ++i) {
+        log_limit_state_t* it = &s_log_limits[i];
+        if (it->tag == tag) {
+            return it;
+        }
+        // replace free state, or the one unused for the longest time
+        if (state->tag != NULL && (it->tag == NULL || now - it->last_time > now - state->last_time)) {
+            state = it;
+        }
+    }
+    memset(state, 0, sizeof(*state));
+    state->tag = tag;
+    state->last_time = now;
+#if CONFIG_LOG_RATE_LIMIT
+    state->burst = s_log_rate_burst;
+    state->per_second = s_log_rate_per_second;
+    for (log_rate_limit_entry_t* it = s_log_rate_limits_head; it != NULL; it = it->next) {
+        if (strcmp(tag, it->tag) == 0) {
+            state->burst = it->burst;
+            state->per_second = it->per_second;
+            break;
+        }
+    }
+    state->tokens = state->burst * 1000;
+#endif
+    return state;
+}
+
+/* Returns false if the message should be suppressed. Otherwise sets numbers
+ * of messages suppressed since the last message of the tag was written out. */
+static bool log_limit_check(const char* tag, uint32_t hash, uint32_t* repeated, uint32_t* limited)
+{
+    *repeated = 0;
+    *limited = 0;
+    if (!s_log_mutex) {
+        s_log_mutex = xSemaphoreCreateMutex();
+    }
+    if (xSemaphoreTake(s_log_mutex, MAX_MUTEX_WAIT_TICKS) == pdFALSE) {
+        // rather write too much than lose the message
+        return true;
+    }
+    uint32_t now = esp_log_timestamp();
+    log_limit_state_t* state = get_limit_state(tag, now);
+    bool output = true;
+#if CONFIG_LOG_RATE_LIMIT
+    // tokens are in thousandths of a message, refilled at per_second messages per 1000 ms
+    uint64_t tokens = state->tokens + (uint64_t) (now - state->last_time) * state->per_second;
+    if (tokens > (uint64_t) state->burst * 1000) {
+        tokens = (uint64_t) state->burst * 1000;
+    }
+    state->tokens = (uint32_t) tokens;
+#endif
+    state->last_time = now;
+#if CONFIG_LOG_SUPPRESS_REPEATS
+    if (state->hash == hash) {
+        ++state->repeats;
+        output = false;
+    }
+#endif
+#if CONFIG_LOG_RATE_LIMIT
+    if (output && state->per_second != 0) {
+        if (state->tokens < 1000) {
+            ++state->limited;
+            output = false;
+        } else {
+            state->tokens -= 1000;
+        }
+    }
+#endif
+    if (output) {
+#if CONFIG_LOG_SUPPRESS_REPEATS
+        *repeated = state->repeats;
+        state->repeats = 0;
+        state->hash = hash;
+#endif
+#if CONFIG_LOG_RATE_LIMIT
+        *limited = state->limited;
+        state->limited = 0;
+#endif
+    } else {
+        ++s_log_suppressed;
+    }
+    xSemaphoreGive(s_log_mutex);
+    return output;
+}
+#endif // LOG_LIMITS
+
+static inline void log_output(const char* tag, const char* format, va_list list)
+{
+#if CONFIG_LOG_TAG_STATS
+    uint64_t start = esp_log_timestamp_us();
+#endif
+#if CONFIG_LOG_SUPPRESS_REPEATS
+    // repeated messages are recognized by their text
+    char line[CONFIG_LOG_MAX_LINE_LENGTH];
+    int len = log_format_line(line, sizeof(line), format, list);
+    if (len <= 0) {
+        return;
+    }
+    uint32_t hash = log_line_hash(line, len);
+#else
+    uint32_t hash = 0;
+#endif
+#if LOG_LIMITS
+    uint32_t repeated;
+    uint32_t limited;
+    if (!log_limit_check(tag, hash, &repeated, &limited)) {
+        return;
+    }
+    if (repeated || limited) {
+        LOG_TIMESTAMP_DECLARE(ts);
+        if (repeated) {
+            log_printf(LOG_FORMAT_TS(W, "last message repeated %u times"), LOG_TIMESTAMP_ARGS(ts), tag, repeated);
+        }
+        if (limited) {
+            log_printf(LOG_FORMAT_TS(W, "%u messages suppressed by rate limit"), LOG_TIMESTAMP_ARGS(ts), tag, limited);
+        }
+    }
 #endif
-        if (s_log_cache[i].tag == tag) {
+#if CONFIG_LOG_SUPPRESS_REPEATS
+    int written = log_print_line(line, len);
+#else
+    (void) hash;
+    int written = log_print(format, list);
+#endif
+#if CONFIG_LOG_TAG_STATS
+    log_stats_add(tag, 1, 0, written > 0 ? written : 0, esp_log_timestamp_us() - start);
+#else
+    (void) written;
+#endif
+}
+
+#if CONFIG_LOG_TAG_STATS
+static void IRAM_ATTR log_stats_add(const char* tag, uint32_t emitted, uint32_t suppressed, uint32_t bytes, uint32_t time_us)
+{
+    portENTER_CRITICAL(&s_log_stats_lock);
+    // entries are only removed all at once, so the probe sequence ends at a free entry
+    esp_log_tag_stats_t* stats = &s_log_stats[CONFIG_LOG_TAG_STATS_SIZE];
+    uint32_t index = ((uint32_t) tag * 2654435761u) % CONFIG_LOG_TAG_STATS_SIZE;
+    for (int i = 0; i < CONFIG_LOG_TAG_STATS_SIZE; ++i) {
+        esp_log_tag_stats_t* it = &s_log_stats[(index + i) % CONFIG_LOG_TAG_STATS_SIZE];
+        if (it->tag == tag) {
+            stats = it;
+            break;
+        }
+        if (it->tag == NULL) {
+            it->tag = tag;
+            stats = it;
             break;
         }
     }
-    if (i == s_log_cache_entry_count) { // Not found in cache
+    stats->emitted += emitted;
+    stats->suppressed += suppressed;
+    stats->bytes += bytes;
+    stats->output_time_us += time_us;
+    portEXIT_CRITICAL(&s_log_stats_lock);
+}
+#endif // CONFIG_LOG_TAG_STATS
+
+size_t esp_log_stats_get(esp_log_tag_stats_t* stats, size_t count)
+{
+    size_t total = 0;
+#if CONFIG_LOG_TAG_STATS
+    esp_log_tag_stats_t snapshot[CONFIG_LOG_TAG_STATS_SIZE + 1];
+    portENTER_CRITICAL(&s_log_stats_lock);
+    memcpy(snapshot, s_log_stats, sizeof(snapshot));
+    portEXIT_CRITICAL(&s_log_stats_lock);
+    for (int i = 0; i <= CONFIG_LOG_TAG_STATS_SIZE; ++i) {
+        const esp_log_tag_stats_t* it = &snapshot[i];
+        if (it->emitted == 0 && it->suppressed == 0) {
+            continue;
+        }
+        // insert into the output, ordered by number of bytes
+        size_t pos = total < count ? total : count;
+        while (pos > 0 && stats[pos - 1].bytes < it->bytes) {
+            if (pos < count) {
+                stats[pos] = stats[pos - 1];
+            }
+            --pos;
+        }
+        if (pos < count) {
+            stats[pos] = *it;
+        }
+        ++total;
+    }
+#endif
+    return total;
+}
+
+void esp_log_stats_reset()
+{
+#if CONFIG_LOG_TAG_STATS
+    portENTER_CRITICAL(&s_log_stats_lock);
+    memset(s_log_stats, 0, sizeof(s_log_stats));
+    portEXIT_CRITICAL(&s_log_stats_lock);
+#endif
+}
+
+uint32_t esp_log_get_dropped_count()
+{
+#if CONFIG_LOG_ASYNC
+    return s_log_async_dropped;
+#else
+    return 0;
+#endif
+}
+
+uint32_t esp_log_get_suppressed_count()
+{
+#if LOG_LIMITS
+    return s_log_suppressed;
+#else
+    return 0;
+#endif
+}
+
+void esp_log_rate_limit_set(const char* tag, uint32_t burst, uint32_t per_second)
+{
+#if CONFIG_LOG_RATE_LIMIT
+    if (!s_log_mutex) {
+        s_log_mutex = xSemaphoreCreateMutex();
+    }
+    xSemaphoreTake(s_log_mutex, portMAX_DELAY);
+    if (strcmp(tag, "*") == 0) {
+        s_log_rate_burst = burst;
+        s_log_rate_per_second = per_second;
+        for (log_rate_limit_entry_t* it = s_log_rate_limits_head; it != NULL; ) {
+            log_rate_limit_entry_t* next = it->next;
+            free(it);
+            it = next;
+        }
+        s_log_rate_limits_head = NULL;
+    } else {
+        log_rate_limit_entry_t* entry = s_log_rate_limits_head;
+        while (entry != NULL && strcmp(tag, entry->tag) != 0) {
+            entry = entry->next;
+        }
+        if (!entry) {
+            entry = (log_rate_limit_entry_t*) malloc(offsetof(log_rate_limit_entry_t, tag) + strlen(tag) + 1);
+            if (entry) {
+                strcpy(entry->tag, tag);
+                entry->next = s_log_rate_limits_head;
+                s_log_rate_limits_head = entry;
+            }
+        }
+        if (entry) {
+            entry->burst = burst;
+            entry->per_second = per_second;
+        }
+    }
+    // states copy the limits when they are created, start over with the new ones
+    memset(s_log_limits, 0, sizeof(s_log_limits));
+    xSemaphoreGive(s_log_mutex);
+#endif
+}
+
+static inline void update_descs(const char* tag, esp_log_level_t level)
+{
+    // NULL tag updates all descriptors
+    for (esp_log_tag_desc_t* it = s_log_descs_head; it != NULL; it = it->next) {
+        if (tag == NULL || strcmp(tag, it->tag) == 0) {
+            it->level = (uint8_t) level;
+        }
+    }
+}
+
+static inline bool IRAM_ATTR get_log_level(const char* tag, esp_log_level_t* level)
+{
+    // Look for the tag in cache first, then in the linked list of all tags
+    if (get_cached_log_level(tag, level)) {
+        return true;
+    }
+    if (!s_log_mutex) {
+        s_log_mutex = xSemaphoreCreateMutex();
+    }
+    if (xSemaphoreTake(s_log_mutex, MAX_MUTEX_WAIT_TICKS) == pdFALSE) {
         return false;
     }
-    // Return level from cache
-    *level = (esp_log_level_t) s_log_cache[i].level;
-    // If cache has been filled, start taking ordering into account
-    // (other options are: dynamically resize cache, add "dummy" entries
-    //  to the cache; this option was chosen because code is much simpler,
-    //  and the unfair behavior of cache will show it self at most once, when
-    //  it has just been filled)
-    if (s_log_cache_entry_count == TAG_CACHE_SIZE) {
-        // Update item generation
-        s_log_cache[i].generation = s_log_cache_max_generation++;
-        // Restore heap ordering
-        heap_bubble_down(i);
+    // cache can't change while the mutex is held, so this lookup is reliable
+    if (!get_cached_log_level(tag, level)) {
+        if (!get_uncached_log_level(tag, level)) {
+            *level = s_log_default_level;
+        }
+        add_to_cache(tag, *level);
+#ifdef LOG_BUILTIN_CHECKS
+        ++s_log_cache_misses;
+#endif
     }
+    xSemaphoreGive(s_log_mutex);
     return true;
 }
 
+static inline uint32_t tag_cache_index(const char* tag)
+{
+    // tags are aligned string constants, multiplicative hash spreads their addresses
+    return ((uint32_t) tag * 2654435761u) >> 27;
+}
+
+static inline bool get_cached_log_level(const char* tag, esp_log_level_t* level)
+{
+    const uint32_t seq = s_log_cache_seq;
+    if (seq & 1) { // cache is being modified
+        return false;
+    }
+    __sync_synchronize();
+    bool found = false;
+    uint32_t index = tag_cache_index(tag);
+    for (int i = 0; i < TAG_CACHE_MAX_PROBES; ++i) {
+        const cached_tag_entry_t* entry = &s_log_cache[(index + i) & (TAG_CACHE_SIZE - 1)];
+        if (entry->tag == tag) {
+            *level = (esp_log_level_t) entry->level;
+            found = true;
+            break;
+        }
+        if (entry->tag == NULL) {
+            break;
+        }
+    }
+    __sync_synchronize();
+    // if the cache was modified in the meantime, the entry may be torn
+    return found && s_log_cache_seq == seq;
+}
+
 static inline void add_to_cache(const char* tag, esp_log_level_t level)
 {
-    uint32_t generation = s_log_cache_max_generation++;
-    // First consider the case when cache is not filled yet.
-    // In this case, just add new entry at the end.
-    // This happens to satisfy binary min-heap ordering.
-    if (s_log_cache_entry_count < TAG_CACHE_SIZE) {
-        s_log_cache[s_log_cache_entry_count] = (cached_tag_entry_t) {
-            .generation = generation,
-            .level = level,
-            .tag = tag
-        };
-        ++s_log_cache_entry_count;
-        return;
+    uint32_t index = tag_cache_index(tag);
+    cached_tag_entry_t* slot = &s_log_cache[index];
+    for (int i = 0; i < TAG_CACHE_MAX_PROBES; ++i) {
+        cached_tag_entry_t* entry = &s_log_cache[(index + i) & (TAG_CACHE_SIZE - 1)];
+        if (entry->tag == NULL) {
+            slot = entry;
+            break;
+        }
     }
+    // entries are never removed one by one, so a free slot doesn't break any probe sequence
+    cache_write_begin();
+    slot->tag = tag;
+    slot->level = level;
+    cache_write_end();
+}
+
+static inline void cache_write_begin()
+{
+    ++s_log_cache_seq;
+    __sync_synchronize();
+}
 
-    // Cache is full, so we replace the oldest entry (which is at index 0
-    // because this is a min-heap) with the new one, and do bubble-down
-    // operation to restore min-heap ordering.
-    s_log_cache[0] = (cached_tag_entry_t) {
-        .tag = tag,
-        .level = level,
-        .generation = generation
-    };
-    heap_bubble_down(0);
+static inline void cache_write_end()
+{
+    __sync_synchronize();
+    ++s_log_cache_seq;
 }
 
 static inline bool get_uncached_log_level(const char* tag, esp_log_level_t* level)
@@ -266,24 +864,6 @@ static inline bool should_output(esp_log_level_t level_for_message, esp_log_leve
 {
     return level_for_message <= level_for_tag;
 }
-
-static void heap_bubble_down(int index)
-{
-    while (index < TAG_CACHE_SIZE / 2) {
-        int left_index = index * 2 + 1;
-        int right_index = left_index + 1;
-        int next = (s_log_cache[left_index].generation < s_log_cache[right_index].generation) ? left_index : right_index;
-        heap_swap(index, next);
-        index = next;
-    }
-}
-
-static inline void heap_swap(int i, int j)
-{
-    cached_tag_entry_t tmp = s_log_cache[i];
-    s_log_cache[i] = s_log_cache[j];
-    s_log_cache[j] = tmp;
-}
 #endif //BOOTLOADER_BUILD
 
 
@@ -313,36 +893,180 @@ uint32_t IRAM_ATTR esp_log_timestamp()
     return base + xTaskGetTickCount() * (1000 / configTICK_RATE_HZ);
 }
 
+// FRC2 counts up at APB_CLK_FREQ / 16 = 5 MHz, both CPUs read the same counter
+#define TIMESTAMP_FRC_PRESCALER_CTL 2
+#define TIMESTAMP_FRC_TICKS_PER_US (APB_CLK_FREQ / 16 / 1000000)
+#define TIMESTAMP_FRC_TICKS_PER_OS_TICK (APB_CLK_FREQ / 16 / configTICK_RATE_HZ)
+
+static volatile bool s_timestamp_started = false;
+static uint32_t s_timestamp_base_frc;
+static TickType_t s_timestamp_base_tick;
+static uint64_t s_timestamp_base_us;
+static portMUX_TYPE s_timestamp_lock = portMUX_INITIALIZER_UNLOCKED;
+
+uint64_t IRAM_ATTR esp_log_timestamp_us()
+{
+    if (!s_timestamp_started) {
+        uint32_t base_ms = esp_log_timestamp();
+        portENTER_CRITICAL(&s_timestamp_lock);
+        if (!s_timestamp_started) {
+            WRITE_PERI_REG(FRC_TIMER_LOAD_REG(1), 0);
+            WRITE_PERI_REG(FRC_TIMER_CTRL_REG(1),
+                    FRC_TIMER_ENABLE | (TIMESTAMP_FRC_PRESCALER_CTL << FRC_TIMER_PRESCALER_S));
+            s_timestamp_base_tick = xTaskGetTickCount();
+            s_timestamp_base_frc = READ_PERI_REG(FRC_TIMER_COUNT_REG(1));
+            s_timestamp_base_us = (uint64_t) base_ms * 1000;
+            s_timestamp_started = true;
+        }
+        portEXIT_CRITICAL(&s_timestamp_lock);
+    }
+    // The counter wraps around every 859 seconds. Tick count tells how many
+    // times it has done so: it is behind the counter by at most a few ticks,
+    // so the wrap count which brings the counter closest to it is the right one.
+    TickType_t ticks = xTaskGetTickCount() - s_timestamp_base_tick;
+    uint32_t frc = READ_PERI_REG(FRC_TIMER_COUNT_REG(1)) - s_timestamp_base_frc;
+    int64_t approx = (int64_t) ticks * TIMESTAMP_FRC_TICKS_PER_OS_TICK;
+    int64_t wraps = (approx - frc + (1LL << 31)) >> 32;
+    uint64_t frc_elapsed = ((uint64_t) wraps << 32) + frc;
+    return s_timestamp_base_us + frc_elapsed / TIMESTAMP_FRC_TICKS_PER_US;
+}
+
 #else
 
 uint32_t esp_log_timestamp() __attribute__((alias("esp_log_early_timestamp")));
 
 #endif //BOOTLOADER_BUILD
 
+static const char s_hex_digits[] = "0123456789abcdef";
+
+static inline char* hex_byte(char* out, uint8_t value)
+{
+    out[0] = s_hex_digits[value >> 4];
+    out[1] = s_hex_digits[value & 0xf];
+    return out + 2;
+}
+
+// Checks the level of the tag before the buffer is formatted
+static inline bool buffer_log_enabled(const char* tag, esp_log_level_t level)
+{
+#ifndef BOOTLOADER_BUILD
+    esp_log_level_t level_for_tag;
+    return get_log_level(tag, &level_for_tag) && should_output(level, level_for_tag);
+#else
+    return LOG_LOCAL_LEVEL >= level;
+#endif
+}
+
 void esp_log_buffer_hex(const char *tag, const char *buffer, uint16_t buff_len)
 {
-    char temp_buffer[3*BYTES_PER_LINE + 1]= {0};
-    int line_len = 0;
-    for (int i = 0; i < buff_len; i++) {
-        line_len += sprintf(temp_buffer+line_len, "%02x ", buffer[i]);
-        if (((i + 1) % BYTES_PER_LINE == 0) || (i == buff_len - 1)) {
-            ESP_LOGI(tag, "%s", temp_buffer);
-            line_len = 0;
-            temp_buffer[0] = 0;
+    if (LOG_LOCAL_LEVEL < ESP_LOG_INFO || !buffer_log_enabled(tag, ESP_LOG_INFO)) {
+        return;
+    }
+    char temp_buffer[3*BYTES_PER_LINE + 1];
+    for (int i = 0; i < buff_len; i += BYTES_PER_LINE) {
+        int line_len = (buff_len - i < BYTES_PER_LINE) ? buff_len - i : BYTES_PER_LINE;
+        char* out = temp_buffer;
+        for (int j = 0; j < line_len; ++j) {
+            out = hex_byte(out, buffer[i + j]);
+            *out++ = ' ';
         }
+        *out = 0;
+        ESP_LOGI(tag, "%s", temp_buffer);
     }
 }
 
 void esp_log_buffer_char(const char *tag, const char *buffer, uint16_t buff_len)
 {
-    char temp_buffer[BYTES_PER_LINE + 1] = {0};
-    int line_len = 0;
-    for (int i = 0; i < buff_len; i++) {
-        line_len += sprintf(temp_buffer+line_len, "%c", buffer[i]);
-        if (((i + 1) % BYTES_PER_LINE == 0) || (i == buff_len - 1)) {
-            ESP_LOGI(tag, "%s", temp_buffer);
-            line_len = 0;
-            temp_buffer[0] = 0;
+    if (LOG_LOCAL_LEVEL < ESP_LOG_INFO || !buffer_log_enabled(tag, ESP_LOG_INFO)) {
+        return;
+    }
+    char temp_buffer[BYTES_PER_LINE + 1];
+    for (int i = 0; i < buff_len; i += BYTES_PER_LINE) {
+        int line_len = (buff_len - i < BYTES_PER_LINE) ? buff_len - i : BYTES_PER_LINE;
+        memcpy(temp_buffer, buffer + i, line_len);
+        temp_buffer[line_len] = 0;
+        ESP_LOGI(tag, "%s", temp_buffer);
+    }
+}
+
+// "0000  00 01 02 03 04 05 06 07  08 09 0a 0b 0c 0d 0e 0f  |0123456789abcdef|"
+#define HEXDUMP_LINE_LENGTH (4 + 2 + 3 * BYTES_PER_LINE + 2 + BYTES_PER_LINE + 2)
+
+// Formats one line of hex dump, returns pointer past its end
+static char* hexdump_line(char* out, const uint8_t* data, uint16_t offset, int len)
+{
+    out = hex_byte(out, offset >> 8);
+    out = hex_byte(out, offset & 0xff);
+    *out++ = ' ';
+    for (int i = 0; i < BYTES_PER_LINE; ++i) {
+        if (i % 8 == 0) {
+            *out++ = ' ';
         }
+        if (i < len) {
+            out = hex_byte(out, data[i]);
+        } else {
+            *out++ = ' ';
+            *out++ = ' ';
+        }
+        *out++ = ' ';
+    }
+    *out++ = ' ';
+    *out++ = '|';
+    for (int i = 0; i < len; ++i) {
+        *out++ = (data[i] >= 0x20 && data[i] < 0x7f) ? data[i] : '.';
+    }
+    *out++ = '|';
+    return out;
+}
+
+static void hexdump_write(esp_log_level_t level, const char* tag, const char* text)
+{
+    switch (level) {
+        case ESP_LOG_ERROR:   ESP_LOGE(tag, "%s", text); break;
+        case ESP_LOG_WARN:    ESP_LOGW(tag, "%s", text); break;
+        case ESP_LOG_INFO:    ESP_LOGI(tag, "%s", text); break;
+        case ESP_LOG_DEBUG:   ESP_LOGD(tag, "%s", text); break;
+        case ESP_LOG_VERBOSE: ESP_LOGV(tag, "%s", text); break;
+        default: break;
+    }
+}
+
+void esp_log_buffer_hexdump(const char *tag, const void *buffer, uint16_t buff_len, esp_log_level_t level)
+{
+    // levels above the default one are compiled out of hexdump_write
+#ifndef BOOTLOADER_BUILD
+    if (level > CONFIG_LOG_DEFAULT_LEVEL) {
+        return;
+    }
+#endif
+    if (level == ESP_LOG_NONE || !buffer_log_enabled(tag, level)) {
+        return;
+    }
+    const uint8_t* data = (const uint8_t*) buffer;
+    int lines = (buff_len + BYTES_PER_LINE - 1) / BYTES_PER_LINE;
+#if !defined(BOOTLOADER_BUILD) && !CONFIG_LOG_ASYNC && !CONFIG_LOG_SUPPRESS_REPEATS
+    // whole dump as one message, when messages can be of any length
+    char* text = (char*) malloc(16 + lines * (HEXDUMP_LINE_LENGTH + 1));
+    if (text) {
+        char* out = text + sprintf(text, "%u bytes", buff_len);
+        for (int i = 0; i < lines; ++i) {
+            int offset = i * BYTES_PER_LINE;
+            *out++ = '\n';
+            out = hexdump_line(out, data + offset, offset,
+                    (buff_len - offset < BYTES_PER_LINE) ? buff_len - offset : BYTES_PER_LINE);
+        }
+        *out = 0;
+        hexdump_write(level, tag, text);
+        free(text);
+        return;
+    }
+#endif
+    char line[HEXDUMP_LINE_LENGTH + 1];
+    for (int i = 0; i < lines; ++i) {
+        int offset = i * BYTES_PER_LINE;
+        char* out = hexdump_line(line, data + offset, offset,
+                (buff_len - offset < BYTES_PER_LINE) ? buff_len - offset : BYTES_PER_LINE);
+        *out = 0;
+        hexdump_write(level, tag, line);
     }
 }
@@ -0,0 +1,384 @@
+#include <stdio.h>
+#include <string.h>
+#include "unity.h"
+#include "esp_log.h"
+#include "xtensa/hal.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+
+static int s_printed;
+
+static int count_vprintf(const char* format, va_list args)
+{
+    ++s_printed;
+    return vsnprintf(NULL, 0, format, args);
+}
+
+static void begin_counting(void)
+{
+    s_printed = 0;
+    esp_log_set_vprintf(&count_vprintf);
+}
+
+// number of messages written out so far
+static int printed(void)
+{
+#if CONFIG_LOG_ASYNC
+    vTaskDelay(10 / portTICK_PERIOD_MS);
+#endif
+    return s_printed;
+}
+
+static void end_counting(void)
+{
+    esp_log_set_vprintf(&vprintf);
+    esp_log_level_set("*", CONFIG_LOG_DEFAULT_LEVEL);
+}
+
+TEST_CASE("log level of a tag can be changed after it has been used", "[log]")
+{
+    static const char* tag = "test_level";
+    begin_counting();
+    esp_log_level_set("*", ESP_LOG_INFO);
+    esp_log_write(ESP_LOG_INFO, tag, "message");
+    esp_log_write(ESP_LOG_DEBUG, tag, "message");
+    TEST_ASSERT_EQUAL(1, printed());
+
+    esp_log_level_set("test_level", ESP_LOG_WARN);
+    esp_log_write(ESP_LOG_INFO, tag, "message");
+    esp_log_write(ESP_LOG_WARN, tag, "message");
+    TEST_ASSERT_EQUAL(2, printed());
+
+    // same tag string at another address
+    char tag_copy[16];
+    strcpy(tag_copy, tag);
+    esp_log_level_set(tag_copy, ESP_LOG_DEBUG);
+    esp_log_write(ESP_LOG_DEBUG, tag, "message");
+    esp_log_write(ESP_LOG_DEBUG, tag_copy, "message");
+    TEST_ASSERT_EQUAL(4, printed());
+
+    esp_log_level_set("*", ESP_LOG_ERROR);
+    esp_log_write(ESP_LOG_WARN, tag, "message");
+    TEST_ASSERT_EQUAL(4, printed());
+    end_counting();
+}
+
+TEST_CASE("log levels are kept for more tags than fit into the cache", "[log]")
+{
+    const int tag_count = 100;
+    static char tags[100][8];
+    begin_counting();
+    esp_log_level_set("*", ESP_LOG_INFO);
+    for (int i = 0; i < tag_count; ++i) {
+        sprintf(tags[i], "tag%d", i);
+        if (i % 2) {
+            esp_log_level_set(tags[i], ESP_LOG_NONE);
+        }
+    }
+    for (int pass = 0; pass < 3; ++pass) {
+        for (int i = 0; i < tag_count; ++i) {
+            esp_log_write(ESP_LOG_INFO, tags[i], "message");
+        }
+        printed(); // with CONFIG_LOG_ASYNC, lets the buffer empty
+    }
+    TEST_ASSERT_EQUAL(3 * tag_count / 2, printed());
+    end_counting();
+}
+
+TEST_CASE("suppressed log messages are cheap", "[log]")
+{
+    static const char* tag = "test_cheap";
+    const int count = 1000;
+    begin_counting();
+    esp_log_level_set(tag, ESP_LOG_ERROR);
+    esp_log_write(ESP_LOG_INFO, tag, "message");
+    uint32_t start = xthal_get_ccount();
+    for (int i = 0; i < count; ++i) {
+        esp_log_write(ESP_LOG_INFO, tag, "message %d", i);
+    }
+    uint32_t cycles = (xthal_get_ccount() - start) / count;
+    end_counting();
+    printf("suppressed message: %d cycles\n", cycles);
+    TEST_ASSERT_EQUAL(0, printed());
+    TEST_ASSERT_TRUE(cycles < 500);
+}
+
+static void log_fast(const char* tag)
+{
+    ESP_LOGW_FAST(tag, "message");
+}
+
+TEST_CASE("ESP_LOGx_FAST follows level set for its tag", "[log]")
+{
+    static const char* tag = "test_fast";
+    begin_counting();
+    esp_log_level_set("*", ESP_LOG_INFO);
+    esp_log_level_set(tag, ESP_LOG_ERROR);
+    log_fast(tag);
+    TEST_ASSERT_EQUAL(0, printed());
+
+    esp_log_level_set(tag, ESP_LOG_WARN);
+    log_fast(tag);
+    TEST_ASSERT_EQUAL(1, printed());
+
+    esp_log_level_set("*", ESP_LOG_ERROR);
+    log_fast(tag);
+    TEST_ASSERT_EQUAL(1, printed());
+
+    esp_log_level_set("*", ESP_LOG_INFO);
+    log_fast(tag);
+    TEST_ASSERT_EQUAL(2, printed());
+    end_counting();
+}
+
+TEST_CASE("suppressed ESP_LOGx_FAST messages are cheaper than ESP_LOGx", "[log]")
+{
+    static const char* tag = "test_cheap_fast";
+    const int count = 1000;
+    begin_counting();
+    esp_log_level_set(tag, ESP_LOG_ERROR);
+    ESP_LOGW(tag, "message");
+    log_fast(tag);
+    uint32_t start = xthal_get_ccount();
+    for (int i = 0; i < count; ++i) {
+        ESP_LOGW(tag, "message %d", i);
+    }
+    uint32_t cycles = (xthal_get_ccount() - start) / count;
+    start = xthal_get_ccount();
+    for (int i = 0; i < count; ++i) {
+        ESP_LOGW_FAST(tag, "message %d", i);
+    }
+    uint32_t cycles_fast = (xthal_get_ccount() - start) / count;
+    end_counting();
+    printf("suppressed message: ESP_LOGW %d cycles, ESP_LOGW_FAST %d cycles\n", cycles, cycles_fast);
+    TEST_ASSERT_EQUAL(0, printed());
+    TEST_ASSERT_TRUE(cycles_fast < cycles);
+}
+
+#if CONFIG_LOG_ASYNC
+TEST_CASE("messages are written out by the log task and dropped when buffer is full", "[log]")
+{
+    static const char* tag = "test_async";
+    begin_counting();
+    esp_log_level_set("*", ESP_LOG_INFO);
+    // first message after scheduler start creates the buffers
+    esp_log_write(ESP_LOG_INFO, tag, "message\n");
+    vTaskDelay(10 / portTICK_PERIOD_MS);
+    s_printed = 0;
+
+    esp_log_write(ESP_LOG_INFO, tag, "message\n");
+    TEST_ASSERT_EQUAL(0, s_printed);
+    vTaskDelay(10 / portTICK_PERIOD_MS);
+    TEST_ASSERT_EQUAL(1, s_printed);
+
+    // the log task has lower priority, so it can't empty the buffer during this loop
+    uint32_t dropped = esp_log_get_dropped_count();
+    const int count = CONFIG_LOG_ASYNC_BUFFER_SIZE / 8;
+    for (int i = 0; i < count; ++i) {
+        esp_log_write(ESP_LOG_INFO, tag, "message %d\n", i);
+    }
+    dropped = esp_log_get_dropped_count() - dropped;
+    TEST_ASSERT_TRUE(dropped > 0);
+    vTaskDelay(100 / portTICK_PERIOD_MS);
+    // written messages and the report of dropped ones
+    TEST_ASSERT_EQUAL(1 + count - dropped + 1, s_printed);
+    end_counting();
+}
+#endif //CONFIG_LOG_ASYNC
+
+#if CONFIG_LOG_SUPPRESS_REPEATS
+TEST_CASE("repeated log messages are written out once", "[log]")
+{
+    static const char* tag = "test_repeat";
+    begin_counting();
+    esp_log_level_set("*", ESP_LOG_INFO);
+    uint32_t suppressed = esp_log_get_suppressed_count();
+    for (int i = 0; i < 10; ++i) {
+        ESP_LOGI(tag, "same message");
+    }
+    ESP_LOGI(tag, "other message");
+    // first message, number of repeats, other message
+    TEST_ASSERT_EQUAL(3, printed());
+    TEST_ASSERT_EQUAL(9, esp_log_get_suppressed_count() - suppressed);
+    end_counting();
+}
+#endif //CONFIG_LOG_SUPPRESS_REPEATS
+
+#if CONFIG_LOG_RATE_LIMIT
+TEST_CASE("log messages over rate limit are suppressed", "[log]")
+{
+    static const char* tag = "test_rate";
+    begin_counting();
+    esp_log_level_set("*", ESP_LOG_INFO);
+    esp_log_rate_limit_set(tag, 5, 1);
+    uint32_t suppressed = esp_log_get_suppressed_count();
+    for (int i = 0; i < 20; ++i) {
+        ESP_LOGI(tag, "message %d", i);
+    }
+    TEST_ASSERT_EQUAL(5, printed());
+    TEST_ASSERT_EQUAL(15, esp_log_get_suppressed_count() - suppressed);
+
+    vTaskDelay(1100 / portTICK_PERIOD_MS);
+    ESP_LOGI(tag, "message");
+    // number of suppressed messages, then the message
+    TEST_ASSERT_EQUAL(7, printed());
+
+    esp_log_rate_limit_set("*", CONFIG_LOG_RATE_LIMIT_BURST, CONFIG_LOG_RATE_LIMIT_PER_SECOND);
+    end_counting();
+}
+#endif //CONFIG_LOG_RATE_LIMIT
+
+typedef struct {
+    SemaphoreHandle_t ping;
+    SemaphoreHandle_t pong;
+    SemaphoreHandle_t done;
+    uint64_t time;
+    int errors;
+} timestamp_test_args_t;
+
+static void timestamp_pong_task(void* arg)
+{
+    timestamp_test_args_t* args = (timestamp_test_args_t*) arg;
+    for (int i = 0; i < 100; ++i) {
+        xSemaphoreTake(args->ping, portMAX_DELAY);
+        uint64_t now = esp_log_timestamp_us();
+        if (now < args->time) {
+            ++args->errors;
+        }
+        args->time = now;
+        xSemaphoreGive(args->pong);
+    }
+    xSemaphoreGive(args->done);
+    vTaskDelete(NULL);
+}
+
+TEST_CASE("microsecond timestamps are consistent between CPUs", "[log]")
+{
+    uint64_t start = esp_log_timestamp_us();
+    vTaskDelay(100 / portTICK_PERIOD_MS);
+    uint32_t elapsed = esp_log_timestamp_us() - start;
+    printf("vTaskDelay(100ms): %d us\n", elapsed);
+    TEST_ASSERT_INT_WITHIN(portTICK_PERIOD_MS * 1000, 100000, elapsed);
+
+    timestamp_test_args_t args = {
+        .ping = xSemaphoreCreateBinary(),
+        .pong = xSemaphoreCreateBinary(),
+        .done = xSemaphoreCreateBinary(),
+        .time = 0,
+        .errors = 0
+    };
+    xTaskCreatePinnedToCore(&timestamp_pong_task, "pong", 2048, &args, 5, NULL, !xPortGetCoreID());
+    for (int i = 0; i < 100; ++i) {
+        uint64_t now = esp_log_timestamp_us();
+        if (now < args.time) {
+            ++args.errors;
+        }
+        args.time = now;
+        xSemaphoreGive(args.ping);
+        xSemaphoreTake(args.pong, portMAX_DELAY);
+    }
+    xSemaphoreTake(args.done, portMAX_DELAY);
+    vSemaphoreDelete(args.ping);
+    vSemaphoreDelete(args.pong);
+    vSemaphoreDelete(args.done);
+    TEST_ASSERT_EQUAL(0, args.errors);
+}
+
+#if CONFIG_LOG_TAG_STATS
+static esp_log_tag_stats_t s_stats[CONFIG_LOG_TAG_STATS_SIZE + 1];
+
+/* Other tasks may log during the test, so entries are looked up by tag */
+static const esp_log_tag_stats_t* find_tag_stats(const char* tag)
+{
+    size_t count = esp_log_stats_get(s_stats, sizeof(s_stats) / sizeof(s_stats[0]));
+    for (size_t i = 0; i < count && i < sizeof(s_stats) / sizeof(s_stats[0]); ++i) {
+        if (s_stats[i].tag == tag) {
+            return &s_stats[i];
+        }
+    }
+    return NULL;
+}
+
+TEST_CASE("log statistics are collected per tag", "[log]")
+{
+    static const char* tag_a = "test_stats_a";
+    static const char* tag_b = "test_stats_b";
+    begin_counting();
+    esp_log_level_set("*", ESP_LOG_INFO);
+    esp_log_stats_reset();
+    for (int i = 0; i < 3; ++i) {
+        esp_log_write(ESP_LOG_INFO, tag_a, "message %d\n", i);
+        esp_log_write(ESP_LOG_DEBUG, tag_a, "message %d\n", i);
+    }
+    esp_log_write(ESP_LOG_VERBOSE, tag_b, "message\n");
+    printed();
+    end_counting();
+
+    const esp_log_tag_stats_t* stats = find_tag_stats(tag_a);
+    TEST_ASSERT_NOT_NULL(stats);
+    TEST_ASSERT_EQUAL(3, stats->emitted);
+    TEST_ASSERT_EQUAL(3, stats->suppressed);
+    stats = find_tag_stats(tag_b);
+    TEST_ASSERT_NOT_NULL(stats);
+    TEST_ASSERT_EQUAL(0, stats->emitted);
+    TEST_ASSERT_EQUAL(1, stats->suppressed);
+
+    esp_log_stats_reset();
+    TEST_ASSERT_NULL(find_tag_stats(tag_a));
+    TEST_ASSERT_NULL(find_tag_stats(tag_b));
+}
+#endif //CONFIG_LOG_TAG_STATS
+
+static char s_captured[512];
+
+static int capture_vprintf(const char* format, va_list args)
+{
+    ++s_printed;
+    size_t len = strlen(s_captured);
+    return vsnprintf(s_captured + len, sizeof(s_captured) - len, format, args);
+}
+
+TEST_CASE("buffer hex dump shows offsets, bytes and characters", "[log]")
+{
+    static const char* tag = "test_dump";
+    uint8_t data[20];
+    for (int i = 0; i < (int) sizeof(data); ++i) {
+        data[i] = 'A' + i;
+    }
+    data[1] = 0x80;
+    s_printed = 0;
+    s_captured[0] = 0;
+    esp_log_set_vprintf(&capture_vprintf);
+    esp_log_level_set("*", ESP_LOG_INFO);
+    esp_log_buffer_hexdump(tag, data, sizeof(data), ESP_LOG_DEBUG);
+    TEST_ASSERT_EQUAL(0, printed());
+    esp_log_buffer_hexdump(tag, data, sizeof(data), ESP_LOG_INFO);
+    printed();
+    esp_log_buffer_hex(tag, (const char*) data, 2);
+    printed();
+    end_counting();
+
+    TEST_ASSERT_NOT_NULL(strstr(s_captured,
+            "0000  41 80 43 44 45 46 47 48  49 4a 4b 4c 4d 4e 4f 50  |A.CDEFGHIJKLMNOP|"));
+    TEST_ASSERT_NOT_NULL(strstr(s_captured,
+            "0010  51 52 53 54                                       |QRST|"));
+    TEST_ASSERT_NOT_NULL(strstr(s_captured, "41 80 \n"));
+}
+
+TEST_CASE("buffer hex dump is faster than esp_log_buffer_hex", "[log]")
+{
+    static const char* tag = "test_dump_speed";
+    static uint8_t data[1500];
+    begin_counting();
+    esp_log_level_set("*", ESP_LOG_INFO);
+    uint32_t start = xthal_get_ccount();
+    esp_log_buffer_hex(tag, (const char*) data, sizeof(data));
+    uint32_t cycles_hex = xthal_get_ccount() - start;
+    start = xthal_get_ccount();
+    esp_log_buffer_hexdump(tag, data, sizeof(data), ESP_LOG_INFO);
+    uint32_t cycles_dump = xthal_get_ccount() - start;
+    end_counting();
+    printf("1500 bytes: esp_log_buffer_hex %d cycles, esp_log_buffer_hexdump %d cycles\n", cycles_hex, cycles_dump);
+    TEST_ASSERT_TRUE(cycles_dump < cycles_hex);
+}
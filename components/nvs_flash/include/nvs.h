@@ -28,6 +28,11 @@ extern "C" {
  */
 typedef uint32_t nvs_handle;
 
+/**
+ * Handle of a value mapped with nvs_map_str or nvs_map_blob
+ */
+typedef uint32_t nvs_map_handle_t;
+
 #define ESP_ERR_NVS_BASE                0x1100                     /*!< Starting number of error codes */
 #define ESP_ERR_NVS_NOT_INITIALIZED     (ESP_ERR_NVS_BASE + 0x01)  /*!< The storage driver is not initialized */
 #define ESP_ERR_NVS_NOT_FOUND           (ESP_ERR_NVS_BASE + 0x02)  /*!< Id namespace doesn’t exist yet and mode is NVS_READONLY */
@@ -42,6 +47,8 @@ typedef uint32_t nvs_handle;
 #define ESP_ERR_NVS_INVALID_STATE       (ESP_ERR_NVS_BASE + 0x0b)  /*!< NVS is in an inconsistent state due to a previous error. Call nvs_flash_init and nvs_open again, then retry. */
 #define ESP_ERR_NVS_INVALID_LENGTH      (ESP_ERR_NVS_BASE + 0x0c)  /*!< String or blob length is not sufficient to store data */
 #define ESP_ERR_NVS_NO_FREE_PAGES       (ESP_ERR_NVS_BASE + 0x0d)  /*!< NVS partition doesn't contain any empty pages. This may happen if NVS partition was truncated. Erase the whole partition and call nvs_flash_init again. */
+#define ESP_ERR_NVS_NOT_MAPPABLE        (ESP_ERR_NVS_BASE + 0x0e)  /*!< Blob is stored on several pages and can't be mapped, use nvs_get_blob or nvs_blob_read_chunk */
+#define ESP_ERR_NVS_VALUE_TOO_LONG      (ESP_ERR_NVS_BASE + 0x0f)  /*!< String or blob is longer than one page and can't be staged in a write batch */
 
 /**
  * @brief Mode of opening the non-volatile storage
@@ -85,6 +92,9 @@ esp_err_t nvs_open(const char* name, nvs_open_mode open_mode, nvs_handle *out_ha
  * This family of functions set value for the key, given its name. Note that
  * actual storage will not be updated until nvs_commit function is called.
  *
+ * Values larger than one page of the storage (4000 bytes) are split into
+ * chunks stored on several pages. Such values can't be staged in a batch.
+ *
  * @param[in]  handle  Handle obtained from nvs_open function.
  *                     Handles that were opened read only cannot be used.
  * @param[in]  key     Key name. Maximal length is determined by the underlying
@@ -99,6 +109,8 @@ esp_err_t nvs_open(const char* name, nvs_open_mode open_mode, nvs_handle *out_ha
  *             - ESP_ERR_NVS_INVALID_NAME if key name doesn't satisfy constraints
  *             - ESP_ERR_NVS_NOT_ENOUGH_SPACE if there is not enough space in the
  *               underlying storage to save the value
+ *             - ESP_ERR_NVS_VALUE_TOO_LONG if a string longer than one page is staged
+ *               in a write batch
  *             - ESP_ERR_NVS_REMOVE_FAILED if the value wasn't updated because flash
  *               write operation has failed. The value was written however, and
  *               update will be finished after re-initialization of nvs, provided that
@@ -136,6 +148,8 @@ esp_err_t nvs_set_str (nvs_handle handle, const char* key, const char* value);
  *             - ESP_ERR_NVS_INVALID_NAME if key name doesn't satisfy constraints
  *             - ESP_ERR_NVS_NOT_ENOUGH_SPACE if there is not enough space in the
  *               underlying storage to save the value
+ *             - ESP_ERR_NVS_VALUE_TOO_LONG if a blob longer than one page is staged
+ *               in a write batch
  *             - ESP_ERR_NVS_REMOVE_FAILED if the value wasn't updated because flash
  *               write operation has failed. The value was written however, and
  *               update will be finished after re-initialization of nvs, provided that
@@ -252,6 +266,111 @@ esp_err_t nvs_get_str (nvs_handle handle, const char* key, char* out_value, size
 esp_err_t nvs_get_blob(nvs_handle handle, const char* key, void* out_value, size_t* length);
 /**@}*/
 
+/**
+ * @brief      Write a binary value in pieces
+ *
+ * Allows writing a blob which doesn't fit into RAM. The first call for the
+ * value has offset 0 and starts a new write, abandoning any write previously
+ * started on the handle. Each following call continues at the offset where
+ * the previous one stopped. When offset + length reaches total_length, the
+ * value replaces the previous value of the key. If power goes off before
+ * that, the previous value stays and the written pieces are removed by
+ * nvs_flash_init.
+ *
+ * The write is not a part of a batch started with nvs_batch_begin. The value
+ * may be read with nvs_get_blob or nvs_blob_read_chunk.
+ *
+ * @param[in]  handle        Handle obtained from nvs_open function.
+ *                           Handles that were opened read only cannot be used.
+ * @param[in]  key           Key name. Should be the same for all pieces of the value.
+ * @param[in]  offset        Offset of this piece in the value.
+ * @param[in]  value         Data of the piece.
+ * @param[in]  length        Length of the piece, in bytes.
+ * @param[in]  total_length  Length of the whole value, in bytes.
+ *
+ * @return
+ *             - ESP_OK if the piece was written
+ *             - ESP_ERR_NVS_INVALID_HANDLE if handle has been closed or is NULL
+ *             - ESP_ERR_NVS_READ_ONLY if storage handle was opened as read only
+ *             - ESP_ERR_NVS_INVALID_LENGTH if offset doesn't follow the previous
+ *               piece of the key, or the piece ends beyond total_length
+ *             - ESP_ERR_NVS_NOT_ENOUGH_SPACE if there is not enough space in the
+ *               underlying storage to save the value
+ *             - ESP_ERR_NVS_REMOVE_FAILED if the value was written, but the previous
+ *               value will only be removed after re-initialization of nvs
+ *             - other error codes from the underlying storage driver; the
+ *               write has to be started again from offset 0
+ */
+esp_err_t nvs_blob_write_chunk(nvs_handle handle, const char* key, size_t offset, const void* value, size_t length, size_t total_length);
+
+/**
+ * @brief      Read a part of a binary value
+ *
+ * @param[in]     handle     Handle obtained from nvs_open function.
+ * @param[in]     key        Key name.
+ * @param[in]     offset     Offset of the part in the value.
+ * @param[out]    out_value  Buffer to read the part into.
+ * @param[inout]  length     A non-zero pointer to the length of out_value.
+ *                           Set to the number of bytes read, which is smaller
+ *                           than the given length at the end of the value.
+ *
+ * @return
+ *             - ESP_OK if the part was read
+ *             - ESP_ERR_NVS_NOT_FOUND if the requested key doesn't exist
+ *             - ESP_ERR_NVS_INVALID_HANDLE if handle has been closed or is NULL
+ *             - ESP_ERR_NVS_INVALID_LENGTH if length is NULL, or offset is beyond
+ *               the end of the value
+ *             - other error codes from the underlying storage driver
+ */
+esp_err_t nvs_blob_read_chunk(nvs_handle handle, const char* key, size_t offset, void* out_value, size_t* length);
+
+/**@{*/
+/**
+ * @brief      Get a pointer to a string or blob value in flash
+ *
+ * The value is mapped into the data address space with spi_flash_mmap and
+ * can be used in place, without copying it into RAM. CRC of the data is
+ * checked once, when the value is mapped.
+ *
+ * The pointer stays valid and the data doesn't change until nvs_unmap is
+ * called, even if the key is set or erased in the meantime; the flash page
+ * which holds the value is not erased while the value is mapped. As long as
+ * a page is held this way, setting values may fail with
+ * ESP_ERR_NVS_NOT_ENOUGH_SPACE when storage is nearly full, so values should
+ * not be kept mapped longer than needed. nvs_flash_init fails with
+ * ESP_ERR_NVS_INVALID_STATE while any value is mapped.
+ *
+ * Each mapping takes a 64kB page of the flash MMU (shared by values which
+ * are in the same 64kB region of flash).
+ *
+ * @param[in]   handle     Handle obtained from nvs_open function.
+ * @param[in]   key        Key name.
+ * @param[out]  out_value  Pointer to the value. For nvs_map_str, the string is
+ *                         zero-terminated.
+ * @param[out]  length     Length of the value in bytes, may be NULL. For
+ *                         nvs_map_str, this includes the zero terminator.
+ * @param[out]  out_map    Handle to be passed to nvs_unmap.
+ *
+ * @return
+ *             - ESP_OK if the value was mapped
+ *             - ESP_ERR_NVS_NOT_FOUND if the requested key doesn't exist
+ *             - ESP_ERR_NVS_INVALID_HANDLE if handle has been closed or is NULL
+ *             - ESP_ERR_NVS_NOT_MAPPABLE if the blob is stored on several pages
+ *             - ESP_ERR_NO_MEM if there are no free MMU pages
+ *             - other error codes from the underlying storage driver
+ */
+esp_err_t nvs_map_str (nvs_handle handle, const char* key, const char** out_value, size_t* length, nvs_map_handle_t* out_map);
+esp_err_t nvs_map_blob(nvs_handle handle, const char* key, const void** out_value, size_t* length, nvs_map_handle_t* out_map);
+/**@}*/
+
+/**
+ * @brief      Release a value mapped with nvs_map_str or nvs_map_blob
+ *
+ * @param[in]  map  Handle obtained from nvs_map_str or nvs_map_blob.
+ *                  Unknown handles are ignored.
+ */
+void nvs_unmap(nvs_map_handle_t map);
+
 /**
  * @brief      Erase key-value pair with given key name.
  *
@@ -289,6 +408,46 @@ esp_err_t nvs_erase_key(nvs_handle handle, const char* key);
  */
 esp_err_t nvs_erase_all(nvs_handle handle);
 
+/**
+ * @brief      Start a write batch on the handle
+ *
+ * After this call, nvs_set_* and nvs_erase_key functions called with the handle
+ * only stage the changes in RAM. Staged changes are written by nvs_commit
+ * atomically: if power goes off during nvs_commit, after the next nvs_flash_init
+ * either all of the changes or none of them are visible.
+ *
+ * Get functions return the committed values, not the staged ones.
+ * nvs_erase_all is not staged and takes effect immediately.
+ * All changes of a batch should fit into one page of the storage (126 entries
+ * of 32 bytes, including one entry with the key of each value), otherwise
+ * nvs_commit fails with ESP_ERR_NVS_NOT_ENOUGH_SPACE.
+ *
+ * Calling this function when a batch has already been started has no effect.
+ *
+ * @param[in]  handle  Storage handle obtained with nvs_open.
+ *                     Handles that were opened read only cannot be used.
+ *
+ * @return
+ *             - ESP_OK if the batch has been started
+ *             - ESP_ERR_NVS_INVALID_HANDLE if handle has been closed or is NULL
+ *             - ESP_ERR_NVS_READ_ONLY if handle was opened as read only
+ */
+esp_err_t nvs_batch_begin(nvs_handle handle);
+
+/**
+ * @brief      Discard the changes staged since nvs_batch_begin
+ *
+ * Following nvs_set_* and nvs_erase_key calls write to storage immediately.
+ * Closing the handle also discards the staged changes.
+ *
+ * @param[in]  handle  Storage handle obtained with nvs_open.
+ *
+ * @return
+ *             - ESP_OK if the batch has been discarded or there was no batch
+ *             - ESP_ERR_NVS_INVALID_HANDLE if handle has been closed or is NULL
+ */
+esp_err_t nvs_batch_abort(nvs_handle handle);
+
 /**
  * @brief      Write any pending changes to non-volatile storage
  *
@@ -296,12 +455,18 @@ esp_err_t nvs_erase_all(nvs_handle handle);
  * to non-volatile storage. Individual implementations may write to storage at other times,
  * but this is not guaranteed.
  *
+ * If a batch was started with nvs_batch_begin, staged changes are written
+ * atomically and the batch is finished, whether the commit succeeds or not.
+ *
  * @param[in]  handle  Storage handle obtained with nvs_open.
  *                     Handles that were opened read only cannot be used.
  *
  * @return
  *             - ESP_OK if the changes have been written successfully
  *             - ESP_ERR_NVS_INVALID_HANDLE if handle has been closed or is NULL
+ *             - ESP_ERR_NVS_NOT_ENOUGH_SPACE if staged changes don't fit into one page
+ *             - ESP_ERR_NVS_REMOVE_FAILED if the changes were written, but old
+ *               values will only be removed after re-initialization of nvs
  *             - other error codes from the underlying storage driver
  */
 esp_err_t nvs_commit(nvs_handle handle);
@@ -319,6 +484,126 @@ esp_err_t nvs_commit(nvs_handle handle);
  */
 void nvs_close(nvs_handle handle);
 
+/**
+ * @brief Types of the values returned by the entry iterator
+ */
+typedef enum {
+    NVS_TYPE_U8    = 0x01,  /*!< Type uint8_t */
+    NVS_TYPE_I8    = 0x11,  /*!< Type int8_t */
+    NVS_TYPE_U16   = 0x02,  /*!< Type uint16_t */
+    NVS_TYPE_I16   = 0x12,  /*!< Type int16_t */
+    NVS_TYPE_U32   = 0x04,  /*!< Type uint32_t */
+    NVS_TYPE_I32   = 0x14,  /*!< Type int32_t */
+    NVS_TYPE_U64   = 0x08,  /*!< Type uint64_t */
+    NVS_TYPE_I64   = 0x18,  /*!< Type int64_t */
+    NVS_TYPE_STR   = 0x21,  /*!< Type string */
+    NVS_TYPE_BLOB  = 0x41,  /*!< Type blob */
+    NVS_TYPE_ANY   = 0xff   /*!< Must be last */
+} nvs_type_t;
+
+/**
+ * @brief Information about a value returned by the entry iterator
+ */
+typedef struct {
+    char namespace_name[16];    /*!< Namespace to which the value belongs */
+    char key[16];               /*!< Key of the value */
+    nvs_type_t type;            /*!< Type of the value */
+} nvs_entry_info_t;
+
+/**
+ * Opaque pointer type representing an iterator over the values in storage
+ */
+typedef struct nvs_opaque_iterator_t *nvs_iterator_t;
+
+/**
+ * @brief      Create an iterator over the values of a namespace and a type
+ *
+ * Values are returned in the order in which they are stored in flash, each
+ * page is read once. The iterator is allocated by this call, following
+ * calls to nvs_entry_next don't allocate memory.
+ *
+ * Storage may be modified while iterating. Values which are not changed are
+ * returned at least once, twice if they have been moved to another page to
+ * free space. Values set in the meantime may or may not be returned. With
+ * CONFIG_NVS_BACKGROUND_RECLAIM, pages are not reclaimed in the background
+ * until all iterators are released. nvs_flash_init fails with
+ * ESP_ERR_NVS_INVALID_STATE while any iterator is not released.
+ *
+ * \code{c}
+ * // Example of listing all the values of namespace "config"
+ * nvs_iterator_t it = nvs_entry_find("config", NVS_TYPE_ANY);
+ * while (it != NULL) {
+ *     nvs_entry_info_t info;
+ *     nvs_entry_info(it, &info);
+ *     it = nvs_entry_next(it);
+ *     printf("key '%s', type '%d'\n", info.key, info.type);
+ * }
+ * // it is NULL here, no need to release it
+ * \endcode
+ *
+ * @param[in]  namespace_name  Namespace of the values, NULL for all namespaces.
+ * @param[in]  type            Type of the values, NVS_TYPE_ANY for all types.
+ *
+ * @return
+ *             - Iterator positioned at the first value, to be released with
+ *               nvs_release_iterator unless nvs_entry_next returns NULL
+ *             - NULL if there are no such values, the storage is not
+ *               initialized, or the namespace doesn't exist
+ */
+nvs_iterator_t nvs_entry_find(const char* namespace_name, nvs_type_t type);
+
+/**
+ * @brief      Advance the iterator to the next value
+ *
+ * @param[in]  iterator  Iterator obtained from nvs_entry_find.
+ *
+ * @return
+ *             - The same iterator, positioned at the next value
+ *             - NULL if there are no more values; the iterator is released
+ */
+nvs_iterator_t nvs_entry_next(nvs_iterator_t iterator);
+
+/**
+ * @brief      Get information about the value at the iterator position
+ *
+ * @param[in]  iterator  Iterator obtained from nvs_entry_find or nvs_entry_next.
+ * @param[out] out_info  Structure to be filled with the information.
+ */
+void nvs_entry_info(nvs_iterator_t iterator, nvs_entry_info_t* out_info);
+
+/**
+ * @brief      Release an iterator which has not reached the end
+ *
+ * @param[in]  iterator  Iterator to release, may be NULL.
+ */
+void nvs_release_iterator(nvs_iterator_t iterator);
+
+/**
+ * @brief Counters of the value cache
+ *
+ * Counters are reset by nvs_flash_init.
+ */
+typedef struct {
+    uint32_t hits;      /*!< Number of nvs_get_* calls for integer types served from RAM */
+    uint32_t misses;    /*!< Number of nvs_get_* calls for integer types which read the flash */
+} nvs_cache_stats_t;
+
+/**
+ * @brief      Get counters of the value cache
+ *
+ * Integer values read by nvs_get_* functions are kept in a RAM cache of
+ * CONFIG_NVS_VALUE_CACHE_SIZE entries, so that the next read of the same key
+ * doesn't access the flash. A key is removed from the cache when it is set
+ * or erased. If the cache size is 0, both counters stay at 0.
+ *
+ * @param[out] out_stats  Structure to be filled with the counters
+ *
+ * @return
+ *             - ESP_OK if the counters were copied
+ *             - ESP_ERR_INVALID_ARG if out_stats is NULL
+ */
+esp_err_t nvs_get_cache_stats(nvs_cache_stats_t* out_stats);
+
 
 #ifdef __cplusplus
 } // extern "C"
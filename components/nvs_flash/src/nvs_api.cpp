@@ -23,11 +23,20 @@
 // Uncomment this line to force output from this module
 // #define LOG_LOCAL_LEVEL ESP_LOG_DEBUG
 #include "esp_log.h"
+#include "freertos/task.h"
 static const char* TAG = "nvs";
 #else
 #define ESP_LOGD(...)
 #endif
 
+#ifndef CONFIG_NVS_VALUE_CACHE_SIZE
+#define CONFIG_NVS_VALUE_CACHE_SIZE     0
+#endif //CONFIG_NVS_VALUE_CACHE_SIZE
+
+#ifndef NVS_RECLAIM_TASK_STACK_SIZE
+#define NVS_RECLAIM_TASK_STACK_SIZE     2048
+#endif //NVS_RECLAIM_TASK_STACK_SIZE
+
 class HandleEntry : public intrusive_list_node<HandleEntry>
 {
 public:
@@ -43,6 +52,23 @@ public:
     nvs_handle mHandle;
     uint8_t mReadOnly;
     uint8_t mNsIndex;
+    nvs::TBatch* mBatch = nullptr;  // changes staged since nvs_batch_begin
+    nvs::BlobWriteState* mBlobWrite = nullptr;  // blob written by nvs_blob_write_chunk
+};
+
+class MapEntry : public intrusive_list_node<MapEntry>
+{
+public:
+    MapEntry(nvs_map_handle_t handle, nvs::Page* page, spi_flash_mmap_handle_t flashHandle) :
+        mHandle(handle),
+        mPage(page),
+        mFlashHandle(flashHandle)
+    {
+    }
+
+    nvs_map_handle_t mHandle;
+    nvs::Page* mPage;
+    spi_flash_mmap_handle_t mFlashHandle;
 };
 
 #ifdef ESP_PLATFORM
@@ -55,6 +81,51 @@ using namespace nvs;
 static intrusive_list<HandleEntry> s_nvs_handles;
 static uint32_t s_nvs_next_handle = 1;
 static nvs::Storage s_nvs_storage;
+static intrusive_list<MapEntry> s_nvs_maps;
+static uint32_t s_nvs_next_map = 1;
+static size_t s_nvs_iterators = 0;  // reclaim is paused while iterators exist
+
+#if CONFIG_NVS_BACKGROUND_RECLAIM
+static TaskHandle_t s_reclaim_task = NULL;
+
+static void nvs_reclaim_task(void* arg)
+{
+    while (true) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        bool pending = true;
+        while (pending) {
+            {
+                // one item per step, so that foreground calls could take the lock between the steps
+                Lock lock;
+                pending = s_nvs_iterators == 0 && s_nvs_storage.reclaimPending();
+                if (pending) {
+                    esp_err_t err = s_nvs_storage.reclaimStep();
+                    if (err != ESP_OK) {
+                        // will be retried after the next write
+                        ESP_LOGE(TAG, "%s: result=0x%x", __func__, err);
+                        pending = false;
+                    }
+                }
+            }
+            if (pending) {
+                // block for a tick, so that the idle task runs and feeds the task watchdog
+                vTaskDelay(1);
+            }
+        }
+    }
+}
+#endif // CONFIG_NVS_BACKGROUND_RECLAIM
+
+/* Wakes up the reclaim task if the storage has no spare free page */
+static esp_err_t nvs_reclaim_notify(esp_err_t result)
+{
+#if CONFIG_NVS_BACKGROUND_RECLAIM
+    if (s_reclaim_task != NULL && s_nvs_storage.reclaimPending()) {
+        xTaskNotifyGive(s_reclaim_task);
+    }
+#endif // CONFIG_NVS_BACKGROUND_RECLAIM
+    return result;
+}
 
 extern "C" void nvs_dump()
 {
@@ -65,7 +136,16 @@ extern "C" void nvs_dump()
 extern "C" esp_err_t nvs_flash_init_custom(uint32_t baseSector, uint32_t sectorCount)
 {
     ESP_LOGD(TAG, "nvs_flash_init_custom start=%d count=%d", baseSector, sectorCount);
+    if (!s_nvs_maps.empty()) {
+        // mapped values point to the pages which are about to be reloaded
+        return ESP_ERR_NVS_INVALID_STATE;
+    }
+    if (s_nvs_iterators != 0) {
+        // iterators refer to the namespaces of the current storage
+        return ESP_ERR_NVS_INVALID_STATE;
+    }
     s_nvs_handles.clear();
+    s_nvs_storage.setValueCacheSize(CONFIG_NVS_VALUE_CACHE_SIZE);
     return s_nvs_storage.init(baseSector, sectorCount);
 }
 
@@ -83,20 +163,88 @@ extern "C" esp_err_t nvs_flash_init(void)
         return ESP_ERR_NOT_FOUND;
     }
 
-    return nvs_flash_init_custom(partition->address / SPI_FLASH_SEC_SIZE,
+    esp_err_t err = nvs_flash_init_custom(partition->address / SPI_FLASH_SEC_SIZE,
             partition->size / SPI_FLASH_SEC_SIZE);
+    if (err != ESP_OK) {
+        return err;
+    }
+#if CONFIG_NVS_BACKGROUND_RECLAIM
+    if (s_reclaim_task == NULL) {
+        if (xTaskCreate(nvs_reclaim_task, "nvs_reclaim", NVS_RECLAIM_TASK_STACK_SIZE, NULL,
+                        CONFIG_NVS_BACKGROUND_RECLAIM_TASK_PRIORITY, &s_reclaim_task) != pdPASS) {
+            ESP_LOGE(TAG, "%s: can't create reclaim task", __func__);
+            return ESP_ERR_NO_MEM;
+        }
+    }
+#endif // CONFIG_NVS_BACKGROUND_RECLAIM
+    return nvs_reclaim_notify(ESP_OK);
 }
 #endif
 
-static esp_err_t nvs_find_ns_handle(nvs_handle handle, HandleEntry& entry)
+static HandleEntry* nvs_find_handle_entry(nvs_handle handle)
 {
     auto it = find_if(begin(s_nvs_handles), end(s_nvs_handles), [=](HandleEntry& e) -> bool {
         return e.mHandle == handle;
     });
     if (it == end(s_nvs_handles)) {
+        return nullptr;
+    }
+    return it;
+}
+
+static esp_err_t nvs_find_ns_handle(nvs_handle handle, HandleEntry& entry)
+{
+    HandleEntry* found = nvs_find_handle_entry(handle);
+    if (found == nullptr) {
         return ESP_ERR_NVS_INVALID_HANDLE;
     }
-    entry = *it;
+    entry = *found;
+    return ESP_OK;
+}
+
+static void nvs_batch_free(HandleEntry& entry)
+{
+    if (entry.mBatch == nullptr) {
+        return;
+    }
+    for (auto it = begin(*entry.mBatch); it != end(*entry.mBatch); ) {
+        auto tmp = it;
+        ++it;
+        entry.mBatch->erase(tmp);
+        delete static_cast<BatchItem*>(tmp);
+    }
+    delete entry.mBatch;
+    entry.mBatch = nullptr;
+}
+
+static void nvs_blob_write_free(HandleEntry& entry)
+{
+    if (entry.mBlobWrite == nullptr) {
+        return;
+    }
+    s_nvs_storage.abortBlob(entry.mNsIndex, *entry.mBlobWrite);
+    delete entry.mBlobWrite;
+    entry.mBlobWrite = nullptr;
+}
+
+static esp_err_t nvs_batch_stage(HandleEntry& entry, nvs::ItemType type, const char* key, const void* data, size_t dataSize)
+{
+    if (strlen(key) > Item::MAX_KEY_LENGTH) {
+        return ESP_ERR_NVS_KEY_TOO_LONG;
+    }
+    // batch is written to one page, so values spanning pages can't be staged
+    if (dataSize > Page::MAX_DATA_SIZE) {
+        return ESP_ERR_NVS_VALUE_TOO_LONG;
+    }
+    // only the last change of the key is kept
+    auto it = find_if(begin(*entry.mBatch), end(*entry.mBatch), [=](BatchItem& e) -> bool {
+        return strncmp(key, e.key, Item::MAX_KEY_LENGTH) == 0;
+    });
+    if (it != end(*entry.mBatch)) {
+        entry.mBatch->erase(it);
+        delete static_cast<BatchItem*>(it);
+    }
+    entry.mBatch->push_back(new BatchItem(type, key, data, dataSize));
     return ESP_OK;
 }
 
@@ -128,6 +276,8 @@ extern "C" void nvs_close(nvs_handle handle)
     if (it == end(s_nvs_handles)) {
         return;
     }
+    nvs_batch_free(*it);
+    nvs_blob_write_free(*it);
     s_nvs_handles.erase(it);
     delete static_cast<HandleEntry*>(it);
 }
@@ -144,7 +294,10 @@ extern "C" esp_err_t nvs_erase_key(nvs_handle handle, const char* key)
     if (entry.mReadOnly) {
         return ESP_ERR_NVS_READ_ONLY;
     }
-    return s_nvs_storage.eraseItem(entry.mNsIndex, key);
+    if (entry.mBatch) {
+        return nvs_batch_stage(entry, nvs::ItemType::ANY, key, nullptr, 0);
+    }
+    return nvs_reclaim_notify(s_nvs_storage.eraseItem(entry.mNsIndex, key));
 }
 
 extern "C" esp_err_t nvs_erase_all(nvs_handle handle)
@@ -159,7 +312,7 @@ extern "C" esp_err_t nvs_erase_all(nvs_handle handle)
     if (entry.mReadOnly) {
         return ESP_ERR_NVS_READ_ONLY;
     }
-    return s_nvs_storage.eraseNamespace(entry.mNsIndex);
+    return nvs_reclaim_notify(s_nvs_storage.eraseNamespace(entry.mNsIndex));
 }
 
 template<typename T>
@@ -175,7 +328,10 @@ static esp_err_t nvs_set(nvs_handle handle, const char* key, T value)
     if (entry.mReadOnly) {
         return ESP_ERR_NVS_READ_ONLY;
     }
-    return s_nvs_storage.writeItem(entry.mNsIndex, key, value);
+    if (entry.mBatch) {
+        return nvs_batch_stage(entry, itemTypeOf(value), key, &value, sizeof(value));
+    }
+    return nvs_reclaim_notify(s_nvs_storage.writeItem(entry.mNsIndex, key, value));
 }
 
 extern "C" esp_err_t nvs_set_i8  (nvs_handle handle, const char* key, int8_t value)
@@ -218,12 +374,50 @@ extern "C" esp_err_t nvs_set_u64 (nvs_handle handle, const char* key, uint64_t v
     return nvs_set(handle, key, value);
 }
 
+extern "C" esp_err_t nvs_batch_begin(nvs_handle handle)
+{
+    Lock lock;
+    ESP_LOGD(TAG, "%s %d", __func__, handle);
+    HandleEntry* entry = nvs_find_handle_entry(handle);
+    if (entry == nullptr) {
+        return ESP_ERR_NVS_INVALID_HANDLE;
+    }
+    if (entry->mReadOnly) {
+        return ESP_ERR_NVS_READ_ONLY;
+    }
+    if (entry->mBatch == nullptr) {
+        entry->mBatch = new TBatch;
+    }
+    return ESP_OK;
+}
+
+extern "C" esp_err_t nvs_batch_abort(nvs_handle handle)
+{
+    Lock lock;
+    ESP_LOGD(TAG, "%s %d", __func__, handle);
+    HandleEntry* entry = nvs_find_handle_entry(handle);
+    if (entry == nullptr) {
+        return ESP_ERR_NVS_INVALID_HANDLE;
+    }
+    nvs_batch_free(*entry);
+    return ESP_OK;
+}
+
 extern "C" esp_err_t nvs_commit(nvs_handle handle)
 {
     Lock lock;
-    // no-op for now, to be used when intermediate cache is added
-    HandleEntry entry;
-    return nvs_find_ns_handle(handle, entry);
+    HandleEntry* entry = nvs_find_handle_entry(handle);
+    if (entry == nullptr) {
+        return ESP_ERR_NVS_INVALID_HANDLE;
+    }
+    // without a batch, values are written by nvs_set_* immediately
+    if (entry->mBatch == nullptr) {
+        return ESP_OK;
+    }
+    ESP_LOGD(TAG, "%s %d items=%d", __func__, handle, entry->mBatch->size());
+    auto err = s_nvs_storage.writeBatch(entry->mNsIndex, *entry->mBatch);
+    nvs_batch_free(*entry);
+    return nvs_reclaim_notify(err);
 }
 
 extern "C" esp_err_t nvs_set_str(nvs_handle handle, const char* key, const char* value)
@@ -235,7 +429,10 @@ extern "C" esp_err_t nvs_set_str(nvs_handle handle, const char* key, const char*
     if (err != ESP_OK) {
         return err;
     }
-    return s_nvs_storage.writeItem(entry.mNsIndex, nvs::ItemType::SZ, key, value, strlen(value) + 1);
+    if (entry.mBatch) {
+        return nvs_batch_stage(entry, nvs::ItemType::SZ, key, value, strlen(value) + 1);
+    }
+    return nvs_reclaim_notify(s_nvs_storage.writeItem(entry.mNsIndex, nvs::ItemType::SZ, key, value, strlen(value) + 1));
 }
 
 extern "C" esp_err_t nvs_set_blob(nvs_handle handle, const char* key, const void* value, size_t length)
@@ -247,7 +444,10 @@ extern "C" esp_err_t nvs_set_blob(nvs_handle handle, const char* key, const void
     if (err != ESP_OK) {
         return err;
     }
-    return s_nvs_storage.writeItem(entry.mNsIndex, nvs::ItemType::BLOB, key, value, length);
+    if (entry.mBatch) {
+        return nvs_batch_stage(entry, nvs::ItemType::BLOB, key, value, length);
+    }
+    return nvs_reclaim_notify(s_nvs_storage.writeItem(entry.mNsIndex, nvs::ItemType::BLOB, key, value, length));
 }
 
 
@@ -343,3 +543,174 @@ extern "C" esp_err_t nvs_get_blob(nvs_handle handle, const char* key, void* out_
     return nvs_get_str_or_blob(handle, nvs::ItemType::BLOB, key, out_value, length);
 }
 
+extern "C" esp_err_t nvs_blob_write_chunk(nvs_handle handle, const char* key, size_t offset, const void* value, size_t length, size_t total_length)
+{
+    Lock lock;
+    ESP_LOGD(TAG, "%s %s %d %d", __func__, key, offset, length);
+    HandleEntry* entry = nvs_find_handle_entry(handle);
+    if (entry == nullptr) {
+        return ESP_ERR_NVS_INVALID_HANDLE;
+    }
+    if (entry->mReadOnly) {
+        return ESP_ERR_NVS_READ_ONLY;
+    }
+    esp_err_t err;
+    if (offset == 0) {
+        nvs_blob_write_free(*entry);
+        entry->mBlobWrite = new BlobWriteState;
+        err = s_nvs_storage.beginBlob(entry->mNsIndex, key, total_length, *entry->mBlobWrite);
+        if (err != ESP_OK) {
+            delete entry->mBlobWrite;
+            entry->mBlobWrite = nullptr;
+            return err;
+        }
+    } else if (entry->mBlobWrite == nullptr || offset != entry->mBlobWrite->offset
+            || total_length != entry->mBlobWrite->dataSize
+            || strncmp(key, entry->mBlobWrite->key, Item::MAX_KEY_LENGTH) != 0) {
+        return ESP_ERR_NVS_INVALID_LENGTH;
+    }
+
+    err = s_nvs_storage.writeBlobChunk(entry->mNsIndex, *entry->mBlobWrite, value, length);
+    if (err == ESP_ERR_NVS_INVALID_LENGTH) {
+        // nothing was written, the write may go on with a valid piece
+        return err;
+    }
+    if (err != ESP_OK || entry->mBlobWrite->offset == entry->mBlobWrite->dataSize) {
+        // storage has already cleaned up after a failed write
+        delete entry->mBlobWrite;
+        entry->mBlobWrite = nullptr;
+    }
+    return nvs_reclaim_notify(err);
+}
+
+extern "C" esp_err_t nvs_blob_read_chunk(nvs_handle handle, const char* key, size_t offset, void* out_value, size_t* length)
+{
+    Lock lock;
+    ESP_LOGD(TAG, "%s %s %d", __func__, key, offset);
+    HandleEntry entry;
+    auto err = nvs_find_ns_handle(handle, entry);
+    if (err != ESP_OK) {
+        return err;
+    }
+    if (length == nullptr) {
+        return ESP_ERR_NVS_INVALID_LENGTH;
+    }
+    return s_nvs_storage.readBlobChunk(entry.mNsIndex, key, offset, out_value, *length);
+}
+
+static esp_err_t nvs_map_str_or_blob(nvs_handle handle, nvs::ItemType type, const char* key, const void** out_value, size_t* length, nvs_map_handle_t* out_map)
+{
+    Lock lock;
+    ESP_LOGD(TAG, "%s %s", __func__, key);
+    HandleEntry entry;
+    auto err = nvs_find_ns_handle(handle, entry);
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    const void* data;
+    size_t dataSize;
+    Page* page;
+    spi_flash_mmap_handle_t flashHandle;
+    err = s_nvs_storage.mapItem(entry.mNsIndex, type, key, data, dataSize, page, flashHandle);
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    uint32_t map = s_nvs_next_map;
+    ++s_nvs_next_map;
+    s_nvs_maps.push_back(new MapEntry(map, page, flashHandle));
+    *out_value = data;
+    if (length != nullptr) {
+        *length = dataSize;
+    }
+    *out_map = map;
+    return ESP_OK;
+}
+
+extern "C" esp_err_t nvs_map_str(nvs_handle handle, const char* key, const char** out_value, size_t* length, nvs_map_handle_t* out_map)
+{
+    return nvs_map_str_or_blob(handle, nvs::ItemType::SZ, key, reinterpret_cast<const void**>(out_value), length, out_map);
+}
+
+extern "C" esp_err_t nvs_map_blob(nvs_handle handle, const char* key, const void** out_value, size_t* length, nvs_map_handle_t* out_map)
+{
+    return nvs_map_str_or_blob(handle, nvs::ItemType::BLOB, key, out_value, length, out_map);
+}
+
+extern "C" void nvs_unmap(nvs_map_handle_t map)
+{
+    Lock lock;
+    ESP_LOGD(TAG, "%s %d", __func__, map);
+    auto it = find_if(begin(s_nvs_maps), end(s_nvs_maps), [=](MapEntry& e) -> bool {
+        return e.mHandle == map;
+    });
+    if (it == end(s_nvs_maps)) {
+        return;
+    }
+    s_nvs_storage.unmapItem(it->mPage, it->mFlashHandle);
+    s_nvs_maps.erase(it);
+    delete static_cast<MapEntry*>(it);
+}
+
+/* Called with the lock held */
+static void nvs_iterator_free(nvs_iterator_t it)
+{
+    s_nvs_storage.releaseEntry(it);
+    delete it;
+    if (--s_nvs_iterators == 0) {
+        nvs_reclaim_notify(ESP_OK);
+    }
+}
+
+extern "C" nvs_iterator_t nvs_entry_find(const char* namespace_name, nvs_type_t type)
+{
+    Lock lock;
+    ESP_LOGD(TAG, "%s %s %d", __func__, namespace_name ? namespace_name : "*", type);
+    nvs_iterator_t it = new nvs_opaque_iterator_t;
+    it->type = type;
+    if (!s_nvs_storage.findEntry(it, namespace_name)) {
+        delete it;
+        return NULL;
+    }
+    ++s_nvs_iterators;
+    return it;
+}
+
+extern "C" nvs_iterator_t nvs_entry_next(nvs_iterator_t it)
+{
+    Lock lock;
+    if (it == NULL) {
+        return NULL;
+    }
+    if (!s_nvs_storage.nextEntry(it)) {
+        nvs_iterator_free(it);
+        return NULL;
+    }
+    return it;
+}
+
+extern "C" void nvs_entry_info(nvs_iterator_t it, nvs_entry_info_t* out_info)
+{
+    *out_info = it->entryInfo;
+}
+
+extern "C" void nvs_release_iterator(nvs_iterator_t it)
+{
+    if (it == NULL) {
+        return;
+    }
+    Lock lock;
+    nvs_iterator_free(it);
+}
+
+extern "C" esp_err_t nvs_get_cache_stats(nvs_cache_stats_t* out_stats)
+{
+    Lock lock;
+    if (out_stats == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    out_stats->hits = s_nvs_storage.valueCache().hits();
+    out_stats->misses = s_nvs_storage.valueCache().misses();
+    return ESP_OK;
+}
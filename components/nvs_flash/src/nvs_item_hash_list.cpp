@@ -23,82 +23,68 @@ HashList::HashList()
     
 void HashList::clear()
 {
-    for (auto it = mBlockList.begin(); it != mBlockList.end();) {
-        auto tmp = it;
-        ++it;
-        mBlockList.erase(tmp);
-        delete static_cast<HashListBlock*>(tmp);
-    }
+    std::fill_n(mNodes, CAPACITY, HashListNode());
 }
     
 HashList::~HashList()
 {
-    clear();
-}
-
-HashList::HashListBlock::HashListBlock()
-{
-    static_assert(sizeof(HashListBlock) == HashListBlock::BYTE_SIZE,
-                  "cache block size calculation incorrect");
 }
 
 void HashList::insert(const Item& item, size_t index)
 {
+    assert(index < 0xff);
     const uint32_t hash_24 = item.calculateCrc32WithoutValue() & 0xffffff;
-    // add entry to the end of last block if possible
-    if (mBlockList.size()) {
-        auto& block = mBlockList.back();
-        if (block.mCount < HashListBlock::ENTRY_COUNT) {
-            block.mNodes[block.mCount++] = HashListNode(hash_24, index);
+    const size_t mask = CAPACITY - 1;
+    for (size_t pos = hash_24 & mask; ; pos = (pos + 1) & mask) {
+        HashListNode& e = mNodes[pos];
+        if (e.mIndex == 0xff) {
+            e = HashListNode(hash_24, index);
             return;
         }
+        assert(e.mIndex != index && "item index is already present in cache");
     }
-    // if the above failed, create a new block and add entry to it
-    HashListBlock* newBlock = new HashListBlock;
-    mBlockList.push_back(newBlock);
-    newBlock->mNodes[0] = HashListNode(hash_24, index);
-    newBlock->mCount++;
 }
 
-void HashList::erase(size_t index)
+uint32_t HashList::erase(size_t index)
 {
-    for (auto it = std::begin(mBlockList); it != std::end(mBlockList);) {
-        bool haveEntries = false;
-        for (size_t i = 0; i < it->mCount; ++i) {
-            if (it->mNodes[i].mIndex == index) {
-                it->mNodes[i].mIndex = 0xff;
-                return;
-            }
-            if (it->mNodes[i].mIndex != 0xff) {
-                haveEntries = true;
-            }
+    const size_t mask = CAPACITY - 1;
+    for (size_t hole = 0; hole < CAPACITY; ++hole) {
+        if (mNodes[hole].mIndex != index) {
+            continue;
         }
-        if (!haveEntries) {
-            auto tmp = it;
-            ++it;
-            mBlockList.erase(tmp);
-            delete static_cast<HashListBlock*>(tmp);
-        } else {
-            ++it;
+        const uint32_t hash_24 = mNodes[hole].mHash;
+        // shift the following nodes of the probe sequence back,
+        // so that find does not have to skip deleted nodes
+        for (size_t next = (hole + 1) & mask; mNodes[next].mIndex != 0xff; next = (next + 1) & mask) {
+            size_t home = mNodes[next].mHash & mask;
+            bool stays = (hole < next) ? (home > hole && home <= next) : (home > hole || home <= next);
+            if (!stays) {
+                mNodes[hole] = mNodes[next];
+                hole = next;
+            }
         }
+        mNodes[hole] = HashListNode();
+        return hash_24;
     }
     assert(false && "item should have been present in cache");
+    return 0;
 }
 
 size_t HashList::find(size_t start, const Item& item)
 {
     const uint32_t hash_24 = item.calculateCrc32WithoutValue() & 0xffffff;
-    for (auto it = std::begin(mBlockList); it != std::end(mBlockList); ++it) {
-        for (size_t index = 0; index < it->mCount; ++index) {
-            HashListNode& e = it->mNodes[index];
-            if (e.mIndex >= start &&
-                    e.mHash == hash_24 &&
-                    e.mIndex != 0xff) {
-                return e.mIndex;
-            }
+    const size_t mask = CAPACITY - 1;
+    // nodes are not sorted by index, so the whole probe sequence is checked
+    size_t result = SIZE_MAX;
+    for (size_t pos = hash_24 & mask; mNodes[pos].mIndex != 0xff; pos = (pos + 1) & mask) {
+        HashListNode& e = mNodes[pos];
+        if (e.mIndex >= start &&
+                e.mHash == hash_24 &&
+                e.mIndex < result) {
+            result = e.mIndex;
         }
     }
-    return SIZE_MAX;
+    return result;
 }
 
 
@@ -17,7 +17,6 @@
 
 #include "nvs.h"
 #include "nvs_types.hpp"
-#include "intrusive_list.h"
 
 namespace nvs
 {
@@ -29,9 +28,13 @@ public:
     ~HashList();
     
     void insert(const Item& item, size_t index);
-    void erase(const size_t index);
+    uint32_t erase(const size_t index);
     size_t find(size_t start, const Item& item);
     void clear();
+
+    /* Number of nodes. Should be at least twice Page::ENTRY_COUNT, so that probe
+     * sequences stay short when the page is full. */
+    static const size_t CAPACITY = 256;
     
 private:
     HashList(const HashList& other);
@@ -54,18 +57,11 @@ protected:
         uint32_t mHash  : 24;
     };
 
-    struct HashListBlock : public intrusive_list_node<HashList::HashListBlock> {
-        HashListBlock();
-
-        static const size_t BYTE_SIZE = 128;
-        static const size_t ENTRY_COUNT = (BYTE_SIZE - sizeof(intrusive_list_node<HashListBlock>) - sizeof(size_t)) / 4;
-
-        size_t mCount = 0;
-        HashListNode mNodes[ENTRY_COUNT];
-    };
+    static_assert((CAPACITY & (CAPACITY - 1)) == 0, "capacity should be a power of two");
 
-    typedef intrusive_list<HashListBlock> TBlockList;
-    TBlockList mBlockList;
+    /* Open addressing table with linear probing. Every entry index is stored
+     * at most once, so the table never overflows. Nodes with mIndex == 0xff are empty. */
+    HashListNode mNodes[CAPACITY];
 }; // class HashList
 
 } // namespace nvs
@@ -0,0 +1,141 @@
+// Copyright 2015-2016 Espressif Systems (Shanghai) PTE LTD
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "nvs_item_index.hpp"
+
+namespace nvs
+{
+
+ItemIndex::ItemIndex()
+{
+}
+
+ItemIndex::~ItemIndex()
+{
+    clear();
+}
+
+uint32_t ItemIndex::hashOf(const Item& item)
+{
+    // same hash as used by HashList of the page
+    return item.calculateCrc32WithoutValue() & 0xffffff;
+}
+
+void ItemIndex::clear()
+{
+    delete[] mNodes;
+    mNodes = nullptr;
+    mCapacity = 0;
+    mCount = 0;
+    mUsed = 0;
+}
+
+void ItemIndex::resize(size_t capacity)
+{
+    IndexNode* oldNodes = mNodes;
+    size_t oldCapacity = mCapacity;
+
+    mNodes = new IndexNode[capacity];
+    for (size_t i = 0; i < capacity; ++i) {
+        mNodes[i].mPage = nullptr;
+    }
+    mCapacity = capacity;
+    mCount = 0;
+    mUsed = 0;
+
+    for (size_t i = 0; i < oldCapacity; ++i) {
+        const IndexNode& node = oldNodes[i];
+        if (node.mPage != nullptr && node.mIndex != EMPTY_INDEX) {
+            insert(node.mHash, node.mPage, node.mIndex);
+        }
+    }
+    delete[] oldNodes;
+}
+
+void ItemIndex::insert(uint32_t hash, Page* page, size_t index)
+{
+    assert(index < EMPTY_INDEX);
+    // keep load factor (including deleted nodes) below 3/4
+    if ((mUsed + 1) * 4 > mCapacity * 3) {
+        size_t capacity = MIN_CAPACITY;
+        while ((mCount + 1) * 2 > capacity) {
+            capacity *= 2;
+        }
+        resize(capacity);
+    }
+    const size_t mask = mCapacity - 1;
+    for (size_t pos = hash & mask; ; pos = (pos + 1) & mask) {
+        IndexNode& node = mNodes[pos];
+        // deleted nodes are dropped on the next resize
+        if (node.mPage == nullptr) {
+            node.mHash = hash;
+            node.mIndex = index;
+            node.mPage = page;
+            ++mCount;
+            ++mUsed;
+            return;
+        }
+    }
+}
+
+void ItemIndex::erase(uint32_t hash, Page* page, size_t index)
+{
+    if (mCapacity == 0) {
+        return;
+    }
+    const size_t mask = mCapacity - 1;
+    for (size_t pos = hash & mask; mNodes[pos].mPage != nullptr; pos = (pos + 1) & mask) {
+        IndexNode& node = mNodes[pos];
+        if (node.mPage == page && node.mIndex == index && node.mHash == hash) {
+            node.mIndex = EMPTY_INDEX;
+            --mCount;
+            return;
+        }
+    }
+}
+
+void ItemIndex::erasePage(Page* page)
+{
+    for (size_t i = 0; i < mCapacity; ++i) {
+        IndexNode& node = mNodes[i];
+        if (node.mPage == page && node.mIndex != EMPTY_INDEX) {
+            node.mIndex = EMPTY_INDEX;
+            --mCount;
+        }
+    }
+}
+
+bool ItemIndex::find(uint32_t hash, size_t& cursor, Page* &page, size_t& index) const
+{
+    if (mCapacity == 0) {
+        return false;
+    }
+    const size_t mask = mCapacity - 1;
+    for (; cursor < mCapacity; ++cursor) {
+        const IndexNode& node = mNodes[(hash + cursor) & mask];
+        if (node.mPage == nullptr) {
+            break;
+        }
+        if (node.mHash == hash && node.mIndex != EMPTY_INDEX) {
+            page = node.mPage;
+            index = node.mIndex;
+            ++cursor;
+            return true;
+        }
+    }
+    return false;
+}
+
+
+} // namespace nvs
@@ -0,0 +1,80 @@
+// Copyright 2015-2016 Espressif Systems (Shanghai) PTE LTD
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef nvs_item_index_h
+#define nvs_item_index_h
+
+#include "nvs.h"
+#include "nvs_types.hpp"
+
+namespace nvs
+{
+
+class Page;
+
+/**
+ * Storage-wide index of items, maps hash of (namespace, key) to (page, entry).
+ *
+ * Open addressing table with linear probing. Several entries may have the same
+ * hash (e.g. same key with different types, or a new copy of an item written
+ * before the old one is erased), so the index only gives candidates which
+ * should be checked by Page::findItem.
+ */
+class ItemIndex
+{
+public:
+    ItemIndex();
+    ~ItemIndex();
+
+    static uint32_t hashOf(const Item& item);
+
+    void insert(uint32_t hash, Page* page, size_t index);
+    void erase(uint32_t hash, Page* page, size_t index);
+    void erasePage(Page* page);
+    void clear();
+
+    /* Returns next candidate with matching hash. Start with cursor = 0. */
+    bool find(uint32_t hash, size_t& cursor, Page* &page, size_t& index) const;
+
+    size_t size() const
+    {
+        return mCount;
+    }
+
+private:
+    ItemIndex(const ItemIndex& other);
+    const ItemIndex& operator= (const ItemIndex& rhs);
+
+protected:
+    struct IndexNode {
+        uint32_t mIndex : 8;
+        uint32_t mHash  : 24;
+        Page* mPage;
+    };
+
+    static const uint32_t EMPTY_INDEX = 0xff;
+    static const size_t MIN_CAPACITY = 64;
+
+    void resize(size_t capacity);
+
+    IndexNode* mNodes = nullptr;
+    size_t mCapacity = 0;
+    size_t mCount = 0;
+    size_t mUsed = 0;   // live and deleted nodes
+}; // class ItemIndex
+
+} // namespace nvs
+
+
+#endif /* nvs_item_index_h */
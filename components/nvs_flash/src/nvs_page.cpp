@@ -19,6 +19,7 @@
 #endif
 #include <cstdio>
 #include <cstring>
+#include <new>
 
 namespace nvs
 {
@@ -30,23 +31,71 @@ uint32_t Page::Header::calculateCrc32()
                     offsetof(Header, mCrc32) - offsetof(Header, mSeqNumber));
 }
 
-esp_err_t Page::load(uint32_t sectorNumber)
+esp_err_t Page::load(uint32_t sectorNumber, uint8_t* sectorBuffer)
 {
     mBaseAddress = sectorNumber * SEC_SIZE;
     mUsedEntryCount = 0;
     mErasedEntryCount = 0;
+    mHasNamespaceItems = false;
+    mHasBlobChunks = false;
+    mHashList.clear();
+    if (mItemIndex) {
+        mItemIndex->erasePage(this);
+    }
 
-    Header header;
-    auto rc = spi_flash_read(mBaseAddress, &header, sizeof(header));
+    if (sectorBuffer) {
+        // read the whole sector at once, entries are then parsed from RAM
+        auto rc = spi_flash_read(mBaseAddress, sectorBuffer, SEC_SIZE);
+        if (rc != ESP_OK) {
+            mState = PageState::INVALID;
+            return rc;
+        }
+        mLoadBuffer = sectorBuffer;
+        rc = mLoad();
+        mLoadBuffer = nullptr;
+        return rc;
+    }
+    return mLoad();
+}
+
+esp_err_t Page::setSectorBuffer(uint8_t* sectorBuffer)
+{
+    mLoadBuffer = nullptr;
+    if (sectorBuffer == nullptr) {
+        return ESP_OK;
+    }
+    auto rc = spi_flash_read(mBaseAddress, sectorBuffer, SEC_SIZE);
     if (rc != ESP_OK) {
-        mState = PageState::INVALID;
         return rc;
     }
-    if (header.mState == PageState::UNINITIALIZED) {
+    mLoadBuffer = sectorBuffer;
+    return ESP_OK;
+}
+
+esp_err_t Page::mLoad()
+{
+    Header header;
+    if (mLoadBuffer) {
+        memcpy(&header, mLoadBuffer + HEADER_OFFSET, sizeof(header));
+    } else {
+        auto rc = spi_flash_read(mBaseAddress, &header, sizeof(header));
+        if (rc != ESP_OK) {
+            mState = PageState::INVALID;
+            return rc;
+        }
+    }
+    if (header.mState == PageState::UNINITIALIZED && mLoadBuffer) {
+        mState = header.mState;
+        const uint32_t* words = reinterpret_cast<const uint32_t*>(mLoadBuffer);
+        if (std::any_of(words, words + SEC_SIZE / 4, [](uint32_t val) -> bool { return val != 0xffffffff; })) {
+            mState = PageState::CORRUPT;
+        }
+    } else if (header.mState == PageState::UNINITIALIZED) {
         mState = header.mState;
         // check if the whole page is really empty
         // reading the whole page takes ~40 times less than erasing it
         uint32_t line[8];
+        esp_err_t rc;
         for (uint32_t i = 0; i < SPI_FLASH_SEC_SIZE; i += sizeof(line)) {
             rc = spi_flash_read(mBaseAddress + i, line, sizeof(line));
             if (rc != ESP_OK) {
@@ -151,7 +200,7 @@ esp_err_t Page::writeEntryData(const uint8_t* data, size_t size)
     return ESP_OK;
 }
 
-esp_err_t Page::writeItem(uint8_t nsIndex, ItemType datatype, const char* key, const void* data, size_t dataSize)
+esp_err_t Page::writeItem(uint8_t nsIndex, ItemType datatype, const char* key, const void* data, size_t dataSize, uint8_t chunkIdx)
 {
     Item item;
     esp_err_t err;
@@ -178,14 +227,14 @@ esp_err_t Page::writeItem(uint8_t nsIndex, ItemType datatype, const char* key, c
 
     size_t totalSize = ENTRY_SIZE;
     size_t entriesCount = 1;
-    if (datatype == ItemType::SZ || datatype == ItemType::BLOB) {
+    if (isVariableLengthType(datatype)) {
         size_t roundedSize = (dataSize + ENTRY_SIZE - 1) & ~(ENTRY_SIZE - 1);
         totalSize += roundedSize;
         entriesCount += roundedSize / ENTRY_SIZE;
     }
 
     // primitive types should fit into one entry
-    assert(totalSize == ENTRY_SIZE || datatype == ItemType::BLOB || datatype == ItemType::SZ);
+    assert(totalSize == ENTRY_SIZE || isVariableLengthType(datatype));
 
     if (mNextFreeEntry == INVALID_ENTRY || mNextFreeEntry + entriesCount > ENTRY_COUNT) {
         // page will not fit this amount of data
@@ -194,10 +243,10 @@ esp_err_t Page::writeItem(uint8_t nsIndex, ItemType datatype, const char* key, c
 
     // write first item
     size_t span = (totalSize + ENTRY_SIZE - 1) / ENTRY_SIZE;
-    item = Item(nsIndex, datatype, span, key);
-    mHashList.insert(item, mNextFreeEntry);
+    item = Item(nsIndex, datatype, span, key, chunkIdx);
+    indexInsert(item, mNextFreeEntry);
 
-    if (datatype != ItemType::SZ && datatype != ItemType::BLOB) {
+    if (!isVariableLengthType(datatype)) {
         memcpy(item.data, data, dataSize);
         item.crc32 = item.calculateCrc32();
         err = writeEntry(item);
@@ -237,7 +286,99 @@ esp_err_t Page::writeItem(uint8_t nsIndex, ItemType datatype, const char* key, c
     return ESP_OK;
 }
 
-esp_err_t Page::readItem(uint8_t nsIndex, ItemType datatype, const char* key, void* data, size_t dataSize)
+size_t Page::getEntryCount(ItemType datatype, size_t dataSize)
+{
+    if (!isVariableLengthType(datatype)) {
+        return 1;
+    }
+    return 1 + (dataSize + ENTRY_SIZE - 1) / ENTRY_SIZE;
+}
+
+esp_err_t Page::writeItems(uint8_t nsIndex, TBatch& batch)
+{
+    if (mState == PageState::INVALID) {
+        return ESP_ERR_NVS_INVALID_STATE;
+    }
+
+    if (mState == PageState::UNINITIALIZED) {
+        auto err = initialize();
+        if (err != ESP_OK) {
+            return err;
+        }
+    }
+
+    if (mState == PageState::FULL) {
+        return ESP_ERR_NVS_PAGE_FULL;
+    }
+
+    size_t entriesCount = 0;
+    for (auto it = batch.begin(); it != batch.end(); ++it) {
+        if (strlen(it->key) > Item::MAX_KEY_LENGTH) {
+            return ESP_ERR_NVS_KEY_TOO_LONG;
+        }
+        entriesCount += getEntryCount(it->datatype, it->dataSize);
+    }
+    if (entriesCount == 0) {
+        return ESP_OK;
+    }
+
+    if (mNextFreeEntry == INVALID_ENTRY || mNextFreeEntry + entriesCount > ENTRY_COUNT) {
+        return ESP_ERR_NVS_PAGE_FULL;
+    }
+
+    // All items are prepared in RAM and written with one flash operation.
+    // Entry states are set afterwards with a single alterEntryRangeState call,
+    // which writes the word with the first entry last; until then the whole
+    // batch is discarded by mLoadEntryTable if power goes off.
+    // Erase is written as an item of type ItemType::ANY, see PageManager::load.
+    uint8_t* buf = new (std::nothrow) uint8_t[entriesCount * ENTRY_SIZE];
+    if (!buf) {
+        return ESP_ERR_NO_MEM;
+    }
+    std::fill_n(buf, entriesCount * ENTRY_SIZE, 0xff);
+
+    const size_t begin = mNextFreeEntry;
+    size_t index = begin;
+    for (auto it = batch.begin(); it != batch.end(); ++it) {
+        const size_t span = getEntryCount(it->datatype, it->dataSize);
+        Item item(nsIndex, it->datatype, span, it->key);
+        if (isVariableLengthType(it->datatype)) {
+            item.varLength.dataCrc32 = Item::calculateCrc32(it->data, it->dataSize);
+            item.varLength.dataSize = it->dataSize;
+            item.varLength.reserved2 = 0xffff;
+            memcpy(buf + (index - begin + 1) * ENTRY_SIZE, it->data, it->dataSize);
+        } else if (it->datatype != ItemType::ANY) {
+            memcpy(item.data, it->data, it->dataSize);
+        }
+        item.crc32 = item.calculateCrc32();
+        memcpy(buf + (index - begin) * ENTRY_SIZE, &item, sizeof(item));
+        indexInsert(item, index);
+        it->index = index;
+        index += span;
+    }
+
+    auto rc = spi_flash_write(getEntryAddress(begin), buf, entriesCount * ENTRY_SIZE);
+    delete[] buf;
+    if (rc != ESP_OK) {
+        mState = PageState::INVALID;
+        return rc;
+    }
+
+    rc = alterEntryRangeState(begin, begin + entriesCount, EntryState::WRITTEN);
+    if (rc != ESP_OK) {
+        mState = PageState::INVALID;
+        return rc;
+    }
+
+    if (mFirstUsedEntry == INVALID_ENTRY) {
+        mFirstUsedEntry = begin;
+    }
+    mUsedEntryCount += entriesCount;
+    mNextFreeEntry += entriesCount;
+    return ESP_OK;
+}
+
+esp_err_t Page::readItem(uint8_t nsIndex, ItemType datatype, const char* key, void* data, size_t dataSize, uint8_t chunkIdx)
 {
     size_t index = 0;
     Item item;
@@ -246,12 +387,12 @@ esp_err_t Page::readItem(uint8_t nsIndex, ItemType datatype, const char* key, vo
         return ESP_ERR_NVS_INVALID_STATE;
     }
     
-    esp_err_t rc = findItem(nsIndex, datatype, key, index, item);
+    esp_err_t rc = findItem(nsIndex, datatype, key, index, item, chunkIdx);
     if (rc != ESP_OK) {
         return rc;
     }
 
-    if (datatype != ItemType::SZ && datatype != ItemType::BLOB) {
+    if (!isVariableLengthType(datatype)) {
         if (dataSize != getAlignmentForType(datatype)) {
             return ESP_ERR_NVS_TYPE_MISMATCH;
         }
@@ -288,7 +429,28 @@ esp_err_t Page::readItem(uint8_t nsIndex, ItemType datatype, const char* key, vo
     return ESP_OK;
 }
 
-esp_err_t Page::eraseItem(uint8_t nsIndex, ItemType datatype, const char* key)
+esp_err_t Page::readItemData(size_t itemIndex, size_t offset, void* data, size_t dataSize)
+{
+    uint8_t* dst = reinterpret_cast<uint8_t*>(data);
+    size_t entry = itemIndex + 1 + offset / ENTRY_SIZE;
+    size_t skip = offset % ENTRY_SIZE;
+    while (dataSize > 0) {
+        Item ditem;
+        auto rc = readEntry(entry, ditem);
+        if (rc != ESP_OK) {
+            return rc;
+        }
+        size_t willCopy = std::min(ENTRY_SIZE - skip, dataSize);
+        memcpy(dst, ditem.rawData + skip, willCopy);
+        dst += willCopy;
+        dataSize -= willCopy;
+        skip = 0;
+        ++entry;
+    }
+    return ESP_OK;
+}
+
+esp_err_t Page::mapItem(uint8_t nsIndex, ItemType datatype, const char* key, const void*& data, size_t& dataSize, spi_flash_mmap_handle_t& handle)
 {
     size_t index = 0;
     Item item;
@@ -296,6 +458,48 @@ esp_err_t Page::eraseItem(uint8_t nsIndex, ItemType datatype, const char* key)
     if (rc != ESP_OK) {
         return rc;
     }
+    if (!isVariableLengthType(datatype)) {
+        return ESP_ERR_NVS_TYPE_MISMATCH;
+    }
+
+    // data entries follow the item entry, so the value is contiguous in flash
+    const uint32_t dataAddress = mBaseAddress + ENTRY_DATA_OFFSET + static_cast<uint32_t>(index + 1) * ENTRY_SIZE;
+    const uint32_t mapAddress = dataAddress & ~(SPI_FLASH_MMU_PAGE_SIZE - 1);
+    const void* mapped;
+    rc = spi_flash_mmap(mapAddress, dataAddress + item.varLength.dataSize - mapAddress, SPI_FLASH_MMAP_DATA, &mapped, &handle);
+    if (rc != ESP_OK) {
+        return rc;
+    }
+    const uint8_t* itemData = reinterpret_cast<const uint8_t*>(mapped) + (dataAddress - mapAddress);
+    if (Item::calculateCrc32(itemData, item.varLength.dataSize) != item.varLength.dataCrc32) {
+        spi_flash_munmap(handle);
+        rc = eraseEntryAndSpan(index);
+        if (rc != ESP_OK) {
+            return rc;
+        }
+        return ESP_ERR_NVS_NOT_FOUND;
+    }
+    ++mMapCount;
+    data = itemData;
+    dataSize = item.varLength.dataSize;
+    return ESP_OK;
+}
+
+void Page::unmapItem(spi_flash_mmap_handle_t handle)
+{
+    assert(mMapCount > 0);
+    --mMapCount;
+    spi_flash_munmap(handle);
+}
+
+esp_err_t Page::eraseItem(uint8_t nsIndex, ItemType datatype, const char* key, uint8_t chunkIdx)
+{
+    size_t index = 0;
+    Item item;
+    esp_err_t rc = findItem(nsIndex, datatype, key, index, item, chunkIdx);
+    if (rc != ESP_OK) {
+        return rc;
+    }
     return eraseEntryAndSpan(index);
 }
 
@@ -310,7 +514,7 @@ esp_err_t Page::eraseEntryAndSpan(size_t index)
 {
     auto state = mEntryTable.get(index);
     assert(state == EntryState::WRITTEN || state == EntryState::EMPTY);
-    mHashList.erase(index);
+    indexErase(index);
 
     size_t span = 1;
     if (state == EntryState::WRITTEN) {
@@ -377,6 +581,28 @@ void Page::updateFirstUsedEntry(size_t index, size_t span)
     }
 }
 
+void Page::indexInsert(const Item& item, size_t index)
+{
+    if (item.nsIndex == NS_INDEX) {
+        mHasNamespaceItems = true;
+    }
+    if (item.datatype == ItemType::BLOB_DATA) {
+        mHasBlobChunks = true;
+    }
+    mHashList.insert(item, index);
+    if (mItemIndex) {
+        mItemIndex->insert(ItemIndex::hashOf(item), this, index);
+    }
+}
+
+void Page::indexErase(size_t index)
+{
+    uint32_t hash = mHashList.erase(index);
+    if (mItemIndex) {
+        mItemIndex->erase(hash, this, index);
+    }
+}
+
 esp_err_t Page::moveItem(Page& other)
 {
     if (mFirstUsedEntry == INVALID_ENTRY) {
@@ -395,7 +621,10 @@ esp_err_t Page::moveItem(Page& other)
     if (err != ESP_OK) {
         return err;
     }
-    other.mHashList.insert(entry, other.mNextFreeEntry);
+    if (other.getFreeEntryCount() < entry.span) {
+        return ESP_ERR_NVS_PAGE_FULL;
+    }
+    other.indexInsert(entry, other.mNextFreeEntry);
     err = other.writeEntry(entry);
     if (err != ESP_OK) {
         return err;
@@ -422,11 +651,15 @@ esp_err_t Page::mLoadEntryTable()
     if (mState == PageState::ACTIVE ||
             mState == PageState::FULL ||
             mState == PageState::FREEING) {
-        auto rc = spi_flash_read(mBaseAddress + ENTRY_TABLE_OFFSET, mEntryTable.data(),
-                                 mEntryTable.byteSize());
-        if (rc != ESP_OK) {
-            mState = PageState::INVALID;
-            return rc;
+        if (mLoadBuffer) {
+            memcpy(mEntryTable.data(), mLoadBuffer + ENTRY_TABLE_OFFSET, mEntryTable.byteSize());
+        } else {
+            auto rc = spi_flash_read(mBaseAddress + ENTRY_TABLE_OFFSET, mEntryTable.data(),
+                                     mEntryTable.byteSize());
+            if (rc != ESP_OK) {
+                mState = PageState::INVALID;
+                return rc;
+            }
         }
     }
 
@@ -457,30 +690,47 @@ esp_err_t Page::mLoadEntryTable()
         // however, if power failed after some data was written into the entry.
         // but before the entry state table was altered, the entry locacted via
         // entry state table may actually be half-written.
-        // this is easy to check by reading EntryHeader (i.e. first word)
-        while (mNextFreeEntry < ENTRY_COUNT) {
-            uint32_t entryAddress = getEntryAddress(mNextFreeEntry);
-            uint32_t header;
-            auto rc = spi_flash_read(entryAddress, &header, sizeof(header));
-            if (rc != ESP_OK) {
-                mState = PageState::INVALID;
-                return rc;
+        // Interrupted write of a batch or a blob may also leave entries with data,
+        // or even entries in WRITTEN state, further in the page. So everything
+        // up to the last entry which is not completely erased is marked as erased.
+        if (mNextFreeEntry < ENTRY_COUNT) {
+            size_t lastUsedEnd = mNextFreeEntry;
+            for (size_t i = mNextFreeEntry; i < ENTRY_COUNT; ++i) {
+                if (mEntryTable.get(i) != EntryState::EMPTY) {
+                    lastUsedEnd = i + 1;
+                    continue;
+                }
+                Item entry;
+                auto rc = readEntry(i, entry);
+                if (rc != ESP_OK) {
+                    mState = PageState::INVALID;
+                    return rc;
+                }
+                const uint32_t* line = reinterpret_cast<const uint32_t*>(entry.rawData);
+                if (std::any_of(line, line + ENTRY_SIZE / 4, [](uint32_t val) -> bool { return val != 0xffffffff; })) {
+                    lastUsedEnd = i + 1;
+                }
             }
-            if (header != 0xffffffff) {
-                auto oldState = mEntryTable.get(mNextFreeEntry);
-                auto err = alterEntryState(mNextFreeEntry, EntryState::ERASED);
+
+            if (lastUsedEnd > mNextFreeEntry) {
+                for (size_t i = mNextFreeEntry; i < lastUsedEnd; ++i) {
+                    auto oldState = mEntryTable.get(i);
+                    if (oldState == EntryState::WRITTEN) {
+                        --mUsedEntryCount;
+                    }
+                    if (oldState != EntryState::ERASED) {
+                        ++mErasedEntryCount;
+                    }
+                }
+                auto err = alterEntryRangeState(mNextFreeEntry, lastUsedEnd, EntryState::ERASED);
                 if (err != ESP_OK) {
                     mState = PageState::INVALID;
                     return err;
                 }
-                ++mNextFreeEntry;
-                if (oldState == EntryState::WRITTEN) {
-                    --mUsedEntryCount;
+                if (mFirstUsedEntry != INVALID_ENTRY && mFirstUsedEntry >= mNextFreeEntry) {
+                    mFirstUsedEntry = INVALID_ENTRY;
                 }
-                ++mErasedEntryCount;
-            }
-            else {
-                break;
+                mNextFreeEntry = lastUsedEnd;
             }
         }
 
@@ -507,7 +757,7 @@ esp_err_t Page::mLoadEntryTable()
                 return err;
             }
             
-            mHashList.insert(item, i);
+            indexInsert(item, i);
             
             // search for potential duplicate item
             size_t duplicateIndex = mHashList.find(0, item);
@@ -522,7 +772,7 @@ esp_err_t Page::mLoadEntryTable()
             }
 
             
-            if (item.datatype == ItemType::BLOB || item.datatype == ItemType::SZ) {
+            if (isVariableLengthType(item.datatype)) {
                 span = item.span;
                 bool needErase = false;
                 for (size_t j = i; j < i + span; ++j) {
@@ -547,7 +797,7 @@ esp_err_t Page::mLoadEntryTable()
         if (lastItemIndex != INVALID_ENTRY) {
             size_t findItemIndex = 0;
             Item dupItem;
-            if (findItem(item.nsIndex, item.datatype, item.key, findItemIndex, dupItem) == ESP_OK) {
+            if (findItem(item.nsIndex, item.datatype, item.key, findItemIndex, dupItem, item.chunkIndex) == ESP_OK) {
                 if (findItemIndex < lastItemIndex) {
                     auto err = eraseEntryAndSpan(findItemIndex);
                     if (err != ESP_OK) {
@@ -572,7 +822,17 @@ esp_err_t Page::mLoadEntryTable()
                 return err;
             }
 
-            mHashList.insert(item, i);
+            indexInsert(item, i);
+
+            // with the sector in RAM, checking the CRC here costs no flash reads
+            if (mLoadBuffer && item.crc32 != item.calculateCrc32()) {
+                err = eraseEntryAndSpan(i);
+                if (err != ESP_OK) {
+                    mState = PageState::INVALID;
+                    return err;
+                }
+                continue;
+            }
 
             size_t span = item.span;
             i += span - 1;
@@ -659,6 +919,10 @@ esp_err_t Page::alterPageState(PageState state)
 
 esp_err_t Page::readEntry(size_t index, Item& dst) const
 {
+    if (mLoadBuffer) {
+        memcpy(&dst, mLoadBuffer + ENTRY_DATA_OFFSET + index * ENTRY_SIZE, sizeof(dst));
+        return ESP_OK;
+    }
     auto rc = spi_flash_read(getEntryAddress(index), &dst, sizeof(dst));
     if (rc != ESP_OK) {
         return rc;
@@ -666,7 +930,7 @@ esp_err_t Page::readEntry(size_t index, Item& dst) const
     return ESP_OK;
 }
 
-esp_err_t Page::findItem(uint8_t nsIndex, ItemType datatype, const char* key, size_t &itemIndex, Item& item)
+esp_err_t Page::findItem(uint8_t nsIndex, ItemType datatype, const char* key, size_t &itemIndex, Item& item, uint8_t chunkIdx)
 {
     if (mState == PageState::CORRUPT || mState == PageState::INVALID || mState == PageState::UNINITIALIZED) {
         return ESP_ERR_NVS_NOT_FOUND;
@@ -688,7 +952,7 @@ esp_err_t Page::findItem(uint8_t nsIndex, ItemType datatype, const char* key, si
     }
 
     if (nsIndex != NS_ANY && datatype != ItemType::ANY && key != NULL) {
-        size_t cachedIndex = mHashList.find(start, Item(nsIndex, datatype, 0, key));
+        size_t cachedIndex = mHashList.find(start, Item(nsIndex, datatype, 0, key, chunkIdx));
         if (cachedIndex < ENTRY_COUNT) {
             start = cachedIndex;
         } else {
@@ -715,7 +979,7 @@ esp_err_t Page::findItem(uint8_t nsIndex, ItemType datatype, const char* key, si
             continue;
         }
 
-        if (item.datatype == ItemType::BLOB || item.datatype == ItemType::SZ) {
+        if (isVariableLengthType(item.datatype)) {
             next = i + item.span;
         }
 
@@ -727,7 +991,15 @@ esp_err_t Page::findItem(uint8_t nsIndex, ItemType datatype, const char* key, si
             continue;
         }
 
+        if (chunkIdx != Item::CHUNK_ANY && item.chunkIndex != chunkIdx) {
+            continue;
+        }
+
         if (datatype != ItemType::ANY && item.datatype != datatype) {
+            // blob of one key may exist as a single item, chunks and index at the same time
+            if (isBlobPartType(datatype) || isBlobPartType(item.datatype)) {
+                continue;
+            }
             return ESP_ERR_NVS_TYPE_MISMATCH;
         }
 
@@ -771,7 +1043,12 @@ esp_err_t Page::erase()
     mFirstUsedEntry = INVALID_ENTRY;
     mNextFreeEntry = INVALID_ENTRY;
     mState = PageState::UNINITIALIZED;
+    mHasNamespaceItems = false;
+    mHasBlobChunks = false;
     mHashList.clear();
+    if (mItemIndex) {
+        mItemIndex->erasePage(this);
+    }
     return ESP_OK;
 }
 
@@ -24,6 +24,7 @@
 #include "compressed_enum_table.hpp"
 #include "intrusive_list.h"
 #include "nvs_item_hash_list.hpp"
+#include "nvs_item_index.hpp"
 
 namespace nvs
 {
@@ -44,6 +45,7 @@ public:
 
     static const size_t ENTRY_SIZE  = 32;
     static const size_t ENTRY_COUNT = 126;
+    static const size_t MAX_DATA_SIZE = (ENTRY_COUNT - 1) * ENTRY_SIZE;  // of one variable length item
     static const uint32_t INVALID_ENTRY = 0xffffffff;
 
     static const uint8_t NS_INDEX = 0;
@@ -76,21 +78,38 @@ public:
         return mState;
     }
 
-    esp_err_t load(uint32_t sectorNumber);
+    /* If sectorBuffer (SEC_SIZE bytes) is given, the sector is read with one flash operation */
+    esp_err_t load(uint32_t sectorNumber, uint8_t* sectorBuffer = nullptr);
+
+    /* Copies the sector into sectorBuffer, following reads of entries use this copy
+     * until the function is called with nullptr. Entries are never rewritten, only
+     * their states, which are kept in RAM anyway. */
+    esp_err_t setSectorBuffer(uint8_t* sectorBuffer);
 
     esp_err_t getSeqNumber(uint32_t& seqNumber) const;
 
     esp_err_t setSeqNumber(uint32_t seqNumber);
 
-    esp_err_t writeItem(uint8_t nsIndex, ItemType datatype, const char* key, const void* data, size_t dataSize);
+    esp_err_t writeItem(uint8_t nsIndex, ItemType datatype, const char* key, const void* data, size_t dataSize, uint8_t chunkIdx = Item::CHUNK_ANY);
+
+    esp_err_t writeItems(uint8_t nsIndex, TBatch& batch);
+
+    esp_err_t readItem(uint8_t nsIndex, ItemType datatype, const char* key, void* data, size_t dataSize, uint8_t chunkIdx = Item::CHUNK_ANY);
+
+    /* Reads part of the data of variable length item found at itemIndex, without the CRC check */
+    esp_err_t readItemData(size_t itemIndex, size_t offset, void* data, size_t dataSize);
 
-    esp_err_t readItem(uint8_t nsIndex, ItemType datatype, const char* key, void* data, size_t dataSize);
+    esp_err_t eraseItem(uint8_t nsIndex, ItemType datatype, const char* key, uint8_t chunkIdx = Item::CHUNK_ANY);
 
-    esp_err_t eraseItem(uint8_t nsIndex, ItemType datatype, const char* key);
+    /* Maps data of variable length item into the address space. Page is not
+     * erased until every mapping is released with unmapItem. */
+    esp_err_t mapItem(uint8_t nsIndex, ItemType datatype, const char* key, const void*& data, size_t& dataSize, spi_flash_mmap_handle_t& handle);
+
+    void unmapItem(spi_flash_mmap_handle_t handle);
 
     esp_err_t findItem(uint8_t nsIndex, ItemType datatype, const char* key);
 
-    esp_err_t findItem(uint8_t nsIndex, ItemType datatype, const char* key, size_t &itemIndex, Item& item);
+    esp_err_t findItem(uint8_t nsIndex, ItemType datatype, const char* key, size_t &itemIndex, Item& item, uint8_t chunkIdx = Item::CHUNK_ANY);
 
     template<typename T>
     esp_err_t writeItem(uint8_t nsIndex, const char* key, const T& value)
@@ -120,6 +139,35 @@ public:
         return mErasedEntryCount;
     }
 
+    /* Number of entries which can still be written to this page */
+    size_t getFreeEntryCount() const
+    {
+        if (mState == PageState::UNINITIALIZED) {
+            return ENTRY_COUNT;
+        }
+        if (mState != PageState::ACTIVE || mNextFreeEntry == INVALID_ENTRY) {
+            return 0;
+        }
+        return ENTRY_COUNT - mNextFreeEntry;
+    }
+
+    /* False if the page has never had items of namespace index since it was loaded */
+    bool hasNamespaceItems() const
+    {
+        return mHasNamespaceItems;
+    }
+
+    /* False if the page has never had blob chunks since it was loaded */
+    bool hasBlobChunks() const
+    {
+        return mHasBlobChunks;
+    }
+
+    bool isMapped() const
+    {
+        return mMapCount > 0;
+    }
+
 
     esp_err_t markFull();
 
@@ -129,6 +177,11 @@ public:
 
     esp_err_t erase();
 
+    void setItemIndex(ItemIndex* itemIndex)
+    {
+        mItemIndex = itemIndex;
+    }
+
     void debugDump() const;
 
 protected:
@@ -156,6 +209,8 @@ protected:
         INVALID = 0x4 // entry is in inconsistent state (write started but ESB_WRITTEN has not been set yet)
     };
 
+    esp_err_t mLoad();
+
     esp_err_t mLoadEntryTable();
 
     esp_err_t initialize();
@@ -176,6 +231,12 @@ protected:
 
     void updateFirstUsedEntry(size_t index, size_t span);
 
+    void indexInsert(const Item& item, size_t index);
+
+    void indexErase(size_t index);
+
+    static size_t getEntryCount(ItemType datatype, size_t dataSize);
+
     static constexpr size_t getAlignmentForType(ItemType type)
     {
         return static_cast<uint8_t>(type) & 0x0f;
@@ -200,14 +261,20 @@ protected:
     size_t mFirstUsedEntry = INVALID_ENTRY;
     uint16_t mUsedEntryCount = 0;
     uint16_t mErasedEntryCount = 0;
+    bool mHasNamespaceItems = false;
+    bool mHasBlobChunks = false;
+    uint16_t mMapCount = 0;  // items mapped with mapItem
+    const uint8_t* mLoadBuffer = nullptr;  // copy of the sector, see setSectorBuffer
 
     HashList mHashList;
+    ItemIndex* mItemIndex = nullptr;
 
     static const uint32_t HEADER_OFFSET = 0;
     static const uint32_t ENTRY_TABLE_OFFSET = HEADER_OFFSET + 32;
     static const uint32_t ENTRY_DATA_OFFSET = ENTRY_TABLE_OFFSET + 32;
 
     static_assert(sizeof(Header) == 32, "header size must be 32 bytes");
+    static_assert(ENTRY_COUNT <= HashList::CAPACITY, "hash list should fit all entries of the page");
     static_assert(ENTRY_TABLE_OFFSET % 32 == 0, "entry table offset should be aligned");
     static_assert(ENTRY_DATA_OFFSET % 32 == 0, "entry data offset should be aligned");
 
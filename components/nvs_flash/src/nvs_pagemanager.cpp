@@ -12,6 +12,7 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 #include "nvs_pagemanager.hpp"
+#include <new>
 
 namespace nvs
 {
@@ -22,9 +23,17 @@ esp_err_t PageManager::load(uint32_t baseSector, uint32_t sectorCount)
     mPageList.clear();
     mFreePageList.clear();
     mPages.reset(new Page[sectorCount]);
+    mItemIndex.clear();
+    mReclaimPage = nullptr;
+    mReclaimBlocked = false;
+
+    // pages are read in one flash operation each; if there is no memory
+    // for the buffer, they are read entry by entry
+    std::unique_ptr<uint8_t[]> sectorBuffer(new (std::nothrow) uint8_t[Page::SEC_SIZE]);
 
     for (uint32_t i = 0; i < sectorCount; ++i) {
-        auto err = mPages[i].load(baseSector + i);
+        mPages[i].setItemIndex(&mItemIndex);
+        auto err = mPages[i].load(baseSector + i, sectorBuffer.get());
         if (err != ESP_OK) {
             return err;
         }
@@ -54,24 +63,63 @@ esp_err_t PageManager::load(uint32_t baseSector, uint32_t sectorCount)
     }
 
     // if power went out after a new item for the given key was written,
-    // but before the old one was erased, we end up with a duplicate item
+    // but before the old one was erased, we end up with a duplicate item.
+    // Write batch may leave such duplicates for all of its items, as well as
+    // erase markers (items of ItemType::ANY) of the keys it erases.
     Page& lastPage = back();
-    size_t lastItemIndex = SIZE_MAX;
+    auto last = PageManager::TPageListIterator(&lastPage);
+    if (sectorBuffer) {
+        auto err = lastPage.setSectorBuffer(sectorBuffer.get());
+        if (err != ESP_OK) {
+            return err;
+        }
+    }
     Item item;
     size_t itemIndex = 0;
     while (lastPage.findItem(Page::NS_ANY, ItemType::ANY, nullptr, itemIndex, item) == ESP_OK) {
+        const size_t index = itemIndex;
         itemIndex += item.span;
-        lastItemIndex = itemIndex;
-    }
-
-    if (lastItemIndex != SIZE_MAX) {
-        auto last = PageManager::TPageListIterator(&lastPage);
+        if (item.datatype == ItemType::BLOB || item.datatype == ItemType::BLOB_IDX) {
+            // blob written as a single item replaces the chunked one and the other way round
+            const ItemType other = (item.datatype == ItemType::BLOB) ? ItemType::BLOB_IDX : ItemType::BLOB;
+            for (auto it = begin(); it != end(); ++it) {
+                size_t otherIndex = 0;
+                Item otherItem;
+                if (it->findItem(item.nsIndex, other, item.key, otherIndex, otherItem) == ESP_OK &&
+                        (it != last || otherIndex < index)) {
+                    it->eraseItem(item.nsIndex, other, item.key);
+                }
+            }
+        }
+        if (item.datatype == ItemType::ANY) {
+            // complete the erase: copies on the earlier pages and before the
+            // marker are older, the marker itself is the last copy to go.
+            // The key may have been written again after the marker.
+            for (auto it = begin(); it != last; ++it) {
+                while (it->eraseItem(item.nsIndex, ItemType::ANY, item.key) == ESP_OK) {
+                }
+            }
+            while (true) {
+                size_t copyIndex = 0;
+                Item copy;
+                if (lastPage.findItem(item.nsIndex, ItemType::ANY, item.key, copyIndex, copy) != ESP_OK ||
+                        copyIndex > index) {
+                    break;
+                }
+                lastPage.eraseItem(item.nsIndex, ItemType::ANY, item.key);
+                if (copyIndex == index) {
+                    break;
+                }
+            }
+            continue;
+        }
         for (auto it = begin(); it != last; ++it) {
-            if (it->eraseItem(item.nsIndex, item.datatype, item.key) == ESP_OK) {
+            if (it->eraseItem(item.nsIndex, item.datatype, item.key, item.chunkIndex) == ESP_OK) {
                 break;
             }
         }
     }
+    lastPage.setSectorBuffer(nullptr);
 
     // check if power went out while page was being freed
     for (auto it = begin(); it!= end(); ++it) {
@@ -88,6 +136,18 @@ esp_err_t PageManager::load(uint32_t baseSector, uint32_t sectorCount)
                 auto err = it->moveItem(*newPage);
                 if (err == ESP_ERR_NVS_NOT_FOUND) {
                     break;
+                } else if (err == ESP_ERR_NVS_PAGE_FULL) {
+                    // page was being reclaimed into the active page, which
+                    // has been filled up by the writes done in the meantime
+                    err = newPage->markFull();
+                    if (err != ESP_OK) {
+                        return err;
+                    }
+                    err = activatePage();
+                    if (err != ESP_OK) {
+                        return err;
+                    }
+                    newPage = &mPageList.back();
                 } else if (err != ESP_OK) {
                     return err;
                 }
@@ -124,20 +184,18 @@ esp_err_t PageManager::requestNewPage()
         return activatePage();
     }
 
-    // find the page with the higest number of erased items
-    TPageListIterator maxErasedItemsPageIt;
-    size_t maxErasedItems = 0;
-    for (auto it = begin(); it != end(); ++it) {
-        auto erased = it->getErasedEntryCount();
-        if (erased > maxErasedItems) {
-            maxErasedItemsPageIt = it;
-            maxErasedItems = erased;
-        }
-    }
-
-    if (maxErasedItems == 0) {
+    // reclaimStep did not free a page in time, finish its page first,
+    // otherwise find the page with the higest number of erased items
+    Page* erasedPage = mReclaimPage;
+    if (erasedPage != nullptr && erasedPage->isMapped()) {
         return ESP_ERR_NVS_NOT_ENOUGH_SPACE;
     }
+    if (erasedPage == nullptr) {
+        erasedPage = findReclaimCandidate(end(), Page::ENTRY_COUNT);
+        if (erasedPage == nullptr) {
+            return ESP_ERR_NVS_NOT_ENOUGH_SPACE;
+        }
+    }
 
     esp_err_t err = activatePage();
     if (err != ESP_OK) {
@@ -146,13 +204,15 @@ esp_err_t PageManager::requestNewPage()
 
     Page* newPage = &mPageList.back();
 
-    Page* erasedPage = maxErasedItemsPageIt;
 #ifndef NDEBUG
     size_t usedEntries = erasedPage->getUsedEntryCount();
 #endif
-    err = erasedPage->markFreeing();
-    if (err != ESP_OK) {
-        return err;
+    if (mReclaimPage == nullptr) {
+        err = erasedPage->markFreeing();
+        if (err != ESP_OK) {
+            return err;
+        }
+        mReclaimPage = erasedPage;
     }
     while (true) {
         err = erasedPage->moveItem(*newPage);
@@ -163,7 +223,7 @@ esp_err_t PageManager::requestNewPage()
         }
     }
 
-    err = erasedPage->erase();
+    err = releaseReclaimPage();
     if (err != ESP_OK) {
         return err;
     }
@@ -171,13 +231,134 @@ esp_err_t PageManager::requestNewPage()
 #ifndef NDEBUG
     assert(usedEntries == newPage->getUsedEntryCount());
 #endif
-    
-    mPageList.erase(maxErasedItemsPageIt);
-    mFreePageList.push_back(erasedPage);
 
     return ESP_OK;
 }
 
+bool PageManager::reclaimPending()
+{
+    if (mReclaimPage != nullptr) {
+        return !mReclaimBlocked;
+    }
+    if (mFreePageList.size() >= 2 || mPageList.empty()) {
+        return false;
+    }
+    Page& current = back();
+    return findReclaimCandidate(TPageListIterator(&current), current.getFreeEntryCount()) != nullptr ||
+           findSpareReclaimCandidate() != nullptr;
+}
+
+esp_err_t PageManager::reclaimStep()
+{
+    if (mReclaimPage == nullptr) {
+        if (mFreePageList.size() >= 2 || mPageList.empty()) {
+            return ESP_OK;
+        }
+        // items are moved to the current page, so take a page which fits there
+        Page& current = back();
+        Page* page = findReclaimCandidate(TPageListIterator(&current), current.getFreeEntryCount());
+        if (page == nullptr) {
+            // current page is too full, reclaim into the spare page right away,
+            // so that the next requestNewPage call does not have to erase
+            if (findSpareReclaimCandidate() == nullptr) {
+                return ESP_OK;
+            }
+            if (current.state() != Page::PageState::FULL) {
+                auto err = current.markFull();
+                if (err != ESP_OK) {
+                    return err;
+                }
+            }
+            return requestNewPage();
+        }
+        auto err = page->markFreeing();
+        if (err != ESP_OK) {
+            return err;
+        }
+        mReclaimPage = page;
+        mReclaimBlocked = false;
+    }
+
+    auto err = mReclaimPage->moveItem(back());
+    if (err == ESP_ERR_NVS_NOT_FOUND) {
+        if (mReclaimPage->isMapped()) {
+            // page is erased once the values mapped from it are released
+            mReclaimBlocked = true;
+            return ESP_OK;
+        }
+        return releaseReclaimPage();
+    } else if (err == ESP_ERR_NVS_PAGE_FULL) {
+        Page& current = back();
+        if (mReclaimPage->isMapped() || mReclaimPage->getErasedEntryCount() <= current.getFreeEntryCount()) {
+            // the next requestNewPage call will finish this page
+            mReclaimBlocked = true;
+            return ESP_OK;
+        }
+        // finish the page in the spare page instead
+        if (current.state() != Page::PageState::FULL) {
+            err = current.markFull();
+            if (err != ESP_OK) {
+                return err;
+            }
+        }
+        return requestNewPage();
+    }
+    return err;
+}
+
+Page* PageManager::findReclaimCandidate(TPageListIterator last, size_t maxUsedEntries)
+{
+    // Items are moved ahead of the entry iterators, so the pages which they
+    // have not read yet are taken only if there is no other candidate
+    Page* candidate = nullptr;
+    size_t maxErasedItems = 0;
+    Page* readCandidate = nullptr;
+    size_t maxReadErasedItems = 0;
+    for (auto it = begin(); it != last; ++it) {
+        auto erased = it->getErasedEntryCount();
+        if (it->getUsedEntryCount() > maxUsedEntries || it->isMapped()) {
+            continue;
+        }
+        if (erased > maxErasedItems) {
+            candidate = it;
+            maxErasedItems = erased;
+        }
+        uint32_t seqNumber;
+        if (erased > maxReadErasedItems && it->getSeqNumber(seqNumber) == ESP_OK &&
+                (seqNumber < mIteratedFirst || seqNumber > mIteratedLast)) {
+            readCandidate = it;
+            maxReadErasedItems = erased;
+        }
+    }
+    return (readCandidate != nullptr) ? readCandidate : candidate;
+}
+
+Page* PageManager::findSpareReclaimCandidate()
+{
+    // Entries left in the current page are lost when it is marked full,
+    // so moving the items to the spare page should free more than that
+    Page& current = back();
+    Page* page = findReclaimCandidate(TPageListIterator(&current), Page::ENTRY_COUNT);
+    if (page == nullptr || page->getErasedEntryCount() <= current.getFreeEntryCount()) {
+        return nullptr;
+    }
+    return page;
+}
+
+esp_err_t PageManager::releaseReclaimPage()
+{
+    Page* page = mReclaimPage;
+    auto err = page->erase();
+    if (err != ESP_OK) {
+        return err;
+    }
+    mPageList.erase(TPageListIterator(page));
+    mFreePageList.push_back(page);
+    mReclaimPage = nullptr;
+    mReclaimBlocked = false;
+    return ESP_OK;
+}
+
 esp_err_t PageManager::activatePage()
 {
     if (mFreePageList.empty()) {
@@ -194,6 +375,7 @@ esp_err_t PageManager::activatePage()
     mPageList.push_back(p);
     p->setSeqNumber(mSeqNumber);
     ++mSeqNumber;
+    mReclaimBlocked = false;
     return ESP_OK;
 }
 
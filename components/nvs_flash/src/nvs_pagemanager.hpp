@@ -50,17 +50,48 @@ public:
 
     esp_err_t requestNewPage();
 
+    /* True if a free page could be prepared by calling reclaimStep */
+    bool reclaimPending();
+
+    /* Moves one item of the page being reclaimed, or erases the page once it is empty */
+    esp_err_t reclaimStep();
+
+    /* Pages with sequence numbers in this range are still read by entry iterators,
+     * other pages are reclaimed first. Empty range if first > last */
+    void setIteratedPages(uint32_t first, uint32_t last)
+    {
+        mIteratedFirst = first;
+        mIteratedLast = last;
+    }
+
+    const ItemIndex& itemIndex() const
+    {
+        return mItemIndex;
+    }
+
 protected:
     friend class Iterator;
 
     esp_err_t activatePage();
 
+    Page* findReclaimCandidate(TPageListIterator last, size_t maxUsedEntries);
+
+    /* Page which is worth reclaiming into the spare page when the current page is too full */
+    Page* findSpareReclaimCandidate();
+
+    esp_err_t releaseReclaimPage();
+
     TPageList mPageList;
     TPageList mFreePageList;
+    ItemIndex mItemIndex;
     std::unique_ptr<Page[]> mPages;
     uint32_t mBaseSector;
     uint32_t mPageCount;
     uint32_t mSeqNumber;
+    Page* mReclaimPage = nullptr;   // FREEING page which is being emptied by reclaimStep
+    bool mReclaimBlocked = false;   // current page has no room for the next item of mReclaimPage
+    uint32_t mIteratedFirst = 1;
+    uint32_t mIteratedLast = 0;
 }; // class PageManager
 
 
@@ -18,6 +18,7 @@
 #ifdef ESP_PLATFORM
 #include "freertos/FreeRTOS.h"
 #include "freertos/semphr.h"
+#include "esp_spi_flash.h"
 
 namespace nvs
 {
@@ -30,10 +31,16 @@ public:
         if (mSemaphore) {
             xSemaphoreTake(mSemaphore, portMAX_DELAY);
         }
+#if CONFIG_SPI_FLASH_ENABLE_COUNTERS
+        mPrevCaller = spi_flash_counters_set_caller("nvs");
+#endif
     }
 
     ~Lock()
     {
+#if CONFIG_SPI_FLASH_ENABLE_COUNTERS
+        spi_flash_counters_set_caller(mPrevCaller);
+#endif
         if (mSemaphore) {
             xSemaphoreGive(mSemaphore);
         }
@@ -60,6 +67,11 @@ public:
     }
 
     static SemaphoreHandle_t mSemaphore;
+
+#if CONFIG_SPI_FLASH_ENABLE_COUNTERS
+protected:
+    const char* mPrevCaller;
+#endif
 };
 } // namespace nvs
 
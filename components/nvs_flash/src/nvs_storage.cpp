@@ -38,6 +38,7 @@ void Storage::clearNamespaces()
 
 esp_err_t Storage::init(uint32_t baseSector, uint32_t sectorCount)
 {
+    mValueCache.clear();
     auto err = mPageManager.load(baseSector, sectorCount);
     if (err != ESP_OK) {
         mState = StorageState::INVALID;
@@ -49,6 +50,9 @@ esp_err_t Storage::init(uint32_t baseSector, uint32_t sectorCount)
     std::fill_n(mNamespaceUsage.data(), mNamespaceUsage.byteSize() / 4, 0);
     for (auto it = mPageManager.begin(); it != mPageManager.end(); ++it) {
         Page& p = *it;
+        if (!p.hasNamespaceItems()) {
+            continue;
+        }
         size_t itemIndex = 0;
         Item item;
         while (p.findItem(Page::NS_INDEX, ItemType::U8, nullptr, itemIndex, item) == ESP_OK) {
@@ -62,6 +66,14 @@ esp_err_t Storage::init(uint32_t baseSector, uint32_t sectorCount)
     }
     mNamespaceUsage.set(0, true);
     mNamespaceUsage.set(255, true);
+
+    // if power went off while a blob was written or erased, some of its chunks
+    // may not belong to the current value
+    err = eraseOrphanBlobChunks();
+    if (err != ESP_OK) {
+        mState = StorageState::INVALID;
+        return err;
+    }
     mState = StorageState::ACTIVE;
 #ifndef ESP_PLATFORM
     debugCheck();
@@ -76,15 +88,49 @@ bool Storage::isValid() const
 
 esp_err_t Storage::findItem(uint8_t nsIndex, ItemType datatype, const char* key, Page* &page, Item& item)
 {
-    for (auto it = std::begin(mPageManager); it != std::end(mPageManager); ++it) {
-        size_t itemIndex = 0;
-        auto err = it->findItem(nsIndex, datatype, key, itemIndex, item);
-        if (err == ESP_OK) {
-            page = it;
-            return ESP_OK;
+    size_t itemIndex;
+    return findItem(nsIndex, datatype, key, page, item, itemIndex);
+}
+
+esp_err_t Storage::findItem(uint8_t nsIndex, ItemType datatype, const char* key, Page* &page, Item& item, size_t& itemIndex, uint8_t chunkIdx)
+{
+    // Only the pages which have an item with the same hash are checked.
+    // If there are several copies of the item, the one on the oldest page wins,
+    // same as if the pages were searched in order.
+    const uint32_t hash = ItemIndex::hashOf(Item(nsIndex, datatype, 0, key, chunkIdx));
+    const ItemIndex& index = mPageManager.itemIndex();
+    Page* foundPage = nullptr;
+    uint32_t foundSeqNumber = UINT32_MAX;
+    size_t foundIndex = SIZE_MAX;
+    size_t cursor = 0;
+    Page* candidate;
+    size_t candidateIndex;
+    while (index.find(hash, cursor, candidate, candidateIndex)) {
+        uint32_t seqNumber;
+        if (candidate->getSeqNumber(seqNumber) != ESP_OK) {
+            continue;
+        }
+        if (foundPage && (seqNumber > foundSeqNumber ||
+                (seqNumber == foundSeqNumber && candidateIndex > foundIndex))) {
+            continue;
         }
+        size_t itemIndex = candidateIndex;
+        Item candidateItem;
+        auto err = candidate->findItem(nsIndex, datatype, key, itemIndex, candidateItem, chunkIdx);
+        if (err != ESP_OK) {
+            continue;
+        }
+        foundPage = candidate;
+        foundSeqNumber = seqNumber;
+        foundIndex = itemIndex;
+        item = candidateItem;
+    }
+    if (foundPage == nullptr) {
+        return ESP_ERR_NVS_NOT_FOUND;
     }
-    return ESP_ERR_NVS_NOT_FOUND;
+    page = foundPage;
+    itemIndex = foundIndex;
+    return ESP_OK;
 }
 
 esp_err_t Storage::writeItem(uint8_t nsIndex, ItemType datatype, const char* key, const void* data, size_t dataSize)
@@ -93,6 +139,12 @@ esp_err_t Storage::writeItem(uint8_t nsIndex, ItemType datatype, const char* key
         return ESP_ERR_NVS_NOT_INITIALIZED;
     }
 
+    mValueCache.erase(nsIndex, key);
+
+    if (datatype == ItemType::BLOB && dataSize > Page::MAX_DATA_SIZE) {
+        return writeMultiPageBlob(nsIndex, key, data, dataSize);
+    }
+
     Page* findPage = nullptr;
     Item item;
     auto err = findItem(nsIndex, datatype, key, findPage, item);
@@ -138,12 +190,125 @@ esp_err_t Storage::writeItem(uint8_t nsIndex, ItemType datatype, const char* key
             return err;
         }
     }
+    if (datatype == ItemType::BLOB) {
+        // blob which fits into one item replaces the chunked one
+        err = eraseMultiPageBlob(nsIndex, key);
+        if (err == ESP_ERR_FLASH_OP_FAIL) {
+            return ESP_ERR_NVS_REMOVE_FAILED;
+        }
+        if (err != ESP_OK && err != ESP_ERR_NVS_NOT_FOUND) {
+            return err;
+        }
+    }
 #ifndef ESP_PLATFORM
     debugCheck();
 #endif
     return ESP_OK;
 }
 
+esp_err_t Storage::writeBatch(uint8_t nsIndex, TBatch& batch)
+{
+    if (mState != StorageState::ACTIVE) {
+        return ESP_ERR_NVS_NOT_INITIALIZED;
+    }
+
+    // erase of a key which doesn't exist needs no marker
+    for (auto it = batch.begin(); it != batch.end(); ) {
+        auto cur = it++;
+        mValueCache.erase(nsIndex, cur->key);
+        if (cur->datatype != ItemType::ANY) {
+            continue;
+        }
+        Page* findPage;
+        Item item;
+        auto err = findItem(nsIndex, ItemType::ANY, cur->key, findPage, item);
+        if (err == ESP_ERR_NVS_NOT_FOUND) {
+            batch.erase(cur);
+            delete static_cast<BatchItem*>(cur);
+        } else if (err != ESP_OK) {
+            return err;
+        }
+    }
+
+    // new items are written to one page, so that they are committed together
+    Page& page = getCurrentPage();
+    auto err = page.writeItems(nsIndex, batch);
+    if (err == ESP_ERR_NVS_PAGE_FULL) {
+        if (page.state() != Page::PageState::FULL) {
+            err = page.markFull();
+            if (err != ESP_OK) {
+                return err;
+            }
+        }
+        err = mPageManager.requestNewPage();
+        if (err != ESP_OK) {
+            return err;
+        }
+
+        err = getCurrentPage().writeItems(nsIndex, batch);
+        if (err == ESP_ERR_NVS_PAGE_FULL) {
+            return ESP_ERR_NVS_NOT_ENOUGH_SPACE;
+        }
+        if (err != ESP_OK) {
+            return err;
+        }
+    } else if (err != ESP_OK) {
+        return err;
+    }
+
+    // batch is committed, now remove old values and erase markers;
+    // if this is interrupted, PageManager::load will finish the job
+    Page* newPage = &getCurrentPage();
+    for (auto it = batch.begin(); it != batch.end(); ++it) {
+        if (it->datatype == ItemType::BLOB || it->datatype == ItemType::ANY) {
+            err = eraseMultiPageBlob(nsIndex, it->key);
+            if (err == ESP_ERR_FLASH_OP_FAIL) {
+                return ESP_ERR_NVS_REMOVE_FAILED;
+            }
+            if (err != ESP_OK && err != ESP_ERR_NVS_NOT_FOUND) {
+                return err;
+            }
+        }
+        err = eraseOldCopies(nsIndex, it->datatype, it->key, newPage, it->index);
+        if (err == ESP_ERR_FLASH_OP_FAIL) {
+            return ESP_ERR_NVS_REMOVE_FAILED;
+        }
+        if (err != ESP_OK) {
+            return err;
+        }
+    }
+#ifndef ESP_PLATFORM
+    debugCheck();
+#endif
+    return ESP_OK;
+}
+
+esp_err_t Storage::eraseOldCopies(uint8_t nsIndex, ItemType datatype, const char* key, Page* newPage, size_t newIndex)
+{
+    // copies are found oldest first, the one written last is at newIndex.
+    // For erase markers (ItemType::ANY) the marker is erased as well.
+    while (true) {
+        Page* findPage;
+        Item item;
+        size_t itemIndex;
+        auto err = findItem(nsIndex, datatype, key, findPage, item, itemIndex);
+        if (err == ESP_ERR_NVS_NOT_FOUND) {
+            return ESP_OK;
+        }
+        if (err != ESP_OK) {
+            return err;
+        }
+        const bool isNew = findPage == newPage && itemIndex == newIndex;
+        if (isNew && datatype != ItemType::ANY) {
+            return ESP_OK;
+        }
+        err = findPage->eraseItem(nsIndex, datatype, key);
+        if (err != ESP_OK || isNew) {
+            return err;
+        }
+    }
+}
+
 esp_err_t Storage::createOrOpenNamespace(const char* nsName, bool canCreate, uint8_t& nsIndex)
 {
     if (mState != StorageState::ACTIVE) {
@@ -193,14 +358,26 @@ esp_err_t Storage::readItem(uint8_t nsIndex, ItemType datatype, const char* key,
         return ESP_ERR_NVS_NOT_INITIALIZED;
     }
 
+    const bool cacheable = mValueCache.capacity() > 0 && ValueCache::isCacheable(datatype, dataSize);
+    if (cacheable && mValueCache.find(nsIndex, datatype, key, data, dataSize)) {
+        return ESP_OK;
+    }
+
     Item item;
     Page* findPage = nullptr;
     auto err = findItem(nsIndex, datatype, key, findPage, item);
+    if (err == ESP_ERR_NVS_NOT_FOUND && datatype == ItemType::BLOB) {
+        return readMultiPageBlob(nsIndex, key, data, dataSize);
+    }
     if (err != ESP_OK) {
         return err;
     }
 
-    return findPage->readItem(nsIndex, datatype, key, data, dataSize);
+    err = findPage->readItem(nsIndex, datatype, key, data, dataSize);
+    if (err == ESP_OK && cacheable) {
+        mValueCache.insert(nsIndex, datatype, key, data, dataSize);
+    }
+    return err;
 }
 
 esp_err_t Storage::eraseItem(uint8_t nsIndex, ItemType datatype, const char* key)
@@ -209,6 +386,15 @@ esp_err_t Storage::eraseItem(uint8_t nsIndex, ItemType datatype, const char* key
         return ESP_ERR_NVS_NOT_INITIALIZED;
     }
 
+    mValueCache.erase(nsIndex, key);
+
+    if (datatype == ItemType::BLOB || datatype == ItemType::ANY) {
+        auto err = eraseMultiPageBlob(nsIndex, key);
+        if (err != ESP_ERR_NVS_NOT_FOUND) {
+            return err;
+        }
+    }
+
     Item item;
     Page* findPage = nullptr;
     auto err = findItem(nsIndex, datatype, key, findPage, item);
@@ -219,12 +405,356 @@ esp_err_t Storage::eraseItem(uint8_t nsIndex, ItemType datatype, const char* key
     return findPage->eraseItem(nsIndex, datatype, key);
 }
 
+esp_err_t Storage::beginBlob(uint8_t nsIndex, const char* key, size_t dataSize, BlobWriteState& state)
+{
+    if (mState != StorageState::ACTIVE) {
+        return ESP_ERR_NVS_NOT_INITIALIZED;
+    }
+    if (strlen(key) > Item::MAX_KEY_LENGTH) {
+        return ESP_ERR_NVS_KEY_TOO_LONG;
+    }
+
+    // chunks of the new value are numbered differently from the current ones
+    uint8_t chunkStart = Item::CHUNK_VER_0;
+    Page* findPage;
+    Item item;
+    size_t itemIndex;
+    auto err = findItem(nsIndex, ItemType::BLOB_IDX, key, findPage, item, itemIndex);
+    if (err == ESP_OK && item.blobIndex.chunkStart == Item::CHUNK_VER_0) {
+        chunkStart = Item::CHUNK_VER_1;
+    } else if (err != ESP_OK && err != ESP_ERR_NVS_NOT_FOUND) {
+        return err;
+    }
+    // left by a write which was not finished
+    err = eraseBlobChunks(nsIndex, key, chunkStart);
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    strncpy(state.key, key, Item::MAX_KEY_LENGTH);
+    state.key[Item::MAX_KEY_LENGTH] = 0;
+    state.dataSize = dataSize;
+    state.offset = 0;
+    state.chunkStart = chunkStart;
+    state.chunkCount = 0;
+    return ESP_OK;
+}
+
+esp_err_t Storage::writeBlobChunk(uint8_t nsIndex, BlobWriteState& state, const void* data, size_t dataSize)
+{
+    if (mState != StorageState::ACTIVE) {
+        return ESP_ERR_NVS_NOT_INITIALIZED;
+    }
+    if (state.offset + dataSize > state.dataSize) {
+        return ESP_ERR_NVS_INVALID_LENGTH;
+    }
+
+    // every piece fills the current page, so chunks don't depend on the sizes of the pieces
+    const uint8_t* src = reinterpret_cast<const uint8_t*>(data);
+    esp_err_t err = ESP_OK;
+    while (dataSize > 0) {
+        Page* page = &getCurrentPage();
+        if (page->getFreeEntryCount() < 2) {
+            if (page->state() == Page::PageState::ACTIVE) {
+                err = page->markFull();
+                if (err != ESP_OK) {
+                    break;
+                }
+            }
+            err = mPageManager.requestNewPage();
+            if (err != ESP_OK) {
+                break;
+            }
+            page = &getCurrentPage();
+            if (page->getFreeEntryCount() < 2) {
+                err = ESP_ERR_NVS_NOT_ENOUGH_SPACE;
+                break;
+            }
+        }
+        if (state.chunkCount == Item::CHUNK_MAX_COUNT) {
+            err = ESP_ERR_NVS_NOT_ENOUGH_SPACE;
+            break;
+        }
+        const size_t chunkSize = std::min(dataSize, (page->getFreeEntryCount() - 1) * Page::ENTRY_SIZE);
+        err = page->writeItem(nsIndex, ItemType::BLOB_DATA, state.key, src, chunkSize,
+                              state.chunkStart + state.chunkCount);
+        if (err != ESP_OK) {
+            break;
+        }
+        ++state.chunkCount;
+        state.offset += chunkSize;
+        src += chunkSize;
+        dataSize -= chunkSize;
+    }
+    if (err != ESP_OK) {
+        abortBlob(nsIndex, state);
+        return err;
+    }
+    if (state.offset < state.dataSize) {
+#ifndef ESP_PLATFORM
+        debugCheck();
+#endif
+        return ESP_OK;
+    }
+
+    // all chunks are written, the index item makes them the value of the key
+    Item index;
+    index.blobIndex.dataSize = state.dataSize;
+    index.blobIndex.chunkCount = state.chunkCount;
+    index.blobIndex.chunkStart = state.chunkStart;
+    index.blobIndex.reserved = 0xffff;
+    err = writeItem(nsIndex, ItemType::BLOB_IDX, state.key, index.data, sizeof(index.data));
+    if (err == ESP_ERR_NVS_REMOVE_FAILED) {
+        return err;
+    }
+    if (err != ESP_OK) {
+        abortBlob(nsIndex, state);
+        return err;
+    }
+
+    // old value, chunked or written as one item
+    const uint8_t oldChunkStart = (state.chunkStart == Item::CHUNK_VER_0) ? Item::CHUNK_VER_1 : Item::CHUNK_VER_0;
+    err = eraseBlobChunks(nsIndex, state.key, oldChunkStart);
+    if (err == ESP_OK) {
+        Page* findPage;
+        Item item;
+        size_t itemIndex;
+        err = findItem(nsIndex, ItemType::BLOB, state.key, findPage, item, itemIndex);
+        if (err == ESP_OK) {
+            err = findPage->eraseItem(nsIndex, ItemType::BLOB, state.key);
+        } else if (err == ESP_ERR_NVS_NOT_FOUND) {
+            err = ESP_OK;
+        }
+    }
+    if (err == ESP_ERR_FLASH_OP_FAIL) {
+        return ESP_ERR_NVS_REMOVE_FAILED;
+    }
+    if (err != ESP_OK) {
+        return err;
+    }
+#ifndef ESP_PLATFORM
+    debugCheck();
+#endif
+    return ESP_OK;
+}
+
+void Storage::abortBlob(uint8_t nsIndex, BlobWriteState& state)
+{
+    // remaining chunks are erased by the next beginBlob for the key, or on init
+    eraseBlobChunks(nsIndex, state.key, state.chunkStart);
+    state.dataSize = 0;
+    state.offset = 0;
+    state.chunkCount = 0;
+}
+
+esp_err_t Storage::readBlobChunk(uint8_t nsIndex, const char* key, size_t offset, void* data, size_t& dataSize)
+{
+    if (mState != StorageState::ACTIVE) {
+        return ESP_ERR_NVS_NOT_INITIALIZED;
+    }
+
+    Page* findPage;
+    Item item;
+    size_t itemIndex;
+    auto err = findItem(nsIndex, ItemType::BLOB, key, findPage, item, itemIndex);
+    if (err == ESP_OK) {
+        const size_t totalSize = item.varLength.dataSize;
+        if (offset > totalSize) {
+            return ESP_ERR_NVS_INVALID_LENGTH;
+        }
+        dataSize = std::min(dataSize, totalSize - offset);
+        if (offset == 0 && dataSize == totalSize) {
+            return findPage->readItem(nsIndex, ItemType::BLOB, key, data, dataSize);
+        }
+        return findPage->readItemData(itemIndex, offset, data, dataSize);
+    }
+    if (err != ESP_ERR_NVS_NOT_FOUND) {
+        return err;
+    }
+
+    err = findItem(nsIndex, ItemType::BLOB_IDX, key, findPage, item, itemIndex);
+    if (err != ESP_OK) {
+        return err;
+    }
+    const size_t totalSize = item.blobIndex.dataSize;
+    if (offset > totalSize) {
+        return ESP_ERR_NVS_INVALID_LENGTH;
+    }
+    dataSize = std::min(dataSize, totalSize - offset);
+    const size_t end = offset + dataSize;
+
+    // data CRC is checked for the chunks which are read completely
+    uint8_t* dst = reinterpret_cast<uint8_t*>(data);
+    size_t chunkOffset = 0;
+    for (size_t i = 0; i < item.blobIndex.chunkCount && chunkOffset < end; ++i) {
+        const uint8_t chunkIdx = item.blobIndex.chunkStart + i;
+        Page* chunkPage;
+        Item chunk;
+        size_t chunkIndex;
+        err = findItem(nsIndex, ItemType::BLOB_DATA, key, chunkPage, chunk, chunkIndex, chunkIdx);
+        if (err != ESP_OK) {
+            return err;
+        }
+        const size_t chunkSize = chunk.varLength.dataSize;
+        const size_t from = std::max(offset, chunkOffset);
+        const size_t to = std::min(end, chunkOffset + chunkSize);
+        if (from < to) {
+            if (from == chunkOffset && to == chunkOffset + chunkSize) {
+                err = chunkPage->readItem(nsIndex, ItemType::BLOB_DATA, key, dst, chunkSize, chunkIdx);
+            } else {
+                err = chunkPage->readItemData(chunkIndex, from - chunkOffset, dst, to - from);
+            }
+            if (err != ESP_OK) {
+                return err;
+            }
+            dst += to - from;
+        }
+        chunkOffset += chunkSize;
+    }
+    return ESP_OK;
+}
+
+esp_err_t Storage::mapItem(uint8_t nsIndex, ItemType datatype, const char* key, const void*& data, size_t& dataSize, Page*& page, spi_flash_mmap_handle_t& handle)
+{
+    if (mState != StorageState::ACTIVE) {
+        return ESP_ERR_NVS_NOT_INITIALIZED;
+    }
+
+    Item item;
+    auto err = findItem(nsIndex, datatype, key, page, item);
+    if (err == ESP_ERR_NVS_NOT_FOUND && datatype == ItemType::BLOB) {
+        Page* findPage;
+        if (findItem(nsIndex, ItemType::BLOB_IDX, key, findPage, item) == ESP_OK) {
+            return ESP_ERR_NVS_NOT_MAPPABLE;
+        }
+    }
+    if (err != ESP_OK) {
+        return err;
+    }
+    return page->mapItem(nsIndex, datatype, key, data, dataSize, handle);
+}
+
+void Storage::unmapItem(Page* page, spi_flash_mmap_handle_t handle)
+{
+    page->unmapItem(handle);
+}
+
+esp_err_t Storage::writeMultiPageBlob(uint8_t nsIndex, const char* key, const void* data, size_t dataSize)
+{
+    BlobWriteState state;
+    auto err = beginBlob(nsIndex, key, dataSize, state);
+    if (err != ESP_OK) {
+        return err;
+    }
+    return writeBlobChunk(nsIndex, state, data, dataSize);
+}
+
+esp_err_t Storage::readMultiPageBlob(uint8_t nsIndex, const char* key, void* data, size_t dataSize)
+{
+    Page* findPage;
+    Item item;
+    size_t itemIndex;
+    auto err = findItem(nsIndex, ItemType::BLOB_IDX, key, findPage, item, itemIndex);
+    if (err != ESP_OK) {
+        return err;
+    }
+    if (dataSize < item.blobIndex.dataSize) {
+        return ESP_ERR_NVS_INVALID_LENGTH;
+    }
+    size_t readSize = item.blobIndex.dataSize;
+    err = readBlobChunk(nsIndex, key, 0, data, readSize);
+    if (err != ESP_OK) {
+        return err;
+    }
+    return (readSize == item.blobIndex.dataSize) ? ESP_OK : ESP_ERR_NVS_NOT_FOUND;
+}
+
+esp_err_t Storage::eraseMultiPageBlob(uint8_t nsIndex, const char* key)
+{
+    Page* findPage;
+    Item item;
+    size_t itemIndex;
+    auto err = findItem(nsIndex, ItemType::BLOB_IDX, key, findPage, item, itemIndex);
+    if (err != ESP_OK) {
+        return err;
+    }
+    // without the index item, chunks are not a part of any value
+    err = findPage->eraseItem(nsIndex, ItemType::BLOB_IDX, key);
+    if (err != ESP_OK) {
+        return err;
+    }
+    err = eraseBlobChunks(nsIndex, key, Item::CHUNK_VER_0);
+    if (err != ESP_OK) {
+        return err;
+    }
+    return eraseBlobChunks(nsIndex, key, Item::CHUNK_VER_1);
+}
+
+esp_err_t Storage::eraseBlobChunks(uint8_t nsIndex, const char* key, uint8_t chunkStart)
+{
+    // chunks may be missing in the middle if an erase was interrupted, so all numbers are checked
+    for (size_t i = 0; i < Item::CHUNK_MAX_COUNT; ++i) {
+        const uint8_t chunkIdx = chunkStart + i;
+        Page* findPage;
+        Item item;
+        size_t itemIndex;
+        auto err = findItem(nsIndex, ItemType::BLOB_DATA, key, findPage, item, itemIndex, chunkIdx);
+        if (err == ESP_ERR_NVS_NOT_FOUND) {
+            continue;
+        }
+        if (err != ESP_OK) {
+            return err;
+        }
+        err = findPage->eraseItem(nsIndex, ItemType::BLOB_DATA, key, chunkIdx);
+        if (err != ESP_OK) {
+            return err;
+        }
+    }
+    return ESP_OK;
+}
+
+esp_err_t Storage::eraseOrphanBlobChunks()
+{
+    for (auto it = mPageManager.begin(); it != mPageManager.end(); ++it) {
+        Page& p = *it;
+        if (!p.hasBlobChunks()) {
+            continue;
+        }
+        size_t itemIndex = 0;
+        Item item;
+        while (p.findItem(Page::NS_ANY, ItemType::ANY, nullptr, itemIndex, item) == ESP_OK) {
+            itemIndex += item.span;
+            if (item.datatype != ItemType::BLOB_DATA) {
+                continue;
+            }
+            Page* findPage;
+            Item index;
+            size_t indexIndex;
+            auto err = findItem(item.nsIndex, ItemType::BLOB_IDX, item.key, findPage, index, indexIndex);
+            if (err == ESP_OK && item.chunkIndex >= index.blobIndex.chunkStart &&
+                    item.chunkIndex < index.blobIndex.chunkStart + index.blobIndex.chunkCount) {
+                continue;
+            }
+            if (err != ESP_OK && err != ESP_ERR_NVS_NOT_FOUND) {
+                return err;
+            }
+            err = p.eraseItem(item.nsIndex, ItemType::BLOB_DATA, item.key, item.chunkIndex);
+            if (err != ESP_OK) {
+                return err;
+            }
+        }
+    }
+    return ESP_OK;
+}
+
 esp_err_t Storage::eraseNamespace(uint8_t nsIndex)
 {
     if (mState != StorageState::ACTIVE) {
         return ESP_ERR_NVS_NOT_INITIALIZED;
     }
 
+    mValueCache.eraseNamespace(nsIndex);
+
     for (auto it = std::begin(mPageManager); it != std::end(mPageManager); ++it) {
         while (true) {
             auto err = it->eraseItem(nsIndex, ItemType::ANY, nullptr);
@@ -240,6 +770,161 @@ esp_err_t Storage::eraseNamespace(uint8_t nsIndex)
 
 }
 
+bool Storage::findEntry(nvs_opaque_iterator_t* it, const char* namespaceName)
+{
+    if (mState != StorageState::ACTIVE) {
+        return false;
+    }
+    it->nsIndex = Page::NS_ANY;
+    it->entryIndex = 0;
+    it->pageSeqNumber = 0;
+    it->rereadCount = 0;
+    setEntryEnd(it);
+    it->pageCount = countEntryPages(it, nullptr);
+    if (namespaceName != nullptr && createOrOpenNamespace(namespaceName, false, it->nsIndex) != ESP_OK) {
+        return false;
+    }
+    if (!nextEntry(it)) {
+        return false;
+    }
+    mIterators.push_back(it);
+    updateIteratedPages();
+    return true;
+}
+
+bool Storage::nextEntry(nvs_opaque_iterator_t* it)
+{
+    if (mState != StorageState::ACTIVE) {
+        return false;
+    }
+
+    // Entries of each page are read once, from where the previous call stopped,
+    // up to the position where the next item was to be written when the
+    // iteration started, so that values set in the meantime don't keep it going.
+    // Pages are ordered by sequence number. Items of erased pages are moved to
+    // the last page, so the end is moved there if a page which was not read
+    // completely has been erased. Such pages are reclaimed only if there is no
+    // other page, when the partition is nearly full.
+    bool pageErased = false;
+    if (countEntryPages(it, &pageErased) < it->pageCount) {
+        if (!pageErased) {
+            setEntryEnd(it);
+        } else if (it->rereadCount < MAX_ENTRY_REREADS) {
+            // values of the current page which were returned already are read
+            // again, so this is limited in case the page is erased after every call
+            ++it->rereadCount;
+            setEntryEnd(it);
+        }
+    }
+    Item item;
+    for (auto page = mPageManager.begin(); page != mPageManager.end(); ++page) {
+        uint32_t seqNumber;
+        if (page->getSeqNumber(seqNumber) != ESP_OK || seqNumber < it->pageSeqNumber) {
+            continue;
+        }
+        if (seqNumber > it->endSeqNumber) {
+            break;
+        }
+        if (seqNumber != it->pageSeqNumber) {
+            it->pageSeqNumber = seqNumber;
+            it->entryIndex = 0;
+        }
+        while (page->findItem(it->nsIndex, ItemType::ANY, nullptr, it->entryIndex, item) == ESP_OK) {
+            if (seqNumber == it->endSeqNumber && it->entryIndex >= it->endEntryIndex) {
+                return false;
+            }
+            it->entryIndex += item.span;
+            if (item.nsIndex == Page::NS_INDEX || item.nsIndex == Page::NS_ANY ||
+                    item.datatype == ItemType::ANY || item.datatype == ItemType::BLOB_DATA) {
+                continue;
+            }
+            const nvs_type_t type = (item.datatype == ItemType::BLOB_IDX) ? NVS_TYPE_BLOB : static_cast<nvs_type_t>(item.datatype);
+            if (it->type != NVS_TYPE_ANY && it->type != type) {
+                continue;
+            }
+            auto ns = std::find_if(mNamespaces.begin(), mNamespaces.end(), [=] (const NamespaceEntry& e) -> bool {
+                return e.mIndex == item.nsIndex;
+            });
+            if (ns == std::end(mNamespaces)) {
+                continue;
+            }
+            it->entryInfo.type = type;
+            strncpy(it->entryInfo.namespace_name, ns->mName, sizeof(it->entryInfo.namespace_name) - 1);
+            it->entryInfo.namespace_name[sizeof(it->entryInfo.namespace_name) - 1] = 0;
+            strncpy(it->entryInfo.key, item.key, sizeof(it->entryInfo.key) - 1);
+            it->entryInfo.key[sizeof(it->entryInfo.key) - 1] = 0;
+            it->pageCount = countEntryPages(it, nullptr);
+            updateIteratedPages();
+            return true;
+        }
+    }
+    return false;
+}
+
+void Storage::releaseEntry(nvs_opaque_iterator_t* it)
+{
+    mIterators.erase(intrusive_list<nvs_opaque_iterator_t>::iterator(it));
+    updateIteratedPages();
+}
+
+void Storage::updateIteratedPages()
+{
+    uint32_t first = UINT32_MAX;
+    uint32_t last = 0;
+    for (auto it = mIterators.begin(); it != mIterators.end(); ++it) {
+        first = std::min(first, it->pageSeqNumber);
+        last = std::max(last, it->endSeqNumber);
+    }
+    mPageManager.setIteratedPages(first, last);
+}
+
+void Storage::setEntryEnd(nvs_opaque_iterator_t* it)
+{
+    Page& page = getCurrentPage();
+    page.getSeqNumber(it->endSeqNumber);
+    it->endEntryIndex = Page::ENTRY_COUNT - page.getFreeEntryCount();
+}
+
+size_t Storage::countEntryPages(const nvs_opaque_iterator_t* it, bool* pageErased)
+{
+    size_t count = 0;
+    bool found = false;
+    for (auto page = mPageManager.begin(); page != mPageManager.end(); ++page) {
+        uint32_t seqNumber;
+        if (page->getSeqNumber(seqNumber) == ESP_OK &&
+                seqNumber >= it->pageSeqNumber && seqNumber <= it->endSeqNumber) {
+            found = found || seqNumber == it->pageSeqNumber;
+            ++count;
+        }
+    }
+    if (pageErased != nullptr) {
+        *pageErased = !found;
+    }
+    return count;
+}
+
+esp_err_t Storage::reclaimStep()
+{
+    if (mState != StorageState::ACTIVE) {
+        return ESP_ERR_NVS_NOT_INITIALIZED;
+    }
+
+    auto err = mPageManager.reclaimStep();
+    if (err != ESP_OK) {
+        return err;
+    }
+    debugCheck();
+    return ESP_OK;
+}
+
+bool Storage::reclaimPending()
+{
+    if (mState != StorageState::ACTIVE) {
+        return false;
+    }
+    return mPageManager.reclaimPending();
+}
+
 esp_err_t Storage::getItemDataSize(uint8_t nsIndex, ItemType datatype, const char* key, size_t& dataSize)
 {
     if (mState != StorageState::ACTIVE) {
@@ -249,6 +934,14 @@ esp_err_t Storage::getItemDataSize(uint8_t nsIndex, ItemType datatype, const cha
     Item item;
     Page* findPage = nullptr;
     auto err = findItem(nsIndex, datatype, key, findPage, item);
+    if (err == ESP_ERR_NVS_NOT_FOUND && datatype == ItemType::BLOB) {
+        err = findItem(nsIndex, ItemType::BLOB_IDX, key, findPage, item);
+        if (err != ESP_OK) {
+            return err;
+        }
+        dataSize = item.blobIndex.dataSize;
+        return ESP_OK;
+    }
     if (err != ESP_OK) {
         return err;
     }
@@ -267,6 +960,9 @@ void Storage::debugDump()
 #ifndef ESP_PLATFORM
 void Storage::debugCheck()
 {
+    if (!mDebugCheck) {
+        return;
+    }
     std::map<std::string, Page*> keys;
     
     for (auto p = mPageManager.begin(); p != mPageManager.end(); ++p) {
@@ -275,7 +971,8 @@ void Storage::debugCheck()
         Item item;
         while (p->findItem(Page::NS_ANY, ItemType::ANY, nullptr, itemIndex, item) == ESP_OK) {
             std::stringstream keyrepr;
-            keyrepr << static_cast<unsigned>(item.nsIndex) << "_" << static_cast<unsigned>(item.datatype) << "_" << item.key;
+            keyrepr << static_cast<unsigned>(item.nsIndex) << "_" << static_cast<unsigned>(item.datatype) << "_" << item.key
+                    << "_" << static_cast<unsigned>(item.chunkIndex);
             std::string keystr = keyrepr.str();
             if (keys.find(keystr) != std::end(keys)) {
                 printf("Duplicate key: %s\n", keystr.c_str());
@@ -283,6 +980,20 @@ void Storage::debugCheck()
                 assert(0);
             }
             keys.insert(std::make_pair(keystr, static_cast<Page*>(p)));
+
+            // every item must be present in the storage index
+            const uint32_t hash = ItemIndex::hashOf(item);
+            size_t cursor = 0;
+            Page* indexPage;
+            size_t indexEntry;
+            bool indexed = false;
+            while (mPageManager.itemIndex().find(hash, cursor, indexPage, indexEntry)) {
+                if (indexPage == static_cast<Page*>(p) && indexEntry == itemIndex) {
+                    indexed = true;
+                    break;
+                }
+            }
+            assert(indexed && "item is missing in the storage index");
             itemIndex += item.span;
             usedCount += item.span;
         }
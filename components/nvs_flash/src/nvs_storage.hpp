@@ -21,9 +21,26 @@
 #include "nvs_types.hpp"
 #include "nvs_page.hpp"
 #include "nvs_pagemanager.hpp"
+#include "nvs_value_cache.hpp"
 
 //extern void dumpBytes(const uint8_t* data, size_t count);
 
+/* State of nvs_entry_find/nvs_entry_next. Positions are kept as sequence
+ * number of the page and entry index, because pages may be erased and reused
+ * between the calls. */
+struct nvs_opaque_iterator_t : public intrusive_list_node<nvs_opaque_iterator_t>
+{
+    nvs_type_t type;
+    uint8_t nsIndex;
+    size_t entryIndex;
+    uint32_t pageSeqNumber;
+    size_t endEntryIndex;       // write position when the iteration started
+    uint32_t endSeqNumber;
+    size_t pageCount;           // pages from the current one to the end
+    size_t rereadCount;         // times the current page was erased
+    nvs_entry_info_t entryInfo;
+};
+
 namespace nvs
 {
 
@@ -42,6 +59,9 @@ class Storage
 
     typedef intrusive_list<NamespaceEntry> TNamespaces;
 
+    /* How many times an entry iterator follows the values of its page to the page they are moved to */
+    static const size_t MAX_ENTRY_REREADS = 8;
+
 public:
     ~Storage();
 
@@ -53,12 +73,33 @@ public:
 
     esp_err_t writeItem(uint8_t nsIndex, ItemType datatype, const char* key, const void* data, size_t dataSize);
 
+    esp_err_t writeBatch(uint8_t nsIndex, TBatch& batch);
+
     esp_err_t readItem(uint8_t nsIndex, ItemType datatype, const char* key, void* data, size_t dataSize);
 
     esp_err_t getItemDataSize(uint8_t nsIndex, ItemType datatype, const char* key, size_t& dataSize);
 
     esp_err_t eraseItem(uint8_t nsIndex, ItemType datatype, const char* key);
 
+    /* Starts a blob value which is written in pieces with writeBlobChunk.
+     * Current value of the key stays until the last piece is written. */
+    esp_err_t beginBlob(uint8_t nsIndex, const char* key, size_t dataSize, BlobWriteState& state);
+
+    /* Appends data to the blob, the value of the key is replaced once state.dataSize bytes
+     * are written. On error, chunks written so far are erased and the write can't be continued. */
+    esp_err_t writeBlobChunk(uint8_t nsIndex, BlobWriteState& state, const void* data, size_t dataSize);
+
+    /* Erases chunks of a blob which will not be finished */
+    void abortBlob(uint8_t nsIndex, BlobWriteState& state);
+
+    /* Reads up to dataSize bytes of a blob starting at offset, dataSize is set to the number of bytes read */
+    esp_err_t readBlobChunk(uint8_t nsIndex, const char* key, size_t offset, void* data, size_t& dataSize);
+
+    /* Maps a string or blob stored on one page, page and handle are passed to unmapItem */
+    esp_err_t mapItem(uint8_t nsIndex, ItemType datatype, const char* key, const void*& data, size_t& dataSize, Page*& page, spi_flash_mmap_handle_t& handle);
+
+    void unmapItem(Page* page, spi_flash_mmap_handle_t handle);
+
     template<typename T>
     esp_err_t writeItem(uint8_t nsIndex, const char* key, const T& value)
     {
@@ -78,10 +119,44 @@ public:
     
     esp_err_t eraseNamespace(uint8_t nsIndex);
 
+    /* Positions the iterator at the first value of the namespace (all namespaces if
+     * the name is nullptr), returns false if there is none */
+    bool findEntry(nvs_opaque_iterator_t* it, const char* namespaceName);
+
+    /* Moves the iterator to the next value, returns false at the end */
+    bool nextEntry(nvs_opaque_iterator_t* it);
+
+    /* Forgets the iterator, to be called before it is freed */
+    void releaseEntry(nvs_opaque_iterator_t* it);
+
+    /* Frees a page ahead of the writes which would need it, one item at a time */
+    esp_err_t reclaimStep();
+
+    bool reclaimPending();
+
+    /* Number of integer values kept in RAM by readItem, zero disables the cache */
+    void setValueCacheSize(size_t size)
+    {
+        mValueCache.setCapacity(size);
+    }
+
+    const ValueCache& valueCache() const
+    {
+        return mValueCache;
+    }
+
     void debugDump();
     
     void debugCheck();
 
+#ifndef ESP_PLATFORM
+    /* debugCheck reads the whole storage after every write, benchmarks turn it off */
+    void setDebugCheck(bool enable)
+    {
+        mDebugCheck = enable;
+    }
+#endif
+
 
 protected:
 
@@ -94,12 +169,38 @@ protected:
 
     esp_err_t findItem(uint8_t nsIndex, ItemType datatype, const char* key, Page* &page, Item& item);
 
+    esp_err_t findItem(uint8_t nsIndex, ItemType datatype, const char* key, Page* &page, Item& item, size_t& itemIndex, uint8_t chunkIdx = Item::CHUNK_ANY);
+
+    esp_err_t eraseOldCopies(uint8_t nsIndex, ItemType datatype, const char* key, Page* newPage, size_t newIndex);
+
+    esp_err_t writeMultiPageBlob(uint8_t nsIndex, const char* key, const void* data, size_t dataSize);
+
+    esp_err_t readMultiPageBlob(uint8_t nsIndex, const char* key, void* data, size_t dataSize);
+
+    esp_err_t eraseMultiPageBlob(uint8_t nsIndex, const char* key);
+
+    esp_err_t eraseBlobChunks(uint8_t nsIndex, const char* key, uint8_t chunkStart);
+
+    esp_err_t eraseOrphanBlobChunks();
+
+    void setEntryEnd(nvs_opaque_iterator_t* it);
+
+    /* Pages from the current one of the iterator to its end, pageErased is set if the current one is missing */
+    size_t countEntryPages(const nvs_opaque_iterator_t* it, bool* pageErased);
+
+    void updateIteratedPages();
+
 protected:
     size_t mPageCount;
     PageManager mPageManager;
+    ValueCache mValueCache;
     TNamespaces mNamespaces;
+    intrusive_list<nvs_opaque_iterator_t> mIterators;
     CompressedEnumTable<bool, 1, 256> mNamespaceUsage;
     StorageState mState = StorageState::INVALID;
+#ifndef ESP_PLATFORM
+    bool mDebugCheck = true;
+#endif
 };
 
 } // namespace nvs
@@ -39,6 +39,8 @@ uint32_t Item::calculateCrc32WithoutValue() const
     result = crc32_le(result, p + offsetof(Item, nsIndex),
                       offsetof(Item, datatype) - offsetof(Item, nsIndex));
     result = crc32_le(result, p + offsetof(Item, key), sizeof(key));
+    // chunks of one blob have the same key, but should not look like duplicates
+    result = crc32_le(result, p + offsetof(Item, chunkIndex), sizeof(chunkIndex));
     return result;
 }
 
@@ -49,4 +51,20 @@ uint32_t Item::calculateCrc32(const uint8_t* data, size_t size)
     return result;
 }
 
+BatchItem::BatchItem(ItemType datatype, const char* key_, const void* data_, size_t dataSize)
+    : datatype(datatype), dataSize(dataSize), index(0)
+{
+    strncpy(key, key_, sizeof(key) - 1);
+    key[sizeof(key) - 1] = 0;
+    if (dataSize > 0) {
+        data = new uint8_t[dataSize];
+        memcpy(data, data_, dataSize);
+    }
+}
+
+BatchItem::~BatchItem()
+{
+    delete[] data;
+}
+
 } // namespace nvs
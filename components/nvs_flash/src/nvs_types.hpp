@@ -21,6 +21,7 @@
 #include <algorithm>
 #include "nvs.h"
 #include "compressed_enum_table.hpp"
+#include "intrusive_list.h"
 
 
 namespace nvs
@@ -37,9 +38,23 @@ enum class ItemType : uint8_t {
     I64  = 0x18,
     SZ   = 0x21,
     BLOB = 0x41,
+    BLOB_DATA = 0x42,   // one chunk of a blob which spans several pages
+    BLOB_IDX  = 0x48,   // size and chunks of a blob which spans several pages
     ANY  = 0xff
 };
 
+/* Types with data stored in the entries following the item */
+inline bool isVariableLengthType(ItemType datatype)
+{
+    return datatype == ItemType::SZ || datatype == ItemType::BLOB || datatype == ItemType::BLOB_DATA;
+}
+
+/* Types of the items which make up a blob spanning several pages */
+inline bool isBlobPartType(ItemType datatype)
+{
+    return datatype == ItemType::BLOB_DATA || datatype == ItemType::BLOB_IDX;
+}
+
 template<typename T, typename std::enable_if<std::is_integral<T>::value, void*>::type = nullptr>
 constexpr ItemType itemTypeOf()
 {
@@ -60,7 +75,7 @@ public:
             uint8_t  nsIndex;
             ItemType datatype;
             uint8_t  span;
-            uint8_t  reserved;
+            uint8_t  chunkIndex;    // CHUNK_ANY unless datatype is BLOB_DATA
             uint32_t crc32;
             char     key[16];
             union {
@@ -69,6 +84,12 @@ public:
                     uint16_t reserved2;
                     uint32_t dataCrc32;
                 } varLength;
+                struct {
+                    uint32_t dataSize;
+                    uint8_t chunkCount;
+                    uint8_t chunkStart;     // CHUNK_VER_0 or CHUNK_VER_1
+                    uint16_t reserved;
+                } blobIndex;
                 uint8_t data[8];
             };
         };
@@ -77,8 +98,16 @@ public:
 
     static const size_t MAX_KEY_LENGTH = sizeof(key) - 1;
 
-    Item(uint8_t nsIndex, ItemType datatype, uint8_t span, const char* key_)
-        : nsIndex(nsIndex), datatype(datatype), span(span), reserved(0xff)
+    // Chunks of a blob are numbered from CHUNK_VER_0 or CHUNK_VER_1, alternately
+    // for every new value, so that the chunks of the old value are kept until
+    // the new index item is written
+    static const uint8_t CHUNK_ANY = 0xff;
+    static const uint8_t CHUNK_VER_0 = 0x00;
+    static const uint8_t CHUNK_VER_1 = 0x80;
+    static const size_t CHUNK_MAX_COUNT = 0x7f;
+
+    Item(uint8_t nsIndex, ItemType datatype, uint8_t span, const char* key_, uint8_t chunkIdx = CHUNK_ANY)
+        : nsIndex(nsIndex), datatype(datatype), span(span), chunkIndex(chunkIdx)
     {
         std::fill_n(reinterpret_cast<uint32_t*>(key),  sizeof(key)  / 4, 0xffffffff);
         std::fill_n(reinterpret_cast<uint32_t*>(data), sizeof(data) / 4, 0xffffffff);
@@ -111,6 +140,40 @@ public:
     }
 };
 
+/**
+ * Set or erase operation staged in a write batch, see Storage::writeBatch.
+ * Erase is staged with datatype == ItemType::ANY.
+ */
+class BatchItem : public intrusive_list_node<BatchItem>
+{
+public:
+    BatchItem(ItemType datatype, const char* key, const void* data, size_t dataSize);
+    ~BatchItem();
+
+    ItemType datatype;
+    char key[Item::MAX_KEY_LENGTH + 1];
+    uint8_t* data = nullptr;
+    size_t dataSize;
+    size_t index;   // entry where the item was written, set by Page::writeItems
+
+private:
+    BatchItem(const BatchItem& other);
+    const BatchItem& operator= (const BatchItem& rhs);
+};
+
+typedef intrusive_list<BatchItem> TBatch;
+
+/**
+ * Blob which is being written in chunks, see Storage::beginBlob.
+ */
+struct BlobWriteState {
+    char key[Item::MAX_KEY_LENGTH + 1];
+    size_t dataSize;        // total size of the value
+    size_t offset;          // number of bytes written so far
+    uint8_t chunkStart;
+    uint8_t chunkCount;
+};
+
 } // namespace nvs
 
 
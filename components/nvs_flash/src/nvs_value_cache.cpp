@@ -0,0 +1,122 @@
+// Copyright 2015-2016 Espressif Systems (Shanghai) PTE LTD
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "nvs_value_cache.hpp"
+#include <new>
+
+namespace nvs
+{
+
+ValueCache::ValueCache()
+{
+}
+
+ValueCache::~ValueCache()
+{
+    delete[] mEntries;
+}
+
+void ValueCache::setCapacity(size_t capacity)
+{
+    delete[] mEntries;
+    mEntries = nullptr;
+    mCapacity = 0;
+    if (capacity > 0) {
+        // cache is optional, without memory reads go to flash
+        mEntries = new (std::nothrow) CacheEntry[capacity];
+        if (mEntries) {
+            mCapacity = capacity;
+        }
+    }
+    clear();
+}
+
+bool ValueCache::isCacheable(ItemType datatype, size_t dataSize)
+{
+    return datatype != ItemType::SZ && datatype != ItemType::BLOB && datatype != ItemType::ANY &&
+           dataSize <= sizeof(CacheEntry::mData);
+}
+
+bool ValueCache::find(uint8_t nsIndex, ItemType datatype, const char* key, void* data, size_t dataSize)
+{
+    for (size_t i = 0; i < mCapacity; ++i) {
+        CacheEntry& entry = mEntries[i];
+        if (entry.mDatatype == datatype && entry.mNsIndex == nsIndex &&
+                strncmp(key, entry.mKey, Item::MAX_KEY_LENGTH) == 0) {
+            memcpy(data, entry.mData, dataSize);
+            entry.mLastUse = ++mUseCounter;
+            ++mHits;
+            return true;
+        }
+    }
+    ++mMisses;
+    return false;
+}
+
+void ValueCache::insert(uint8_t nsIndex, ItemType datatype, const char* key, const void* data, size_t dataSize)
+{
+    if (mCapacity == 0) {
+        return;
+    }
+    CacheEntry* victim = &mEntries[0];
+    for (size_t i = 0; i < mCapacity; ++i) {
+        CacheEntry& entry = mEntries[i];
+        if (entry.mDatatype == ItemType::ANY) {
+            victim = &entry;
+            break;
+        }
+        if (entry.mLastUse < victim->mLastUse) {
+            victim = &entry;
+        }
+    }
+    victim->mNsIndex = nsIndex;
+    victim->mDatatype = datatype;
+    strncpy(victim->mKey, key, Item::MAX_KEY_LENGTH);
+    victim->mKey[Item::MAX_KEY_LENGTH] = 0;
+    memcpy(victim->mData, data, dataSize);
+    victim->mLastUse = ++mUseCounter;
+}
+
+void ValueCache::erase(uint8_t nsIndex, const char* key)
+{
+    for (size_t i = 0; i < mCapacity; ++i) {
+        CacheEntry& entry = mEntries[i];
+        if (entry.mDatatype != ItemType::ANY && entry.mNsIndex == nsIndex &&
+                strncmp(key, entry.mKey, Item::MAX_KEY_LENGTH) == 0) {
+            entry.mDatatype = ItemType::ANY;
+        }
+    }
+}
+
+void ValueCache::eraseNamespace(uint8_t nsIndex)
+{
+    for (size_t i = 0; i < mCapacity; ++i) {
+        if (mEntries[i].mNsIndex == nsIndex) {
+            mEntries[i].mDatatype = ItemType::ANY;
+        }
+    }
+}
+
+void ValueCache::clear()
+{
+    for (size_t i = 0; i < mCapacity; ++i) {
+        mEntries[i].mDatatype = ItemType::ANY;
+        mEntries[i].mLastUse = 0;
+    }
+    mUseCounter = 0;
+    mHits = 0;
+    mMisses = 0;
+}
+
+} // namespace nvs
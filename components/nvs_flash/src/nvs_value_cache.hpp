@@ -0,0 +1,92 @@
+// Copyright 2015-2016 Espressif Systems (Shanghai) PTE LTD
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef nvs_value_cache_h
+#define nvs_value_cache_h
+
+#include "nvs.h"
+#include "nvs_types.hpp"
+
+namespace nvs
+{
+
+/**
+ * Values of integer items recently read by Storage, keyed by (namespace, key, type).
+ *
+ * Cache has a fixed number of entries, least recently used one is replaced.
+ * Storage removes the key from the cache before every change of the key,
+ * so a cached value is always the one stored in flash.
+ */
+class ValueCache
+{
+public:
+    ValueCache();
+    ~ValueCache();
+
+    /* Drops all values; capacity of zero disables the cache */
+    void setCapacity(size_t capacity);
+
+    size_t capacity() const
+    {
+        return mCapacity;
+    }
+
+    static bool isCacheable(ItemType datatype, size_t dataSize);
+
+    /* Copies the cached value to data, counts a hit or a miss */
+    bool find(uint8_t nsIndex, ItemType datatype, const char* key, void* data, size_t dataSize);
+
+    void insert(uint8_t nsIndex, ItemType datatype, const char* key, const void* data, size_t dataSize);
+
+    /* Removes the key with any type */
+    void erase(uint8_t nsIndex, const char* key);
+
+    void eraseNamespace(uint8_t nsIndex);
+
+    void clear();
+
+    uint32_t hits() const
+    {
+        return mHits;
+    }
+
+    uint32_t misses() const
+    {
+        return mMisses;
+    }
+
+private:
+    ValueCache(const ValueCache& other);
+    const ValueCache& operator= (const ValueCache& rhs);
+
+protected:
+    struct CacheEntry {
+        uint32_t mLastUse;
+        uint8_t mNsIndex;
+        ItemType mDatatype;     // ItemType::ANY if the entry is not used
+        char mKey[Item::MAX_KEY_LENGTH + 1];
+        uint8_t mData[8];
+    };
+
+    CacheEntry* mEntries = nullptr;
+    size_t mCapacity = 0;
+    uint32_t mUseCounter = 0;
+    uint32_t mHits = 0;
+    uint32_t mMisses = 0;
+}; // class ValueCache
+
+} // namespace nvs
+
+
+#endif /* nvs_value_cache_h */
@@ -61,6 +61,29 @@ esp_err_t spi_flash_read(size_t src_addr, void *des_addr, size_t size)
     return ESP_OK;
 }
 
+esp_err_t spi_flash_mmap(size_t src_addr, size_t size, spi_flash_mmap_memory_t memory,
+                         const void** out_ptr, spi_flash_mmap_handle_t* out_handle)
+{
+    if (!s_emulator) {
+        return ESP_ERR_NO_MEM;
+    }
+
+    const uint8_t* ptr = s_emulator->map(src_addr);
+    if (ptr == nullptr) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    *out_ptr = ptr;
+    *out_handle = static_cast<spi_flash_mmap_handle_t>(src_addr / SPI_FLASH_MMU_PAGE_SIZE);
+    return ESP_OK;
+}
+
+void spi_flash_munmap(spi_flash_mmap_handle_t handle)
+{
+    if (s_emulator) {
+        s_emulator->unmap();
+    }
+}
+
 // timing data for ESP8266, 160MHz CPU frequency, 80MHz flash requency
 // all values in microseconds
 // values are for block sizes starting at 4 bytes and going up to 4096 bytes
@@ -71,6 +94,10 @@ static size_t blockEraseTime = 37142;
 
 static size_t timeInterp(uint32_t bytes, size_t* lut)
 {
+    const int lutMax = sizeof(readTimes) / sizeof(readTimes[0]) - 1;
+    if (bytes >= (4u << lutMax)) {
+        return lut[lutMax] * bytes / (4u << lutMax);
+    }
     int lz = __builtin_clz(bytes / 4);
     int log_size = 32 - lz;
     size_t x2 = 1 << (log_size + 2);
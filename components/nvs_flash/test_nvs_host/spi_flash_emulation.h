@@ -36,6 +36,7 @@ public:
     SpiFlashEmulator(size_t sectorCount) : mUpperSectorBound(sectorCount)
     {
         mData.resize(sectorCount * SPI_FLASH_SEC_SIZE / 4, 0xffffffff);
+        mSectorEraseOps.resize(sectorCount, 0);
         spi_flash_emulator_set(this);
     }
 
@@ -115,6 +116,7 @@ public:
         std::fill_n(begin(mData) + offset, SPI_FLASH_SEC_SIZE / 4, 0xffffffff);
 
         ++mEraseOps;
+        ++mSectorEraseOps[sectorNumber];
         mTotalTime += getEraseOpTime();
         return true;
     }
@@ -149,6 +151,7 @@ public:
         off_t size = ftell(f);
         assert(size % SPI_FLASH_SEC_SIZE == 0);
         mData.resize(size);
+        mSectorEraseOps.resize(size / SPI_FLASH_SEC_SIZE, 0);
         fseek(f, 0, SEEK_SET);
         auto s = fread(mData.data(), SPI_FLASH_SEC_SIZE, size / SPI_FLASH_SEC_SIZE, f);
         assert(s == static_cast<size_t>(size / SPI_FLASH_SEC_SIZE));
@@ -162,6 +165,7 @@ public:
         mReadOps = 0;
         mWriteOps = 0;
         mTotalTime = 0;
+        std::fill(begin(mSectorEraseOps), end(mSectorEraseOps), 0);
     }
 
     size_t getReadOps() const
@@ -176,6 +180,10 @@ public:
     {
         return mEraseOps;
     }
+    size_t getSectorEraseOps(size_t sectorNumber) const
+    {
+        return mSectorEraseOps[sectorNumber];
+    }
     size_t getReadBytes() const
     {
         return mReadBytes;
@@ -198,6 +206,26 @@ public:
         mFailCountdown = count;
     }
 
+    const uint8_t* map(size_t srcAddr)
+    {
+        if (srcAddr % SPI_FLASH_MMU_PAGE_SIZE != 0 || srcAddr >= size()) {
+            return nullptr;
+        }
+        ++mMapCount;
+        return bytes() + srcAddr;
+    }
+
+    void unmap()
+    {
+        assert(mMapCount > 0);
+        --mMapCount;
+    }
+
+    size_t getMapCount() const
+    {
+        return mMapCount;
+    }
+
 protected:
     static size_t getReadOpTime(uint32_t bytes);
     static size_t getWriteOpTime(uint32_t bytes);
@@ -205,6 +233,7 @@ protected:
 
 
     std::vector<uint32_t> mData;
+    std::vector<size_t> mSectorEraseOps;
 
     mutable size_t mReadOps = 0;
     mutable size_t mWriteOps = 0;
@@ -216,6 +245,7 @@ protected:
     size_t mUpperSectorBound = 0;
     
     size_t mFailCountdown = SIZE_MAX;
+    size_t mMapCount = 0;
 
 };
 
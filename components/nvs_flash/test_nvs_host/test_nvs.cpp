@@ -17,6 +17,8 @@
 #include "spi_flash_emulation.h"
 #include <sstream>
 #include <iostream>
+#include <set>
+#include <string>
 
 #define TEST_ESP_ERR(rc, res) CHECK((rc) == (res))
 #define TEST_ESP_OK(rc) CHECK((rc) == ESP_OK)
@@ -45,7 +47,7 @@ TEST_CASE("crc32 behaves as expected", "[nvs]")
     item1.datatype = ItemType::I32;
     item1.nsIndex = 1;
     item1.crc32 = 0;
-    item1.reserved = 0xff;
+    item1.chunkIndex = 0xff;
     fill_n(item1.key, sizeof(item1.key), 0xbb);
     fill_n(item1.data, sizeof(item1.data), 0xaa);
 
@@ -231,6 +233,69 @@ TEST_CASE("different key names are distinguished even if the pointer is the same
     }
 }
 
+TEST_CASE("hash list finds items after other items are erased", "[nvs]")
+{
+    HashList hashList;
+    char key[16];
+    for (size_t i = 0; i < Page::ENTRY_COUNT; ++i) {
+        snprintf(key, sizeof(key), "key%d", static_cast<int>(i));
+        hashList.insert(Item(1, ItemType::U8, 1, key), i);
+    }
+    for (size_t i = 0; i < Page::ENTRY_COUNT; i += 2) {
+        snprintf(key, sizeof(key), "key%d", static_cast<int>(i));
+        CHECK(hashList.erase(i) == (Item(1, ItemType::U8, 1, key).calculateCrc32WithoutValue() & 0xffffff));
+    }
+    for (size_t i = 0; i < Page::ENTRY_COUNT; ++i) {
+        snprintf(key, sizeof(key), "key%d", static_cast<int>(i));
+        CHECK(hashList.find(0, Item(1, ItemType::U8, 1, key)) == ((i % 2) ? i : SIZE_MAX));
+    }
+    // lowest index not less than start is returned for duplicates
+    hashList.insert(Item(1, ItemType::U8, 1, "key1"), 0);
+    CHECK(hashList.find(0, Item(1, ItemType::U8, 1, "key1")) == 0);
+    CHECK(hashList.find(1, Item(1, ItemType::U8, 1, "key1")) == 1);
+    CHECK(hashList.find(2, Item(1, ItemType::U8, 1, "key1")) == SIZE_MAX);
+    hashList.clear();
+    CHECK(hashList.find(0, Item(1, ItemType::U8, 1, "key1")) == SIZE_MAX);
+}
+
+class HashListProbeCounter : public HashList
+{
+public:
+    size_t probes(const Item& item)
+    {
+        const size_t mask = CAPACITY - 1;
+        size_t count = 1;
+        for (size_t pos = item.calculateCrc32WithoutValue() & mask; mNodes[pos].mIndex != 0xff; pos = (pos + 1) & mask) {
+            ++count;
+        }
+        return count;
+    }
+};
+
+TEST_CASE("hash list of a full page finds missing keys with few probes", "[nvs]")
+{
+    HashListProbeCounter hashList;
+    char key[16];
+    for (size_t i = 0; i < Page::ENTRY_COUNT; ++i) {
+        snprintf(key, sizeof(key), "key%d", static_cast<int>(i));
+        hashList.insert(Item(1 + i % 3, ItemType::U32, 1, key), i);
+    }
+    const size_t lookups = 1000;
+    size_t total = 0;
+    size_t longest = 0;
+    for (size_t i = 0; i < lookups; ++i) {
+        snprintf(key, sizeof(key), "missing%d", static_cast<int>(i));
+        Item item(1, ItemType::U32, 1, key);
+        CHECK(hashList.find(0, item) == SIZE_MAX);
+        size_t probes = hashList.probes(item);
+        total += probes;
+        longest = std::max(longest, probes);
+    }
+    std::cout << "hash list probes for missing keys: avg " << (double) total / lookups << ", max " << longest << std::endl;
+    CHECK(total <= 3 * lookups);
+    CHECK(longest <= 16);
+}
+
 TEST_CASE("can init PageManager in empty flash", "[nvs]")
 {
     SpiFlashEmulator emu(4);
@@ -342,6 +407,326 @@ TEST_CASE("storage can find items on second page if first is not fully written a
 }
 
 
+TEST_CASE("storage index finds items after pages are reclaimed", "[nvs]")
+{
+    SpiFlashEmulator emu(5);
+    Storage storage;
+    CHECK(storage.init(0, 5) == ESP_OK);
+    const size_t keysCount = 200;
+    char key[16];
+    for (size_t round = 0; round < 4; ++round) {
+        for (size_t i = 0; i < keysCount; ++i) {
+            snprintf(key, sizeof(key), "key%d", static_cast<int>(i));
+            REQUIRE(storage.writeItem(1, key, static_cast<uint32_t>(i + round * keysCount)) == ESP_OK);
+        }
+    }
+    for (size_t i = 0; i < keysCount; ++i) {
+        snprintf(key, sizeof(key), "key%d", static_cast<int>(i));
+        uint32_t value;
+        REQUIRE(storage.readItem(1, key, value) == ESP_OK);
+        CHECK(value == i + 3 * keysCount);
+    }
+
+    // missing key is resolved by the index alone, without reading the pages
+    emu.clearStats();
+    uint32_t value;
+    CHECK(storage.readItem(1, "missing", value) == ESP_ERR_NVS_NOT_FOUND);
+    CHECK(storage.readItem(2, "key1", value) == ESP_ERR_NVS_NOT_FOUND);
+    CHECK(emu.getReadOps() == 0);
+
+    // existing key costs one page lookup
+    CHECK(storage.readItem(1, "key7", value) == ESP_OK);
+    CHECK(value == 7 + 3 * keysCount);
+    s_perf << "Reads to find one item among " << keysCount << " keys: " << emu.getReadOps() << std::endl;
+
+    Storage storage2;
+    CHECK(storage2.init(0, 5) == ESP_OK);
+    CHECK(storage2.readItem(1, "key7", value) == ESP_OK);
+    CHECK(value == 7 + 3 * keysCount);
+}
+
+TEST_CASE("pages are reclaimed ahead of the writes which need them", "[nvs][reclaim]")
+{
+    SpiFlashEmulator emu(5);
+    Storage storage;
+    CHECK(storage.init(0, 5) == ESP_OK);
+    const size_t keysCount = 200;
+    const size_t roundsCount = 10;
+    char key[16];
+    size_t writeErases = 0;
+    size_t reclaimErases = 0;
+    size_t reclaimSteps = 0;
+    emu.clearStats();
+    for (size_t round = 0; round < roundsCount; ++round) {
+        for (size_t i = 0; i < keysCount; ++i) {
+            snprintf(key, sizeof(key), "key%d", static_cast<int>(i));
+            size_t erases = emu.getEraseOps();
+            REQUIRE(storage.writeItem(1, key, static_cast<uint32_t>(i + round * keysCount)) == ESP_OK);
+            writeErases += emu.getEraseOps() - erases;
+
+            erases = emu.getEraseOps();
+            while (storage.reclaimPending()) {
+                REQUIRE(storage.reclaimStep() == ESP_OK);
+                ++reclaimSteps;
+            }
+            reclaimErases += emu.getEraseOps() - erases;
+        }
+    }
+    CHECK(writeErases == 0);
+    CHECK(reclaimErases > 0);
+    s_perf << "Pages reclaimed in " << reclaimSteps << " steps, erases: " << reclaimErases << std::endl;
+
+    Storage storage2;
+    CHECK(storage2.init(0, 5) == ESP_OK);
+    for (size_t i = 0; i < keysCount; ++i) {
+        snprintf(key, sizeof(key), "key%d", static_cast<int>(i));
+        uint32_t value;
+        REQUIRE(storage2.readItem(1, key, value) == ESP_OK);
+        CHECK(value == i + (roundsCount - 1) * keysCount);
+    }
+}
+
+class ReclaimTestStorage : public Storage
+{
+public:
+    size_t currentFreeEntries()
+    {
+        return getCurrentPage().getFreeEntryCount();
+    }
+};
+
+TEST_CASE("spare page is prepared when the current page is nearly full", "[nvs][reclaim]")
+{
+    SpiFlashEmulator emu(4);
+    ReclaimTestStorage storage;
+    CHECK(storage.init(0, 4) == ESP_OK);
+    // every fifth write adds a key which is never changed, so no page is
+    // empty enough to be reclaimed into the few entries left in the current one
+    char key[16];
+    auto writeNext = [&](size_t i) -> esp_err_t {
+        if (i % 5 == 0) {
+            snprintf(key, sizeof(key), "static%d", static_cast<int>(i / 5));
+        } else {
+            snprintf(key, sizeof(key), "hot%d", static_cast<int>(i % 10));
+        }
+        return storage.writeItem(1, key, static_cast<uint32_t>(i));
+    };
+    size_t i = 0;
+    // fill the third page almost completely, the fourth is the only free page left
+    for (; i < 3 * Page::ENTRY_COUNT - 6 || storage.currentFreeEntries() > 2; ++i) {
+        REQUIRE(writeNext(i) == ESP_OK);
+    }
+    emu.clearStats();
+    size_t reclaimSteps = 0;
+    while (storage.reclaimPending()) {
+        REQUIRE(storage.reclaimStep() == ESP_OK);
+        ++reclaimSteps;
+    }
+    CHECK(reclaimSteps > 0);
+    CHECK(emu.getEraseOps() > 0);
+
+    // the writes which fill the current page get a new page without erasing
+    emu.clearStats();
+    for (size_t end = i + Page::ENTRY_COUNT; i < end; ++i) {
+        REQUIRE(writeNext(i) == ESP_OK);
+    }
+    CHECK(emu.getEraseOps() == 0);
+
+    Storage storage2;
+    CHECK(storage2.init(0, 4) == ESP_OK);
+    for (size_t j = 0; j < i; ++j) {
+        if (j % 5 == 0) {
+            snprintf(key, sizeof(key), "static%d", static_cast<int>(j / 5));
+        } else if (j + 10 >= i) {
+            snprintf(key, sizeof(key), "hot%d", static_cast<int>(j % 10));
+        } else {
+            continue;
+        }
+        uint32_t value;
+        REQUIRE(storage2.readItem(1, key, value) == ESP_OK);
+        CHECK(value == j);
+    }
+}
+
+TEST_CASE("page reclaim interleaved with writes survives power off", "[nvs][reclaim]")
+{
+    const size_t keysCount = 20;
+    const size_t writesCount = 200;
+    char key[16];
+    size_t failures = 0;
+    for (uint32_t failAfter = 0; ; failAfter += 17) {
+        INFO(failAfter);
+        SpiFlashEmulator emu(4);
+        std::vector<uint32_t> values(keysCount);
+        Storage storage;
+        REQUIRE(storage.init(0, 4) == ESP_OK);
+        uint32_t value = 0;
+        size_t i = 0;
+        // fill the storage until the spare page is used up; keys which never
+        // change are mixed in, so that every page has some items to move
+        size_t staticKeysCount = 0;
+        while (!storage.reclaimPending()) {
+            snprintf(key, sizeof(key), "key%d", static_cast<int>(i));
+            REQUIRE(storage.writeItem(1, key, ++value) == ESP_OK);
+            values[i] = value;
+            i = (i + 1) % keysCount;
+            if (value % 4 == 0) {
+                snprintf(key, sizeof(key), "static%d", static_cast<int>(staticKeysCount));
+                REQUIRE(storage.writeItem(1, key, static_cast<uint32_t>(staticKeysCount)) == ESP_OK);
+                ++staticKeysCount;
+            }
+        }
+
+        // one reclaim step per eight writes, so writes fill the page which
+        // the items are moved to before the reclaimed page is freed
+        emu.failAfter(failAfter);
+        esp_err_t err = ESP_OK;
+        size_t failedKey = keysCount;
+        for (size_t n = 0; n < writesCount && err == ESP_OK; ++n) {
+            if (n % 8 == 0) {
+                err = storage.reclaimStep();
+                if (err != ESP_OK) {
+                    break;
+                }
+            }
+            snprintf(key, sizeof(key), "key%d", static_cast<int>(i));
+            err = storage.writeItem(1, key, ++value);
+            if (err == ESP_OK) {
+                values[i] = value;
+            } else {
+                failedKey = i;
+            }
+            i = (i + 1) % keysCount;
+        }
+        emu.failAfter(UINT32_MAX);
+
+        Storage storage2;
+        REQUIRE(storage2.init(0, 4) == ESP_OK);
+        for (size_t k = 0; k < keysCount; ++k) {
+            snprintf(key, sizeof(key), "key%d", static_cast<int>(k));
+            uint32_t readValue;
+            REQUIRE(storage2.readItem(1, key, readValue) == ESP_OK);
+            if (k == failedKey) {
+                CHECK((readValue == values[k] || readValue == value));
+            } else {
+                CHECK(readValue == values[k]);
+            }
+        }
+        for (size_t k = 0; k < staticKeysCount; ++k) {
+            snprintf(key, sizeof(key), "static%d", static_cast<int>(k));
+            uint32_t readValue;
+            REQUIRE(storage2.readItem(1, key, readValue) == ESP_OK);
+            CHECK(readValue == k);
+        }
+        // storage keeps working after recovery
+        REQUIRE(storage2.writeItem(1, "key0", ++value) == ESP_OK);
+        if (err == ESP_OK) {
+            break;
+        }
+        ++failures;
+    }
+    CHECK(failures > 0);
+}
+
+TEST_CASE("value cache serves repeated reads and is invalidated by changes", "[nvs][cache]")
+{
+    SpiFlashEmulator emu(4);
+    Storage storage;
+    storage.setValueCacheSize(4);
+    CHECK(storage.init(0, 4) == ESP_OK);
+    uint32_t value;
+    REQUIRE(storage.writeItem(1, "key", static_cast<uint32_t>(1)) == ESP_OK);
+    CHECK(storage.readItem(1, "key", value) == ESP_OK);
+    CHECK(value == 1);
+    emu.clearStats();
+    CHECK(storage.readItem(1, "key", value) == ESP_OK);
+    CHECK(value == 1);
+    CHECK(emu.getReadOps() == 0);
+    CHECK(storage.valueCache().hits() == 1);
+    CHECK(storage.valueCache().misses() == 1);
+
+    // other type or namespace is not served from the cache
+    uint16_t value16;
+    CHECK(storage.readItem(1, "key", value16) == ESP_ERR_NVS_NOT_FOUND);
+    CHECK(storage.readItem(2, "key", value) == ESP_ERR_NVS_NOT_FOUND);
+
+    REQUIRE(storage.writeItem(1, "key", static_cast<uint32_t>(2)) == ESP_OK);
+    CHECK(storage.readItem(1, "key", value) == ESP_OK);
+    CHECK(value == 2);
+    REQUIRE(storage.eraseItem(1, "key") == ESP_OK);
+    CHECK(storage.readItem(1, "key", value) == ESP_ERR_NVS_NOT_FOUND);
+
+    TBatch batch;
+    const uint32_t batchValue = 3;
+    REQUIRE(storage.writeItem(1, "key", static_cast<uint32_t>(2)) == ESP_OK);
+    REQUIRE(storage.writeItem(1, "key2", static_cast<uint32_t>(2)) == ESP_OK);
+    CHECK(storage.readItem(1, "key", value) == ESP_OK);
+    CHECK(storage.readItem(1, "key2", value) == ESP_OK);
+    batch.push_back(new BatchItem(ItemType::U32, "key", &batchValue, sizeof(batchValue)));
+    batch.push_back(new BatchItem(ItemType::ANY, "key2", nullptr, 0));
+    REQUIRE(storage.writeBatch(1, batch) == ESP_OK);
+    while (!batch.empty()) {
+        BatchItem* item = &batch.front();
+        batch.erase(batch.begin());
+        delete item;
+    }
+    CHECK(storage.readItem(1, "key", value) == ESP_OK);
+    CHECK(value == 3);
+    CHECK(storage.readItem(1, "key2", value) == ESP_ERR_NVS_NOT_FOUND);
+
+    REQUIRE(storage.eraseNamespace(1) == ESP_OK);
+    CHECK(storage.readItem(1, "key", value) == ESP_ERR_NVS_NOT_FOUND);
+
+    // least recently used value is replaced
+    char key[16];
+    for (size_t i = 0; i < 5; ++i) {
+        snprintf(key, sizeof(key), "key%d", static_cast<int>(i));
+        REQUIRE(storage.writeItem(1, key, static_cast<uint32_t>(i)) == ESP_OK);
+        CHECK(storage.readItem(1, key, value) == ESP_OK);
+    }
+    const uint32_t misses = storage.valueCache().misses();
+    CHECK(storage.readItem(1, "key4", value) == ESP_OK);
+    CHECK(storage.readItem(1, "key1", value) == ESP_OK);
+    CHECK(storage.valueCache().misses() == misses);
+    CHECK(storage.readItem(1, "key0", value) == ESP_OK);
+    CHECK(value == 0);
+    CHECK(storage.valueCache().misses() == misses + 1);
+}
+
+TEST_CASE("PageManager reads each page with one flash operation", "[nvs]")
+{
+    const size_t sectorCount = 8;
+    SpiFlashEmulator emu(sectorCount);
+    {
+        Storage storage;
+        CHECK(storage.init(0, sectorCount) == ESP_OK);
+        uint8_t ns;
+        CHECK(storage.createOrOpenNamespace("test", true, ns) == ESP_OK);
+        char key[16];
+        for (size_t i = 0; i < 500; ++i) {
+            snprintf(key, sizeof(key), "key%d", static_cast<int>(i));
+            REQUIRE(storage.writeItem(ns, key, static_cast<uint32_t>(i)) == ESP_OK);
+        }
+        uint8_t blob[300] = {1};
+        REQUIRE(storage.writeItem(ns, ItemType::BLOB, "blob", blob, sizeof(blob)) == ESP_OK);
+    }
+
+    emu.clearStats();
+    PageManager pm;
+    CHECK(pm.load(0, sectorCount) == ESP_OK);
+    // one read per page, and one more to check the last page for duplicates
+    CHECK(emu.getReadOps() == sectorCount + 1);
+    s_perf << "Time to load " << sectorCount << " pages with 500 items: " << emu.getTotalTime() << " us (" << emu.getReadOps() << "R " << emu.getReadBytes() << "Rb)" << std::endl;
+
+    Storage storage;
+    CHECK(storage.init(0, sectorCount) == ESP_OK);
+    uint8_t ns;
+    CHECK(storage.createOrOpenNamespace("test", false, ns) == ESP_OK);
+    uint32_t value;
+    CHECK(storage.readItem(ns, "key499", value) == ESP_OK);
+    CHECK(value == 499);
+}
+
 TEST_CASE("can write and read variable length data lots of times", "[nvs]")
 {
     SpiFlashEmulator emu(8);
@@ -1144,6 +1529,559 @@ TEST_CASE("nvs_flash_init checks for an empty page", "[nvs]")
     TEST_ESP_ERR( nvs_flash_init_custom(0, 3), ESP_ERR_NVS_NO_FREE_PAGES );
 }
 
+TEST_CASE("write batch is applied on commit", "[nvs][batch]")
+{
+    SpiFlashEmulator emu(5);
+    TEST_ESP_OK( nvs_flash_init_custom(0, 5) );
+    nvs_handle handle;
+    TEST_ESP_OK( nvs_open("test", NVS_READWRITE, &handle) );
+    TEST_ESP_OK( nvs_set_u32(handle, "u", 1) );
+    TEST_ESP_OK( nvs_set_str(handle, "s", "old") );
+    TEST_ESP_OK( nvs_set_u8(handle, "e", 7) );
+
+    TEST_ESP_OK( nvs_batch_begin(handle) );
+    TEST_ESP_OK( nvs_set_u32(handle, "u", 2) );
+    TEST_ESP_OK( nvs_set_u32(handle, "u", 3) );
+    TEST_ESP_OK( nvs_set_str(handle, "s", "new value, longer than one entry") );
+    TEST_ESP_OK( nvs_erase_key(handle, "e") );
+    TEST_ESP_OK( nvs_erase_key(handle, "missing") );
+    TEST_ESP_OK( nvs_set_u16(handle, "x", 5) );
+    TEST_ESP_ERR( nvs_set_u8(handle, "key name is too long", 1), ESP_ERR_NVS_KEY_TOO_LONG );
+
+    // staged values are not visible before commit
+    uint32_t u;
+    TEST_ESP_OK( nvs_get_u32(handle, "u", &u) );
+    CHECK(u == 1);
+    uint16_t x;
+    TEST_ESP_ERR( nvs_get_u16(handle, "x", &x), ESP_ERR_NVS_NOT_FOUND );
+
+    TEST_ESP_OK( nvs_commit(handle) );
+    TEST_ESP_OK( nvs_get_u32(handle, "u", &u) );
+    CHECK(u == 3);
+    char buf[64];
+    size_t len = sizeof(buf);
+    TEST_ESP_OK( nvs_get_str(handle, "s", buf, &len) );
+    CHECK(strcmp(buf, "new value, longer than one entry") == 0);
+    uint8_t e;
+    TEST_ESP_ERR( nvs_get_u8(handle, "e", &e), ESP_ERR_NVS_NOT_FOUND );
+    TEST_ESP_OK( nvs_get_u16(handle, "x", &x) );
+    CHECK(x == 5);
+
+    // batch is finished by commit, aborted batch has no effect
+    TEST_ESP_OK( nvs_set_u32(handle, "u", 4) );
+    TEST_ESP_OK( nvs_batch_begin(handle) );
+    TEST_ESP_OK( nvs_set_u32(handle, "u", 5) );
+    TEST_ESP_OK( nvs_batch_abort(handle) );
+    TEST_ESP_OK( nvs_commit(handle) );
+    TEST_ESP_OK( nvs_get_u32(handle, "u", &u) );
+    CHECK(u == 4);
+
+    // batch should fit into one page
+    const size_t blob_size = 2048;
+    uint8_t blob[blob_size] = {0};
+    TEST_ESP_OK( nvs_batch_begin(handle) );
+    TEST_ESP_OK( nvs_set_blob(handle, "b1", blob, blob_size) );
+    TEST_ESP_OK( nvs_set_blob(handle, "b2", blob, blob_size) );
+    TEST_ESP_ERR( nvs_commit(handle), ESP_ERR_NVS_NOT_ENOUGH_SPACE );
+    TEST_ESP_ERR( nvs_get_blob(handle, "b1", blob, &len), ESP_ERR_NVS_NOT_FOUND );
+
+    // value spanning pages is rejected when it is staged
+    const size_t max_size = Page::MAX_DATA_SIZE;
+    static uint8_t bigBlob[max_size + 1];
+    TEST_ESP_OK( nvs_batch_begin(handle) );
+    TEST_ESP_ERR( nvs_set_blob(handle, "big", bigBlob, max_size + 1), ESP_ERR_NVS_VALUE_TOO_LONG );
+    TEST_ESP_OK( nvs_set_blob(handle, "big", bigBlob, max_size) );
+    TEST_ESP_OK( nvs_commit(handle) );
+    TEST_ESP_OK( nvs_get_blob(handle, "big", NULL, &len) );
+    CHECK(len == max_size);
+    nvs_close(handle);
+
+    TEST_ESP_OK( nvs_open("test", NVS_READONLY, &handle) );
+    TEST_ESP_ERR( nvs_batch_begin(handle), ESP_ERR_NVS_READ_ONLY );
+    nvs_close(handle);
+}
+
+TEST_CASE("write batch is atomic if power goes off during commit", "[nvs][batch]")
+{
+    const size_t filler_size = 3500; // batch doesn't fit into the first page
+    static uint8_t filler[filler_size];
+    uint8_t oldBlob[100], newBlob[100];
+    std::fill_n(oldBlob, sizeof(oldBlob), 1);
+    std::fill_n(newBlob, sizeof(newBlob), 2);
+    const char* newStr = "new value, longer than one entry";
+
+    size_t oldCount = 0;
+    size_t newCount = 0;
+    for (uint32_t failAfter = 0; ; ++failAfter) {
+        INFO(failAfter);
+        SpiFlashEmulator emu(5);
+        nvs_handle handle;
+        TEST_ESP_OK( nvs_flash_init_custom(0, 5) );
+        TEST_ESP_OK( nvs_open("test", NVS_READWRITE, &handle) );
+        TEST_ESP_OK( nvs_set_u32(handle, "u", 1) );
+        TEST_ESP_OK( nvs_set_str(handle, "s", "old") );
+        TEST_ESP_OK( nvs_set_blob(handle, "b", oldBlob, sizeof(oldBlob)) );
+        TEST_ESP_OK( nvs_set_u8(handle, "e", 7) );
+        TEST_ESP_OK( nvs_set_blob(handle, "filler", filler, filler_size) );
+
+        TEST_ESP_OK( nvs_batch_begin(handle) );
+        TEST_ESP_OK( nvs_set_u32(handle, "u", 2) );
+        TEST_ESP_OK( nvs_set_str(handle, "s", newStr) );
+        TEST_ESP_OK( nvs_set_blob(handle, "b", newBlob, sizeof(newBlob)) );
+        TEST_ESP_OK( nvs_erase_key(handle, "e") );
+        TEST_ESP_OK( nvs_set_u16(handle, "x", 5) );
+        emu.failAfter(failAfter);
+        esp_err_t err = nvs_commit(handle);
+        nvs_close(handle);
+        emu.failAfter(UINT32_MAX);
+
+        TEST_ESP_OK( nvs_flash_init_custom(0, 5) );
+        TEST_ESP_OK( nvs_open("test", NVS_READWRITE, &handle) );
+        uint32_t u;
+        TEST_ESP_OK( nvs_get_u32(handle, "u", &u) );
+        char str[64];
+        size_t len = sizeof(str);
+        TEST_ESP_OK( nvs_get_str(handle, "s", str, &len) );
+        uint8_t blob[100];
+        len = sizeof(blob);
+        TEST_ESP_OK( nvs_get_blob(handle, "b", blob, &len) );
+        uint8_t e;
+        esp_err_t errE = nvs_get_u8(handle, "e", &e);
+        uint16_t x;
+        esp_err_t errX = nvs_get_u16(handle, "x", &x);
+        if (u == 1) {
+            CHECK(strcmp(str, "old") == 0);
+            CHECK(memcmp(blob, oldBlob, sizeof(blob)) == 0);
+            CHECK(errE == ESP_OK);
+            CHECK(errX == ESP_ERR_NVS_NOT_FOUND);
+            ++oldCount;
+        } else {
+            CHECK(u == 2);
+            CHECK(strcmp(str, newStr) == 0);
+            CHECK(memcmp(blob, newBlob, sizeof(blob)) == 0);
+            CHECK(errE == ESP_ERR_NVS_NOT_FOUND);
+            CHECK(errX == ESP_OK);
+            ++newCount;
+        }
+        // storage keeps working after recovery
+        TEST_ESP_OK( nvs_set_u32(handle, "u", 3) );
+        nvs_close(handle);
+        if (err == ESP_OK) {
+            break;
+        }
+    }
+    CHECK(oldCount > 0);
+    CHECK(newCount > 0);
+}
+
+TEST_CASE("key written again after an unfinished erase keeps the new value", "[nvs][batch]")
+{
+    SpiFlashEmulator emu(3);
+    nvs_handle handle;
+    TEST_ESP_OK( nvs_flash_init_custom(0, 3) );
+    TEST_ESP_OK( nvs_open("test", NVS_READWRITE, &handle) );
+    TEST_ESP_OK( nvs_set_u32(handle, "k", 1) );
+    nvs_close(handle);
+
+    // erase marker of a batch which was committed, but old copies and the
+    // marker were not removed, followed by a new value of the same key.
+    // Page is full, so its duplicates are only resolved by PageManager::load.
+    Page page;
+    TEST_ESP_OK( page.load(0) );
+    CHECK(page.state() == Page::PageState::ACTIVE);
+    TBatch batch;
+    batch.push_back(new BatchItem(ItemType::ANY, "k", nullptr, 0));
+    TEST_ESP_OK( page.writeItems(1, batch) );
+    BatchItem* marker = &batch.front();
+    batch.pop_front();
+    delete marker;
+    TEST_ESP_OK( page.writeItem<uint32_t>(1, "k", 2) );
+    TEST_ESP_OK( page.markFull() );
+
+    TEST_ESP_OK( nvs_flash_init_custom(0, 3) );
+    TEST_ESP_OK( nvs_open("test", NVS_READWRITE, &handle) );
+    uint32_t value;
+    TEST_ESP_OK( nvs_get_u32(handle, "k", &value) );
+    CHECK(value == 2);
+    TEST_ESP_OK( nvs_set_u32(handle, "k", 3) );
+    nvs_close(handle);
+
+    TEST_ESP_OK( nvs_flash_init_custom(0, 3) );
+    TEST_ESP_OK( nvs_open("test", NVS_READONLY, &handle) );
+    TEST_ESP_OK( nvs_get_u32(handle, "k", &value) );
+    CHECK(value == 3);
+    nvs_close(handle);
+}
+
+TEST_CASE("blobs larger than a page are split into chunks", "[nvs][blob]")
+{
+    SpiFlashEmulator emu(8);
+    TEST_ESP_OK( nvs_flash_init_custom(0, 8) );
+    nvs_handle handle;
+    TEST_ESP_OK( nvs_open("test", NVS_READWRITE, &handle) );
+
+    const size_t blob_size = 10000;
+    static uint8_t blob[blob_size];
+    static uint8_t buf[blob_size];
+    for (size_t i = 0; i < blob_size; ++i) {
+        blob[i] = static_cast<uint8_t>(i * 7 + i / 256);
+    }
+    TEST_ESP_OK( nvs_set_blob(handle, "big", blob, blob_size) );
+    size_t len = 0;
+    TEST_ESP_OK( nvs_get_blob(handle, "big", NULL, &len) );
+    CHECK(len == blob_size);
+    len = blob_size - 1;
+    TEST_ESP_ERR( nvs_get_blob(handle, "big", buf, &len), ESP_ERR_NVS_INVALID_LENGTH );
+    len = blob_size;
+    TEST_ESP_OK( nvs_get_blob(handle, "big", buf, &len) );
+    CHECK(memcmp(buf, blob, blob_size) == 0);
+
+    // pieces which cross the boundaries of chunks
+    std::fill_n(buf, blob_size, 0);
+    for (size_t offset = 0; offset < blob_size; ) {
+        len = 333;
+        TEST_ESP_OK( nvs_blob_read_chunk(handle, "big", offset, buf + offset, &len) );
+        REQUIRE(len > 0);
+        offset += len;
+    }
+    CHECK(memcmp(buf, blob, blob_size) == 0);
+    len = 10;
+    TEST_ESP_OK( nvs_blob_read_chunk(handle, "big", blob_size, buf, &len) );
+    CHECK(len == 0);
+    TEST_ESP_ERR( nvs_blob_read_chunk(handle, "big", blob_size + 1, buf, &len), ESP_ERR_NVS_INVALID_LENGTH );
+    TEST_ESP_ERR( nvs_blob_read_chunk(handle, "big", 0, buf, NULL), ESP_ERR_NVS_INVALID_LENGTH );
+
+    // streaming write replaces the value when the last piece is written
+    for (size_t i = 0; i < blob_size; ++i) {
+        blob[i] = static_cast<uint8_t>(~blob[i]);
+    }
+    const size_t piece = 1500;
+    for (size_t offset = 0; offset < blob_size; offset += piece) {
+        len = blob_size;
+        TEST_ESP_OK( nvs_get_blob(handle, "big", buf, &len) );
+        CHECK(memcmp(buf, blob, blob_size) != 0);
+        TEST_ESP_OK( nvs_blob_write_chunk(handle, "big", offset, blob + offset,
+                                          std::min(piece, blob_size - offset), blob_size) );
+    }
+    len = blob_size;
+    TEST_ESP_OK( nvs_get_blob(handle, "big", buf, &len) );
+    CHECK(memcmp(buf, blob, blob_size) == 0);
+
+    // pieces have to follow each other
+    TEST_ESP_ERR( nvs_blob_write_chunk(handle, "big", 100, blob, 100, blob_size), ESP_ERR_NVS_INVALID_LENGTH );
+    TEST_ESP_OK( nvs_blob_write_chunk(handle, "big", 0, blob, 100, blob_size) );
+    TEST_ESP_ERR( nvs_blob_write_chunk(handle, "big", 200, blob, 100, blob_size), ESP_ERR_NVS_INVALID_LENGTH );
+    TEST_ESP_ERR( nvs_blob_write_chunk(handle, "other", 100, blob, 100, blob_size), ESP_ERR_NVS_INVALID_LENGTH );
+    TEST_ESP_ERR( nvs_blob_write_chunk(handle, "big", 100, blob, blob_size, blob_size), ESP_ERR_NVS_INVALID_LENGTH );
+
+    // unfinished write is dropped on reinit, previous value stays
+    nvs_close(handle);
+    TEST_ESP_OK( nvs_flash_init_custom(0, 8) );
+    TEST_ESP_OK( nvs_open("test", NVS_READWRITE, &handle) );
+    len = blob_size;
+    TEST_ESP_OK( nvs_get_blob(handle, "big", buf, &len) );
+    CHECK(memcmp(buf, blob, blob_size) == 0);
+
+    // small value replaces the chunked one and the other way round
+    TEST_ESP_OK( nvs_set_blob(handle, "big", blob, 100) );
+    TEST_ESP_OK( nvs_get_blob(handle, "big", NULL, &len) );
+    CHECK(len == 100);
+    len = 50;
+    TEST_ESP_OK( nvs_blob_read_chunk(handle, "big", 60, buf, &len) );
+    CHECK(len == 40);
+    CHECK(memcmp(buf, blob + 60, 40) == 0);
+    TEST_ESP_OK( nvs_set_blob(handle, "big", blob, blob_size) );
+    TEST_ESP_OK( nvs_erase_key(handle, "big") );
+    TEST_ESP_ERR( nvs_get_blob(handle, "big", NULL, &len), ESP_ERR_NVS_NOT_FOUND );
+    TEST_ESP_ERR( nvs_erase_key(handle, "big"), ESP_ERR_NVS_NOT_FOUND );
+
+    // all space taken by the chunks is reused
+    for (int i = 0; i < 20; ++i) {
+        TEST_ESP_OK( nvs_set_blob(handle, "big", blob, blob_size) );
+        TEST_ESP_OK( nvs_set_u32(handle, "u", i) );
+    }
+    TEST_ESP_ERR( nvs_set_blob(handle, "big2", blob, blob_size * 3), ESP_ERR_NVS_NOT_ENOUGH_SPACE );
+    TEST_ESP_OK( nvs_set_blob(handle, "big2", blob, blob_size / 2) );
+    len = blob_size;
+    TEST_ESP_OK( nvs_get_blob(handle, "big", buf, &len) );
+    CHECK(memcmp(buf, blob, blob_size) == 0);
+    nvs_close(handle);
+
+    TEST_ESP_OK( nvs_open("test", NVS_READONLY, &handle) );
+    TEST_ESP_ERR( nvs_blob_write_chunk(handle, "big", 0, blob, 100, 100), ESP_ERR_NVS_READ_ONLY );
+    nvs_close(handle);
+}
+
+TEST_CASE("blob written in pieces is atomic if power goes off", "[nvs][blob]")
+{
+    const size_t blob_size = 6000;
+    static uint8_t oldBlob[blob_size], newBlob[blob_size], buf[blob_size];
+    std::fill_n(oldBlob, blob_size, 1);
+    std::fill_n(newBlob, blob_size, 2);
+
+    size_t oldCount = 0;
+    size_t newCount = 0;
+    for (uint32_t failAfter = 0; ; failAfter += 37) {
+        INFO(failAfter);
+        SpiFlashEmulator emu(5);
+        nvs_handle handle;
+        TEST_ESP_OK( nvs_flash_init_custom(0, 5) );
+        TEST_ESP_OK( nvs_open("test", NVS_READWRITE, &handle) );
+        TEST_ESP_OK( nvs_set_blob(handle, "b", oldBlob, blob_size) );
+
+        emu.failAfter(failAfter);
+        esp_err_t err = ESP_OK;
+        const size_t piece = 1000;
+        for (size_t offset = 0; offset < blob_size && err == ESP_OK; offset += piece) {
+            err = nvs_blob_write_chunk(handle, "b", offset, newBlob + offset, piece, blob_size);
+        }
+        nvs_close(handle);
+        emu.failAfter(UINT32_MAX);
+
+        TEST_ESP_OK( nvs_flash_init_custom(0, 5) );
+        TEST_ESP_OK( nvs_open("test", NVS_READWRITE, &handle) );
+        size_t len = blob_size;
+        TEST_ESP_OK( nvs_get_blob(handle, "b", buf, &len) );
+        CHECK(len == blob_size);
+        if (buf[0] == 1) {
+            CHECK(memcmp(buf, oldBlob, blob_size) == 0);
+            ++oldCount;
+        } else {
+            CHECK(memcmp(buf, newBlob, blob_size) == 0);
+            ++newCount;
+        }
+        // no chunks are left behind, so the value can be written again
+        TEST_ESP_OK( nvs_set_blob(handle, "b", newBlob, blob_size) );
+        TEST_ESP_OK( nvs_set_blob(handle, "b", oldBlob, blob_size) );
+        nvs_close(handle);
+        if (err == ESP_OK) {
+            break;
+        }
+    }
+    CHECK(oldCount > 0);
+    CHECK(newCount > 0);
+}
+
+TEST_CASE("blob replaced by a chunked one is atomic if power goes off", "[nvs][blob]")
+{
+    const size_t small_size = 100;
+    const size_t big_size = 5000;
+    static uint8_t smallBlob[small_size], bigBlob[big_size], buf[big_size];
+    std::fill_n(smallBlob, small_size, 1);
+    std::fill_n(bigBlob, big_size, 2);
+
+    for (int toBig = 0; toBig < 2; ++toBig) {
+        const uint8_t* oldBlob = toBig ? smallBlob : bigBlob;
+        const size_t oldSize = toBig ? small_size : big_size;
+        const uint8_t* newBlob = toBig ? bigBlob : smallBlob;
+        const size_t newSize = toBig ? big_size : small_size;
+        size_t oldCount = 0;
+        size_t newCount = 0;
+        for (uint32_t failAfter = 0; ; ++failAfter) {
+            INFO(toBig << " " << failAfter);
+            SpiFlashEmulator emu(5);
+            nvs_handle handle;
+            TEST_ESP_OK( nvs_flash_init_custom(0, 5) );
+            TEST_ESP_OK( nvs_open("test", NVS_READWRITE, &handle) );
+            TEST_ESP_OK( nvs_set_blob(handle, "b", oldBlob, oldSize) );
+
+            emu.failAfter(failAfter);
+            esp_err_t err = nvs_set_blob(handle, "b", newBlob, newSize);
+            nvs_close(handle);
+            emu.failAfter(UINT32_MAX);
+
+            TEST_ESP_OK( nvs_flash_init_custom(0, 5) );
+            TEST_ESP_OK( nvs_open("test", NVS_READWRITE, &handle) );
+            size_t len = 0;
+            TEST_ESP_OK( nvs_get_blob(handle, "b", NULL, &len) );
+            REQUIRE((len == oldSize || len == newSize));
+            TEST_ESP_OK( nvs_get_blob(handle, "b", buf, &len) );
+            if (len == oldSize) {
+                CHECK(memcmp(buf, oldBlob, len) == 0);
+                ++oldCount;
+            } else {
+                CHECK(memcmp(buf, newBlob, len) == 0);
+                ++newCount;
+            }
+            // a later erase leaves nothing behind
+            TEST_ESP_OK( nvs_erase_key(handle, "b") );
+            TEST_ESP_ERR( nvs_get_blob(handle, "b", NULL, &len), ESP_ERR_NVS_NOT_FOUND );
+            nvs_close(handle);
+            if (err == ESP_OK) {
+                break;
+            }
+        }
+        CHECK(oldCount > 0);
+        CHECK(newCount > 0);
+    }
+}
+
+TEST_CASE("entry iterator returns values of namespace and type", "[nvs][iterator]")
+{
+    SpiFlashEmulator emu(5);
+    TEST_ESP_OK( nvs_flash_init_custom(0, 5) );
+    CHECK(nvs_entry_find(NULL, NVS_TYPE_ANY) == NULL);
+
+    nvs_handle h1, h2;
+    TEST_ESP_OK( nvs_open("ns1", NVS_READWRITE, &h1) );
+    TEST_ESP_OK( nvs_open("ns2", NVS_READWRITE, &h2) );
+    static uint8_t big[5000];
+    char key[16];
+    for (int i = 0; i < 100; ++i) {
+        snprintf(key, sizeof(key), "u%d", i);
+        TEST_ESP_OK( nvs_set_u32(h1, key, i) );
+    }
+    for (int i = 0; i < 20; ++i) {
+        snprintf(key, sizeof(key), "s%d", i);
+        TEST_ESP_OK( nvs_set_str(h2, key, "string value") );
+    }
+    TEST_ESP_OK( nvs_set_blob(h2, "big", big, sizeof(big)) );
+    TEST_ESP_OK( nvs_set_blob(h2, "small", big, 100) );
+    TEST_ESP_OK( nvs_set_i8(h2, "i8", -1) );
+    TEST_ESP_OK( nvs_erase_key(h1, "u0") );
+    TEST_ESP_OK( nvs_set_u32(h1, "u1", 10) );
+
+    auto count = [](const char* ns, nvs_type_t type) -> size_t {
+        size_t n = 0;
+        std::set<std::string> keys;
+        for (nvs_iterator_t it = nvs_entry_find(ns, type); it != NULL; it = nvs_entry_next(it)) {
+            nvs_entry_info_t info;
+            nvs_entry_info(it, &info);
+            CHECK((ns == NULL || strcmp(info.namespace_name, ns) == 0));
+            CHECK((type == NVS_TYPE_ANY || info.type == type));
+            CHECK(keys.insert(std::string(info.namespace_name) + "/" + info.key).second);
+            ++n;
+        }
+        return n;
+    };
+    size_t readBytes = emu.getReadBytes();
+    CHECK(count(NULL, NVS_TYPE_ANY) == 99 + 20 + 3);
+    // each entry is read at most once
+    CHECK(emu.getReadBytes() - readBytes <= 5 * Page::ENTRY_COUNT * Page::ENTRY_SIZE);
+    CHECK(count("ns1", NVS_TYPE_ANY) == 99);
+    CHECK(count("ns1", NVS_TYPE_U32) == 99);
+    CHECK(count("ns1", NVS_TYPE_STR) == 0);
+    CHECK(count("ns2", NVS_TYPE_STR) == 20);
+    CHECK(count("ns2", NVS_TYPE_BLOB) == 2);
+    CHECK(count(NULL, NVS_TYPE_I8) == 1);
+    CHECK(count("missing", NVS_TYPE_ANY) == 0);
+
+    nvs_iterator_t it = nvs_entry_find("ns2", NVS_TYPE_I8);
+    REQUIRE(it != NULL);
+    nvs_entry_info_t info;
+    nvs_entry_info(it, &info);
+    CHECK(strcmp(info.key, "i8") == 0);
+    CHECK(info.type == NVS_TYPE_I8);
+    nvs_release_iterator(it);
+
+    TEST_ESP_OK( nvs_erase_all(h1) );
+    CHECK(count(NULL, NVS_TYPE_ANY) == 20 + 3);
+    nvs_close(h1);
+    nvs_close(h2);
+}
+
+TEST_CASE("entry iterator returns all values while pages are reclaimed by writes", "[nvs][iterator]")
+{
+    SpiFlashEmulator emu(5);
+    TEST_ESP_OK( nvs_flash_init_custom(0, 5) );
+    nvs_handle handle, other;
+    TEST_ESP_OK( nvs_open("test", NVS_READWRITE, &handle) );
+    TEST_ESP_OK( nvs_open("other", NVS_READWRITE, &other) );
+    // pages of the values also hold old copies of another value, so that
+    // they are reclaimed while the values are being read
+    uint32_t value = 0;
+    char key[16];
+    for (int i = 0; i < 150; ++i) {
+        snprintf(key, sizeof(key), "k%d", i);
+        TEST_ESP_OK( nvs_set_u32(handle, key, i) );
+        TEST_ESP_OK( nvs_set_u32(other, "hot", ++value) );
+    }
+
+    std::set<std::string> keys;
+    size_t count = 0;
+    nvs_iterator_t it = nvs_entry_find("test", NVS_TYPE_ANY);
+    CHECK(nvs_flash_init_custom(0, 5) == ESP_ERR_NVS_INVALID_STATE);
+    while (it != NULL) {
+        nvs_entry_info_t info;
+        nvs_entry_info(it, &info);
+        keys.insert(info.key);
+        ++count;
+        for (int i = 0; i < 40; ++i) {
+            snprintf(key, sizeof(key), "h%d", (int)(value % 60));
+            TEST_ESP_OK( nvs_set_u32(other, key, ++value) );
+        }
+        it = nvs_entry_next(it);
+    }
+    CHECK(keys.size() == 150);
+    // pages which are read already are reclaimed first, so no value is read twice
+    CHECK(count == 150);
+    nvs_close(handle);
+    nvs_close(other);
+    TEST_ESP_OK( nvs_flash_init_custom(0, 5) );
+}
+
+TEST_CASE("strings and blobs can be mapped from flash", "[nvs][mmap]")
+{
+    SpiFlashEmulator emu(4);
+    TEST_ESP_OK( nvs_flash_init_custom(0, 4) );
+    nvs_handle handle;
+    TEST_ESP_OK( nvs_open("test", NVS_READWRITE, &handle) );
+
+    const char* str = "value which spans several entries of the page";
+    uint8_t blob[1000];
+    for (size_t i = 0; i < sizeof(blob); ++i) {
+        blob[i] = static_cast<uint8_t>(i);
+    }
+    TEST_ESP_OK( nvs_set_str(handle, "s", str) );
+    TEST_ESP_OK( nvs_set_blob(handle, "b", blob, sizeof(blob)) );
+    TEST_ESP_OK( nvs_set_u32(handle, "u", 1) );
+
+    const char* mappedStr;
+    const void* mappedBlob;
+    size_t len;
+    nvs_map_handle_t strMap, blobMap;
+    size_t readBytes = emu.getReadBytes();
+    TEST_ESP_OK( nvs_map_str(handle, "s", &mappedStr, &len, &strMap) );
+    CHECK(len == strlen(str) + 1);
+    CHECK(strcmp(mappedStr, str) == 0);
+    TEST_ESP_OK( nvs_map_blob(handle, "b", &mappedBlob, &len, &blobMap) );
+    CHECK(len == sizeof(blob));
+    CHECK(memcmp(mappedBlob, blob, sizeof(blob)) == 0);
+    // only the item headers are read
+    CHECK(emu.getReadBytes() - readBytes <= 4 * Page::ENTRY_SIZE);
+    CHECK(emu.getMapCount() == 2);
+
+    TEST_ESP_ERR( nvs_map_str(handle, "b", &mappedStr, NULL, &strMap), ESP_ERR_NVS_NOT_FOUND );
+    TEST_ESP_ERR( nvs_map_blob(handle, "missing", &mappedBlob, NULL, &blobMap), ESP_ERR_NVS_NOT_FOUND );
+    TEST_ESP_ERR( nvs_flash_init_custom(0, 4), ESP_ERR_NVS_INVALID_STATE );
+
+    // page of the mapped values is not erased, other pages are reclaimed as usual
+    uint8_t other[1000] = {0};
+    for (int i = 0; i < 20; ++i) {
+        TEST_ESP_OK( nvs_set_blob(handle, "b", other, sizeof(other)) );
+        TEST_ESP_OK( nvs_set_str(handle, "s", "new") );
+    }
+    CHECK(emu.getSectorEraseOps(0) == 0);
+    CHECK(emu.getEraseOps() > 0);
+    CHECK(memcmp(mappedBlob, blob, sizeof(blob)) == 0);
+    CHECK(strcmp(mappedStr, str) == 0);
+
+    nvs_unmap(blobMap);
+    nvs_unmap(strMap);
+    nvs_unmap(strMap);
+    CHECK(emu.getMapCount() == 0);
+    for (int i = 0; i < 20; ++i) {
+        TEST_ESP_OK( nvs_set_blob(handle, "b", other, sizeof(other)) );
+    }
+
+    // chunks of a large blob are on different pages
+    static uint8_t big[6000];
+    TEST_ESP_OK( nvs_set_blob(handle, "big", big, sizeof(big)) );
+    TEST_ESP_ERR( nvs_map_blob(handle, "big", &mappedBlob, NULL, &blobMap), ESP_ERR_NVS_NOT_MAPPABLE );
+    nvs_close(handle);
+    TEST_ESP_OK( nvs_flash_init_custom(0, 4) );
+}
+
 TEST_CASE("dump all performance data", "[nvs]")
 {
     std::cout << "====================" << std::endl << "Dumping benchmarks" << std::endl;
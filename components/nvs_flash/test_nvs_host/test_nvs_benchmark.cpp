@@ -0,0 +1,207 @@
+// Copyright 2015-2016 Espressif Systems (Shanghai) PTE LTD
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "catch.hpp"
+#include "nvs.hpp"
+#include "spi_flash_emulation.h"
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+#include <algorithm>
+#include <numeric>
+
+using namespace nvs;
+
+// Key mix: many small integers updated often, some strings, a few large blobs
+#define BENCH_SECTOR_COUNT      16
+#define BENCH_OP_COUNT          20000
+#define BENCH_GET_COUNT         5000
+#define BENCH_STR_COUNT         20
+#define BENCH_STR_SIZE          40
+#define BENCH_BLOB_COUNT        4
+#define BENCH_BLOB_SIZE         1500
+#define BENCH_INT_PERCENT       95
+#define BENCH_STR_PERCENT       4       // rest of the operations are blob updates
+
+static size_t percentile(std::vector<size_t>& values, size_t percent)
+{
+    std::sort(values.begin(), values.end());
+    return values[(values.size() - 1) * percent / 100];
+}
+
+static esp_err_t write_int(Storage& storage, uint8_t ns, size_t index, uint32_t value)
+{
+    char key[16];
+    snprintf(key, sizeof(key), "int%d", static_cast<int>(index));
+    return storage.writeItem(ns, key, value);
+}
+
+static esp_err_t write_str(Storage& storage, uint8_t ns, size_t index, uint32_t value)
+{
+    char key[16];
+    char str[BENCH_STR_SIZE];
+    snprintf(key, sizeof(key), "str%d", static_cast<int>(index));
+    memset(str, 'a' + value % 26, sizeof(str));
+    str[sizeof(str) - 1] = 0;
+    return storage.writeItem(ns, ItemType::SZ, key, str, sizeof(str));
+}
+
+static esp_err_t write_blob(Storage& storage, uint8_t ns, size_t index, uint32_t value)
+{
+    char key[16];
+    std::vector<uint8_t> blob(BENCH_BLOB_SIZE, static_cast<uint8_t>(value));
+    snprintf(key, sizeof(key), "blob%d", static_cast<int>(index));
+    return storage.writeItem(ns, ItemType::BLOB, key, blob.data(), blob.size());
+}
+
+static void run_benchmark(size_t intCount, bool background)
+{
+    SpiFlashEmulator emu(BENCH_SECTOR_COUNT);
+    Storage storage;
+    storage.setDebugCheck(false);
+    REQUIRE(storage.init(0, BENCH_SECTOR_COUNT) == ESP_OK);
+    uint8_t ns;
+    REQUIRE(storage.createOrOpenNamespace("bench", true, ns) == ESP_OK);
+
+    for (size_t i = 0; i < intCount; ++i) {
+        REQUIRE(write_int(storage, ns, i, 0) == ESP_OK);
+    }
+    for (size_t i = 0; i < BENCH_STR_COUNT; ++i) {
+        REQUIRE(write_str(storage, ns, i, 0) == ESP_OK);
+    }
+    for (size_t i = 0; i < BENCH_BLOB_COUNT; ++i) {
+        REQUIRE(write_blob(storage, ns, i, 0) == ESP_OK);
+    }
+    const size_t strEntries = 1 + (BENCH_STR_SIZE + Page::ENTRY_SIZE - 1) / Page::ENTRY_SIZE;
+    const size_t blobEntries = 1 + (BENCH_BLOB_SIZE + Page::ENTRY_SIZE - 1) / Page::ENTRY_SIZE;
+    const size_t liveEntries = 1 + intCount + BENCH_STR_COUNT * strEntries + BENCH_BLOB_COUNT * blobEntries;
+    // one page is always kept free
+    const size_t capacity = (BENCH_SECTOR_COUNT - 1) * Page::ENTRY_COUNT;
+
+    // updates
+    emu.clearStats();
+    srand(1);
+    std::vector<size_t> setLatency;
+    setLatency.reserve(BENCH_OP_COUNT);
+    size_t gcCount = 0;
+    size_t gcTime = 0;
+    size_t gcMax = 0;
+    size_t fullCount = 0;
+    size_t reclaimTime = 0;
+    for (uint32_t op = 1; op <= BENCH_OP_COUNT; ++op) {
+        const size_t timeBefore = emu.getTotalTime();
+        const size_t erasesBefore = emu.getEraseOps();
+        const int kind = rand() % 100;
+        esp_err_t err;
+        if (kind < BENCH_INT_PERCENT) {
+            err = write_int(storage, ns, rand() % intCount, op);
+        } else if (kind < BENCH_INT_PERCENT + BENCH_STR_PERCENT) {
+            err = write_str(storage, ns, rand() % BENCH_STR_COUNT, op);
+        } else {
+            err = write_blob(storage, ns, rand() % BENCH_BLOB_COUNT, op);
+        }
+        // a blob may not fit even after garbage collection if the partition is nearly full
+        REQUIRE((err == ESP_OK || err == ESP_ERR_NVS_NOT_ENOUGH_SPACE));
+        if (err == ESP_ERR_NVS_NOT_ENOUGH_SPACE) {
+            ++fullCount;
+        }
+        const size_t time = emu.getTotalTime() - timeBefore;
+        setLatency.push_back(time);
+        if (emu.getEraseOps() != erasesBefore) {
+            ++gcCount;
+            gcTime += time;
+            gcMax = std::max(gcMax, time);
+        }
+        // idle time between the updates
+        const size_t reclaimBefore = emu.getTotalTime();
+        while (background && storage.reclaimPending()) {
+            REQUIRE(storage.reclaimStep() == ESP_OK);
+        }
+        reclaimTime += emu.getTotalTime() - reclaimBefore;
+    }
+    const size_t setTime = emu.getTotalTime() - reclaimTime;
+    const size_t eraseOps = emu.getEraseOps();
+    size_t maxSectorErases = 0;
+    for (size_t i = 0; i < BENCH_SECTOR_COUNT; ++i) {
+        maxSectorErases = std::max(maxSectorErases, emu.getSectorEraseOps(i));
+    }
+
+    // reads of existing and missing keys
+    emu.clearStats();
+    std::vector<size_t> getLatency;
+    getLatency.reserve(BENCH_GET_COUNT);
+    for (size_t i = 0; i < BENCH_GET_COUNT; ++i) {
+        char key[16];
+        snprintf(key, sizeof(key), "int%d", static_cast<int>(rand() % intCount));
+        const size_t timeBefore = emu.getTotalTime();
+        uint32_t value;
+        REQUIRE(storage.readItem(ns, key, value) == ESP_OK);
+        getLatency.push_back(emu.getTotalTime() - timeBefore);
+    }
+    const size_t getReads = emu.getReadOps();
+    emu.clearStats();
+    for (size_t i = 0; i < BENCH_GET_COUNT; ++i) {
+        uint32_t value;
+        REQUIRE(storage.readItem(ns, "missing", value) == ESP_ERR_NVS_NOT_FOUND);
+    }
+    const size_t missTime = emu.getTotalTime();
+
+    const size_t setP50 = percentile(setLatency, 50);
+    const size_t setP99 = percentile(setLatency, 99);
+    const size_t getAvg10 = std::accumulate(getLatency.begin(), getLatency.end(), size_t(0)) * 10 / BENCH_GET_COUNT;
+    const size_t getP99 = percentile(getLatency, 99);
+
+    // init of the filled partition
+    emu.clearStats();
+    Storage storage2;
+    storage2.setDebugCheck(false);
+    REQUIRE(storage2.init(0, BENCH_SECTOR_COUNT) == ESP_OK);
+
+    printf("%s fill=%3d%%  set us avg=%d p50=%d p99=%d max=%d  gc=%d avg=%d max=%d us  "
+           "erases=%d (%.3f/set, max/sector=%d)  no space=%d  get us avg=%.1f p99=%d reads/get=%.2f miss=%.1f  "
+           "init=%d us (%dR %dRb)  background=%d us\n",
+           background ? "bg    " : "inline",
+           static_cast<int>(liveEntries * 100 / capacity),
+           static_cast<int>(setTime / BENCH_OP_COUNT),
+           static_cast<int>(setP50),
+           static_cast<int>(setP99),
+           static_cast<int>(setLatency.back()),
+           static_cast<int>(gcCount),
+           static_cast<int>(gcCount ? gcTime / gcCount : 0),
+           static_cast<int>(gcMax),
+           static_cast<int>(eraseOps),
+           static_cast<double>(eraseOps) / BENCH_OP_COUNT,
+           static_cast<int>(maxSectorErases),
+           static_cast<int>(fullCount),
+           getAvg10 / 10.0,
+           static_cast<int>(getP99),
+           static_cast<double>(getReads) / BENCH_GET_COUNT,
+           static_cast<double>(missTime) / BENCH_GET_COUNT,
+           static_cast<int>(emu.getTotalTime()),
+           static_cast<int>(emu.getReadOps()),
+           static_cast<int>(emu.getReadBytes()),
+           static_cast<int>(reclaimTime / BENCH_OP_COUNT));
+}
+
+TEST_CASE("nvs benchmark", "[.][benchmark]")
+{
+    const size_t intCounts[] = {200, 600, 1000};
+    printf("%d sectors, %d updates (%d%% u32 of N keys, %d%% %d byte strings of %d keys, rest %d byte blobs of %d keys), "
+           "modelled flash timing\n",
+           BENCH_SECTOR_COUNT, BENCH_OP_COUNT, BENCH_INT_PERCENT, BENCH_STR_PERCENT, BENCH_STR_SIZE,
+           BENCH_STR_COUNT, BENCH_BLOB_SIZE, BENCH_BLOB_COUNT);
+    for (size_t intCount : intCounts) {
+        run_benchmark(intCount, false);
+        run_benchmark(intCount, true);
+    }
+}
@@ -30,6 +30,7 @@
 #include "esp_intr_alloc.h"
 #include "esp_spi_flash.h"
 #include "esp_log.h"
+#include "cache_utils.h"
 
 
 static void IRAM_ATTR spi_flash_disable_cache(uint32_t cpuid, uint32_t* saved_state);
@@ -37,6 +38,18 @@ static void IRAM_ATTR spi_flash_restore_cache(uint32_t cpuid, uint32_t saved_sta
 
 static uint32_t s_flash_op_cache_state[2];
 
+#if CONFIG_SPI_FLASH_ENABLE_COUNTERS
+/* CPU cycle count when non-IRAM interrupts were disabled for the current flash operation */
+static uint32_t s_flash_op_disabled_ccount;
+#define CACHE_DISABLED_BEGIN()  s_flash_op_disabled_ccount = xthal_get_ccount()
+#define CACHE_DISABLED_END()    uint32_t cache_disabled_cycles = xthal_get_ccount() - s_flash_op_disabled_ccount
+#define CACHE_DISABLED_COUNT()  spi_flash_counters_add_cache_disabled(cache_disabled_cycles)
+#else
+#define CACHE_DISABLED_BEGIN()
+#define CACHE_DISABLED_END()
+#define CACHE_DISABLED_COUNT()
+#endif //CONFIG_SPI_FLASH_ENABLE_COUNTERS
+
 #ifndef CONFIG_FREERTOS_UNICORE
 static SemaphoreHandle_t s_flash_op_mutex;
 static volatile bool s_flash_op_can_start = false;
@@ -122,6 +135,7 @@ void IRAM_ATTR spi_flash_disable_interrupts_caches_and_other_cpu()
     }
     // Kill interrupts that aren't located in IRAM
     esp_intr_noniram_disable();
+    CACHE_DISABLED_BEGIN();
     // Disable cache on this CPU as well
     spi_flash_disable_cache(cpuid, &s_flash_op_cache_state[cpuid]);
 }
@@ -151,6 +165,7 @@ void IRAM_ATTR spi_flash_enable_interrupts_caches_and_other_cpu()
     }
     // Re-enable non-iram interrupts
     esp_intr_noniram_enable();
+    CACHE_DISABLED_END();
 
     // Resume tasks on the current CPU, if the scheduler has started.
     // NOTE: enabling non-IRAM interrupts has to happen before this,
@@ -161,6 +176,7 @@ void IRAM_ATTR spi_flash_enable_interrupts_caches_and_other_cpu()
     if (xTaskGetSchedulerState() != taskSCHEDULER_NOT_STARTED) {
         xTaskResumeAll();
     }
+    CACHE_DISABLED_COUNT();
     // Release API lock
     spi_flash_op_unlock();
 }
@@ -209,6 +225,7 @@ void IRAM_ATTR spi_flash_disable_interrupts_caches_and_other_cpu()
 {
     spi_flash_op_lock();
     esp_intr_noniram_disable();
+    CACHE_DISABLED_BEGIN();
     spi_flash_disable_cache(0, &s_flash_op_cache_state[0]);
 }
 
@@ -216,6 +233,8 @@ void IRAM_ATTR spi_flash_enable_interrupts_caches_and_other_cpu()
 {
     spi_flash_restore_cache(0, s_flash_op_cache_state[0]);
     esp_intr_noniram_enable();
+    CACHE_DISABLED_END();
+    CACHE_DISABLED_COUNT();
     spi_flash_op_unlock();
 }
 
@@ -56,4 +56,10 @@ void spi_flash_enable_interrupts_caches_no_os();
 // Only call this while holding spi_flash_op_lock()
 void spi_flash_mark_modified_region(uint32_t start_addr, uint32_t length);
 
+#if CONFIG_SPI_FLASH_ENABLE_COUNTERS
+// Count a period of given number of CPU cycles when flash cache was disabled.
+// Called by spi_flash_enable_interrupts_caches_and_other_cpu.
+void spi_flash_counters_add_cache_disabled(uint32_t cycles);
+#endif
+
 #endif //ESP_SPI_FLASH_CACHE_UTILS_H
@@ -16,6 +16,7 @@
 #include <assert.h>
 #include <string.h>
 #include <stdio.h>
+#include <sys/param.h>  // For MIN/MAX(a, b)
 
 #include <freertos/FreeRTOS.h>
 #include <freertos/task.h>
@@ -367,3 +368,80 @@ const void *spi_flash_phys2cache(uint32_t phys_offs, spi_flash_mmap_memory_t mem
     }
     return NULL;
 }
+
+/* Number of bytes mapped at a time by spi_flash_find_first_non_erased */
+#define ERASED_CHECK_MAP_SIZE (4 * SPI_FLASH_MMU_PAGE_SIZE)
+
+static const uint8_t *find_non_erased(const uint8_t *begin, const uint8_t *end)
+{
+    while (begin < end && ((intptr_t) begin & 3) != 0) {
+        if (*begin != 0xff) {
+            return begin;
+        }
+        ++begin;
+    }
+    const uint32_t *w = (const uint32_t *) begin;
+    const uint32_t *w_end = (const uint32_t *) ((intptr_t) end & ~3);
+    while (w_end - w >= 4 && (w[0] & w[1] & w[2] & w[3]) == UINT32_MAX) {
+        w += 4;
+    }
+    while (w < w_end && *w == UINT32_MAX) {
+        ++w;
+    }
+    /* the first byte which is not 0xff is in *w, or in the remaining bytes */
+    for (begin = (const uint8_t *) w; begin < end; ++begin) {
+        if (*begin != 0xff) {
+            return begin;
+        }
+    }
+    return NULL;
+}
+
+esp_err_t spi_flash_find_first_non_erased(size_t start_addr, size_t size, size_t *out_addr)
+{
+    if (start_addr + size > spi_flash_get_chip_size()) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    size_t end = start_addr + size;
+    if (esp_flash_encryption_enabled()) {
+        /* mapped data is decrypted, erased flash has to be read as it is */
+        uint32_t buf[64];
+        for (size_t addr = start_addr; addr < end; addr += sizeof(buf)) {
+            size_t read_size = MIN(end - addr, sizeof(buf));
+            esp_err_t err = spi_flash_read(addr, buf, read_size);
+            if (err != ESP_OK) {
+                return err;
+            }
+            const uint8_t *found = find_non_erased((const uint8_t *) buf, (const uint8_t *) buf + read_size);
+            if (found) {
+                *out_addr = addr + (found - (const uint8_t *) buf);
+                return ESP_OK;
+            }
+        }
+        return ESP_ERR_NOT_FOUND;
+    }
+    for (size_t addr = start_addr; addr < end; ) {
+        size_t map_addr = addr & ~(SPI_FLASH_MMU_PAGE_SIZE - 1);
+        size_t map_end = MIN(end, map_addr + ERASED_CHECK_MAP_SIZE);
+        const uint8_t *ptr;
+        spi_flash_mmap_handle_t handle;
+        esp_err_t err = spi_flash_mmap(map_addr, map_end - map_addr, SPI_FLASH_MMAP_DATA, (const void **) &ptr, &handle);
+        if (err != ESP_OK) {
+            return err;
+        }
+        const uint8_t *found = find_non_erased(ptr + (addr - map_addr), ptr + (map_end - map_addr));
+        spi_flash_munmap(handle);
+        if (found) {
+            *out_addr = map_addr + (found - ptr);
+            return ESP_OK;
+        }
+        addr = map_end;
+    }
+    return ESP_ERR_NOT_FOUND;
+}
+
+bool spi_flash_is_erased(size_t start_addr, size_t size)
+{
+    size_t addr;
+    return spi_flash_find_first_non_erased(start_addr, size, &addr) == ESP_ERR_NOT_FOUND;
+}
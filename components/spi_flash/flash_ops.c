@@ -29,6 +29,7 @@
 #include "esp_ipc.h"
 #include "esp_attr.h"
 #include "esp_spi_flash.h"
+#include "esp_spi_flash_queue.h"
 #include "esp_log.h"
 #include "cache_utils.h"
 
@@ -45,16 +46,32 @@
 static const char *TAG = "spi_flash";
 static spi_flash_counters_t s_flash_stats;
 
-#define COUNTER_START()     uint32_t ts_begin = xthal_get_ccount()
+/* Caller tags of the tasks, set with spi_flash_counters_set_caller */
+typedef struct {
+    TaskHandle_t task;
+    const char *tag;
+} caller_task_t;
+
+static caller_task_t s_caller_tasks[CONFIG_SPI_FLASH_COUNTERS_CALLERS];
+/* Counters of each tag, the last entry counts operations without a tag */
+static spi_flash_caller_counters_t s_caller_stats[CONFIG_SPI_FLASH_COUNTERS_CALLERS + 1];
+static portMUX_TYPE s_caller_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static spi_flash_caller_counters_t *counter_caller();
+static void counter_add(spi_flash_counter_t *counter, spi_flash_counter_t *caller_counter, uint32_t time);
+
+#define COUNTER_START()     uint32_t ts_begin = xthal_get_ccount(); \
+                            spi_flash_caller_counters_t *caller = counter_caller()
 #define COUNTER_STOP(counter)  \
     do{ \
-        s_flash_stats.counter.count++; \
-        s_flash_stats.counter.time += (xthal_get_ccount() - ts_begin) / (XT_CLOCK_FREQ / 1000000); \
+        counter_add(&s_flash_stats.counter, &caller->counters.counter, \
+                (xthal_get_ccount() - ts_begin) / (XT_CLOCK_FREQ / 1000000)); \
     } while(0)
 
 #define COUNTER_ADD_BYTES(counter, size) \
     do { \
         s_flash_stats.counter.bytes += size; \
+        caller->counters.counter.bytes += size; \
     } while (0)
 
 #else
@@ -88,6 +105,9 @@ void spi_flash_init()
 #if CONFIG_SPI_FLASH_ENABLE_COUNTERS
     spi_flash_reset_counters();
 #endif
+#if CONFIG_SPI_FLASH_QUEUE
+    ESP_ERROR_CHECK(spi_flash_queue_init());
+#endif
 }
 
 void IRAM_ATTR spi_flash_guard_set(const spi_flash_guard_funcs_t *funcs)
@@ -488,10 +508,105 @@ static esp_err_t IRAM_ATTR spi_flash_translate_rc(esp_rom_spiflash_result_t rc)
 
 #if CONFIG_SPI_FLASH_ENABLE_COUNTERS
 
+static IRAM_ATTR spi_flash_caller_counters_t *counter_caller()
+{
+    spi_flash_caller_counters_t *result = &s_caller_stats[CONFIG_SPI_FLASH_COUNTERS_CALLERS];
+    if (s_flash_guard_ops == &g_flash_guard_no_os_ops ||
+            xTaskGetSchedulerState() == taskSCHEDULER_NOT_STARTED) {
+        return result;
+    }
+    TaskHandle_t task = xTaskGetCurrentTaskHandle();
+    portENTER_CRITICAL(&s_caller_lock);
+    const char *tag = NULL;
+    for (int i = 0; i < CONFIG_SPI_FLASH_COUNTERS_CALLERS; ++i) {
+        if (s_caller_tasks[i].task == task) {
+            tag = s_caller_tasks[i].tag;
+            break;
+        }
+    }
+    for (int i = 0; tag != NULL && i < CONFIG_SPI_FLASH_COUNTERS_CALLERS; ++i) {
+        if (s_caller_stats[i].tag == NULL) {
+            s_caller_stats[i].tag = tag;
+        }
+        if (s_caller_stats[i].tag == tag || strcmp(s_caller_stats[i].tag, tag) == 0) {
+            result = &s_caller_stats[i];
+            break;
+        }
+    }
+    portEXIT_CRITICAL(&s_caller_lock);
+    return result;
+}
+
+static IRAM_ATTR void counter_add_one(spi_flash_counter_t *counter, uint32_t time)
+{
+    /* buckets grow by a factor of 4: <16us, <64us, ... <16ms, <64ms, 64ms or more */
+    int bucket = 0;
+    for (uint32_t t = time >> 4; t != 0 && bucket < SPI_FLASH_COUNTER_HISTOGRAM_SIZE - 1; t >>= 2) {
+        ++bucket;
+    }
+    counter->count++;
+    counter->time += time;
+    counter->max_time = MAX(counter->max_time, time);
+    counter->histogram[bucket]++;
+}
+
+static IRAM_ATTR void counter_add(spi_flash_counter_t *counter, spi_flash_counter_t *caller_counter, uint32_t time)
+{
+    counter_add_one(counter, time);
+    counter_add_one(caller_counter, time);
+}
+
+void IRAM_ATTR spi_flash_counters_add_cache_disabled(uint32_t cycles)
+{
+    spi_flash_caller_counters_t *caller = counter_caller();
+    counter_add(&s_flash_stats.cache_disabled, &caller->counters.cache_disabled,
+            cycles / (XT_CLOCK_FREQ / 1000000));
+}
+
+const char *spi_flash_counters_set_caller(const char *tag)
+{
+    TaskHandle_t task = xTaskGetCurrentTaskHandle();
+    caller_task_t *entry = NULL;
+    caller_task_t *free_entry = NULL;
+    portENTER_CRITICAL(&s_caller_lock);
+    for (int i = 0; i < CONFIG_SPI_FLASH_COUNTERS_CALLERS; ++i) {
+        if (s_caller_tasks[i].task == task) {
+            entry = &s_caller_tasks[i];
+            break;
+        }
+        if (free_entry == NULL && s_caller_tasks[i].task == NULL) {
+            free_entry = &s_caller_tasks[i];
+        }
+    }
+    const char *prev = entry ? entry->tag : NULL;
+    if (entry == NULL && tag != NULL) {
+        /* if all entries are used, operations of this task are counted without a tag */
+        entry = free_entry;
+    }
+    if (entry) {
+        entry->task = (tag != NULL) ? task : NULL;
+        entry->tag = tag;
+    }
+    portEXIT_CRITICAL(&s_caller_lock);
+    return prev;
+}
+
 static inline void dump_counter(spi_flash_counter_t *counter, const char *name)
 {
-    ESP_LOGI(TAG, "%s  count=%8d  time=%8dus  bytes=%8d\n", name,
-             counter->count, counter->time, counter->bytes);
+    ESP_LOGI(TAG, "%s  count=%8d  time=%8dus  bytes=%8d  max=%8dus", name,
+             counter->count, counter->time, counter->bytes, counter->max_time);
+    if (counter->count == 0) {
+        return;
+    }
+    static const char *bucket_names[SPI_FLASH_COUNTER_HISTOGRAM_SIZE] = {
+        "<16us", "<64us", "<256us", "<1ms", "<4ms", "<16ms", "<64ms", ">=64ms"
+    };
+    char line[SPI_FLASH_COUNTER_HISTOGRAM_SIZE * 18 + 1];
+    int len = 0;
+    for (int i = 0; i < SPI_FLASH_COUNTER_HISTOGRAM_SIZE; ++i) {
+        len += snprintf(line + len, sizeof(line) - len, " %s=%d", bucket_names[i], counter->histogram[i]);
+    }
+    ESP_LOGI(TAG, "%s %s", name, line);
 }
 
 const spi_flash_counters_t *spi_flash_get_counters()
@@ -499,9 +614,25 @@ const spi_flash_counters_t *spi_flash_get_counters()
     return &s_flash_stats;
 }
 
+size_t spi_flash_get_caller_counters(spi_flash_caller_counters_t *out_counters, size_t count)
+{
+    size_t n = 0;
+    portENTER_CRITICAL(&s_caller_lock);
+    for (int i = 0; i < CONFIG_SPI_FLASH_COUNTERS_CALLERS + 1 && n < count; ++i) {
+        if (s_caller_stats[i].tag != NULL || i == CONFIG_SPI_FLASH_COUNTERS_CALLERS) {
+            out_counters[n++] = s_caller_stats[i];
+        }
+    }
+    portEXIT_CRITICAL(&s_caller_lock);
+    return n;
+}
+
 void spi_flash_reset_counters()
 {
+    portENTER_CRITICAL(&s_caller_lock);
     memset(&s_flash_stats, 0, sizeof(s_flash_stats));
+    memset(s_caller_stats, 0, sizeof(s_caller_stats));
+    portEXIT_CRITICAL(&s_caller_lock);
 }
 
 void spi_flash_dump_counters()
@@ -509,6 +640,17 @@ void spi_flash_dump_counters()
     dump_counter(&s_flash_stats.read,  "read ");
     dump_counter(&s_flash_stats.write, "write");
     dump_counter(&s_flash_stats.erase, "erase");
+    dump_counter(&s_flash_stats.cache_disabled, "cache disabled");
+    for (int i = 0; i < CONFIG_SPI_FLASH_COUNTERS_CALLERS + 1; ++i) {
+        const spi_flash_caller_counters_t *caller = &s_caller_stats[i];
+        if (caller->tag == NULL && i != CONFIG_SPI_FLASH_COUNTERS_CALLERS) {
+            continue;
+        }
+        ESP_LOGI(TAG, "%s: read %dus, write %dus, erase %dus, cache disabled %dus (max %dus)",
+                 caller->tag ? caller->tag : "(no tag)", caller->counters.read.time,
+                 caller->counters.write.time, caller->counters.erase.time,
+                 caller->counters.cache_disabled.time, caller->counters.cache_disabled.max_time);
+    }
 }
 
 #endif //CONFIG_SPI_FLASH_ENABLE_COUNTERS
@@ -0,0 +1,181 @@
+// Copyright 2015-2017 Espressif Systems (Shanghai) PTE LTD
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>  // For MIN/MAX(a, b)
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/semphr.h>
+#include "sdkconfig.h"
+#include "esp_spi_flash.h"
+#include "esp_spi_flash_queue.h"
+
+#if CONFIG_SPI_FLASH_QUEUE
+
+/* Queued operations are kept in a list sorted by priority, operations with
+ * equal priority in the order of submission. The queue task executes one
+ * step of the operation at the head of the list (one sector erase or one
+ * write slice), then looks at the head again. This way flash caches are
+ * enabled between the steps, and an operation with higher priority submitted
+ * while a long erase is running only waits for the current step.
+ */
+
+typedef enum {
+    FLASH_QUEUE_ERASE,
+    FLASH_QUEUE_WRITE,
+} flash_queue_op_type_t;
+
+typedef struct flash_queue_op_ {
+    struct flash_queue_op_* next;
+    flash_queue_op_type_t type;
+    size_t address;
+    const uint8_t* src;
+    size_t size;
+    size_t done_size;
+    spi_flash_queue_done_t done;
+} flash_queue_op_t;
+
+static flash_queue_op_t* s_queue_head = NULL;
+static size_t s_queue_pending = 0;
+static TaskHandle_t s_queue_task = NULL;
+static portMUX_TYPE s_queue_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static esp_err_t flash_queue_step(flash_queue_op_t* op)
+{
+    size_t addr = op->address + op->done_size;
+    size_t size;
+    esp_err_t err;
+    if (op->type == FLASH_QUEUE_ERASE) {
+        size = SPI_FLASH_SEC_SIZE;
+        err = spi_flash_erase_range(addr, size);
+    } else {
+        // keep the following steps 4-byte aligned, so that each of them is a single write
+        size = MIN(op->size - op->done_size, CONFIG_SPI_FLASH_QUEUE_WRITE_SLICE - (addr & 3));
+        err = spi_flash_write(addr, op->src + op->done_size, size);
+    }
+    op->done_size += size;
+    return err;
+}
+
+static void flash_queue_task(void* arg)
+{
+    while (true) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        while (true) {
+            portENTER_CRITICAL(&s_queue_lock);
+            flash_queue_op_t* op = s_queue_head;
+            portEXIT_CRITICAL(&s_queue_lock);
+            if (op == NULL) {
+                break;
+            }
+            // only this task removes operations, so op stays valid outside of the lock
+            esp_err_t err = (op->done_size < op->size) ? flash_queue_step(op) : ESP_OK;
+            if (err == ESP_OK && op->done_size < op->size) {
+                // block for a tick before the next step, so that lower priority
+                // tasks, including the idle task which feeds the task watchdog, run
+                vTaskDelay(1);
+                continue;
+            }
+            portENTER_CRITICAL(&s_queue_lock);
+            flash_queue_op_t** it = &s_queue_head;
+            while (*it != op) {
+                it = &(*it)->next;
+            }
+            *it = op->next;
+            --s_queue_pending;
+            bool more = s_queue_head != NULL;
+            portEXIT_CRITICAL(&s_queue_lock);
+            if (op->done.callback) {
+                op->done.callback(err, op->done.arg);
+            }
+            if (op->done.semaphore) {
+                xSemaphoreGive(op->done.semaphore);
+            }
+            free(op);
+            if (more) {
+                vTaskDelay(1);
+            }
+        }
+    }
+}
+
+esp_err_t spi_flash_queue_init()
+{
+    if (xTaskCreatePinnedToCore(&flash_queue_task, "spi_flash", CONFIG_SPI_FLASH_QUEUE_TASK_STACK_SIZE, NULL,
+            CONFIG_SPI_FLASH_QUEUE_TASK_PRIORITY, &s_queue_task, tskNO_AFFINITY) != pdPASS) {
+        return ESP_ERR_NO_MEM;
+    }
+    return ESP_OK;
+}
+
+static esp_err_t flash_queue_submit(flash_queue_op_type_t type, size_t address, const void* src, size_t size,
+        const spi_flash_queue_done_t* done)
+{
+    if (s_queue_task == NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    flash_queue_op_t* op = (flash_queue_op_t*) calloc(1, sizeof(flash_queue_op_t));
+    if (op == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    op->type = type;
+    op->address = address;
+    op->src = (const uint8_t*) src;
+    op->size = size;
+    if (done) {
+        op->done = *done;
+    }
+    portENTER_CRITICAL(&s_queue_lock);
+    flash_queue_op_t** it = &s_queue_head;
+    while (*it != NULL && (*it)->done.priority >= op->done.priority) {
+        it = &(*it)->next;
+    }
+    op->next = *it;
+    *it = op;
+    ++s_queue_pending;
+    portEXIT_CRITICAL(&s_queue_lock);
+    xTaskNotifyGive(s_queue_task);
+    return ESP_OK;
+}
+
+esp_err_t spi_flash_queue_erase_range(size_t start_address, size_t size, const spi_flash_queue_done_t* done)
+{
+    if (start_address % SPI_FLASH_SEC_SIZE != 0) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (size % SPI_FLASH_SEC_SIZE != 0) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    if (size + start_address > spi_flash_get_chip_size()) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    return flash_queue_submit(FLASH_QUEUE_ERASE, start_address, NULL, size, done);
+}
+
+esp_err_t spi_flash_queue_write(size_t dest_addr, const void* src, size_t size, const spi_flash_queue_done_t* done)
+{
+    if (dest_addr + size > spi_flash_get_chip_size()) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    return flash_queue_submit(FLASH_QUEUE_WRITE, dest_addr, src, size, done);
+}
+
+size_t spi_flash_queue_pending()
+{
+    return s_queue_pending;
+}
+
+#endif //CONFIG_SPI_FLASH_QUEUE
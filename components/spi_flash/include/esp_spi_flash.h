@@ -197,6 +197,38 @@ void spi_flash_munmap(spi_flash_mmap_handle_t handle);
  */
 void spi_flash_mmap_dump();
 
+/**
+ * @brief Find the first byte in a region of flash which is not erased (0xff)
+ *
+ * The region is mapped into data address space 256kB at a time, and compared
+ * one 32-bit word at a time, stopping at the first word which is not 0xffffffff.
+ * If flash encryption is enabled, the region is read using spi_flash_read instead,
+ * because mapped data is decrypted.
+ *
+ * @param start_addr  Address where the region starts, no alignment is required
+ * @param size  Size of the region, in bytes
+ * @param out_addr  Output, address of the first byte which is not 0xff
+ *
+ * @return
+ *      - ESP_OK if a byte which is not 0xff is found
+ *      - ESP_ERR_NOT_FOUND if the whole region is erased
+ *      - ESP_ERR_INVALID_SIZE if the region is outside of flash chip
+ *      - ESP_ERR_NO_MEM if the region can not be mapped
+ */
+esp_err_t spi_flash_find_first_non_erased(size_t start_addr, size_t size, size_t *out_addr);
+
+/**
+ * @brief Check if a region of flash is erased (all bytes are 0xff)
+ *
+ * This is faster than reading the region into RAM, see spi_flash_find_first_non_erased.
+ *
+ * @param start_addr  Address where the region starts, no alignment is required
+ * @param size  Size of the region, in bytes
+ *
+ * @return true if the region is erased, false if it is not or in case of an error
+ */
+bool spi_flash_is_erased(size_t start_addr, size_t size);
+
 
 #define SPI_FLASH_CACHE2PHYS_FAIL UINT32_MAX /*<! Result from spi_flash_cache2phys() if flash cache address is invalid */
 
@@ -312,6 +344,8 @@ extern const spi_flash_guard_funcs_t g_flash_guard_no_os_ops;
 
 #if CONFIG_SPI_FLASH_ENABLE_COUNTERS
 
+#define SPI_FLASH_COUNTER_HISTOGRAM_SIZE 8   /**< number of latency histogram buckets */
+
 /**
  * Structure holding statistics for one type of operation
  */
@@ -319,14 +353,26 @@ typedef struct {
     uint32_t count;     // number of times operation was executed
     uint32_t time;      // total time taken, in microseconds
     uint32_t bytes;     // total number of bytes
+    uint32_t max_time;  // longest time taken by one operation, in microseconds
+    // number of operations which took <16us, <64us, <256us, <1ms, <4ms, <16ms, <64ms, 64ms or more
+    uint32_t histogram[SPI_FLASH_COUNTER_HISTOGRAM_SIZE];
 } spi_flash_counter_t;
 
 typedef struct {
     spi_flash_counter_t read;
     spi_flash_counter_t write;
     spi_flash_counter_t erase;
+    spi_flash_counter_t cache_disabled;  // periods when flash cache was disabled, bytes are not counted
 } spi_flash_counters_t;
 
+/**
+ * Structure holding statistics of the operations done with one caller tag
+ */
+typedef struct {
+    const char *tag;                // caller tag, NULL for operations without a tag
+    spi_flash_counters_t counters;  // statistics of the operations
+} spi_flash_caller_counters_t;
+
 /**
  * @brief  Reset SPI flash operation counters
  */
@@ -345,6 +391,39 @@ void spi_flash_dump_counters();
  */
 const spi_flash_counters_t* spi_flash_get_counters();
 
+/**
+ * @brief  Set caller tag of the operations done by the current task
+ *
+ * Time of the following flash operations done by this task, including
+ * periods when flash cache was disabled, is also counted for this tag.
+ * NVS sets tag "nvs", and esp_partition_* functions use the partition label
+ * if the task has no tag.
+ *
+ * The tag string is not copied, it must stay valid. Up to
+ * CONFIG_SPI_FLASH_COUNTERS_CALLERS tags are counted, and up to the same
+ * number of tasks can have a tag at the same time.
+ * Operations beyond these limits are counted without a tag.
+ *
+ * @param  tag  caller tag, or NULL to remove the tag of the current task
+ *
+ * @return  previous tag of the current task, which should be restored
+ *          when the tagged operations are done
+ */
+const char *spi_flash_counters_set_caller(const char *tag);
+
+/**
+ * @brief  Get SPI flash operation counters of each caller tag
+ *
+ * The last entry filled holds the counters of the operations without a tag,
+ * unless count is smaller than the number of tags.
+ *
+ * @param  out_counters  array to fill
+ * @param  count  number of entries in out_counters
+ *
+ * @return  number of entries filled
+ */
+size_t spi_flash_get_caller_counters(spi_flash_caller_counters_t *out_counters, size_t count);
+
 #endif //CONFIG_SPI_FLASH_ENABLE_COUNTERS
 
 #ifdef __cplusplus
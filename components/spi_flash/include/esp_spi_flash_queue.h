@@ -0,0 +1,121 @@
+// Copyright 2015-2017 Espressif Systems (Shanghai) PTE LTD
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef ESP_SPI_FLASH_QUEUE_H
+#define ESP_SPI_FLASH_QUEUE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "esp_err.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "sdkconfig.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#if CONFIG_SPI_FLASH_QUEUE
+
+/**
+ * @brief Callback called when a queued flash operation completes
+ *
+ * The callback is called from the flash queue task. It should not block.
+ *
+ * @param result  ESP_OK if the operation succeeded, error code of
+ *                spi_flash_erase_range or spi_flash_write otherwise
+ * @param arg     argument given in spi_flash_queue_done_t
+ */
+typedef void (*spi_flash_queue_cb_t)(esp_err_t result, void* arg);
+
+/**
+ * @brief Priority and completion notification of a queued flash operation
+ */
+typedef struct {
+    uint8_t priority;               /**< operations with higher priority are executed first */
+    spi_flash_queue_cb_t callback;  /**< called when the operation completes, may be NULL */
+    void* arg;                      /**< argument passed to the callback */
+    SemaphoreHandle_t semaphore;    /**< given when the operation completes (after the callback), may be NULL */
+} spi_flash_queue_done_t;
+
+/**
+ * @brief  Start the task which executes queued flash operations
+ *
+ *  Currently this function is called from spi_flash_init. There is
+ *  no need to call it from application code.
+ *
+ * @return ESP_OK on success, ESP_ERR_NO_MEM if the task can not be created
+ */
+esp_err_t spi_flash_queue_init();
+
+/**
+ * @brief  Queue erase of a range of flash sectors
+ *
+ * The range is erased one sector at a time. Flash caches are enabled
+ * between the sectors, and an operation with higher priority submitted
+ * in the meantime is executed before the rest of the range.
+ *
+ * Operations with equal priority are executed in the order they were
+ * submitted. Operations which depend on each other (erase, then write
+ * of the same sector) must have the same priority.
+ *
+ * @param  start_address  Address where erase operation has to start.
+ *                        Must be 4kB-aligned
+ * @param  size  Size of erased range, in bytes. Must be divisible by 4kB.
+ * @param  done  Priority and completion notification, may be NULL
+ *
+ * @return
+ *      - ESP_OK if the operation is queued
+ *      - ESP_ERR_INVALID_ARG, ESP_ERR_INVALID_SIZE if the range is invalid
+ *      - ESP_ERR_NO_MEM if the operation can not be allocated
+ *      - ESP_ERR_INVALID_STATE if the queue task is not running
+ */
+esp_err_t spi_flash_queue_erase_range(size_t start_address, size_t size, const spi_flash_queue_done_t* done);
+
+/**
+ * @brief  Queue write of data to flash
+ *
+ * Data is written in steps of CONFIG_SPI_FLASH_QUEUE_WRITE_SLICE bytes,
+ * with the same ordering rules as spi_flash_queue_erase_range.
+ *
+ * @note The source buffer is not copied. It must stay valid until
+ *       the operation completes.
+ *
+ * @param  dest_addr destination address in Flash.
+ * @param  src       pointer to the source buffer.
+ * @param  size      length of data, in bytes.
+ * @param  done      Priority and completion notification, may be NULL
+ *
+ * @return
+ *      - ESP_OK if the operation is queued
+ *      - ESP_ERR_INVALID_SIZE if the range is outside of flash chip
+ *      - ESP_ERR_NO_MEM if the operation can not be allocated
+ *      - ESP_ERR_INVALID_STATE if the queue task is not running
+ */
+esp_err_t spi_flash_queue_write(size_t dest_addr, const void* src, size_t size, const spi_flash_queue_done_t* done);
+
+/**
+ * @brief  Get number of queued operations which have not completed yet
+ *
+ * @return number of operations, including the one being executed
+ */
+size_t spi_flash_queue_pending();
+
+#endif //CONFIG_SPI_FLASH_QUEUE
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* ESP_SPI_FLASH_QUEUE_H */
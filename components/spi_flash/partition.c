@@ -32,6 +32,19 @@
 #endif
 #include "rom/queue.h"
 
+#if CONFIG_SPI_FLASH_ENABLE_COUNTERS
+/* Count flash operations for the partition label, unless the task has a caller tag already */
+#define PARTITION_CALLER_BEGIN(partition) \
+    const char* prev_caller = spi_flash_counters_set_caller((partition)->label); \
+    if (prev_caller) { \
+        spi_flash_counters_set_caller(prev_caller); \
+    }
+#define PARTITION_CALLER_END() spi_flash_counters_set_caller(prev_caller)
+#else
+#define PARTITION_CALLER_BEGIN(partition)
+#define PARTITION_CALLER_END()
+#endif //CONFIG_SPI_FLASH_ENABLE_COUNTERS
+
 
 typedef struct partition_list_item_ {
     esp_partition_t info;
@@ -236,7 +249,10 @@ esp_err_t esp_partition_read(const esp_partition_t* partition,
     }
 
     if (!partition->encrypted) {
-        return spi_flash_read(partition->address + src_offset, dst, size);
+        PARTITION_CALLER_BEGIN(partition);
+        esp_err_t err = spi_flash_read(partition->address + src_offset, dst, size);
+        PARTITION_CALLER_END();
+        return err;
     } else {
         /* Encrypted partitions need to be read via a cache mapping */
         const void *buf;
@@ -265,11 +281,15 @@ esp_err_t esp_partition_write(const esp_partition_t* partition,
         return ESP_ERR_INVALID_SIZE;
     }
     dst_offset = partition->address + dst_offset;
+    esp_err_t err;
+    PARTITION_CALLER_BEGIN(partition);
     if (partition->encrypted) {
-        return spi_flash_write_encrypted(dst_offset, src, size);
+        err = spi_flash_write_encrypted(dst_offset, src, size);
     } else {
-        return spi_flash_write(dst_offset, src, size);
+        err = spi_flash_write(dst_offset, src, size);
     }
+    PARTITION_CALLER_END();
+    return err;
 }
 
 esp_err_t esp_partition_erase_range(const esp_partition_t* partition,
@@ -288,7 +308,10 @@ esp_err_t esp_partition_erase_range(const esp_partition_t* partition,
     if (start_addr % SPI_FLASH_SEC_SIZE != 0) {
         return ESP_ERR_INVALID_ARG;
     }
-    return spi_flash_erase_range(partition->address + start_addr, size);
+    PARTITION_CALLER_BEGIN(partition);
+    esp_err_t err = spi_flash_erase_range(partition->address + start_addr, size);
+    PARTITION_CALLER_END();
+    return err;
 
 }
 
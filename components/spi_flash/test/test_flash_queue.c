@@ -0,0 +1,128 @@
+#include <stdio.h>
+#include <string.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/semphr.h>
+
+#include <unity.h>
+#include <test_utils.h>
+#include <esp_spi_flash.h>
+#include <esp_spi_flash_queue.h>
+
+#if CONFIG_SPI_FLASH_QUEUE
+
+#define ORDER_MAX 8
+
+static int s_order[ORDER_MAX];
+static esp_err_t s_results[ORDER_MAX];
+static volatile int s_completed;
+
+static void record_done(esp_err_t result, void* arg)
+{
+    if (s_completed < ORDER_MAX) {
+        s_order[s_completed] = (int) arg;
+        s_results[s_completed] = result;
+    }
+    ++s_completed;
+}
+
+static size_t test_start()
+{
+    s_completed = 0;
+    return get_test_data_partition()->address;
+}
+
+TEST_CASE("queued erase and write complete with callback and semaphore", "[spi_flash]")
+{
+    const size_t start = test_start();
+    SemaphoreHandle_t sem = xSemaphoreCreateCounting(2, 0);
+    static uint32_t data[1000];
+    for (int i = 0; i < sizeof(data) / sizeof(data[0]); ++i) {
+        data[i] = 0x5a000000 + i;
+    }
+    spi_flash_queue_done_t done = {
+        .callback = &record_done,
+        .arg = (void*) 1,
+        .semaphore = sem
+    };
+    TEST_ESP_OK(spi_flash_queue_erase_range(start, 2 * SPI_FLASH_SEC_SIZE, &done));
+    done.arg = (void*) 2;
+    // unaligned destination, split into several slices
+    TEST_ESP_OK(spi_flash_queue_write(start + 2, data, sizeof(data) - 2, &done));
+    TEST_ASSERT_TRUE(xSemaphoreTake(sem, 1000 / portTICK_PERIOD_MS));
+    TEST_ASSERT_TRUE(xSemaphoreTake(sem, 1000 / portTICK_PERIOD_MS));
+    TEST_ASSERT_EQUAL(0, spi_flash_queue_pending());
+    TEST_ASSERT_EQUAL(2, s_completed);
+    TEST_ASSERT_EQUAL(1, s_order[0]);
+    TEST_ASSERT_EQUAL(2, s_order[1]);
+    TEST_ESP_OK(s_results[0]);
+    TEST_ESP_OK(s_results[1]);
+
+    static uint32_t readback[1000];
+    TEST_ESP_OK(spi_flash_read(start + 2, readback, sizeof(readback) - 2));
+    TEST_ASSERT_EQUAL(0, memcmp(data, readback, sizeof(data) - 2));
+    uint16_t head;
+    TEST_ESP_OK(spi_flash_read(start, &head, sizeof(head)));
+    TEST_ASSERT_EQUAL_HEX16(0xffff, head);
+    vSemaphoreDelete(sem);
+}
+
+TEST_CASE("queued operation with higher priority runs between erase steps", "[spi_flash]")
+{
+    const size_t start = test_start();
+    SemaphoreHandle_t sem = xSemaphoreCreateCounting(2, 0);
+    spi_flash_queue_done_t low = {
+        .priority = 0,
+        .callback = &record_done,
+        .arg = (void*) 1,
+        .semaphore = sem
+    };
+    spi_flash_queue_done_t high = {
+        .priority = 10,
+        .callback = &record_done,
+        .arg = (void*) 2,
+        .semaphore = sem
+    };
+    // the first and the last sector of the long erase are marked, to see its progress
+    const uint32_t mark = 0;
+    uint32_t word;
+    TEST_ESP_OK(spi_flash_erase_range(start, 8 * SPI_FLASH_SEC_SIZE));
+    TEST_ESP_OK(spi_flash_write(start, &mark, sizeof(mark)));
+    TEST_ESP_OK(spi_flash_write(start + 7 * SPI_FLASH_SEC_SIZE, &mark, sizeof(mark)));
+
+    TEST_ESP_OK(spi_flash_queue_erase_range(start, 8 * SPI_FLASH_SEC_SIZE, &low));
+    // the caller keeps running while the range is being erased;
+    // wait until the first step is done
+    int wait_ms = 0;
+    do {
+        vTaskDelay(1);
+        wait_ms += portTICK_PERIOD_MS;
+        TEST_ESP_OK(spi_flash_read(start, &word, sizeof(word)));
+    } while (word != 0xffffffff && wait_ms < 1000);
+    TEST_ASSERT_EQUAL_HEX32(0xffffffff, word);
+    TEST_ASSERT_EQUAL(1, spi_flash_queue_pending());
+
+    TEST_ESP_OK(spi_flash_queue_erase_range(start + 8 * SPI_FLASH_SEC_SIZE, SPI_FLASH_SEC_SIZE, &high));
+    TEST_ASSERT_TRUE(xSemaphoreTake(sem, 2000 / portTICK_PERIOD_MS));
+    // high priority operation is done, the long erase is not
+    TEST_ASSERT_EQUAL(1, s_completed);
+    TEST_ASSERT_EQUAL(2, s_order[0]);
+    TEST_ASSERT_EQUAL(1, spi_flash_queue_pending());
+    TEST_ASSERT_TRUE(xSemaphoreTake(sem, 2000 / portTICK_PERIOD_MS));
+    TEST_ASSERT_EQUAL(2, s_completed);
+    TEST_ASSERT_EQUAL(1, s_order[1]);
+    TEST_ESP_OK(spi_flash_read(start + 7 * SPI_FLASH_SEC_SIZE, &word, sizeof(word)));
+    TEST_ASSERT_EQUAL_HEX32(0xffffffff, word);
+    vSemaphoreDelete(sem);
+}
+
+TEST_CASE("queued operations check arguments", "[spi_flash]")
+{
+    const size_t start = test_start();
+    TEST_ASSERT_EQUAL(ESP_ERR_INVALID_ARG, spi_flash_queue_erase_range(start + 4, SPI_FLASH_SEC_SIZE, NULL));
+    TEST_ASSERT_EQUAL(ESP_ERR_INVALID_SIZE, spi_flash_queue_erase_range(start, 100, NULL));
+    TEST_ASSERT_EQUAL(ESP_ERR_INVALID_SIZE, spi_flash_queue_write(spi_flash_get_chip_size() - 4, &start, 8, NULL));
+    TEST_ASSERT_EQUAL(0, s_completed);
+}
+
+#endif //CONFIG_SPI_FLASH_QUEUE
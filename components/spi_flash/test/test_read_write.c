@@ -217,3 +217,23 @@ TEST_CASE("Test spi_flash_write", "[spi_flash]")
     ESP_ERROR_CHECK(spi_flash_write(start, (char *) 0x40078000, 16));
     ESP_ERROR_CHECK(spi_flash_write(start, (char *) 0x40080000, 16));
 }
+
+TEST_CASE("Test spi_flash_is_erased", "[spi_flash]")
+{
+    setup_tests();
+    ESP_ERROR_CHECK(spi_flash_erase_sector(start / SPI_FLASH_SEC_SIZE));
+    TEST_ASSERT_TRUE(spi_flash_is_erased(start, SPI_FLASH_SEC_SIZE));
+    TEST_ASSERT_TRUE(spi_flash_is_erased(start + 3, 0));
+    size_t addr;
+    TEST_ASSERT_EQUAL(ESP_ERR_NOT_FOUND, spi_flash_find_first_non_erased(start + 1, SPI_FLASH_SEC_SIZE - 2, &addr));
+
+    const uint8_t val[3] = { 0xff, 0x7f, 0x00 };
+    ESP_ERROR_CHECK(spi_flash_write(start + 1001, val, sizeof(val)));
+    TEST_ESP_OK(spi_flash_find_first_non_erased(start, SPI_FLASH_SEC_SIZE, &addr));
+    TEST_ASSERT_EQUAL_HEX32(start + 1002, addr);
+    TEST_ASSERT_TRUE(spi_flash_is_erased(start, 1002));
+    TEST_ASSERT_FALSE(spi_flash_is_erased(start, 1003));
+    TEST_ASSERT_FALSE(spi_flash_is_erased(start + 1003, 1));
+    TEST_ASSERT_TRUE(spi_flash_is_erased(start + 1004, SPI_FLASH_SEC_SIZE - 1004));
+    TEST_ASSERT_EQUAL(ESP_ERR_INVALID_SIZE, spi_flash_find_first_non_erased(spi_flash_get_chip_size() - 4, 8, &addr));
+}
@@ -1,9 +1,11 @@
 #include <stdio.h>
+#include <string.h>
 #include <freertos/FreeRTOS.h>
 #include <freertos/task.h>
 #include <freertos/semphr.h>
 
 #include <unity.h>
+#include <test_utils.h>
 #include <esp_spi_flash.h>
 #include <esp_attr.h>
 #include "driver/timer.h"
@@ -167,3 +169,61 @@ TEST_CASE("spi flash functions can run along with IRAM interrupts", "[spi_flash]
     free(read_arg.buf);
 }
 
+
+#if CONFIG_SPI_FLASH_ENABLE_COUNTERS
+
+static uint32_t histogram_sum(const spi_flash_counter_t *counter)
+{
+    uint32_t sum = 0;
+    for (int i = 0; i < SPI_FLASH_COUNTER_HISTOGRAM_SIZE; ++i) {
+        sum += counter->histogram[i];
+    }
+    return sum;
+}
+
+TEST_CASE("flash operations are counted per caller tag", "[spi_flash]")
+{
+    const esp_partition_t *part = get_test_data_partition();
+    static const char *tag = "test";
+    spi_flash_reset_counters();
+
+    const char *prev = spi_flash_counters_set_caller(tag);
+    TEST_ESP_OK(spi_flash_erase_range(part->address, 2 * SPI_FLASH_SEC_SIZE));
+    uint32_t val = 0x12345678;
+    TEST_ESP_OK(spi_flash_write(part->address, &val, sizeof(val)));
+    TEST_ASSERT_EQUAL_PTR(tag, spi_flash_counters_set_caller(prev));
+    // without a tag
+    TEST_ESP_OK(spi_flash_read(part->address, &val, sizeof(val)));
+    // partition label is used as the tag
+    TEST_ESP_OK(esp_partition_read(part, 0, &val, sizeof(val)));
+
+    const spi_flash_counters_t *total = spi_flash_get_counters();
+    TEST_ASSERT_EQUAL(1, total->erase.count);
+    TEST_ASSERT_EQUAL(2 * SPI_FLASH_SEC_SIZE, total->erase.bytes);
+    TEST_ASSERT_EQUAL(1, histogram_sum(&total->erase));
+    TEST_ASSERT_EQUAL(total->erase.time, total->erase.max_time);
+    TEST_ASSERT_EQUAL(2, total->read.count);
+    TEST_ASSERT_EQUAL(2, histogram_sum(&total->read));
+    TEST_ASSERT_TRUE(total->read.max_time <= total->read.time);
+    // each sector erase, write and read disables the cache at least once
+    TEST_ASSERT_TRUE(total->cache_disabled.count >= 5);
+    TEST_ASSERT_EQUAL(total->cache_disabled.count, histogram_sum(&total->cache_disabled));
+    TEST_ASSERT_TRUE(total->cache_disabled.time <= total->erase.time + total->write.time + total->read.time);
+
+    spi_flash_caller_counters_t callers[CONFIG_SPI_FLASH_COUNTERS_CALLERS + 1];
+    size_t count = spi_flash_get_caller_counters(callers, CONFIG_SPI_FLASH_COUNTERS_CALLERS + 1);
+    TEST_ASSERT_EQUAL(3, count);
+    TEST_ASSERT_EQUAL_STRING(tag, callers[0].tag);
+    TEST_ASSERT_EQUAL(1, callers[0].counters.erase.count);
+    TEST_ASSERT_EQUAL(1, callers[0].counters.write.count);
+    TEST_ASSERT_EQUAL(0, callers[0].counters.read.count);
+    TEST_ASSERT_TRUE(callers[0].counters.cache_disabled.time > 0);
+    TEST_ASSERT_EQUAL_STRING(part->label, callers[1].tag);
+    TEST_ASSERT_EQUAL(1, callers[1].counters.read.count);
+    TEST_ASSERT_NULL(callers[2].tag);
+    TEST_ASSERT_EQUAL(1, callers[2].counters.read.count);
+
+    spi_flash_dump_counters();
+}
+
+#endif //CONFIG_SPI_FLASH_ENABLE_COUNTERS
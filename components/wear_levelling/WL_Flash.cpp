@@ -74,6 +74,7 @@ esp_err_t WL_Flash::config(wl_config_t *cfg, Flash_Access *flash_drv)
     }
     WL_RESULT_CHECK(result);
 
+    memset(&this->stats, 0, sizeof(this->stats));
     this->temp_buff = (uint8_t *)malloc(this->cfg.temp_buff_size);
     this->state_size = this->cfg.sector_size;
     if (this->state_size < (sizeof(wl_state_t) + (this->cfg.full_mem_size / this->cfg.sector_size)*this->cfg.wr_size)) {
@@ -105,6 +106,9 @@ esp_err_t WL_Flash::init()
     }
     // If flow will be interrupted by error, then this flag will be false
     this->initialized = false;
+    // Move that was not finished before will be started again
+    this->move_pending = false;
+    this->move_step = 0;
     // Init states if it is first time...
     this->flash_drv->read(this->addr_state1, &this->state, sizeof(wl_state_t));
     wl_state_t sa_copy;
@@ -280,9 +284,49 @@ esp_err_t WL_Flash::updateWL()
     if (this->state.access_count < this->state.max_count) {
         return result;
     }
+    // The previous move must be finished before the next one can start
+    if (this->move_pending) {
+        result = this->completeMove();
+        WL_RESULT_CHECK(result);
+    }
     // Here we have to move the block and increase the state
     this->state.access_count = 0;
     ESP_LOGV(TAG, "%s - access_count=0x%08x, pos=0x%08x", __func__, this->state.access_count, this->state.pos);
+    this->move_pending = true;
+    this->move_step = 0;
+    this->move_time = 0;
+    if (this->background_update) {
+        return result;
+    }
+    return this->completeMove();
+}
+
+esp_err_t WL_Flash::moveStep()
+{
+    uint32_t begin = WL_TIME_GET();
+    esp_err_t result = this->doMoveStep();
+    uint32_t time = WL_TIME_TO_US((uint32_t)(WL_TIME_GET() - begin));
+    this->stats.move_time += time;
+    this->move_time += time;
+    if ((result == ESP_OK) && !this->move_pending) {
+        this->stats.move_count++;
+        if (this->move_time > this->stats.max_move_time) {
+            this->stats.max_move_time = this->move_time;
+        }
+    }
+    return result;
+}
+
+esp_err_t WL_Flash::doMoveStep()
+{
+    esp_err_t result = ESP_OK;
+    // The move is split to steps:
+    // erase every sector of the dummy page, copy the page chunk by chunk,
+    // mark the position as used and, when position wraps, store both state copies.
+    size_t erase_count = this->cfg.page_size / this->cfg.sector_size;
+    size_t copy_count = this->cfg.page_size / this->cfg.temp_buff_size;
+    size_t mark_step = erase_count + copy_count;
+
     // copy data to dummy block
     size_t data_addr = this->state.pos + 1; // next block, [pos+1] copy to [pos]
     if (data_addr >= this->state.max_pos) {
@@ -290,77 +334,118 @@ esp_err_t WL_Flash::updateWL()
     }
     data_addr = this->cfg.start_addr + data_addr * this->cfg.page_size;
     this->dummy_addr = this->cfg.start_addr + this->state.pos * this->cfg.page_size;
-    result = this->flash_drv->erase_range(this->dummy_addr, this->cfg.page_size);
-    if (result != ESP_OK) {
-        ESP_LOGE(TAG, "%s - erase wl dummy sector result=%08x", __func__, result);
-        this->state.access_count = this->state.max_count - 1; // we will update next time
-        return result;
-    }
 
-    size_t copy_count = this->cfg.page_size / this->cfg.temp_buff_size;
-    for (size_t i = 0; i < copy_count; i++) {
-        result = this->flash_drv->read(data_addr + i * this->cfg.temp_buff_size, this->temp_buff, this->cfg.temp_buff_size);
+    if (this->move_step < erase_count) {
+        result = this->eraseRange(this->dummy_addr + this->move_step * this->cfg.sector_size, this->cfg.sector_size);
+        if (result != ESP_OK) {
+            ESP_LOGE(TAG, "%s - erase wl dummy sector result=%08x", __func__, result);
+            goto restart;
+        }
+    } else if (this->move_step < mark_step) {
+        size_t offset = (this->move_step - erase_count) * this->cfg.temp_buff_size;
+        result = this->flash_drv->read(data_addr + offset, this->temp_buff, this->cfg.temp_buff_size);
         if (result != ESP_OK) {
             ESP_LOGE(TAG, "%s - not possible to read buffer, will try next time, result=%08x", __func__, result);
-            this->state.access_count = this->state.max_count - 1; // we will update next time
-            return result;
+            goto restart;
         }
-        result = this->flash_drv->write(this->dummy_addr + i * this->cfg.temp_buff_size, this->temp_buff, this->cfg.temp_buff_size);
+        result = this->flash_drv->write(this->dummy_addr + offset, this->temp_buff, this->cfg.temp_buff_size);
         if (result != ESP_OK) {
             ESP_LOGE(TAG, "%s - not possible to write buffer, will try next time, result=%08x", __func__, result);
-            this->state.access_count = this->state.max_count - 1; // we will update next time
-            return result;
+            goto restart;
+        }
+    } else if (this->move_step == mark_step) {
+        // done... block moved.
+        // Here we will update structures...
+        // Update bits and save to flash:
+        uint32_t byte_pos = this->state.pos * this->cfg.wr_size;
+        this->used_bits = 0;
+        // write state to mem. We updating only affected bits
+        result |= this->flash_drv->write(this->addr_state1 + sizeof(wl_state_t) + byte_pos, &this->used_bits, 1);
+        if (result != ESP_OK) {
+            ESP_LOGE(TAG, "%s - update position 1 result=%08x", __func__, result);
+            goto restart;
+        }
+        result |= this->flash_drv->write(this->addr_state2 + sizeof(wl_state_t) + byte_pos, &this->used_bits, 1);
+        if (result != ESP_OK) {
+            ESP_LOGE(TAG, "%s - update position 2 result=%08x", __func__, result);
+            goto restart;
         }
-    }
-    // done... block moved.
-    // Here we will update structures...
-    // Update bits and save to flash:
-    uint32_t byte_pos = this->state.pos * this->cfg.wr_size;
-    this->used_bits = 0;
-    // write state to mem. We updating only affected bits
-    result |= this->flash_drv->write(this->addr_state1 + sizeof(wl_state_t) + byte_pos, &this->used_bits, 1);
-    if (result != ESP_OK) {
-        ESP_LOGE(TAG, "%s - update position 1 result=%08x", __func__, result);
-        this->state.access_count = this->state.max_count - 1; // we will update next time
-        return result;
-    }
-    result |= this->flash_drv->write(this->addr_state2 + sizeof(wl_state_t) + byte_pos, &this->used_bits, 1);
-    if (result != ESP_OK) {
-        ESP_LOGE(TAG, "%s - update position 2 result=%08x", __func__, result);
-        this->state.access_count = this->state.max_count - 1; // we will update next time
-        return result;
-    }
 
-    this->state.pos++;
-    if (this->state.pos >= this->state.max_pos) {
+        this->state.pos++;
+        if (this->state.pos < this->state.max_pos) {
+            this->move_pending = false;
+            ESP_LOGV(TAG, "%s - result=%08x", __func__, result);
+            return result;
+        }
         this->state.pos = 0;
         // one loop more
         this->state.move_count++;
         if (this->state.move_count >= (this->state.max_pos - 1)) {
             this->state.move_count = 0;
         }
-        // write main state
         this->state.crc = crc32::crc32_le(WL_CFG_CRC_CONST, (uint8_t *)&this->state, sizeof(wl_state_t) - sizeof(uint32_t));
-
-        result = this->flash_drv->erase_range(this->addr_state1, this->state_size);
-        WL_RESULT_CHECK(result);
-        result = this->flash_drv->write(this->addr_state1, &this->state, sizeof(wl_state_t));
-        WL_RESULT_CHECK(result);
-        result = this->flash_drv->erase_range(this->addr_state2, this->state_size);
+        this->move_state = this->state;
+    } else {
+        // write main state, then the copy. On failure the same step is repeated
+        size_t addr_state = (this->move_step == mark_step + 1) ? this->addr_state1 : this->addr_state2;
+        result = this->eraseRange(addr_state, this->state_size);
         WL_RESULT_CHECK(result);
-        result = this->flash_drv->write(this->addr_state2, &this->state, sizeof(wl_state_t));
+        result = this->flash_drv->write(addr_state, &this->move_state, sizeof(wl_state_t));
         WL_RESULT_CHECK(result);
-        ESP_LOGD(TAG, "%s - move_count=%08x", __func__, this->state.move_count);
+        if (addr_state == this->addr_state2) {
+            this->move_pending = false;
+            ESP_LOGD(TAG, "%s - move_count=%08x", __func__, this->state.move_count);
+            return result;
+        }
     }
-    // Save structures to the flash... and check result
-    if (result == ESP_OK) {
-        ESP_LOGV(TAG, "%s - result=%08x", __func__, result);
-    } else {
-        ESP_LOGE(TAG, "%s - result=%08x", __func__, result);
+    this->move_step++;
+    return result;
+
+restart:
+    // The dummy page holds no valid data until the position is marked,
+    // so the move could be started from the beginning.
+    this->move_step = 0;
+    if (!this->background_update) {
+        this->move_pending = false;
+        this->state.access_count = this->state.max_count - 1; // we will update next time
     }
     return result;
 }
 
+esp_err_t WL_Flash::eraseRange(size_t addr, size_t size)
+{
+    this->stats.flash_erase_count += (size + this->cfg.sector_size - 1) / this->cfg.sector_size;
+    return this->flash_drv->erase_range(addr, size);
+}
+
+esp_err_t WL_Flash::completeMove()
+{
+    esp_err_t result = ESP_OK;
+    while (this->move_pending) {
+        result = this->moveStep();
+        WL_RESULT_CHECK(result);
+    }
+    return result;
+}
+
+esp_err_t WL_Flash::syncMove(size_t virt_addr, size_t size)
+{
+    // Data of the page that is being copied must not be changed before the copy is done
+    if (!this->move_pending) {
+        return ESP_OK;
+    }
+    size_t src_addr = this->state.pos + 1;
+    if (src_addr >= this->state.max_pos) {
+        src_addr = 0;
+    }
+    src_addr = src_addr * this->cfg.page_size;
+    if ((virt_addr < src_addr + this->cfg.page_size) && (virt_addr + size > src_addr)) {
+        ESP_LOGV(TAG, "%s - virt_addr=0x%08x hits moved page, finish the move", __func__, (uint32_t) virt_addr);
+        return this->completeMove();
+    }
+    return ESP_OK;
+}
+
 size_t WL_Flash::calcAddr(size_t addr)
 {
     size_t result = (this->flash_size - this->state.move_count * this->cfg.page_size + addr) % this->flash_size;
@@ -373,6 +458,29 @@ size_t WL_Flash::calcAddr(size_t addr)
     return result;
 }
 
+size_t WL_Flash::calcRun(size_t addr, size_t size, size_t *run_addr)
+{
+    // Same conversion as calcAddr, but also returns how many bytes from addr
+    // are continuous in real memory. The run ends at the end of the data
+    // region (where the address wraps around) or at the dummy page.
+    size_t result = (this->flash_size - this->state.move_count * this->cfg.page_size + addr) % this->flash_size;
+    size_t dummy_addr = this->state.pos * this->cfg.page_size;
+    size_t run_size = this->flash_size - result;
+    if (result < dummy_addr) {
+        if (dummy_addr - result < run_size) {
+            run_size = dummy_addr - result;
+        }
+    } else {
+        result += this->cfg.page_size;
+    }
+    if (size < run_size) {
+        run_size = size;
+    }
+    *run_addr = result;
+    ESP_LOGV(TAG, "%s - addr=0x%08x -> result=0x%08x, run_size=0x%08x", __func__, (uint32_t) addr, (uint32_t) result, (uint32_t) run_size);
+    return run_size;
+}
+
 
 size_t WL_Flash::chip_size()
 {
@@ -396,11 +504,15 @@ esp_err_t WL_Flash::erase_sector(size_t sector)
     if (!this->initialized) {
         return ESP_ERR_INVALID_STATE;
     }
+    WL_OpTimer timer(&this->stats);
+    this->stats.erase_count++;
     ESP_LOGV(TAG, "%s - sector=0x%08x", __func__, (uint32_t) sector);
     result = this->updateWL();
     WL_RESULT_CHECK(result);
+    result = this->syncMove(this->calcAddr(sector * this->cfg.sector_size), this->cfg.sector_size);
+    WL_RESULT_CHECK(result);
     size_t virt_addr = this->calcAddr(sector * this->cfg.sector_size);
-    result = this->flash_drv->erase_sector((this->cfg.start_addr + virt_addr) / this->cfg.sector_size);
+    result = this->eraseRange(this->cfg.start_addr + virt_addr, this->cfg.sector_size);
     WL_RESULT_CHECK(result);
     return result;
 }
@@ -412,10 +524,27 @@ esp_err_t WL_Flash::erase_range(size_t start_address, size_t size)
     }
     ESP_LOGV(TAG, "%s - start_address=0x%08x, size=0x%08x", __func__, (uint32_t) start_address, (uint32_t) size);
     size_t erase_count = (size + this->cfg.sector_size - 1) / this->cfg.sector_size;
-    size_t start_sector = start_address / this->cfg.sector_size;
-    for (size_t i = 0; i < erase_count; i++) {
-        result = this->erase_sector(start_sector + i);
+    size_t addr = start_address / this->cfg.sector_size * this->cfg.sector_size;
+    size_t end_addr = addr + erase_count * this->cfg.sector_size;
+    if (erase_count == 0) {
+        return result;
+    }
+    WL_OpTimer timer(&this->stats);
+    this->stats.erase_count += erase_count;
+    // The whole range is counted as one access
+    result = this->updateWL();
+    WL_RESULT_CHECK(result);
+    // The range is erased by continuous runs in real memory, so the flash
+    // driver could use block erase where the run is aligned
+    while (addr < end_addr) {
+        size_t virt_addr;
+        size_t run_size = this->calcRun(addr, end_addr - addr, &virt_addr);
+        result = this->syncMove(virt_addr, run_size);
+        WL_RESULT_CHECK(result);
+        run_size = this->calcRun(addr, end_addr - addr, &virt_addr);
+        result = this->eraseRange(this->cfg.start_addr + virt_addr, run_size);
         WL_RESULT_CHECK(result);
+        addr += run_size;
     }
     ESP_LOGV(TAG, "%s - result=%08x", __func__, result);
     return result;
@@ -427,13 +556,20 @@ esp_err_t WL_Flash::write(size_t dest_addr, const void *src, size_t size)
     if (!this->initialized) {
         return ESP_ERR_INVALID_STATE;
     }
+    WL_OpTimer timer(&this->stats);
+    this->stats.write_count++;
+    this->stats.write_bytes += size;
     ESP_LOGV(TAG, "%s - dest_addr=0x%08x, size=0x%08x", __func__, (uint32_t) dest_addr, (uint32_t) size);
     uint32_t count = (size - 1) / this->cfg.page_size;
     for (size_t i = 0; i < count; i++) {
+        result = this->syncMove(this->calcAddr(dest_addr + i * this->cfg.page_size), this->cfg.page_size);
+        WL_RESULT_CHECK(result);
         size_t virt_addr = this->calcAddr(dest_addr + i * this->cfg.page_size);
         result = this->flash_drv->write(this->cfg.start_addr + virt_addr, &((uint8_t *)src)[i * this->cfg.page_size], size);
         WL_RESULT_CHECK(result);
     }
+    result = this->syncMove(this->calcAddr(dest_addr + count * this->cfg.page_size), size - count * this->cfg.page_size);
+    WL_RESULT_CHECK(result);
     size_t virt_addr_last = this->calcAddr(dest_addr + count * this->cfg.page_size);
     result = this->flash_drv->write(this->cfg.start_addr + virt_addr_last, &((uint8_t *)src)[count * this->cfg.page_size], size - count * this->cfg.page_size);
     WL_RESULT_CHECK(result);
@@ -446,6 +582,9 @@ esp_err_t WL_Flash::read(size_t src_addr, void *dest, size_t size)
     if (!this->initialized) {
         return ESP_ERR_INVALID_STATE;
     }
+    WL_OpTimer timer(&this->stats);
+    this->stats.read_count++;
+    this->stats.read_bytes += size;
     ESP_LOGV(TAG, "%s - src_addr=0x%08x, size=0x%08x", __func__, (uint32_t) src_addr, (uint32_t) size);
     uint32_t count = (size - 1) / this->cfg.page_size;
     for (size_t i = 0; i < count; i++) {
@@ -468,11 +607,45 @@ wl_config_t *WL_Flash::get_cfg()
     return &this->cfg;
 }
 
+void WL_Flash::set_background_update(bool enable)
+{
+    this->background_update = enable;
+}
+
+bool WL_Flash::update_pending()
+{
+    return this->move_pending;
+}
+
+esp_err_t WL_Flash::update_step()
+{
+    if (!this->initialized) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (!this->move_pending) {
+        return ESP_OK;
+    }
+    return this->moveStep();
+}
+
+size_t WL_Flash::data_sectors()
+{
+    return (this->addr_state1 - this->cfg.start_addr) / this->cfg.sector_size;
+}
+
+void WL_Flash::get_stats(wl_stats_t *out_stats)
+{
+    memcpy(out_stats, &this->stats, sizeof(wl_stats_t));
+}
+
 esp_err_t WL_Flash::flush()
 {
     esp_err_t result = ESP_OK;
     this->state.access_count = this->state.max_count - 1;
     result = this->updateWL();
+    if (result == ESP_OK) {
+        result = this->completeMove();
+    }
     ESP_LOGV(TAG, "%s - result=%08x", __func__, result);
     return result;
 }
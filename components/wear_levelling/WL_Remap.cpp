@@ -0,0 +1,752 @@
+// Copyright 2015-2017 Espressif Systems (Shanghai) PTE LTD
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "esp_log.h"
+#include "WL_Remap.h"
+#include "crc32.h"
+
+static const char *TAG = "wl_remap";
+#ifndef WL_CFG_CRC_CONST
+#define WL_CFG_CRC_CONST UINT32_MAX
+#endif // WL_CFG_CRC_CONST
+
+#define WL_RESULT_CHECK(result) \
+    if (result != ESP_OK) { \
+        ESP_LOGE(TAG,"%s(%d): result = 0x%08x", __FUNCTION__, __LINE__, result); \
+        return (result); \
+    }
+
+// Minimum amount of sectors for the records in one log area. Every erase and write
+// of the sector adds about 3 records, so the log area is made large enough to be
+// erased not more often than the data sectors.
+#ifndef WL_REMAP_LOG_SECTORS
+#define WL_REMAP_LOG_SECTORS    4
+#endif // WL_REMAP_LOG_SECTORS
+
+// Minimum amount of physical sectors which are not used for logical sectors
+#ifndef WL_REMAP_MIN_SPARE
+#define WL_REMAP_MIN_SPARE      4
+#endif // WL_REMAP_MIN_SPARE
+
+// One sector is relocated every (updaterate * WL_REMAP_RELOCATE_RATE) allocations,
+// so sectors with static data also take part in wear levelling
+#ifndef WL_REMAP_RELOCATE_RATE
+#define WL_REMAP_RELOCATE_RATE  4
+#endif // WL_REMAP_RELOCATE_RATE
+
+#define WL_REMAP_MAGIC          0x50414d52
+#define WL_REMAP_NONE           0xffff
+
+#define WL_REMAP_RECORD_MAP     0x0001  // logical sector is mapped to physical sector
+#define WL_REMAP_RECORD_UNMAP   0x0002  // logical sector is erased
+#define WL_REMAP_RECORD_ALLOC   0x0003  // physical sector is used as relocation target
+#define WL_REMAP_RECORD_FREE    0x0004  // physical sector is erased
+
+// States of the physical sectors
+#define WL_REMAP_FREE           0       // erased
+#define WL_REMAP_USED           1       // mapped to logical sector
+#define WL_REMAP_DIRTY          2       // has to be erased before use
+#define WL_REMAP_RELOC          3       // relocation target
+
+#define WL_REMAP_ALIGN(size)    (((size) + 31) & ~31)
+
+#ifndef _MSC_VER // MSVS has different format for this define
+static_assert(sizeof(wl_remap_header_t) % 32 == 0, "wl_remap_header_t structure size must be multiple of flash encryption unit size");
+static_assert(sizeof(wl_remap_record_t) == 16, "wl_remap_record_t structure size must be 16 bytes");
+#endif // _MSC_VER
+
+WL_Remap::WL_Remap()
+{
+}
+
+WL_Remap::~WL_Remap()
+{
+    free(this->map);
+    free(this->phys_state);
+}
+
+esp_err_t WL_Remap::config(wl_config_t *cfg, Flash_Access *flash_drv)
+{
+    esp_err_t result = WL_Flash::config(cfg, flash_drv);
+    WL_RESULT_CHECK(result);
+    this->configured = false;
+
+    uint32_t sector_size = this->cfg.sector_size;
+    uint32_t total_count = this->cfg.full_mem_size / sector_size;
+    // Snapshot size is calculated for the whole partition, the real one is a bit smaller
+    size_t snapshot_size = sizeof(wl_remap_header_t) + WL_REMAP_ALIGN(total_count * sizeof(uint16_t)) + WL_REMAP_ALIGN(total_count);
+    this->snapshot_sectors = (snapshot_size + sector_size - 1) / sector_size;
+    uint32_t record_sectors = (2 * total_count * sizeof(wl_remap_record_t) + sector_size - 1) / sector_size;
+    if (record_sectors < WL_REMAP_LOG_SECTORS) {
+        record_sectors = WL_REMAP_LOG_SECTORS;
+    }
+    this->log_sectors = this->snapshot_sectors + record_sectors;
+    if ((total_count < 2 * this->log_sectors + 2 * WL_REMAP_MIN_SPARE)
+            || (total_count - 2 * this->log_sectors >= WL_REMAP_NONE)
+            || (this->cfg.wr_size > sizeof(wl_remap_record_t))) {
+        ESP_LOGE(TAG, "%s - unsupported configuration, total_count=%i", __func__, total_count);
+        return ESP_ERR_INVALID_ARG;
+    }
+    this->physical_count = total_count - 2 * this->log_sectors;
+    uint32_t spare_count = this->physical_count / 32;
+    if (spare_count < WL_REMAP_MIN_SPARE) {
+        spare_count = WL_REMAP_MIN_SPARE;
+    }
+    this->logical_count = this->physical_count - spare_count;
+    this->log_capacity = record_sectors * sector_size / sizeof(wl_remap_record_t);
+
+    this->addr_data = this->cfg.start_addr;
+    this->addr_log[0] = this->addr_data + this->physical_count * sector_size;
+    this->addr_log[1] = this->addr_log[0] + this->log_sectors * sector_size;
+
+    this->map_size = WL_REMAP_ALIGN(this->logical_count * sizeof(uint16_t));
+    this->state_size = WL_REMAP_ALIGN(this->physical_count);
+    free(this->map);
+    free(this->phys_state);
+    this->map = (uint16_t *)malloc(this->map_size);
+    this->phys_state = (uint8_t *)malloc(this->state_size);
+    if ((this->map == NULL) || (this->phys_state == NULL) || (this->temp_buff == NULL)) {
+        return ESP_ERR_NO_MEM;
+    }
+    this->flash_size = this->logical_count * sector_size;
+
+    ESP_LOGV(TAG, "%s - logical_count=%i, physical_count=%i, log_sectors=%i", __func__,
+             this->logical_count, this->physical_count, this->log_sectors);
+    this->configured = true;
+    return ESP_OK;
+}
+
+esp_err_t WL_Remap::init()
+{
+    esp_err_t result = ESP_OK;
+    if (this->configured == false) {
+        ESP_LOGW(TAG, "WL_Remap: not configured, call config() first");
+        return ESP_ERR_INVALID_STATE;
+    }
+    // If flow will be interrupted by error, then this flag will be false
+    this->initialized = false;
+    this->reloc_pending = false;
+    this->reloc_active = false;
+    this->reloc_cursor = 0;
+    this->alloc_cursor = 0;
+    this->gc_cursor = 0;
+    this->alloc_count = 0;
+
+    wl_remap_header_t header[2];
+    result = this->flash_drv->read(this->addr_log[0], &header[0], sizeof(wl_remap_header_t));
+    WL_RESULT_CHECK(result);
+    result = this->flash_drv->read(this->addr_log[1], &header[1], sizeof(wl_remap_header_t));
+    WL_RESULT_CHECK(result);
+
+    // Newer snapshot first. If it is broken, the older one is still valid.
+    int area = (header[1].generation > header[0].generation) ? 1 : 0;
+    result = this->loadSnapshot(area);
+    if (result == ESP_ERR_NOT_FOUND) {
+        result = this->loadSnapshot(1 - area);
+    }
+    if (result == ESP_ERR_NOT_FOUND) {
+        result = this->format();
+        WL_RESULT_CHECK(result);
+    }
+    WL_RESULT_CHECK(result);
+    result = this->replayLog();
+    WL_RESULT_CHECK(result);
+    // The state of the second log area is unknown, it will be erased
+    this->log_erase_pos = 0;
+
+    ESP_LOGD(TAG, "%s - generation=%i, log_pos=%i, free_count=%i, dirty_count=%i", __func__,
+             this->generation, this->log_pos, this->free_count, this->dirty_count);
+    this->initialized = true;
+    return ESP_OK;
+}
+
+esp_err_t WL_Remap::format()
+{
+    esp_err_t result = ESP_OK;
+    ESP_LOGD(TAG, "%s", __func__);
+    memset(this->map, 0xff, this->map_size);
+    // Content of the data sectors is unknown, all of them will be erased before use
+    memset(this->phys_state, WL_REMAP_DIRTY, this->state_size);
+    this->free_count = 0;
+    this->dirty_count = this->physical_count;
+    this->generation = 1;
+    this->log_active = 0;
+    this->log_pos = 0;
+    result = this->eraseRange(this->addr_log[0], this->log_sectors * this->cfg.sector_size);
+    WL_RESULT_CHECK(result);
+    result = this->writeSnapshot(0);
+    WL_RESULT_CHECK(result);
+    return result;
+}
+
+esp_err_t WL_Remap::loadSnapshot(int area)
+{
+    esp_err_t result = ESP_OK;
+    wl_remap_header_t header;
+    result = this->flash_drv->read(this->addr_log[area], &header, sizeof(wl_remap_header_t));
+    WL_RESULT_CHECK(result);
+    if ((header.magic != WL_REMAP_MAGIC)
+            || (header.version != this->cfg.version)
+            || (header.logical_count != this->logical_count)
+            || (header.physical_count != this->physical_count)
+            || (header.sector_size != this->cfg.sector_size)) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    size_t addr = this->addr_log[area] + sizeof(wl_remap_header_t);
+    result = this->flash_drv->read(addr, this->map, this->map_size);
+    WL_RESULT_CHECK(result);
+    result = this->flash_drv->read(addr + this->map_size, this->phys_state, this->state_size);
+    WL_RESULT_CHECK(result);
+    uint32_t crc = crc32::crc32_le(WL_CFG_CRC_CONST, (const unsigned char *)this->map, this->map_size);
+    crc = crc32::crc32_le(crc, (const unsigned char *)this->phys_state, this->state_size);
+    crc = crc32::crc32_le(crc, (const unsigned char *)&header, sizeof(wl_remap_header_t) - sizeof(uint32_t));
+    if (crc != header.crc) {
+        ESP_LOGW(TAG, "%s - area=%i, crc=0x%08x, header.crc=0x%08x", __func__, area, crc, header.crc);
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    // Only erased sectors are trusted, the state of all others is defined by the map
+    this->free_count = 0;
+    this->dirty_count = 0;
+    for (size_t i = 0; i < this->physical_count; i++) {
+        if (this->phys_state[i] == WL_REMAP_FREE) {
+            this->free_count++;
+        } else {
+            this->phys_state[i] = WL_REMAP_DIRTY;
+            this->dirty_count++;
+        }
+    }
+    for (size_t i = 0; i < this->logical_count; i++) {
+        if (this->map[i] >= this->physical_count) {
+            this->map[i] = WL_REMAP_NONE;
+        } else {
+            this->setState(this->map[i], WL_REMAP_USED);
+        }
+    }
+    this->generation = header.generation;
+    this->log_active = area;
+    return ESP_OK;
+}
+
+esp_err_t WL_Remap::replayLog()
+{
+    esp_err_t result = ESP_OK;
+    size_t addr = this->addr_log[this->log_active] + this->snapshot_sectors * this->cfg.sector_size;
+    this->log_pos = 0;
+    for (size_t i = 0; i < this->log_capacity; i++) {
+        wl_remap_record_t record;
+        result = this->flash_drv->read(addr + i * sizeof(wl_remap_record_t), &record, sizeof(wl_remap_record_t));
+        WL_RESULT_CHECK(result);
+        const uint8_t *bytes = (const uint8_t *)&record;
+        bool erased = true;
+        for (size_t n = 0; n < sizeof(wl_remap_record_t); n++) {
+            if (bytes[n] != 0xff) {
+                erased = false;
+                break;
+            }
+        }
+        if (erased) {
+            break;
+        }
+        // Broken record is skipped, the slot could not be written again
+        this->log_pos = i + 1;
+        uint32_t crc = crc32::crc32_le(WL_CFG_CRC_CONST, (const unsigned char *)&record, sizeof(wl_remap_record_t) - sizeof(uint32_t));
+        if ((crc != record.crc) || (record.generation != this->generation)) {
+            ESP_LOGW(TAG, "%s - broken record at pos=%i", __func__, (int) i);
+            continue;
+        }
+        uint16_t logical = record.logical;
+        uint16_t physical = record.physical;
+        if (((logical != WL_REMAP_NONE) && (logical >= this->logical_count))
+                || ((physical != WL_REMAP_NONE) && (physical >= this->physical_count))) {
+            ESP_LOGW(TAG, "%s - wrong record at pos=%i", __func__, (int) i);
+            continue;
+        }
+        switch (record.type) {
+        case WL_REMAP_RECORD_MAP:
+        case WL_REMAP_RECORD_UNMAP:
+            if (logical == WL_REMAP_NONE) {
+                break;
+            }
+            if (this->map[logical] != WL_REMAP_NONE) {
+                this->setState(this->map[logical], WL_REMAP_DIRTY);
+            }
+            this->map[logical] = WL_REMAP_NONE;
+            if ((record.type == WL_REMAP_RECORD_MAP) && (physical != WL_REMAP_NONE)) {
+                this->map[logical] = physical;
+                this->setState(physical, WL_REMAP_USED);
+            }
+            break;
+        case WL_REMAP_RECORD_ALLOC:
+            if (physical != WL_REMAP_NONE) {
+                this->setState(physical, WL_REMAP_DIRTY);
+            }
+            break;
+        case WL_REMAP_RECORD_FREE:
+            if (physical != WL_REMAP_NONE) {
+                this->setState(physical, WL_REMAP_FREE);
+            }
+            break;
+        default:
+            break;
+        }
+    }
+    return ESP_OK;
+}
+
+esp_err_t WL_Remap::writeSnapshot(int area)
+{
+    esp_err_t result = ESP_OK;
+    wl_remap_header_t header;
+    header.magic = WL_REMAP_MAGIC;
+    header.version = this->cfg.version;
+    header.generation = this->generation;
+    header.logical_count = this->logical_count;
+    header.physical_count = this->physical_count;
+    header.sector_size = this->cfg.sector_size;
+    header.reserved = UINT32_MAX;
+    uint32_t crc = crc32::crc32_le(WL_CFG_CRC_CONST, (const unsigned char *)this->map, this->map_size);
+    crc = crc32::crc32_le(crc, (const unsigned char *)this->phys_state, this->state_size);
+    header.crc = crc32::crc32_le(crc, (const unsigned char *)&header, sizeof(wl_remap_header_t) - sizeof(uint32_t));
+
+    // Header is written last, the snapshot is not valid without it
+    size_t addr = this->addr_log[area] + sizeof(wl_remap_header_t);
+    result = this->flash_drv->write(addr, this->map, this->map_size);
+    WL_RESULT_CHECK(result);
+    result = this->flash_drv->write(addr + this->map_size, this->phys_state, this->state_size);
+    WL_RESULT_CHECK(result);
+    result = this->flash_drv->write(this->addr_log[area], &header, sizeof(wl_remap_header_t));
+    WL_RESULT_CHECK(result);
+    return result;
+}
+
+esp_err_t WL_Remap::switchLog()
+{
+    esp_err_t result = ESP_OK;
+    int area = 1 - this->log_active;
+    ESP_LOGD(TAG, "%s - area=%i, generation=%i", __func__, area, this->generation + 1);
+    if (this->log_erase_pos < this->log_sectors) {
+        result = this->eraseRange(this->addr_log[area] + this->log_erase_pos * this->cfg.sector_size,
+                                  (this->log_sectors - this->log_erase_pos) * this->cfg.sector_size);
+        WL_RESULT_CHECK(result);
+        this->log_erase_pos = this->log_sectors;
+    }
+    this->generation++;
+    result = this->writeSnapshot(area);
+    if (result != ESP_OK) {
+        // area was partially written, it has to be erased again
+        this->log_erase_pos = 0;
+        return result;
+    }
+    this->log_active = area;
+    this->log_pos = 0;
+    this->log_erase_pos = 0;
+    return result;
+}
+
+esp_err_t WL_Remap::appendRecord(uint16_t type, uint16_t logical, uint16_t physical)
+{
+    esp_err_t result = ESP_OK;
+    if (this->log_pos >= this->log_capacity) {
+        result = this->switchLog();
+        WL_RESULT_CHECK(result);
+    }
+    wl_remap_record_t record;
+    record.type = type;
+    record.logical = logical;
+    record.physical = physical;
+    record.reserved = WL_REMAP_NONE;
+    record.generation = this->generation;
+    record.crc = crc32::crc32_le(WL_CFG_CRC_CONST, (const unsigned char *)&record, sizeof(wl_remap_record_t) - sizeof(uint32_t));
+    size_t addr = this->addr_log[this->log_active] + this->snapshot_sectors * this->cfg.sector_size;
+    addr += this->log_pos * sizeof(wl_remap_record_t);
+    // The slot is used even if write fails
+    this->log_pos++;
+    result = this->flash_drv->write(addr, &record, sizeof(wl_remap_record_t));
+    WL_RESULT_CHECK(result);
+    return result;
+}
+
+void WL_Remap::setState(uint16_t physical, uint8_t state)
+{
+    uint8_t old_state = this->phys_state[physical];
+    if (old_state == WL_REMAP_FREE) {
+        this->free_count--;
+    } else if (old_state == WL_REMAP_DIRTY) {
+        this->dirty_count--;
+    }
+    this->phys_state[physical] = state;
+    if (state == WL_REMAP_FREE) {
+        this->free_count++;
+    } else if (state == WL_REMAP_DIRTY) {
+        this->dirty_count++;
+    }
+}
+
+size_t WL_Remap::physAddr(uint16_t physical)
+{
+    return this->addr_data + physical * this->cfg.sector_size;
+}
+
+uint16_t WL_Remap::findFree()
+{
+    for (size_t i = 0; i < this->physical_count; i++) {
+        uint16_t physical = (this->alloc_cursor + i) % this->physical_count;
+        if (this->phys_state[physical] == WL_REMAP_FREE) {
+            this->alloc_cursor = (physical + 1) % this->physical_count;
+            return physical;
+        }
+    }
+    return WL_REMAP_NONE;
+}
+
+esp_err_t WL_Remap::eraseDirty(bool record)
+{
+    esp_err_t result = ESP_OK;
+    for (size_t i = 0; i < this->physical_count; i++) {
+        uint16_t physical = (this->gc_cursor + i) % this->physical_count;
+        if (this->phys_state[physical] != WL_REMAP_DIRTY) {
+            continue;
+        }
+        this->gc_cursor = (physical + 1) % this->physical_count;
+        result = this->eraseRange(this->physAddr(physical), this->cfg.sector_size);
+        WL_RESULT_CHECK(result);
+        this->setState(physical, WL_REMAP_FREE);
+        // Without the record the sector will be erased again after restart
+        if (record) {
+            result = this->appendRecord(WL_REMAP_RECORD_FREE, WL_REMAP_NONE, physical);
+            WL_RESULT_CHECK(result);
+        }
+        return result;
+    }
+    ESP_LOGE(TAG, "%s - no dirty sectors", __func__);
+    return ESP_ERR_NO_MEM;
+}
+
+esp_err_t WL_Remap::allocSector(uint16_t logical)
+{
+    esp_err_t result = ESP_OK;
+    if (this->free_count == 0) {
+        result = this->eraseDirty(false);
+        WL_RESULT_CHECK(result);
+    }
+    uint16_t physical = this->findFree();
+    result = this->appendRecord(WL_REMAP_RECORD_MAP, logical, physical);
+    WL_RESULT_CHECK(result);
+    this->map[logical] = physical;
+    this->setState(physical, WL_REMAP_USED);
+    ESP_LOGV(TAG, "%s - logical=%i -> physical=%i", __func__, logical, physical);
+
+    this->alloc_count++;
+    if ((this->cfg.updaterate != 0) && (this->alloc_count >= this->cfg.updaterate * WL_REMAP_RELOCATE_RATE)) {
+        this->alloc_count = 0;
+        this->reloc_pending = true;
+    }
+    return result;
+}
+
+esp_err_t WL_Remap::unmapSector(uint16_t logical)
+{
+    esp_err_t result = ESP_OK;
+    uint16_t physical = this->map[logical];
+    if (physical == WL_REMAP_NONE) {
+        return result;
+    }
+    this->abortReloc(logical);
+    result = this->appendRecord(WL_REMAP_RECORD_UNMAP, logical, WL_REMAP_NONE);
+    WL_RESULT_CHECK(result);
+    this->map[logical] = WL_REMAP_NONE;
+    this->setState(physical, WL_REMAP_DIRTY);
+    return result;
+}
+
+void WL_Remap::abortReloc(uint16_t logical)
+{
+    // Sector which is being copied is changed by the user, the copy will be started again later
+    if (this->reloc_active && (this->reloc_logical == logical)) {
+        ESP_LOGV(TAG, "%s - logical=%i", __func__, logical);
+        this->setState(this->reloc_dst, WL_REMAP_DIRTY);
+        this->reloc_active = false;
+        this->reloc_pending = true;
+    }
+}
+
+esp_err_t WL_Remap::relocStep()
+{
+    esp_err_t result = ESP_OK;
+    if (!this->reloc_active) {
+        if (this->free_count == 0) {
+            return this->eraseDirty(true);
+        }
+        // Next used sector after the cursor is moved to the next free sector
+        uint16_t src = WL_REMAP_NONE;
+        for (size_t i = 0; i < this->physical_count; i++) {
+            uint16_t physical = (this->reloc_cursor + i) % this->physical_count;
+            if (this->phys_state[physical] == WL_REMAP_USED) {
+                src = physical;
+                break;
+            }
+        }
+        uint16_t logical = WL_REMAP_NONE;
+        for (size_t i = 0; (src != WL_REMAP_NONE) && (i < this->logical_count); i++) {
+            if (this->map[i] == src) {
+                logical = i;
+                break;
+            }
+        }
+        if (logical == WL_REMAP_NONE) {
+            this->reloc_pending = false;
+            return result;
+        }
+        this->reloc_cursor = (src + 1) % this->physical_count;
+        uint16_t dst = this->findFree();
+        result = this->appendRecord(WL_REMAP_RECORD_ALLOC, WL_REMAP_NONE, dst);
+        WL_RESULT_CHECK(result);
+        this->setState(dst, WL_REMAP_RELOC);
+        this->reloc_logical = logical;
+        this->reloc_src = src;
+        this->reloc_dst = dst;
+        this->reloc_step = 0;
+        this->reloc_active = true;
+        this->reloc_pending = false;
+        this->move_time = 0;
+        ESP_LOGV(TAG, "%s - logical=%i, %i -> %i", __func__, logical, src, dst);
+        return result;
+    }
+
+    size_t copy_count = this->cfg.sector_size / this->cfg.temp_buff_size;
+    if (this->reloc_step < copy_count) {
+        size_t offset = this->reloc_step * this->cfg.temp_buff_size;
+        result = this->flash_drv->read(this->physAddr(this->reloc_src) + offset, this->temp_buff, this->cfg.temp_buff_size);
+        if (result == ESP_OK) {
+            result = this->flash_drv->write(this->physAddr(this->reloc_dst) + offset, this->temp_buff, this->cfg.temp_buff_size);
+        }
+        if (result != ESP_OK) {
+            this->abortReloc(this->reloc_logical);
+            WL_RESULT_CHECK(result);
+        }
+        this->reloc_step++;
+        return result;
+    }
+
+    result = this->appendRecord(WL_REMAP_RECORD_MAP, this->reloc_logical, this->reloc_dst);
+    if (result != ESP_OK) {
+        this->abortReloc(this->reloc_logical);
+        WL_RESULT_CHECK(result);
+    }
+    this->map[this->reloc_logical] = this->reloc_dst;
+    this->setState(this->reloc_dst, WL_REMAP_USED);
+    this->setState(this->reloc_src, WL_REMAP_DIRTY);
+    this->reloc_active = false;
+    this->stats.move_count++;
+    return result;
+}
+
+bool WL_Remap::workPending(bool with_gc)
+{
+    return this->reloc_active
+           || this->reloc_pending
+           || (this->log_erase_pos < this->log_sectors)
+           || (with_gc && (this->dirty_count > 0));
+}
+
+esp_err_t WL_Remap::workStep(bool with_gc)
+{
+    esp_err_t result = ESP_OK;
+    uint32_t begin = WL_TIME_GET();
+    bool reloc = this->reloc_active;
+    if (this->reloc_active || this->reloc_pending) {
+        result = this->relocStep();
+    } else if (this->log_erase_pos < this->log_sectors) {
+        int area = 1 - this->log_active;
+        result = this->eraseRange(this->addr_log[area] + this->log_erase_pos * this->cfg.sector_size, this->cfg.sector_size);
+        if (result == ESP_OK) {
+            this->log_erase_pos++;
+        }
+    } else if (with_gc && (this->dirty_count > 0)) {
+        result = this->eraseDirty(true);
+    }
+    uint32_t time = WL_TIME_TO_US((uint32_t)(WL_TIME_GET() - begin));
+    this->stats.move_time += time;
+    if (reloc || this->reloc_active) {
+        this->move_time += time;
+        if (!this->reloc_active && !this->reloc_pending && (this->move_time > this->stats.max_move_time)) {
+            this->stats.max_move_time = this->move_time;
+        }
+    }
+    return result;
+}
+
+esp_err_t WL_Remap::completeWork()
+{
+    esp_err_t result = ESP_OK;
+    // Without background task the relocation is done by the operation that requested it.
+    // Dirty sectors are erased only when there are no free sectors.
+    while (this->workPending(false)) {
+        result = this->workStep(false);
+        WL_RESULT_CHECK(result);
+    }
+    return result;
+}
+
+esp_err_t WL_Remap::erase_sector(size_t sector)
+{
+    esp_err_t result = ESP_OK;
+    if (!this->initialized) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (sector >= this->logical_count) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    WL_OpTimer timer(&this->stats);
+    this->stats.erase_count++;
+    ESP_LOGV(TAG, "%s - sector=0x%08x", __func__, (uint32_t) sector);
+    result = this->unmapSector(sector);
+    WL_RESULT_CHECK(result);
+    if (!this->background_update) {
+        result = this->completeWork();
+    }
+    return result;
+}
+
+esp_err_t WL_Remap::erase_range(size_t start_address, size_t size)
+{
+    esp_err_t result = ESP_OK;
+    if (!this->initialized) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    ESP_LOGV(TAG, "%s - start_address=0x%08x, size=0x%08x", __func__, (uint32_t) start_address, (uint32_t) size);
+    size_t erase_count = (size + this->cfg.sector_size - 1) / this->cfg.sector_size;
+    size_t start_sector = start_address / this->cfg.sector_size;
+    if (start_sector + erase_count > this->logical_count) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    WL_OpTimer timer(&this->stats);
+    this->stats.erase_count += erase_count;
+    for (size_t i = 0; i < erase_count; i++) {
+        result = this->unmapSector(start_sector + i);
+        WL_RESULT_CHECK(result);
+    }
+    if (!this->background_update) {
+        result = this->completeWork();
+    }
+    return result;
+}
+
+esp_err_t WL_Remap::write(size_t dest_addr, const void *src, size_t size)
+{
+    esp_err_t result = ESP_OK;
+    if (!this->initialized) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (dest_addr + size > this->flash_size) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    WL_OpTimer timer(&this->stats);
+    this->stats.write_count++;
+    this->stats.write_bytes += size;
+    ESP_LOGV(TAG, "%s - dest_addr=0x%08x, size=0x%08x", __func__, (uint32_t) dest_addr, (uint32_t) size);
+    const uint8_t *data = (const uint8_t *)src;
+    while (size > 0) {
+        uint16_t logical = dest_addr / this->cfg.sector_size;
+        size_t offset = dest_addr % this->cfg.sector_size;
+        size_t count = this->cfg.sector_size - offset;
+        if (count > size) {
+            count = size;
+        }
+        this->abortReloc(logical);
+        if (this->map[logical] == WL_REMAP_NONE) {
+            result = this->allocSector(logical);
+            WL_RESULT_CHECK(result);
+        }
+        result = this->flash_drv->write(this->physAddr(this->map[logical]) + offset, data, count);
+        WL_RESULT_CHECK(result);
+        dest_addr += count;
+        data += count;
+        size -= count;
+    }
+    if (!this->background_update) {
+        result = this->completeWork();
+    }
+    return result;
+}
+
+esp_err_t WL_Remap::read(size_t src_addr, void *dest, size_t size)
+{
+    esp_err_t result = ESP_OK;
+    if (!this->initialized) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (src_addr + size > this->flash_size) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    WL_OpTimer timer(&this->stats);
+    this->stats.read_count++;
+    this->stats.read_bytes += size;
+    ESP_LOGV(TAG, "%s - src_addr=0x%08x, size=0x%08x", __func__, (uint32_t) src_addr, (uint32_t) size);
+    uint8_t *data = (uint8_t *)dest;
+    while (size > 0) {
+        uint16_t logical = src_addr / this->cfg.sector_size;
+        size_t offset = src_addr % this->cfg.sector_size;
+        size_t count = this->cfg.sector_size - offset;
+        if (count > size) {
+            count = size;
+        }
+        // Sector that is not mapped was erased
+        if (this->map[logical] == WL_REMAP_NONE) {
+            memset(data, 0xff, count);
+        } else {
+            result = this->flash_drv->read(this->physAddr(this->map[logical]) + offset, data, count);
+            WL_RESULT_CHECK(result);
+        }
+        src_addr += count;
+        data += count;
+        size -= count;
+    }
+    return result;
+}
+
+esp_err_t WL_Remap::flush()
+{
+    esp_err_t result = ESP_OK;
+    if (!this->initialized) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    result = this->completeWork();
+    ESP_LOGV(TAG, "%s - result=%08x", __func__, result);
+    return result;
+}
+
+size_t WL_Remap::data_sectors()
+{
+    return this->physical_count;
+}
+
+bool WL_Remap::update_pending()
+{
+    return this->initialized && this->workPending(true);
+}
+
+esp_err_t WL_Remap::update_step()
+{
+    if (!this->initialized) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (!this->workPending(true)) {
+        return ESP_OK;
+    }
+    return this->workStep(true);
+}
@@ -29,6 +29,28 @@ typedef int32_t wl_handle_t;
 
 #define WL_INVALID_HANDLE -1
 
+/**
+* @brief Wear levelling statistics
+*
+* All counters are collected since the partition was mounted, they are not
+* stored in flash. To track the wear of the partition over the lifetime of
+* the device, accumulate flash_erase_count in the application storage.
+* Times are measured only on the target and are zero in host builds.
+*/
+typedef struct {
+    uint32_t erase_count;       /*!< Number of sectors erased by the user */
+    uint32_t write_count;       /*!< Number of write operations */
+    uint32_t read_count;        /*!< Number of read operations */
+    uint64_t write_bytes;       /*!< Number of bytes written by the user */
+    uint64_t read_bytes;        /*!< Number of bytes read by the user */
+    uint32_t move_count;        /*!< Number of pages moved by wear levelling */
+    uint32_t flash_erase_count; /*!< Number of sectors erased in flash, including page moves and state updates */
+    uint64_t op_time;           /*!< Time spent in erase, write and read operations, in microseconds */
+    uint64_t move_time;         /*!< Part of op_time spent moving pages, in microseconds */
+    uint32_t max_op_time;       /*!< Longest erase, write or read operation, in microseconds */
+    uint32_t max_move_time;     /*!< Longest page move, in microseconds */
+} wl_stats_t;
+
 /**
 * @brief Mount WL for defined partition
 *
@@ -128,6 +150,19 @@ size_t wl_size(wl_handle_t handle);
 */
 size_t wl_sector_size(wl_handle_t handle);
 
+/**
+* @brief Get statistics of the WL instance
+*
+* @param handle WL module handle that was initialized before
+* @param out_stats pointer to the structure which will be filled
+*
+* @return
+*       - ESP_OK, if statistics were copied;
+*       - ESP_ERR_INVALID_ARG, if out_stats is NULL;
+*       - ESP_ERR_NOT_FOUND, if handle is not valid.
+*/
+esp_err_t wl_get_stats(wl_handle_t handle, wl_stats_t *out_stats);
+
 
 #ifdef __cplusplus
 } // extern "C"
@@ -18,6 +18,11 @@
 #include "Flash_Access.h"
 #include "WL_Config.h"
 #include "WL_State.h"
+#include "wear_levelling.h"
+#ifdef ESP_PLATFORM
+#include "freertos/FreeRTOS.h"
+#include "esp_log.h"
+#endif // ESP_PLATFORM
 
 /**
 * @brief This class is used to make wear levelling for flash devices. Class implements Flash_Access interface
@@ -47,6 +52,19 @@ public :
     Flash_Access *get_drv();
     wl_config_t *get_cfg();
 
+    // Background update mode: erase_sector() only schedules the page move,
+    // and the move is done later chunk by chunk through update_step().
+    void set_background_update(bool enable);
+    virtual bool update_pending();
+    virtual esp_err_t update_step();
+
+    // Amount of physical sectors which hold the data, including the dummy or
+    // spare sectors. They are at the start of the partition, the state and
+    // configuration sectors follow them.
+    virtual size_t data_sectors();
+
+    void get_stats(wl_stats_t *out_stats);
+
 protected:
     bool configured = false;
     bool initialized = false;
@@ -67,10 +85,54 @@ protected:
     size_t dummy_addr;
     uint8_t used_bits;
 
+    bool background_update = false;
+    bool move_pending = false;
+    size_t move_step = 0;
+    uint32_t move_time;
+    // State stored by the last steps of the move. Foreground operations
+    // change access_count in between, so the copy keeps the CRC valid.
+    wl_state_t move_state;
+
+    wl_stats_t stats;
+
     esp_err_t initSections();
     esp_err_t updateWL();
+    esp_err_t moveStep();
+    esp_err_t doMoveStep();
+    esp_err_t completeMove();
+    esp_err_t syncMove(size_t virt_addr, size_t size);
+    esp_err_t eraseRange(size_t addr, size_t size);
     esp_err_t recoverPos();
     size_t calcAddr(size_t addr);
+    size_t calcRun(size_t addr, size_t size, size_t *run_addr);
+};
+
+#ifdef ESP_PLATFORM
+#define WL_TIME_GET()           ((uint32_t)esp_log_timestamp_us())
+#define WL_TIME_TO_US(time)     (time)
+#else
+#define WL_TIME_GET()           0
+#define WL_TIME_TO_US(time)     (time)
+#endif // ESP_PLATFORM
+
+/**
+* @brief Adds the time spent in the scope to the operation statistics
+*/
+class WL_OpTimer
+{
+public:
+    WL_OpTimer(wl_stats_t *stats) : stats(stats), begin(WL_TIME_GET()) {}
+    ~WL_OpTimer()
+    {
+        uint32_t time = WL_TIME_TO_US((uint32_t)(WL_TIME_GET() - this->begin));
+        this->stats->op_time += time;
+        if (time > this->stats->max_op_time) {
+            this->stats->max_op_time = time;
+        }
+    }
+private:
+    wl_stats_t *stats;
+    uint32_t begin;
 };
 
 #endif // _WL_Flash_H_
@@ -0,0 +1,132 @@
+// Copyright 2015-2017 Espressif Systems (Shanghai) PTE LTD
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef _WL_Remap_H_
+#define _WL_Remap_H_
+
+#include "esp_err.h"
+#include "WL_Flash.h"
+
+/**
+* @brief Header of the map snapshot stored at the beginning of the log area
+*
+*/
+typedef struct WL_Remap_Header_s {
+    uint32_t magic;             /*!< WL_REMAP_MAGIC*/
+    uint32_t version;           /*!< version from the configuration*/
+    uint32_t generation;        /*!< incremented every time the log area is changed*/
+    uint32_t logical_count;     /*!< amount of logical sectors*/
+    uint32_t physical_count;    /*!< amount of physical data sectors*/
+    uint32_t sector_size;       /*!< size of one sector*/
+    uint32_t reserved;          /*!< 0xffffffff*/
+    uint32_t crc;               /*!< CRC of the header and the snapshot data*/
+} wl_remap_header_t;
+
+/**
+* @brief One change of the sector map, appended to the log area after the snapshot
+*
+*/
+typedef struct WL_Remap_Record_s {
+    uint16_t type;              /*!< WL_REMAP_RECORD_xxx*/
+    uint16_t logical;           /*!< logical sector*/
+    uint16_t physical;          /*!< physical sector*/
+    uint16_t reserved;          /*!< 0xffff*/
+    uint32_t generation;        /*!< generation of the log area*/
+    uint32_t crc;               /*!< CRC of the record*/
+} wl_remap_record_t;
+
+/**
+* @brief Wear levelling with logical to physical sector map in RAM.
+*
+* Erase operation only removes the logical sector from the map. The first write
+* to unmapped sector takes the next free physical sector, so frequently changed
+* sectors are spread over the whole partition. Sectors which are not mapped
+* anymore are erased later, in background if background update is enabled.
+* Every change of the map is appended to the log area. When the log is full,
+* snapshot of the map is written to the second log area.
+*/
+class WL_Remap : public WL_Flash
+{
+public :
+    WL_Remap();
+    ~WL_Remap() override;
+
+    esp_err_t config(wl_config_t *cfg, Flash_Access *flash_drv) override;
+    esp_err_t init() override;
+
+    esp_err_t erase_sector(size_t sector) override;
+    esp_err_t erase_range(size_t start_address, size_t size) override;
+
+    esp_err_t write(size_t dest_addr, const void *src, size_t size) override;
+    esp_err_t read(size_t src_addr, void *dest, size_t size) override;
+
+    esp_err_t flush() override;
+
+    bool update_pending() override;
+    esp_err_t update_step() override;
+
+    size_t data_sectors() override;
+
+protected:
+    uint32_t logical_count;
+    uint32_t physical_count;
+    uint32_t log_sectors;       // sectors in one log area, including the snapshot
+    uint32_t snapshot_sectors;  // sectors of the snapshot at the beginning of the log area
+    uint32_t log_capacity;      // amount of records in one log area
+    size_t addr_data;
+    size_t addr_log[2];
+
+    uint16_t *map = NULL;       // logical -> physical
+    uint8_t *phys_state = NULL; // WL_REMAP_xxx state of every physical sector
+    size_t map_size;
+    size_t state_size;
+
+    uint32_t generation;
+    int log_active;
+    uint32_t log_pos;
+    uint32_t log_erase_pos;     // sectors of inactive log area already erased
+
+    uint32_t free_count;
+    uint32_t dirty_count;
+    uint32_t alloc_cursor;
+    uint32_t gc_cursor;
+    uint32_t alloc_count;
+
+    bool reloc_pending = false;
+    bool reloc_active = false;
+    uint32_t reloc_cursor;
+    uint16_t reloc_logical;
+    uint16_t reloc_src;
+    uint16_t reloc_dst;
+    size_t reloc_step;
+
+    esp_err_t format();
+    esp_err_t loadSnapshot(int area);
+    esp_err_t replayLog();
+    esp_err_t writeSnapshot(int area);
+    esp_err_t switchLog();
+    esp_err_t appendRecord(uint16_t type, uint16_t logical, uint16_t physical);
+    uint16_t findFree();
+    esp_err_t allocSector(uint16_t logical);
+    esp_err_t unmapSector(uint16_t logical);
+    esp_err_t eraseDirty(bool record);
+    void setState(uint16_t physical, uint8_t state);
+    bool workPending(bool with_gc);
+    esp_err_t workStep(bool with_gc);
+    esp_err_t completeWork();
+    esp_err_t relocStep();
+    void abortReloc(uint16_t logical);
+    size_t physAddr(uint16_t physical);
+};
+
+#endif // _WL_Remap_H_
@@ -0,0 +1,180 @@
+// Copyright 2015-2017 Espressif Systems (Shanghai) PTE LTD
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include <algorithm>
+#include "WL_Config.h"
+#include "WL_Flash.h"
+#include "WL_Remap.h"
+#include "Flash_Emulator.h"
+#include "catch.hpp"
+
+// Same configuration as wl_mount uses, on a 1 MB partition
+#define BENCH_SECTOR_SIZE       4096
+#define BENCH_PARTITION_SIZE    (256 * BENCH_SECTOR_SIZE)
+#define BENCH_UPDATERATE        16
+#define BENCH_TEMP_SIZE         32
+#define BENCH_WR_BLOCK_SIZE     16
+#define BENCH_OP_COUNT          20000
+#define BENCH_BG_STEPS          32      // background steps done while the user is idle between operations
+
+typedef enum {
+    BENCH_SEQUENTIAL,
+    BENCH_RANDOM,
+    BENCH_FAT,
+} bench_pattern_t;
+
+static const char *s_pattern_names[] = {"sequential", "random", "fat"};
+
+// Returns the logical sector of the next write for the pattern
+static size_t next_sector(bench_pattern_t pattern, size_t op, size_t sectors_count)
+{
+    switch (pattern) {
+    case BENCH_SEQUENTIAL:
+        return op % sectors_count;
+    case BENCH_RANDOM:
+        return rand() % sectors_count;
+    case BENCH_FAT:
+    default:
+        // Every data sector write updates the FAT and the directory entry,
+        // data is appended file by file after the first 4 metadata sectors
+        if (op % 3 == 0) {
+            return 1;
+        }
+        if (op % 3 == 1) {
+            return 3;
+        }
+        return 4 + (op / 3) % (sectors_count - 4);
+    }
+}
+
+static void bench_config(wl_config_t *cfg)
+{
+    memset(cfg, 0, sizeof(wl_config_t));
+    cfg->full_mem_size = BENCH_PARTITION_SIZE;
+    cfg->start_addr = 0;
+    cfg->sector_size = BENCH_SECTOR_SIZE;
+    cfg->page_size = BENCH_SECTOR_SIZE;
+    cfg->updaterate = BENCH_UPDATERATE;
+    cfg->temp_buff_size = BENCH_TEMP_SIZE;
+    cfg->wr_size = BENCH_WR_BLOCK_SIZE;
+    cfg->version = 1;
+}
+
+static void run_benchmark(bench_pattern_t pattern, bool remap, bool background)
+{
+    wl_config_t cfg;
+    bench_config(&cfg);
+
+    Flash_Emulator emul(BENCH_PARTITION_SIZE, BENCH_SECTOR_SIZE);
+    WL_Flash *wl = remap ? new WL_Remap() : new WL_Flash();
+    WL_Flash &wl_flash = *wl;
+    REQUIRE(wl_flash.config(&cfg, &emul) == ESP_OK);
+    REQUIRE(wl_flash.init() == ESP_OK);
+    wl_flash.set_background_update(background);
+    memset(emul.access_count, 0, emul.size / emul.sector_sise * sizeof(uint32_t));
+    emul.ClearStats();
+
+    size_t sectors_count = wl_flash.chip_size() / wl_flash.sector_size();
+    std::vector<uint8_t> data(BENCH_SECTOR_SIZE, 0x5a);
+    std::vector<uint64_t> latency;
+    latency.reserve(BENCH_OP_COUNT);
+    uint64_t background_time = 0;
+
+    srand(1);
+    for (size_t op = 0; op < BENCH_OP_COUNT; op++) {
+        size_t sector = next_sector(pattern, op, sectors_count);
+        uint64_t begin = emul.total_time;
+        REQUIRE(wl_flash.erase_sector(sector) == ESP_OK);
+        REQUIRE(wl_flash.write(sector * BENCH_SECTOR_SIZE, data.data(), BENCH_SECTOR_SIZE) == ESP_OK);
+        latency.push_back(emul.total_time - begin);
+        begin = emul.total_time;
+        for (size_t i = 0; background && i < BENCH_BG_STEPS && wl_flash.update_pending(); i++) {
+            REQUIRE(wl_flash.update_step() == ESP_OK);
+        }
+        background_time += emul.total_time - begin;
+    }
+
+    uint64_t foreground_time = emul.total_time - background_time;
+    std::sort(latency.begin(), latency.end());
+    // Wear of the data area, state and log sectors are reported separately
+    uint32_t max_erases = 0;
+    uint64_t sum_erases = 0;
+    uint32_t max_meta_erases = 0;
+    size_t data_sectors = wl_flash.data_sectors();
+    size_t phys_sectors = emul.size / emul.sector_sise;
+    for (size_t i = 0; i < phys_sectors; i++) {
+        if (i < data_sectors) {
+            max_erases = std::max(max_erases, emul.access_count[i]);
+            sum_erases += emul.access_count[i];
+        } else {
+            max_meta_erases = std::max(max_meta_erases, emul.access_count[i]);
+        }
+    }
+    uint64_t user_bytes = (uint64_t) BENCH_OP_COUNT * BENCH_SECTOR_SIZE;
+
+    // Background steps take the flash too, so the sustained rate is
+    // calculated over the whole time, foreground rate shows the latency gain
+    printf("%-10s %-6s %-10s %8.1f ops/s (foreground %8.1f)  WA=%.3f  EA=%.3f  erases/data sector avg=%.1f max=%u  state max=%u  "
+           "latency us p50=%llu p90=%llu p99=%llu p99.9=%llu max=%llu  bg=%llu us\n",
+           s_pattern_names[pattern],
+           remap ? "remap" : "rotate",
+           background ? "background" : "inline",
+           BENCH_OP_COUNT * 1e6 / emul.total_time,
+           BENCH_OP_COUNT * 1e6 / foreground_time,
+           (double) emul.write_bytes / user_bytes,
+           (double) emul.erase_ops / BENCH_OP_COUNT,
+           (double) sum_erases / data_sectors,
+           max_erases,
+           max_meta_erases,
+           (unsigned long long) latency[latency.size() * 50 / 100],
+           (unsigned long long) latency[latency.size() * 90 / 100],
+           (unsigned long long) latency[latency.size() * 99 / 100],
+           (unsigned long long) latency[latency.size() * 999 / 1000],
+           (unsigned long long) latency.back(),
+           (unsigned long long) background_time);
+    delete wl;
+}
+
+static void run_format(void)
+{
+    wl_config_t cfg;
+    bench_config(&cfg);
+
+    Flash_Emulator emul(BENCH_PARTITION_SIZE, BENCH_SECTOR_SIZE);
+    WL_Flash wl_flash;
+    REQUIRE(wl_flash.config(&cfg, &emul) == ESP_OK);
+    REQUIRE(wl_flash.init() == ESP_OK);
+    emul.ClearStats();
+
+    REQUIRE(wl_flash.erase_range(0, wl_flash.chip_size()) == ESP_OK);
+    printf("%-21s %8llu us  erases=%u\n", "format (erase_range)",
+           (unsigned long long) emul.total_time, emul.erase_ops);
+}
+
+TEST_CASE("wear levelling benchmark", "[.][benchmark]")
+{
+    const bench_pattern_t patterns[] = {BENCH_SEQUENTIAL, BENCH_RANDOM, BENCH_FAT};
+    printf("%d x (erase + write) of %d byte sectors, modelled flash timing\n", BENCH_OP_COUNT, BENCH_SECTOR_SIZE);
+    for (bench_pattern_t pattern : patterns) {
+        run_benchmark(pattern, false, false);
+        run_benchmark(pattern, false, true);
+        run_benchmark(pattern, true, false);
+        run_benchmark(pattern, true, true);
+    }
+    run_format();
+}
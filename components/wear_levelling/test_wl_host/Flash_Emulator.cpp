@@ -18,8 +18,20 @@
 #include <stdlib.h>
 #include <string.h>
 
+// Timing model, in microseconds. Read and write times are linear fits of the
+// values used by the NVS flash emulator, erase times are typical values
+// for 4 kB sector erase and 64 kB block erase.
+#define READ_OP_TIME            7
+#define READ_BYTES_PER_US       9
+#define WRITE_OP_TIME           19
+#define WRITE_US_PER_KB         1550
+#define SECTOR_ERASE_TIME       45000
+#define BLOCK_ERASE_TIME        150000
+#define BLOCK_ERASE_SIZE        65536
+
 Flash_Emulator::Flash_Emulator(size_t size, size_t sector_sise)
 {
+    this->ClearStats();
     this->reset_count = 0x7fffffff;
     this->size = size;
     this->sector_sise = sector_sise;
@@ -38,6 +50,12 @@ size_t Flash_Emulator::sector_size()
 }
 
 esp_err_t Flash_Emulator::erase_sector(size_t sector)
+{
+    this->total_time += SECTOR_ERASE_TIME;
+    return this->erase(sector);
+}
+
+esp_err_t Flash_Emulator::erase(size_t sector)
 {
     esp_err_t result = ESP_OK;
     if ((this->reset_count != 0x7fffffff) && (this->reset_count != 0)) {
@@ -49,6 +67,7 @@ esp_err_t Flash_Emulator::erase_sector(size_t sector)
     }
     memset(&this->buff[sector * this->sector_sise], -1, this->sector_sise);
     this->access_count[sector]++;
+    this->erase_ops++;
     return result;
 }
 
@@ -72,8 +91,20 @@ esp_err_t Flash_Emulator::erase_range(size_t start_address, size_t size)
     esp_err_t result = ESP_OK;
     uint32_t start_sector = start_address / this->sector_sise;
     uint32_t count = (size + this->sector_sise - 1) / this->sector_sise;
-    for (size_t i = 0; i < count; i++) {
-        result |= this->erase_sector(start_sector + i);
+    uint32_t block_sectors = BLOCK_ERASE_SIZE / this->sector_sise;
+    // Aligned 64 kB blocks are erased at once, as spi_flash_erase_range does
+    for (size_t i = 0; i < count;) {
+        size_t sector = start_sector + i;
+        if ((sector % block_sectors == 0) && (count - i >= block_sectors)) {
+            this->total_time += BLOCK_ERASE_TIME;
+            for (size_t j = 0; j < block_sectors; j++) {
+                result |= this->erase(sector + j);
+            }
+            i += block_sectors;
+        } else {
+            result |= this->erase_sector(sector);
+            i++;
+        }
     }
     return result;
 }
@@ -89,6 +120,9 @@ esp_err_t Flash_Emulator::write(size_t dest_addr, const void *src, size_t size)
         return result;
     }
     memcpy(&this->buff[dest_addr], src, size);
+    this->write_ops++;
+    this->write_bytes += size;
+    this->total_time += WRITE_OP_TIME + (uint64_t) size * WRITE_US_PER_KB / 1024;
     return result;
 }
 
@@ -100,6 +134,9 @@ esp_err_t Flash_Emulator::read(size_t src_addr, void *dest, size_t size)
         return result;
     }
     memcpy(dest, &this->buff[src_addr], size);
+    this->read_ops++;
+    this->read_bytes += size;
+    this->total_time += READ_OP_TIME + size / READ_BYTES_PER_US;
     return result;
 }
 
@@ -118,3 +155,13 @@ void Flash_Emulator::SetResetSector(size_t sector)
 {
     this->reset_sector = sector;
 }
+
+void Flash_Emulator::ClearStats()
+{
+    this->read_ops = 0;
+    this->write_ops = 0;
+    this->erase_ops = 0;
+    this->read_bytes = 0;
+    this->write_bytes = 0;
+    this->total_time = 0;
+}
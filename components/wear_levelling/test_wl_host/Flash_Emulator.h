@@ -53,6 +53,19 @@ public:
     void SetResetCount(uint32_t count);
     void SetResetSector(size_t sector);
 
+public:
+    // Operation counters and modelled time of flash operations, in microseconds
+    uint32_t read_ops;
+    uint32_t write_ops;
+    uint32_t erase_ops;
+    uint64_t read_bytes;
+    uint64_t write_bytes;
+    uint64_t total_time;
+    void ClearStats();
+
+protected:
+    esp_err_t erase(size_t sector);
+
 };
 
 #endif // _Flash_Emulator_H_
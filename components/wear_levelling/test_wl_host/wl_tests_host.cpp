@@ -15,6 +15,7 @@
 #include <string.h>
 #include "WL_Config.h"
 #include "WL_Flash.h"
+#include "WL_Remap.h"
 #include "Flash_Emulator.h"
 #include "catch.hpp"
 
@@ -54,3 +55,358 @@ TEST_CASE("flash starts with all bytes == 0xff", "[spi_flash_emu]")
 }
 
 
+TEST_CASE("background update keeps data consistent", "[wear_levelling]")
+{
+    wl_config_t *wl = new wl_config_t();
+
+    wl->full_mem_size = FLASH_ACCESS_SIZE;
+    wl->start_addr = FLASH_START_ADDR;
+    wl->sector_size = FLASH_SECTOR_SIZE;
+    wl->page_size = FLASH_PAGE_SIZE;
+    wl->updaterate = FLASH_UPDATERATE;
+    wl->temp_buff_size = FLASH_SECTOR_SIZE / 4;
+    wl->wr_size = FLASH_WR_BLOCK_SIZE;
+
+    WL_Flash *wl_flash = new WL_Flash();
+    Flash_Emulator *emul = new Flash_Emulator(FLASH_ACCESS_SIZE + FLASH_START_ADDR, FLASH_SECTOR_SIZE);
+    CHECK(wl_flash->config(wl, emul) == ESP_OK);
+    REQUIRE(wl_flash->init() == ESP_OK);
+    wl_flash->set_background_update(true);
+
+    size_t sectors_count = wl_flash->chip_size() / wl_flash->sector_size();
+    size_t words_count = wl_flash->sector_size() / sizeof(uint32_t);
+    uint32_t *sector_data = new uint32_t[words_count];
+    uint32_t *shadow = new uint32_t[sectors_count];
+    for (size_t i = 0; i < sectors_count; i++) {
+        REQUIRE(wl_flash->erase_sector(i) == ESP_OK);
+        shadow[i] = 0xffffffff;
+    }
+
+    // Sector 0 is hot, other sectors are rewritten randomly. Some steps of
+    // the page move are done between the foreground operations.
+    srand(42);
+    size_t moves = 0;
+    for (size_t k = 0; k < 20000; k++) {
+        size_t sector = (k % 2) ? 0 : rand() % sectors_count;
+        REQUIRE(wl_flash->erase_sector(sector) == ESP_OK);
+        shadow[sector] = rand();
+        for (size_t m = 0; m < words_count; m++) {
+            sector_data[m] = shadow[sector] + m;
+        }
+        REQUIRE(wl_flash->write(sector * wl_flash->sector_size(), sector_data, wl_flash->sector_size()) == ESP_OK);
+        for (size_t s = rand() % 4; s > 0 && wl_flash->update_pending(); s--) {
+            REQUIRE(wl_flash->update_step() == ESP_OK);
+            if (!wl_flash->update_pending()) {
+                moves++;
+            }
+        }
+        size_t check = rand() % sectors_count;
+        REQUIRE(wl_flash->read(check * wl_flash->sector_size(), sector_data, wl_flash->sector_size()) == ESP_OK);
+        for (size_t m = 0; m < words_count; m++) {
+            uint32_t expected = (shadow[check] == 0xffffffff) ? 0xffffffff : shadow[check] + m;
+            REQUIRE(sector_data[m] == expected);
+        }
+    }
+    CHECK(moves > 0);
+
+    // Pending move is finished by flush, and the state survives re-init
+    REQUIRE(wl_flash->flush() == ESP_OK);
+    CHECK(wl_flash->update_pending() == false);
+    REQUIRE(wl_flash->init() == ESP_OK);
+    for (size_t i = 0; i < sectors_count; i++) {
+        REQUIRE(wl_flash->read(i * wl_flash->sector_size(), sector_data, wl_flash->sector_size()) == ESP_OK);
+        for (size_t m = 0; m < words_count; m++) {
+            uint32_t expected = (shadow[i] == 0xffffffff) ? 0xffffffff : shadow[i] + m;
+            REQUIRE(sector_data[m] == expected);
+        }
+    }
+
+    delete[] shadow;
+    delete[] sector_data;
+    delete wl_flash;
+    delete emul;
+    delete wl;
+}
+
+TEST_CASE("background update state survives re-init without flush", "[wear_levelling]")
+{
+    wl_config_t *wl = new wl_config_t();
+
+    wl->full_mem_size = FLASH_SECTOR_SIZE * 64;
+    wl->start_addr = FLASH_START_ADDR;
+    wl->sector_size = FLASH_SECTOR_SIZE;
+    wl->page_size = FLASH_PAGE_SIZE;
+    wl->updaterate = 16;
+    wl->temp_buff_size = FLASH_SECTOR_SIZE / 4;
+    wl->wr_size = FLASH_WR_BLOCK_SIZE;
+
+    Flash_Emulator *emul = new Flash_Emulator(wl->full_mem_size + FLASH_START_ADDR, FLASH_SECTOR_SIZE);
+    WL_Flash *wl_flash = new WL_Flash();
+    CHECK(wl_flash->config(wl, emul) == ESP_OK);
+    REQUIRE(wl_flash->init() == ESP_OK);
+    wl_flash->set_background_update(true);
+
+    size_t sectors_count = wl_flash->chip_size() / wl_flash->sector_size();
+    size_t words_count = wl_flash->sector_size() / sizeof(uint32_t);
+    uint32_t *sector_data = new uint32_t[words_count];
+    uint32_t *shadow = new uint32_t[sectors_count];
+    for (size_t i = 0; i < sectors_count; i++) {
+        REQUIRE(wl_flash->erase_sector(i) == ESP_OK);
+        shadow[i] = 0xffffffff;
+    }
+
+    // Every foreground erase is followed by one step of the move, so the
+    // access counter changes while the state copies are being written.
+    // After each finished move the partition is mounted again without flush,
+    // the move that is pending at this time is dropped.
+    srand(7);
+    size_t moves = 0;
+    for (size_t k = 0; k < 3000; k++) {
+        size_t sector = rand() % sectors_count;
+        REQUIRE(wl_flash->erase_sector(sector) == ESP_OK);
+        shadow[sector] = rand();
+        for (size_t m = 0; m < words_count; m++) {
+            sector_data[m] = shadow[sector] + m;
+        }
+        REQUIRE(wl_flash->write(sector * wl_flash->sector_size(), sector_data, wl_flash->sector_size()) == ESP_OK);
+        REQUIRE(wl_flash->update_step() == ESP_OK);
+        wl_stats_t stats;
+        wl_flash->get_stats(&stats);
+        if (stats.move_count == 0) {
+            continue;
+        }
+        moves += stats.move_count;
+        delete wl_flash;
+        wl_flash = new WL_Flash();
+        CHECK(wl_flash->config(wl, emul) == ESP_OK);
+        REQUIRE(wl_flash->init() == ESP_OK);
+        wl_flash->set_background_update(true);
+        for (size_t i = 0; i < sectors_count; i++) {
+            REQUIRE(wl_flash->read(i * wl_flash->sector_size(), sector_data, wl_flash->sector_size()) == ESP_OK);
+            for (size_t m = 0; m < words_count; m++) {
+                uint32_t expected = (shadow[i] == 0xffffffff) ? 0xffffffff : shadow[i] + m;
+                REQUIRE(sector_data[m] == expected);
+            }
+        }
+    }
+    CHECK(moves > 2 * sectors_count);
+
+    delete[] shadow;
+    delete[] sector_data;
+    delete wl_flash;
+    delete emul;
+    delete wl;
+}
+
+TEST_CASE("erase_range erases only requested sectors", "[wear_levelling]")
+{
+    wl_config_t *wl = new wl_config_t();
+
+    wl->full_mem_size = FLASH_ACCESS_SIZE;
+    wl->start_addr = FLASH_START_ADDR;
+    wl->sector_size = FLASH_SECTOR_SIZE;
+    wl->page_size = FLASH_PAGE_SIZE;
+    wl->updaterate = FLASH_UPDATERATE;
+    wl->temp_buff_size = FLASH_TEMP_SIZE;
+    wl->wr_size = FLASH_WR_BLOCK_SIZE;
+
+    WL_Flash *wl_flash = new WL_Flash();
+    Flash_Emulator *emul = new Flash_Emulator(FLASH_ACCESS_SIZE + FLASH_START_ADDR, FLASH_SECTOR_SIZE);
+    CHECK(wl_flash->config(wl, emul) == ESP_OK);
+    REQUIRE(wl_flash->init() == ESP_OK);
+
+    size_t sector_size = wl_flash->sector_size();
+    size_t sectors_count = wl_flash->chip_size() / sector_size;
+    size_t words_count = sector_size / sizeof(uint32_t);
+    uint32_t *sector_data = new uint32_t[words_count];
+    bool *erased = new bool[sectors_count];
+
+    REQUIRE(wl_flash->erase_range(0, wl_flash->chip_size()) == ESP_OK);
+    srand(7);
+    for (size_t k = 0; k < 300; k++) {
+        // Write some sectors, then erase a random range. The ranges cross
+        // the dummy page and the end of the data region from time to time.
+        for (size_t i = 0; i < sectors_count; i++) {
+            erased[i] = true;
+        }
+        for (size_t n = 0; n < 8; n++) {
+            size_t sector = rand() % sectors_count;
+            REQUIRE(wl_flash->erase_sector(sector) == ESP_OK);
+            for (size_t m = 0; m < words_count; m++) {
+                sector_data[m] = sector + m;
+            }
+            REQUIRE(wl_flash->write(sector * sector_size, sector_data, sector_size) == ESP_OK);
+            erased[sector] = false;
+        }
+        size_t first = rand() % sectors_count;
+        size_t count = 1 + rand() % (sectors_count - first);
+        REQUIRE(wl_flash->erase_range(first * sector_size, count * sector_size) == ESP_OK);
+        for (size_t i = first; i < first + count; i++) {
+            erased[i] = true;
+        }
+        for (size_t i = 0; i < sectors_count; i++) {
+            REQUIRE(wl_flash->read(i * sector_size, sector_data, sector_size) == ESP_OK);
+            size_t errors = 0;
+            for (size_t m = 0; m < words_count; m++) {
+                errors += (sector_data[m] != (erased[i] ? 0xffffffff : i + m));
+            }
+            REQUIRE(errors == 0);
+        }
+        REQUIRE(wl_flash->erase_range(0, wl_flash->chip_size()) == ESP_OK);
+    }
+
+    delete[] erased;
+    delete[] sector_data;
+    delete wl_flash;
+    delete emul;
+    delete wl;
+}
+
+TEST_CASE("statistics count operations and page moves", "[wear_levelling]")
+{
+    wl_config_t *wl = new wl_config_t();
+
+    wl->full_mem_size = FLASH_ACCESS_SIZE;
+    wl->start_addr = FLASH_START_ADDR;
+    wl->sector_size = FLASH_SECTOR_SIZE;
+    wl->page_size = FLASH_PAGE_SIZE;
+    wl->updaterate = FLASH_UPDATERATE;
+    wl->temp_buff_size = FLASH_TEMP_SIZE;
+    wl->wr_size = FLASH_WR_BLOCK_SIZE;
+
+    WL_Flash *wl_flash = new WL_Flash();
+    Flash_Emulator *emul = new Flash_Emulator(FLASH_ACCESS_SIZE + FLASH_START_ADDR, FLASH_SECTOR_SIZE);
+    CHECK(wl_flash->config(wl, emul) == ESP_OK);
+    REQUIRE(wl_flash->init() == ESP_OK);
+
+    uint32_t data[4] = {1, 2, 3, 4};
+    for (size_t i = 0; i < 3 * FLASH_UPDATERATE; i++) {
+        REQUIRE(wl_flash->erase_sector(i) == ESP_OK);
+        REQUIRE(wl_flash->write(i * FLASH_SECTOR_SIZE, data, sizeof(data)) == ESP_OK);
+        REQUIRE(wl_flash->read(i * FLASH_SECTOR_SIZE, data, sizeof(data)) == ESP_OK);
+    }
+    REQUIRE(wl_flash->erase_range(0, 4 * FLASH_SECTOR_SIZE) == ESP_OK);
+
+    wl_stats_t stats;
+    wl_flash->get_stats(&stats);
+    CHECK(stats.erase_count == 3 * FLASH_UPDATERATE + 4);
+    CHECK(stats.write_count == 3 * FLASH_UPDATERATE);
+    CHECK(stats.read_count == 3 * FLASH_UPDATERATE);
+    CHECK(stats.write_bytes == 3 * FLASH_UPDATERATE * sizeof(data));
+    // Every updaterate-th erase moves one page, erase_range is counted once
+    CHECK(stats.move_count == 3);
+    CHECK(stats.flash_erase_count == stats.erase_count + stats.move_count);
+
+    delete wl_flash;
+    delete emul;
+    delete wl;
+}
+
+TEST_CASE("remap mode survives power down", "[wear_levelling][remap]")
+{
+    wl_config_t *wl = new wl_config_t();
+
+    wl->full_mem_size = FLASH_ACCESS_SIZE;
+    wl->start_addr = FLASH_START_ADDR;
+    wl->sector_size = FLASH_SECTOR_SIZE;
+    wl->page_size = FLASH_PAGE_SIZE;
+    wl->updaterate = FLASH_UPDATERATE;
+    wl->temp_buff_size = FLASH_TEMP_SIZE;
+    wl->wr_size = FLASH_WR_BLOCK_SIZE;
+
+    WL_Flash *wl_flash = new WL_Remap();
+    Flash_Emulator *emul = new Flash_Emulator(FLASH_ACCESS_SIZE + FLASH_START_ADDR, FLASH_SECTOR_SIZE);
+    CHECK(wl_flash->config(wl, emul) == ESP_OK);
+
+    test_power_down(wl_flash, emul, TEST_COUNT_MAX);
+
+    delete wl_flash;
+    delete emul;
+    delete wl;
+}
+
+static uint32_t test_hot_sector(WL_Flash *wl_flash, Flash_Emulator *emul)
+{
+    REQUIRE(wl_flash->init() == ESP_OK);
+    wl_flash->set_background_update(true);
+
+    size_t sectors_count = wl_flash->chip_size() / wl_flash->sector_size();
+    size_t words_count = wl_flash->sector_size() / sizeof(uint32_t);
+    uint32_t *sector_data = new uint32_t[words_count];
+    uint32_t *shadow = new uint32_t[sectors_count];
+    REQUIRE(wl_flash->erase_range(0, wl_flash->chip_size()) == ESP_OK);
+    for (size_t i = 0; i < sectors_count; i++) {
+        shadow[i] = 0xffffffff;
+    }
+    memset(emul->access_count, 0, emul->size / emul->sector_sise * sizeof(uint32_t));
+
+    // Sectors 1 and 3 are changed with every data write, like FAT table and directory
+    srand(3);
+    for (size_t k = 0; k < 6000; k++) {
+        size_t sector = (k % 3 == 0) ? 1 : (k % 3 == 1) ? 3 : 4 + rand() % (sectors_count - 4);
+        REQUIRE(wl_flash->erase_sector(sector) == ESP_OK);
+        shadow[sector] = rand();
+        for (size_t m = 0; m < words_count; m++) {
+            sector_data[m] = shadow[sector] + m;
+        }
+        REQUIRE(wl_flash->write(sector * wl_flash->sector_size(), sector_data, wl_flash->sector_size()) == ESP_OK);
+        for (size_t s = 0; s < 8 && wl_flash->update_pending(); s++) {
+            REQUIRE(wl_flash->update_step() == ESP_OK);
+        }
+    }
+
+    REQUIRE(wl_flash->flush() == ESP_OK);
+    REQUIRE(wl_flash->init() == ESP_OK);
+    for (size_t i = 0; i < sectors_count; i++) {
+        REQUIRE(wl_flash->read(i * wl_flash->sector_size(), sector_data, wl_flash->sector_size()) == ESP_OK);
+        size_t errors = 0;
+        for (size_t m = 0; m < words_count; m++) {
+            uint32_t expected = (shadow[i] == 0xffffffff) ? 0xffffffff : shadow[i] + m;
+            errors += (sector_data[m] != expected);
+        }
+        REQUIRE(errors == 0);
+    }
+
+    uint32_t max_erases = 0;
+    for (size_t i = 0; i < emul->size / emul->sector_sise; i++) {
+        if (emul->access_count[i] > max_erases) {
+            max_erases = emul->access_count[i];
+        }
+    }
+    delete[] shadow;
+    delete[] sector_data;
+    return max_erases;
+}
+
+TEST_CASE("remap mode spreads erases of hot sectors", "[wear_levelling][remap]")
+{
+    wl_config_t *wl = new wl_config_t();
+
+    wl->full_mem_size = FLASH_ACCESS_SIZE;
+    wl->start_addr = FLASH_START_ADDR;
+    wl->sector_size = FLASH_SECTOR_SIZE;
+    wl->page_size = FLASH_PAGE_SIZE;
+    wl->updaterate = FLASH_UPDATERATE;
+    wl->temp_buff_size = FLASH_SECTOR_SIZE / 4;
+    wl->wr_size = FLASH_WR_BLOCK_SIZE;
+
+    WL_Flash *wl_rotate = new WL_Flash();
+    Flash_Emulator *emul_rotate = new Flash_Emulator(FLASH_ACCESS_SIZE + FLASH_START_ADDR, FLASH_SECTOR_SIZE);
+    CHECK(wl_rotate->config(wl, emul_rotate) == ESP_OK);
+    uint32_t max_rotate = test_hot_sector(wl_rotate, emul_rotate);
+
+    WL_Flash *wl_remap = new WL_Remap();
+    Flash_Emulator *emul_remap = new Flash_Emulator(FLASH_ACCESS_SIZE + FLASH_START_ADDR, FLASH_SECTOR_SIZE);
+    CHECK(wl_remap->config(wl, emul_remap) == ESP_OK);
+    CHECK(wl_remap->chip_size() < wl_rotate->chip_size());
+    uint32_t max_remap = test_hot_sector(wl_remap, emul_remap);
+
+    printf("max erases of one sector: rotate=%u, remap=%u\n", max_rotate, max_remap);
+    CHECK(max_remap * 10 < max_rotate);
+
+    delete wl_remap;
+    delete emul_remap;
+    delete wl_rotate;
+    delete emul_rotate;
+    delete wl;
+}
@@ -15,9 +15,12 @@
 #include <stdlib.h>
 #include <new>
 #include <sys/lock.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
 #include "wear_levelling.h"
 #include "WL_Config.h"
 #include "WL_Flash.h"
+#include "WL_Remap.h"
 #include "SPI_Flash.h"
 #include "Partition.h"
 
@@ -45,6 +48,10 @@
 #define WL_CURRENT_VERSION  1
 #endif //WL_CURRENT_VERSION
 
+#ifndef WL_UPDATE_TASK_STACK_SIZE
+#define WL_UPDATE_TASK_STACK_SIZE   2048
+#endif //WL_UPDATE_TASK_STACK_SIZE
+
 typedef struct {
     WL_Flash *instance;
     _lock_t lock;
@@ -56,6 +63,56 @@ static const char *TAG = "wear_levelling";
 
 static esp_err_t check_handle(wl_handle_t handle, const char *func);
 
+#if CONFIG_WL_BACKGROUND_UPDATE
+static TaskHandle_t s_update_task = NULL;
+
+static void wl_update_task(void *arg)
+{
+    while (true) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        bool pending;
+        do {
+            // One step per instance at a time, so foreground operations
+            // could take the instance lock between the steps
+            pending = false;
+            _lock_acquire(&s_instances_lock);
+            for (size_t i = 0; i < MAX_WL_HANDLES; i++) {
+                if (s_instances[i].instance == NULL) {
+                    continue;
+                }
+                _lock_acquire(&s_instances[i].lock);
+                if (s_instances[i].instance->update_pending()) {
+                    esp_err_t result = s_instances[i].instance->update_step();
+                    if (result != ESP_OK) {
+                        // will be retried after the next erase operation
+                        ESP_LOGE(TAG, "%s: instance=0x%08x, result=0x%x", __func__, i, result);
+                    } else if (s_instances[i].instance->update_pending()) {
+                        pending = true;
+                    }
+                }
+                _lock_release(&s_instances[i].lock);
+            }
+            _lock_release(&s_instances_lock);
+            if (pending) {
+                // Let the idle task run, a long move must not trigger the task watchdog
+                vTaskDelay(1);
+            }
+        } while (pending);
+    }
+}
+#endif // CONFIG_WL_BACKGROUND_UPDATE
+
+// Wakes up the update task if the instance has work for it. Called with the
+// instance lock held. Notifications given while the task is busy are merged.
+static inline void wl_notify_update(wl_handle_t handle)
+{
+#if CONFIG_WL_BACKGROUND_UPDATE
+    if (s_instances[handle].instance->update_pending()) {
+        xTaskNotifyGive(s_update_task);
+    }
+#endif // CONFIG_WL_BACKGROUND_UPDATE
+}
+
 esp_err_t wl_mount(const esp_partition_t *partition, wl_handle_t *out_handle)
 {
     // Initialize variables before the first jump to cleanup label
@@ -101,13 +158,21 @@ esp_err_t wl_mount(const esp_partition_t *partition, wl_handle_t *out_handle)
     part = new (part_ptr) Partition(partition);
 
     // Same for WL_Flash: allocate memory, use placement new
+#if CONFIG_WL_MODE_REMAP
+    wl_flash_ptr = malloc(sizeof(WL_Remap));
+#else
     wl_flash_ptr = malloc(sizeof(WL_Flash));
+#endif // CONFIG_WL_MODE_REMAP
     if (wl_flash_ptr == NULL) {
         result = ESP_ERR_NO_MEM;
         ESP_LOGE(TAG, "%s: can't allocate WL_Flash", __func__);
         goto out;
     }
+#if CONFIG_WL_MODE_REMAP
+    wl_flash = new (wl_flash_ptr) WL_Remap();
+#else
     wl_flash = new (wl_flash_ptr) WL_Flash();
+#endif // CONFIG_WL_MODE_REMAP
 
     result = wl_flash->config(&cfg, part);
     if (ESP_OK != result) {
@@ -119,6 +184,17 @@ esp_err_t wl_mount(const esp_partition_t *partition, wl_handle_t *out_handle)
         ESP_LOGE(TAG, "%s: init instance=0x%08x, result=0x%x", __func__, *out_handle, result);
         goto out;
     }
+#if CONFIG_WL_BACKGROUND_UPDATE
+    if (s_update_task == NULL) {
+        if (xTaskCreate(wl_update_task, "wl_update", WL_UPDATE_TASK_STACK_SIZE, NULL,
+                        CONFIG_WL_BACKGROUND_UPDATE_TASK_PRIORITY, &s_update_task) != pdPASS) {
+            ESP_LOGE(TAG, "%s: can't create update task", __func__);
+            result = ESP_ERR_NO_MEM;
+            goto out;
+        }
+    }
+    wl_flash->set_background_update(true);
+#endif // CONFIG_WL_BACKGROUND_UPDATE
     s_instances[*out_handle].instance = wl_flash;
     _lock_init(&s_instances[*out_handle].lock);
     _lock_release(&s_instances_lock);
@@ -168,6 +244,7 @@ esp_err_t wl_erase_range(wl_handle_t handle, size_t start_addr, size_t size)
     }
     _lock_acquire(&s_instances[handle].lock);
     result = s_instances[handle].instance->erase_range(start_addr, size);
+    wl_notify_update(handle);
     _lock_release(&s_instances[handle].lock);
     return result;
 }
@@ -180,6 +257,7 @@ esp_err_t wl_write(wl_handle_t handle, size_t dest_addr, const void *src, size_t
     }
     _lock_acquire(&s_instances[handle].lock);
     result = s_instances[handle].instance->write(dest_addr, src, size);
+    wl_notify_update(handle);
     _lock_release(&s_instances[handle].lock);
     return result;
 }
@@ -220,6 +298,21 @@ size_t wl_sector_size(wl_handle_t handle)
     return result;
 }
 
+esp_err_t wl_get_stats(wl_handle_t handle, wl_stats_t *out_stats)
+{
+    esp_err_t result = check_handle(handle, __func__);
+    if (result != ESP_OK) {
+        return result;
+    }
+    if (out_stats == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    _lock_acquire(&s_instances[handle].lock);
+    s_instances[handle].instance->get_stats(out_stats);
+    _lock_release(&s_instances[handle].lock);
+    return ESP_OK;
+}
+
 static esp_err_t check_handle(wl_handle_t handle, const char *func)
 {
     if (handle == WL_INVALID_HANDLE) {